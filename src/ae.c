@@ -38,6 +38,8 @@
 #include <poll.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
 
 #include "ae.h"
@@ -60,6 +62,9 @@
     #endif
 #endif
 
+static void aeProcessAsyncEvents(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask);
+
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
     int i;
@@ -80,8 +85,17 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
      * vector with it. */
     for (i = 0; i < setsize; i++)
         eventLoop->events[i].mask = AE_NONE;
-    eventLoop->lock = zmalloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(eventLoop->lock, NULL);
+    eventLoop->asyncEventHead = eventLoop->asyncEventTail = NULL;
+    eventLoop->asynclock = zmalloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(eventLoop->asynclock, NULL);
+    if (pipe(eventLoop->asyncpipe) == -1) goto err;
+    for (i = 0; i < 2; i++) {
+        fcntl(eventLoop->asyncpipe[i], F_SETFL,
+              fcntl(eventLoop->asyncpipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(eventLoop->asyncpipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    if (aeCreateFileEvent(eventLoop, eventLoop->asyncpipe[0], AE_READABLE,
+            aeProcessAsyncEvents, NULL) == AE_ERR) goto err;
     return eventLoop;
 
 err:
@@ -97,8 +111,16 @@ void aeDeleteEventLoop(aeEventLoop *eventLoop) {
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
-    pthread_mutex_destroy(eventLoop->lock);
-    zfree(eventLoop->lock);
+    close(eventLoop->asyncpipe[0]);
+    close(eventLoop->asyncpipe[1]);
+    while (eventLoop->asyncEventHead) {
+        aeAsyncEvent *ae = eventLoop->asyncEventHead;
+
+        eventLoop->asyncEventHead = ae->next;
+        zfree(ae);
+    }
+    pthread_mutex_destroy(eventLoop->asynclock);
+    zfree(eventLoop->asynclock);
     zfree(eventLoop);
 }
 
@@ -212,6 +234,109 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
     return AE_ERR; /* NO event with the specified ID found */
 }
 
+/* Queue 'proc' to be called with 'clientData' by the thread running the
+ * event loop, as soon as possible. This is the only ae function that is
+ * safe to call from other threads: it is used by threads that completed a
+ * job to hand the result back to the event loop.
+ *
+ * Async events are processed in FIFO order. The loop is woken up writing to
+ * a pipe registered as a file event, so a loop blocked in aeApiPoll() does
+ * not have to wait for its timeout to expire. */
+int aeCreateAsyncEvent(aeEventLoop *eventLoop, aeAsyncProc *proc,
+        void *clientData)
+{
+    aeAsyncEvent *ae = zmalloc(sizeof(*ae));
+    int wakeup;
+
+    if (ae == NULL) return AE_ERR;
+    ae->asyncProc = proc;
+    ae->clientData = clientData;
+    ae->next = NULL;
+
+    pthread_mutex_lock(eventLoop->asynclock);
+    /* The pipe only needs to be written when the queue goes from empty to
+     * non empty, the loop processes the whole queue once woken up. */
+    wakeup = (eventLoop->asyncEventHead == NULL);
+    if (eventLoop->asyncEventTail)
+        eventLoop->asyncEventTail->next = ae;
+    else
+        eventLoop->asyncEventHead = ae;
+    eventLoop->asyncEventTail = ae;
+    if (wakeup && write(eventLoop->asyncpipe[1],"x",1) == -1) {
+        /* EAGAIN means the pipe is full, so the loop will wake up anyway. */
+    }
+    pthread_mutex_unlock(eventLoop->asynclock);
+    return AE_OK;
+}
+
+/* Remove all the pending async events for 'clientData' without calling
+ * them. Returns the number of events removed. */
+int aeDeleteAsyncEvents(aeEventLoop *eventLoop, void *clientData) {
+    aeAsyncEvent *ae, *prev = NULL, *next;
+    int deleted = 0;
+
+    pthread_mutex_lock(eventLoop->asynclock);
+    for (ae = eventLoop->asyncEventHead; ae; ae = next) {
+        next = ae->next;
+        if (ae->clientData == clientData) {
+            if (prev == NULL)
+                eventLoop->asyncEventHead = next;
+            else
+                prev->next = next;
+            if (eventLoop->asyncEventTail == ae)
+                eventLoop->asyncEventTail = prev;
+            zfree(ae);
+            deleted++;
+        } else {
+            prev = ae;
+        }
+    }
+    pthread_mutex_unlock(eventLoop->asynclock);
+    return deleted;
+}
+
+/* File event handler of the async events pipe. Events are popped one at a
+ * time, so that an async proc can safely delete the events of some other
+ * clientData. Events queued while we are processing are left for the next
+ * iteration of the loop, re-arming the pipe. */
+static void aeProcessAsyncEvents(aeEventLoop *eventLoop, int fd,
+        void *clientData, int mask)
+{
+    char buf[64];
+    aeAsyncEvent *ae;
+    int pending = 0;
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+
+    pthread_mutex_lock(eventLoop->asynclock);
+    for (ae = eventLoop->asyncEventHead; ae; ae = ae->next) pending++;
+    pthread_mutex_unlock(eventLoop->asynclock);
+
+    while (pending--) {
+        pthread_mutex_lock(eventLoop->asynclock);
+        ae = eventLoop->asyncEventHead;
+        if (ae) {
+            eventLoop->asyncEventHead = ae->next;
+            if (eventLoop->asyncEventTail == ae)
+                eventLoop->asyncEventTail = NULL;
+        }
+        pthread_mutex_unlock(eventLoop->asynclock);
+        if (ae == NULL) break;
+
+        ae->asyncProc(eventLoop,ae->clientData);
+        zfree(ae);
+    }
+
+    pthread_mutex_lock(eventLoop->asynclock);
+    if (eventLoop->asyncEventHead &&
+        write(eventLoop->asyncpipe[1],"x",1) == -1) {
+        /* Pipe full: already readable. */
+    }
+    pthread_mutex_unlock(eventLoop->asynclock);
+}
+
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
@@ -342,8 +467,6 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         aeTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
-        pthread_mutex_lock(eventLoop->lock);
-
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
@@ -374,7 +497,6 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
                 tvp = NULL; /* wait forever */
             }
         }
-        pthread_mutex_unlock(eventLoop->lock);
 
         numevents = aeApiPoll(eventLoop, tvp);
         for (j = 0; j < numevents; j++) {
@@ -398,11 +520,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         }
     }
     /* Check time events */
-    if (flags & AE_TIME_EVENTS) {
-        pthread_mutex_lock(eventLoop->lock);
+    if (flags & AE_TIME_EVENTS)
         processed += processTimeEvents(eventLoop);
-        pthread_mutex_unlock(eventLoop->lock);
-    }
     return processed; /* return the number of processed file/time events */
 }
 
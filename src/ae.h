@@ -57,6 +57,7 @@ typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData,
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeAsyncProc(struct aeEventLoop *eventLoop, void *clientData);
 
 /* File event structure */
 typedef struct aeFileEvent {
@@ -77,6 +78,13 @@ typedef struct aeTimeEvent {
     struct aeTimeEvent *next;
 } aeTimeEvent;
 
+/* Async event structure, queued by other threads to run in the loop */
+typedef struct aeAsyncEvent {
+    aeAsyncProc *asyncProc;
+    void *clientData;
+    struct aeAsyncEvent *next;
+} aeAsyncEvent;
+
 /* A fired event */
 typedef struct aeFiredEvent {
     int fd;
@@ -95,7 +103,9 @@ typedef struct aeEventLoop {
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
-    pthread_mutex_t *lock; /* Alas, timeEvents need a lock */
+    aeAsyncEvent *asyncEventHead, *asyncEventTail;
+    pthread_mutex_t *asynclock; /* Protects the async events queue */
+    int asyncpipe[2];           /* Self-pipe to wake up aeApiPoll() */
 } aeEventLoop;
 
 /* Prototypes */
@@ -110,6 +120,9 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
+int aeCreateAsyncEvent(aeEventLoop *eventLoop, aeAsyncProc *proc,
+        void *clientData);
+int aeDeleteAsyncEvents(aeEventLoop *eventLoop, void *clientData);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
@@ -178,7 +178,7 @@ void stopAppendOnly(void) {
         redisLog(REDIS_NOTICE,"Killing running AOF rewrite child: %ld",
             (long) server.aof_child_pid);
         if (kill(server.aof_child_pid,SIGKILL) != -1)
-            wait3(&statloc,0,NULL);
+            waitpid(server.aof_child_pid,&statloc,0);
         /* reset the buffer accumulating changes while the child saves */
         aofRewriteBufferReset();
         aofRemoveTempFile(server.aof_child_pid);
@@ -446,6 +446,7 @@ struct redisClient *createFakeClient(void) {
     c->querybuf_peak = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->cmd = NULL;
     c->bufpos = 0;
     c->flags = 0;
     /* We set the fake client as a slave waiting for the synchronization
@@ -455,6 +456,11 @@ struct redisClient *createFakeClient(void) {
     c->reply_bytes = 0;
     c->obuf_soft_limit_reached_time = 0;
     c->watched_keys = listCreate();
+    c->sql_conn = NULL;
+    c->sql_stmt_tables = NULL;
+    c->sql_cursor_fetch = 0;
+    c->sql_stmt_writes = 0;
+    c->sql_binary = 0;
     listSetFreeMethod(c->reply,decrRefCount);
     listSetDupMethod(c->reply,dupClientReplyValue);
     initClientMultiState(c);
@@ -462,6 +468,7 @@ struct redisClient *createFakeClient(void) {
 }
 
 void freeFakeClient(struct redisClient *c) {
+    sqlClientClose(c);
     sdsfree(c->querybuf);
     listRelease(c->reply);
     listRelease(c->watched_keys);
@@ -541,6 +548,7 @@ int loadAppendOnlyFile(char *filename) {
         /* Run the command in the context of a fake client */
         fakeClient->argc = argc;
         fakeClient->argv = argv;
+        fakeClient->cmd = cmd;
         cmd->proc(fakeClient);
 
         /* The fake client should not have a reply */
@@ -841,7 +849,7 @@ int rewriteAppendOnlyFile(char *filename) {
     rio aof;
     FILE *fp;
     char tmpfile[256];
-    int j;
+    int j, k;
     long long now = mstime();
 
     /* Note that we have to use a different temp name here compared to the
@@ -857,60 +865,65 @@ int rewriteAppendOnlyFile(char *filename) {
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
-        if (!di) {
-            fclose(fp);
-            return REDIS_ERR;
-        }
+        if (dbSize(db) == 0) continue;
 
         /* SELECT the new DB */
         if (rioWrite(&aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
         if (rioWriteBulkLongLong(&aof,j) == 0) goto werr;
 
-        /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
-            sds keystr;
-            robj key, *o;
-            long long expiretime;
-
-            keystr = dictGetKey(de);
-            o = dictGetVal(de);
-            initStaticStringObject(key,keystr);
-
-            expiretime = getExpire(db,&key);
-
-            /* Save the key and associated value */
-            if (o->type == REDIS_STRING) {
-                /* Emit a SET command */
-                char cmd[]="*3\r\n$3\r\nSET\r\n";
-                if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                /* Key and value */
-                if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
-                if (rioWriteBulkObject(&aof,o) == 0) goto werr;
-            } else if (o->type == REDIS_LIST) {
-                if (rewriteListObject(&aof,&key,o) == 0) goto werr;
-            } else if (o->type == REDIS_SET) {
-                if (rewriteSetObject(&aof,&key,o) == 0) goto werr;
-            } else if (o->type == REDIS_ZSET) {
-                if (rewriteSortedSetObject(&aof,&key,o) == 0) goto werr;
-            } else if (o->type == REDIS_HASH) {
-                if (rewriteHashObject(&aof,&key,o) == 0) goto werr;
-            } else {
-                redisPanic("Unknown object type");
+        for (k = 0; k < REDIS_DB_SEGMENTS; k++) {
+            redisDbSegment *seg = db->segments+k;
+
+            di = dictGetSafeIterator(seg->dict);
+            if (!di) {
+                fclose(fp);
+                return REDIS_ERR;
             }
-            /* Save the expire time */
-            if (expiretime != -1) {
-                char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
-                /* If this key is already expired skip it */
-                if (expiretime < now) continue;
-                if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
-                if (rioWriteBulkLongLong(&aof,expiretime) == 0) goto werr;
+
+            /* Iterate this segment writing every entry */
+            while((de = dictNext(di)) != NULL) {
+                sds keystr;
+                robj key, *o;
+                long long expiretime;
+
+                keystr = dictGetKey(de);
+                o = dictGetVal(de);
+                initStaticStringObject(key,keystr);
+
+                expiretime = segmentGetExpire(seg,keystr);
+
+                /* Save the key and associated value */
+                if (o->type == REDIS_STRING) {
+                    /* Emit a SET command */
+                    char cmd[]="*3\r\n$3\r\nSET\r\n";
+                    if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+                    /* Key and value */
+                    if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
+                    if (rioWriteBulkObject(&aof,o) == 0) goto werr;
+                } else if (o->type == REDIS_LIST) {
+                    if (rewriteListObject(&aof,&key,o) == 0) goto werr;
+                } else if (o->type == REDIS_SET) {
+                    if (rewriteSetObject(&aof,&key,o) == 0) goto werr;
+                } else if (o->type == REDIS_ZSET) {
+                    if (rewriteSortedSetObject(&aof,&key,o) == 0) goto werr;
+                } else if (o->type == REDIS_HASH) {
+                    if (rewriteHashObject(&aof,&key,o) == 0) goto werr;
+                } else {
+                    redisPanic("Unknown object type");
+                }
+                /* Save the expire time */
+                if (expiretime != -1) {
+                    char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
+                    /* If this key is already expired skip it */
+                    if (expiretime < now) continue;
+                    if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+                    if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
+                    if (rioWriteBulkLongLong(&aof,expiretime) == 0) goto werr;
+                }
             }
+            dictReleaseIterator(di);
+            di = NULL;
         }
-        dictReleaseIterator(di);
     }
 
     /* Make sure data will not remain on the OS's output buffers */
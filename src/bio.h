@@ -37,4 +37,5 @@ time_t bioOlderJobOfType(int type);
 /* Background job opcodes */
 #define REDIS_BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define REDIS_BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
-#define REDIS_BIO_NUM_OPS       2
+#define REDIS_BIO_SQL_CHECKPOINT 2 /* SQL DB WAL checkpoint. */
+#define REDIS_BIO_NUM_OPS       3
@@ -197,6 +197,7 @@ void bitopCommand(redisClient *c) {
     robj *o, *targetkey = c->argv[2];
     long op, j, numkeys;
     robj **objects;      /* Array of soruce objects. */
+    robj **keys = NULL;  /* Target and source keys, locked at once. */
     unsigned char **src; /* Array of source strings pointers. */
     long *len, maxlen = 0; /* Array of length of src strings, and max len. */
     long minlen = 0;    /* Min len among the input keys. */
@@ -222,7 +223,13 @@ void bitopCommand(redisClient *c) {
         return;
     }
 
-    lockKey(c,targetkey);
+    /* Lock the target and the source keys at once. */
+    if (server.locking_mode) {
+        keys = zmalloc(sizeof(robj*) * (c->argc - 2));
+        for (j = 2; j < c->argc; j++)
+            keys[j-2] = c->argv[j];
+        lockKeys(c,keys,c->argc - 2);
+    }
 
     /* Lookup keys, and store pointers to the string objects into an array. */
     numkeys = c->argc - 3;
@@ -230,7 +237,6 @@ void bitopCommand(redisClient *c) {
     len = zmalloc(sizeof(long) * numkeys);
     objects = zmalloc(sizeof(robj*) * numkeys);
     for (j = 0; j < numkeys; j++) {
-        lockKey(c,c->argv[j+3]);
         o = lookupKeyRead(c->db,c->argv[j+3]);
         /* Handle non-existing keys as empty strings. */
         if (o == NULL) {
@@ -242,15 +248,17 @@ void bitopCommand(redisClient *c) {
         }
         /* Return an error if one of the keys is not a string. */
         if (checkType(c,o,REDIS_STRING)) {
-            unlockKey(c,c->argv[j+3]);
             for (j = j-1; j >= 0; j--) {
                 if (objects[j])
                     decrRefCount(objects[j]);
-                unlockKey(c,c->argv[j+3]);
             }
             zfree(src);
             zfree(len);
             zfree(objects);
+            if (keys) {
+                unlockKeys(c,keys,c->argc - 2);
+                zfree(keys);
+            }
             return;
         }
         objects[j] = getDecodedObject(o);
@@ -349,7 +357,6 @@ void bitopCommand(redisClient *c) {
     for (j = 0; j < numkeys; j++) {
         if (objects[j])
             decrRefCount(objects[j]);
-        unlockKey(c,c->argv[j+3]);
     }
     zfree(src);
     zfree(len);
@@ -365,7 +372,10 @@ void bitopCommand(redisClient *c) {
     }
     server.dirty++;
     addReplyLongLong(c,maxlen); /* Return the output string length in bytes. */
-    unlockKey(c,targetkey);
+    if (keys) {
+        unlockKeys(c,keys,c->argc - 2);
+        zfree(keys);
+    }
 }
 
 /* BITCOUNT key [start end] */
@@ -310,9 +310,31 @@ void loadServerConfigFromString(char *config) {
         } else if (!strcasecmp(argv[0],"dbfilename") && argc == 2) {
             zfree(server.rdb_filename);
             server.rdb_filename = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"sql-stmt-cache-size") && argc == 2) {
+            server.sql_stmt_cache_size = atoi(argv[1]);
+            if (server.sql_stmt_cache_size < 0) {
+                err = "Invalid sql-stmt-cache-size"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"sqlfilename") && argc == 2) {
             zfree(server.sql_filename);
             server.sql_filename = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"sql-wal") && argc == 2) {
+            if ((server.sql_wal = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"sql-mmap-size") && argc == 2) {
+            server.sql_mmap_size = memtoll(argv[1],NULL);
+            /* PRAGMA mmap_size is silently ignored by older versions. */
+            if (server.sql_mmap_size && sqlite3_libversion_number() < 3007017) {
+                err = "sql-mmap-size needs SQLite 3.7.17 or newer"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"sql-cache-size") && argc == 2) {
+            server.sql_cache_size = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"sql-wal-checkpoint") && argc == 2) {
+            server.sql_wal_checkpoint = atoi(argv[1]);
+            if (server.sql_wal_checkpoint < 0) {
+                err = "Invalid sql-wal-checkpoint"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hash-max-ziplist-entries") && argc == 2) {
             server.hash_max_ziplist_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"hash-max-ziplist-value") && argc == 2) {
@@ -353,6 +375,16 @@ void loadServerConfigFromString(char *config) {
             }
         } else if (!strcasecmp(argv[0],"lua-time-limit") && argc == 2) {
             server.lua_time_limit = strtoll(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"sql-pool-size") && argc == 2) {
+            server.sql_pool_size = atoi(argv[1]);
+            if (server.sql_pool_size < 0) {
+                err = "Invalid sql-pool-size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"sql-cursor-timeout") && argc == 2) {
+            server.sql_cursor_timeout = strtoll(argv[1],NULL,10);
+            if (server.sql_cursor_timeout < 0) {
+                err = "Invalid sql-cursor-timeout"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"slowlog-log-slower-than") &&
                    argc == 2)
         {
@@ -396,6 +428,46 @@ void loadServerConfigFromString(char *config) {
                     err = "Invalid threadpool-size"; goto loaderr;
                 }
             }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads = atoi(argv[1]);
+            if (server.io_threads < 0 ||
+                server.io_threads > REDIS_IO_THREADS_MAX) {
+                err = "Invalid io-threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"threadpool-queue-size") && argc == 2) {
+            server.threadpool_queue_size = atoi(argv[1]);
+            if (server.threadpool_queue_size <= 0) {
+                err = "Invalid threadpool-queue-size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"thread-min-cost") && argc == 2) {
+            server.thread_min_cost = strtoll(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"parallel-min-cost") && argc == 2) {
+            server.parallel_min_cost = strtoll(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"parallel-max-parts") && argc == 2) {
+            server.parallel_max_parts = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"pipeline-batch-size") && argc == 2) {
+            server.pipeline_batch_size = atoi(argv[1]);
+            if (server.pipeline_batch_size < 1 ||
+                server.pipeline_batch_size > REDIS_PIPELINE_BATCH_MAX) {
+                err = "Invalid pipeline-batch-size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"reply-cache-max-memory") && argc == 2) {
+            long long bytes = memtoll(argv[1],NULL);
+
+            if (bytes < 0) {
+                err = "Invalid reply-cache-max-memory"; goto loaderr;
+            }
+            server.reply_cache_max_memory = bytes;
+        } else if (!strcasecmp(argv[0],"reply-cache-min-size") && argc == 2) {
+            server.reply_cache_min_size = memtoll(argv[1],NULL);
+            if (server.reply_cache_min_size < 0) {
+                err = "Invalid reply-cache-min-size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"thread-commands")) {
+            if (setThreadedCommands(argv+1,argc-1) == REDIS_ERR) {
+                err = "Invalid thread-commands, expected a list of +command "
+                      "or -command"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"sentinel")) {
             /* argc == 1 is handled by main() as we need to enter the sentinel
              * mode ASAP. */
@@ -630,12 +702,54 @@ void configSetCommand(redisClient *c) {
     } else if (!strcasecmp(c->argv[2]->ptr,"lua-time-limit")) {
         if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
         server.lua_time_limit = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"sql-pool-size")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0 || ll > INT_MAX) goto badfmt;
+        server.sql_pool_size = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"sql-cursor-timeout")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
+        server.sql_cursor_timeout = ll;
     } else if (!strcasecmp(c->argv[2]->ptr,"slowlog-log-slower-than")) {
         if (getLongLongFromObject(o,&ll) == REDIS_ERR) goto badfmt;
         server.slowlog_log_slower_than = ll;
     } else if (!strcasecmp(c->argv[2]->ptr,"slowlog-max-len")) {
         if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
         server.slowlog_max_len = (unsigned)ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"thread-min-cost")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR) goto badfmt;
+        server.thread_min_cost = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"parallel-min-cost")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR) goto badfmt;
+        server.parallel_min_cost = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"pipeline-batch-size")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 1 || ll > REDIS_PIPELINE_BATCH_MAX) goto badfmt;
+        server.pipeline_batch_size = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"reply-cache-max-memory")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
+        server.reply_cache_max_memory = ll;
+        replyCacheTrim();
+    } else if (!strcasecmp(c->argv[2]->ptr,"reply-cache-min-size")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
+        server.reply_cache_min_size = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"sql-stmt-cache-size")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0 || ll > INT_MAX) goto badfmt;
+        server.sql_stmt_cache_size = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"sql-wal-checkpoint")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0 || ll > INT_MAX) goto badfmt;
+        server.sql_wal_checkpoint = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"parallel-max-parts")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
+        server.parallel_max_parts = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"thread-commands")) {
+        int vlen, retval;
+        sds *v = sdssplitlen(o->ptr,sdslen(o->ptr)," ",1,&vlen);
+
+        retval = setThreadedCommands(v,vlen);
+        sdsfreesplitres(v,vlen);
+        if (retval == REDIS_ERR) goto badfmt;
     } else if (!strcasecmp(c->argv[2]->ptr,"loglevel")) {
         if (!strcasecmp(o->ptr,"warning")) {
             server.verbosity = REDIS_WARNING;
@@ -781,6 +895,7 @@ void configGetCommand(redisClient *c) {
     config_get_string_field("unixsocket",server.unixsocket);
     config_get_string_field("logfile",server.logfile);
     config_get_string_field("pidfile",server.pidfile);
+    config_get_string_field("thread-commands",server.thread_commands);
 
     /* Numerical values */
     config_get_numerical_field("maxmemory",server.maxmemory);
@@ -817,8 +932,23 @@ void configGetCommand(redisClient *c) {
     config_get_numerical_field("watchdog-period",server.watchdog_period);
     config_get_numerical_field("slave-priority",server.slave_priority);
     config_get_numerical_field("threadpool-size",server.threadpool_size);
+    config_get_numerical_field("io-threads",server.io_threads);
+    config_get_numerical_field("threadpool-queue-size",server.threadpool_queue_size);
+    config_get_numerical_field("thread-min-cost",server.thread_min_cost);
+    config_get_numerical_field("parallel-min-cost",server.parallel_min_cost);
+    config_get_numerical_field("parallel-max-parts",server.parallel_max_parts);
+    config_get_numerical_field("pipeline-batch-size",server.pipeline_batch_size);
+    config_get_numerical_field("reply-cache-max-memory",server.reply_cache_max_memory);
+    config_get_numerical_field("reply-cache-min-size",server.reply_cache_min_size);
+    config_get_numerical_field("sql-stmt-cache-size",server.sql_stmt_cache_size);
+    config_get_numerical_field("sql-pool-size",server.sql_pool_size);
+    config_get_numerical_field("sql-cursor-timeout",server.sql_cursor_timeout);
+    config_get_numerical_field("sql-mmap-size",server.sql_mmap_size);
+    config_get_numerical_field("sql-cache-size",server.sql_cache_size);
+    config_get_numerical_field("sql-wal-checkpoint",server.sql_wal_checkpoint);
 
     /* Bool (yes/no) values */
+    config_get_bool_field("sql-wal",server.sql_wal);
     config_get_bool_field("no-appendfsync-on-rewrite",
             server.aof_no_fsync_on_rewrite);
     config_get_bool_field("slave-serve-stale-data",
@@ -966,6 +1096,13 @@ void configCommand(redisClient *c) {
         server.stat_expiredkeys = 0;
         server.stat_rejected_conn = 0;
         server.stat_fork_time = 0;
+        pthread_mutex_lock(server.lock);
+        server.stat_sql_stmt_hits = 0;
+        server.stat_sql_stmt_misses = 0;
+        server.stat_sql_stmt_evictions = 0;
+        server.stat_pipeline_batches = 0;
+        server.stat_pipeline_batched_cmds = 0;
+        pthread_mutex_unlock(server.lock);
         server.aof_delayed_fsync = 0;
         resetCommandTableStats();
         addReply(c,shared.ok);
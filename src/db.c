@@ -35,33 +35,129 @@
 void SlotToKeyAdd(robj *key);
 void SlotToKeyDel(robj *key);
 
+/*-----------------------------------------------------------------------------
+ * Keyspace segments
+ *----------------------------------------------------------------------------*/
+
+/* Return the segment of 'db' holding 'key'. The segment is selected using the
+ * high bits of the hash, as the low bits select the bucket inside the dict. */
+redisDbSegment *dbSegment(redisDb *db, sds key) {
+    unsigned int h = dictGenHashFunction(key,sdslen(key));
+
+    return db->segments + (h >> (32-REDIS_DB_SEGMENTS_BITS));
+}
+
+void dbInitSegments(redisDb *db) {
+    pthread_mutexattr_t attr;
+    int j;
+
+    /* Recursive, so that code iterating a segment can call the functions of
+     * this file, and expireIfNeeded() can call dbDelete(). */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    for (j = 0; j < REDIS_DB_SEGMENTS; j++) {
+        db->segments[j].dict = dictCreate(&dbDictType,NULL);
+        db->segments[j].expires = dictCreate(&keyptrDictType,NULL);
+        pthread_mutex_init(&db->segments[j].lock,&attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Number of keys in the DB. */
+unsigned long dbSize(redisDb *db) {
+    unsigned long size = 0;
+    int j;
+
+    for (j = 0; j < REDIS_DB_SEGMENTS; j++)
+        size += dictSize(db->segments[j].dict);
+    return size;
+}
+
+/* Number of keys with an expire set in the DB. */
+unsigned long dbExpiresSize(redisDb *db) {
+    unsigned long size = 0;
+    int j;
+
+    for (j = 0; j < REDIS_DB_SEGMENTS; j++)
+        size += dictSize(db->segments[j].expires);
+    return size;
+}
+
+/* Remove every key from the DB, returning the number of keys removed,
+ * leaving the reply cache to the caller. */
+static long long dbEmptyDicts(redisDb *db) {
+    long long removed = 0;
+    int j;
+
+    for (j = 0; j < REDIS_DB_SEGMENTS; j++) {
+        redisDbSegment *seg = db->segments+j;
+
+        pthread_mutex_lock(&seg->lock);
+        removed += dictSize(seg->dict);
+        dictEmpty(seg->dict);
+        dictEmpty(seg->expires);
+        pthread_mutex_unlock(&seg->lock);
+    }
+    return removed;
+}
+
+/* Remove every key from the DB, returning the number of keys removed. */
+long long dbEmpty(redisDb *db) {
+    long long removed = dbEmptyDicts(db);
+
+    replyCacheInvalidateDb(db->id);
+    return removed;
+}
+
 /*-----------------------------------------------------------------------------
  * C-level DB API
  *----------------------------------------------------------------------------*/
 
+/* Lookups don't move the rehashing of a dict forward (see _dictRehashStep()),
+ * since the dict of a value may be read by several threads holding its key
+ * shared. A value that is only ever read would then stay in the middle of a
+ * rehashing forever, with two tables to look up and to keep in memory: the
+ * event loop rehashes it a step at a time when it reads it while no thread
+ * is running, as nobody else can be using the value then. The keyspace
+ * itself is rehashed by serverCron(). */
+static void valueRehashStep(robj *val) {
+    dict *d = NULL;
+
+    if (server.locking_mode) return;
+    if ((val->type == REDIS_SET || val->type == REDIS_HASH) &&
+        val->encoding == REDIS_ENCODING_HT)
+        d = val->ptr;
+    else if (val->type == REDIS_ZSET &&
+             val->encoding == REDIS_ENCODING_SKIPLIST)
+        d = ((zset*)val->ptr)->dict;
+    if (d && dictIsRehashing(d) && d->iterators == 0) dictRehash(d,1);
+}
+
 robj *lookupKey(redisDb *db, robj *key) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    redisDbSegment *seg = dbSegment(db,key->ptr);
+    dictEntry *de;
+    robj *val = NULL;
+
+    pthread_mutex_lock(&seg->lock);
+    de = dictFind(seg->dict,key->ptr);
     if (de) {
-        robj *val = dictGetVal(de);
+        val = dictGetVal(de);
 
         /* Update the access time for the aging algorithm.
          * Don't do it if we have a saving child, as this will trigger
          * a copy on write madness. */
         if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
             val->lru = server.lruclock;
-        return val;
-    } else {
-        return NULL;
     }
+    pthread_mutex_unlock(&seg->lock);
+    if (val) valueRehashStep(val);
+    return val;
 }
 
 robj *lookupKeyRead(redisDb *db, robj *key) {
     robj *val;
 
-    pthread_mutex_lock(db->lock);
-    expireIfNeeded(db,key);
-    pthread_mutex_unlock(db->lock);
-    val = lookupKey(db,key);
+    val = expireIfNeeded(db,key) == 2 ? NULL : lookupKey(db,key);
     if (val == NULL)
         server.stat_keyspace_misses++;
     else
@@ -70,9 +166,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
 }
 
 robj *lookupKeyWrite(redisDb *db, robj *key) {
-    pthread_mutex_lock(db->lock);
     expireIfNeeded(db,key);
-    pthread_mutex_unlock(db->lock);
     return lookupKey(db,key);
 }
 
@@ -93,8 +187,13 @@ robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
+    redisDbSegment *seg = dbSegment(db,key->ptr);
     sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    int retval;
+
+    pthread_mutex_lock(&seg->lock);
+    retval = dictAdd(seg->dict, copy, val);
+    pthread_mutex_unlock(&seg->lock);
 
     redisAssertWithInfo(NULL,key,retval == REDIS_OK);
  }
@@ -105,10 +204,14 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
-    struct dictEntry *de = dictFind(db->dict,key->ptr);
-    
+    redisDbSegment *seg = dbSegment(db,key->ptr);
+    struct dictEntry *de;
+
+    pthread_mutex_lock(&seg->lock);
+    de = dictFind(seg->dict,key->ptr);
     redisAssertWithInfo(NULL,key,de != NULL);
-    dictReplace(db->dict, key->ptr, val);
+    dictReplace(seg->dict, key->ptr, val);
+    pthread_mutex_unlock(&seg->lock);
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -129,7 +232,13 @@ void setKey(redisDb *db, robj *key, robj *val) {
 }
 
 int dbExists(redisDb *db, robj *key) {
-    return dictFind(db->dict,key->ptr) != NULL;
+    redisDbSegment *seg = dbSegment(db,key->ptr);
+    int exists;
+
+    pthread_mutex_lock(&seg->lock);
+    exists = dictFind(seg->dict,key->ptr) != NULL;
+    pthread_mutex_unlock(&seg->lock);
+    return exists;
 }
 
 /* Return a random key, in form of a Redis object.
@@ -139,50 +248,56 @@ int dbExists(redisDb *db, robj *key) {
 robj *dbRandomKey(redisDb *db) {
     struct dictEntry *de;
 
-    pthread_mutex_lock(db->lock);
     while(1) {
+        redisDbSegment *seg;
         sds key;
         robj *keyobj;
 
-        de = dictGetRandomKey(db->dict);
+        if (dbSize(db) == 0) return NULL;
+        seg = db->segments + (random() & (REDIS_DB_SEGMENTS-1));
+        pthread_mutex_lock(&seg->lock);
+        de = dictGetRandomKey(seg->dict);
         if (de == NULL) {
-            pthread_mutex_unlock(db->lock);
-            return NULL;
+            /* Empty segment, try another one. */
+            pthread_mutex_unlock(&seg->lock);
+            continue;
         }
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (dictFind(seg->expires,key)) {
             /* search for another key. This expired. */
+            pthread_mutex_unlock(&seg->lock);
             decrRefCount(keyobj);
             continue;
         }
-        pthread_mutex_unlock(db->lock);
+        pthread_mutex_unlock(&seg->lock);
         return keyobj;
     }
 }
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbDelete(redisDb *db, robj *key) {
+    redisDbSegment *seg = dbSegment(db,key->ptr);
+    int retval;
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-        return 1;
-    } else {
-        return 0;
-    }
+    pthread_mutex_lock(&seg->lock);
+    if (dictSize(seg->expires) > 0) dictDelete(seg->expires,key->ptr);
+    retval = dictDelete(seg->dict,key->ptr) == DICT_OK;
+    pthread_mutex_unlock(&seg->lock);
+    if (retval) replyCacheInvalidateKey(db,key);
+    return retval;
 }
 
 long long emptyDb() {
     int j;
     long long removed = 0;
 
-    for (j = 0; j < server.dbnum; j++) {
-        removed += dictSize(server.db[j].dict);
-        dictEmpty(server.db[j].dict);
-        dictEmpty(server.db[j].expires);
-    }
+    for (j = 0; j < server.dbnum; j++)
+        removed += dbEmptyDicts(server.db+j);
+    replyCacheInvalidateDb(-1);
     return removed;
 }
 
@@ -204,6 +319,7 @@ int selectDb(redisClient *c, int id) {
 
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
+    replyCacheInvalidateKey(db,key);
 }
 
 void signalFlushedDb(int dbid) {
@@ -215,13 +331,9 @@ void signalFlushedDb(int dbid) {
  *----------------------------------------------------------------------------*/
 
 void flushdbCommand(redisClient *c) {
-    server.dirty += dictSize(c->db->dict);
     signalFlushedDb(c->db->id);
-    pthread_mutex_lock(c->db->lock);
-    dictEmpty(c->db->dict);
-    dictEmpty(c->db->expires);
+    server.dirty += dbEmpty(c->db);
     addReply(c,shared.ok);
-    pthread_mutex_unlock(c->db->lock);
 }
 
 void flushallCommand(redisClient *c) {
@@ -271,10 +383,9 @@ void delCommand(redisClient *c) {
 }
 
 void existsCommand(redisClient *c) {
-    pthread_mutex_lock(c->db->lock);
-    expireIfNeeded(c->db,c->argv[1]);
-    pthread_mutex_unlock(c->db->lock);
-    if (dbExists(c->db,c->argv[1])) {
+    /* An expired key held shared is still there, but gone for readers. */
+    if (expireIfNeeded(c->db,c->argv[1]) != 2 &&
+        dbExists(c->db,c->argv[1])) {
         addReply(c, shared.cone);
     } else {
         addReply(c, shared.czero);
@@ -314,30 +425,35 @@ void keysCommand(redisClient *c) {
     int plen = sdslen(pattern), allkeys;
     unsigned long numkeys = 0;
     void *replylen = addDeferredMultiBulkLength(c);
+    int j;
 
-    pthread_mutex_lock(c->db->lock);
-    di = dictGetSafeIterator(c->db->dict);
     allkeys = (pattern[0] == '*' && pattern[1] == '\0');
-    while((de = dictNext(di)) != NULL) {
-        sds key = dictGetKey(de);
-        robj *keyobj;
-
-        if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0)) {
-            keyobj = createStringObject(key,sdslen(key));
-            if (expireIfNeeded(c->db,keyobj) == 0) {
-                addReplyBulk(c,keyobj);
-                numkeys++;
+    for (j = 0; j < REDIS_DB_SEGMENTS; j++) {
+        redisDbSegment *seg = c->db->segments+j;
+
+        pthread_mutex_lock(&seg->lock);
+        di = dictGetSafeIterator(seg->dict);
+        while((de = dictNext(di)) != NULL) {
+            sds key = dictGetKey(de);
+            robj *keyobj;
+
+            if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0)) {
+                keyobj = createStringObject(key,sdslen(key));
+                if (expireIfNeeded(c->db,keyobj) == 0) {
+                    addReplyBulk(c,keyobj);
+                    numkeys++;
+                }
+                decrRefCount(keyobj);
             }
-            decrRefCount(keyobj);
         }
+        dictReleaseIterator(di);
+        pthread_mutex_unlock(&seg->lock);
     }
-    dictReleaseIterator(di);
     setDeferredMultiBulkLength(c,replylen,numkeys);
-    pthread_mutex_unlock(c->db->lock);
 }
 
 void dbsizeCommand(redisClient *c) {
-    addReplyLongLong(c,dictSize(c->db->dict));
+    addReplyLongLong(c,dbSize(c->db));
 }
 
 void lastsaveCommand(redisClient *c) {
@@ -456,6 +572,7 @@ void moveCommand(redisClient *c) {
     robj *o;
     redisDb *src, *dst;
     int srcid;
+    dbKey keys[2];
 
     /* Obtain source and target DB pointers */
     src = c->db;
@@ -474,30 +591,25 @@ void moveCommand(redisClient *c) {
         return;
     }
 
-    /* repeat the db switcheroo so we can lock the keys */
-    lockKey(c,c->argv[1]); /* src */
-    selectDb(c,atoi(c->argv[2]->ptr));
-    lockKey(c,c->argv[1]); /* dst */
-    selectDb(c,srcid);
+    /* Lock the key in both DBs at once */
+    keys[0].db = src;
+    keys[0].key = c->argv[1];
+    keys[1].db = dst;
+    keys[1].key = c->argv[1];
+    lockDbKeys(c,keys,2);
 
     /* Check if the element exists and get a reference */
     o = lookupKeyWrite(c->db,c->argv[1]);
     if (!o) {
         addReply(c,shared.czero);
-        selectDb(c,atoi(c->argv[2]->ptr));
-        unlockKey(c,c->argv[1]); /* dst */
-        selectDb(c,srcid);
-        unlockKey(c,c->argv[1]); /* src */
+        unlockDbKeys(c,keys,2);
         return;
     }
 
     /* Return zero if the key already exists in the target DB */
     if (lookupKeyWrite(dst,c->argv[1]) != NULL) {
         addReply(c,shared.czero);
-        selectDb(c,atoi(c->argv[2]->ptr));
-        unlockKey(c,c->argv[1]); /* dst */
-        selectDb(c,srcid);
-        unlockKey(c,c->argv[1]); /* src */
+        unlockDbKeys(c,keys,2);
         return;
     }
     dbAdd(dst,c->argv[1],o);
@@ -507,10 +619,7 @@ void moveCommand(redisClient *c) {
     dbDelete(src,c->argv[1]);
     server.dirty++;
     addReply(c,shared.cone);
-    selectDb(c,atoi(c->argv[2]->ptr));
-    unlockKey(c,c->argv[1]); /* dst */
-    selectDb(c,srcid);
-    unlockKey(c,c->argv[1]); /* src */
+    unlockDbKeys(c,keys,2);
 }
 
 /*-----------------------------------------------------------------------------
@@ -518,34 +627,56 @@ void moveCommand(redisClient *c) {
  *----------------------------------------------------------------------------*/
 
 int removeExpire(redisDb *db, robj *key) {
+    redisDbSegment *seg = dbSegment(db,key->ptr);
+    int retval;
+
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    redisAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    pthread_mutex_lock(&seg->lock);
+    redisAssertWithInfo(NULL,key,dictFind(seg->dict,key->ptr) != NULL);
+    retval = dictDelete(seg->expires,key->ptr) == DICT_OK;
+    pthread_mutex_unlock(&seg->lock);
+    return retval;
 }
 
 void setExpire(redisDb *db, robj *key, long long when) {
+    redisDbSegment *seg = dbSegment(db,key->ptr);
     dictEntry *kde, *de;
 
     /* Reuse the sds from the main dict in the expire dict */
-    kde = dictFind(db->dict,key->ptr);
+    pthread_mutex_lock(&seg->lock);
+    kde = dictFind(seg->dict,key->ptr);
     redisAssertWithInfo(NULL,key,kde != NULL);
-    de = dictReplaceRaw(db->expires,dictGetKey(kde));
+    de = dictReplaceRaw(seg->expires,dictGetKey(kde));
     dictSetSignedIntegerVal(de,when);
+    pthread_mutex_unlock(&seg->lock);
 }
 
 /* Return the expire time of the specified key, or -1 if no expire
  * is associated with this key (i.e. the key is non volatile) */
 long long getExpire(redisDb *db, robj *key) {
+    redisDbSegment *seg = dbSegment(db,key->ptr);
+    long long when;
+
+    pthread_mutex_lock(&seg->lock);
+    when = segmentGetExpire(seg,key->ptr);
+    pthread_mutex_unlock(&seg->lock);
+    return when;
+}
+
+/* Like getExpire() for a key of the segment 'seg', without locking it.
+ * Used when iterating a segment, and by the saving children that can't
+ * take locks possibly held by a thread of the parent at fork() time. */
+long long segmentGetExpire(redisDbSegment *seg, sds key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+    if (dictSize(seg->expires) == 0 ||
+       (de = dictFind(seg->expires,key)) == NULL) return -1;
 
     /* The entry was found in the expire dict, this means it should also
      * be present in the main dict (safety check). */
-    redisAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
+    redisAssert(dictFind(seg->dict,key) != NULL);
     return dictGetSignedIntegerVal(de);
 }
 
@@ -575,7 +706,9 @@ void propagateExpire(redisDb *db, robj *key) {
 }
 
 int expireIfNeeded(redisDb *db, robj *key) {
+    redisDbSegment *seg = dbSegment(db,key->ptr);
     long long when;
+    int deleted;
 
     when = getExpire(db,key);
 
@@ -598,10 +731,21 @@ int expireIfNeeded(redisDb *db, robj *key) {
     /* Return when this key has not expired */
     if (mstime() <= when) return 0;
 
-    /* Delete the key */
+    /* Readers sharing the key may be using its value: report it as expired
+     * and leave the deletion to the next writer or to the expire cycle. */
+    if (server.locking_mode && keyIsShared(db,key->ptr)) return 2;
+
+    /* Delete the key, checking again under the segment lock as some other
+     * thread may have removed or persisted it meanwhile. */
+    pthread_mutex_lock(&seg->lock);
+    when = segmentGetExpire(seg,key->ptr);
+    deleted = (when >= 0 && mstime() > when) ? dbDelete(db,key) : 0;
+    pthread_mutex_unlock(&seg->lock);
+    if (!deleted) return 0;
+
     server.stat_expiredkeys++;
     propagateExpire(db,key);
-    return dbDelete(db,key);
+    return 1;
 }
 
 /*-----------------------------------------------------------------------------
@@ -616,7 +760,6 @@ int expireIfNeeded(redisDb *db, robj *key) {
  * unit is either UNIT_SECONDS or UNIT_MILLISECONDS, and is only used for
  * the argv[2] parameter. The basetime is always specified in milliesconds. */
 void expireGenericCommand(redisClient *c, long long basetime, int unit) {
-    dictEntry *de;
     robj *key = c->argv[1], *param = c->argv[2];
     long long when; /* unix time in milliseconds when the key will expire. */
 
@@ -627,8 +770,7 @@ void expireGenericCommand(redisClient *c, long long basetime, int unit) {
     when += basetime;
 
     lockKey(c,key);
-    de = dictFind(c->db->dict,key->ptr);
-    if (de == NULL) {
+    if (!dbExists(c->db,key)) {
         addReply(c,shared.czero);
         unlockKey(c,key);
         return;
@@ -702,11 +844,8 @@ void pttlCommand(redisClient *c) {
 }
 
 void persistCommand(redisClient *c) {
-    dictEntry *de;
-
     lockKey(c,c->argv[1]);
-    de = dictFind(c->db->dict,c->argv[1]->ptr);
-    if (de == NULL) {
+    if (!dbExists(c->db,c->argv[1])) {
         addReply(c,shared.czero);
     } else {
         if (removeExpire(c->db,c->argv[1])) {
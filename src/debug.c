@@ -107,7 +107,7 @@ void computeDatasetDigest(unsigned char *final) {
     char buf[128];
     dictIterator *di = NULL;
     dictEntry *de;
-    int j;
+    int j, k;
     uint32_t aux;
 
     memset(final,0,20); /* Start with a clean result */
@@ -115,132 +115,140 @@ void computeDatasetDigest(unsigned char *final) {
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
 
-        if (dictSize(db->dict) == 0) continue;
-        di = dictGetIterator(db->dict);
+        if (dbSize(db) == 0) continue;
 
         /* hash the DB id, so the same dataset moved in a different
          * DB will lead to a different digest */
         aux = htonl(j);
         mixDigest(final,&aux,sizeof(aux));
 
-        /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
-            sds key;
-            robj *keyobj, *o;
-            long long expiretime;
-
-            memset(digest,0,20); /* This key-val digest */
-            key = dictGetKey(de);
-            keyobj = createStringObject(key,sdslen(key));
-
-            mixDigest(digest,key,sdslen(key));
-
-            o = dictGetVal(de);
-
-            aux = htonl(o->type);
-            mixDigest(digest,&aux,sizeof(aux));
-            expiretime = getExpire(db,keyobj);
-
-            /* Save the key and associated value */
-            if (o->type == REDIS_STRING) {
-                mixObjectDigest(digest,o);
-            } else if (o->type == REDIS_LIST) {
-                listTypeIterator *li = listTypeInitIterator(o,0,REDIS_TAIL);
-                listTypeEntry entry;
-                while(listTypeNext(li,&entry)) {
-                    robj *eleobj = listTypeGet(&entry);
-                    mixObjectDigest(digest,eleobj);
-                    decrRefCount(eleobj);
-                }
-                listTypeReleaseIterator(li);
-            } else if (o->type == REDIS_SET) {
-                setTypeIterator *si = setTypeInitIterator(o);
-                robj *ele;
-                while((ele = setTypeNextObject(si)) != NULL) {
-                    xorObjectDigest(digest,ele);
-                    decrRefCount(ele);
-                }
-                setTypeReleaseIterator(si);
-            } else if (o->type == REDIS_ZSET) {
-                unsigned char eledigest[20];
-
-                if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-                    unsigned char *zl = o->ptr;
-                    unsigned char *eptr, *sptr;
-                    unsigned char *vstr;
-                    unsigned int vlen;
-                    long long vll;
-                    double score;
-
-                    eptr = ziplistIndex(zl,0);
-                    redisAssert(eptr != NULL);
-                    sptr = ziplistNext(zl,eptr);
-                    redisAssert(sptr != NULL);
-
-                    while (eptr != NULL) {
-                        redisAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
-                        score = zzlGetScore(sptr);
+        /* Key-val digests are xored together, so the order of the segments
+         * does not matter. */
+        for (k = 0; k < REDIS_DB_SEGMENTS; k++) {
+            redisDbSegment *seg = db->segments+k;
+
+            pthread_mutex_lock(&seg->lock);
+            di = dictGetIterator(seg->dict);
+            /* Iterate this segment writing every entry */
+            while((de = dictNext(di)) != NULL) {
+                sds key;
+                robj *keyobj, *o;
+                long long expiretime;
+
+                memset(digest,0,20); /* This key-val digest */
+                key = dictGetKey(de);
+                keyobj = createStringObject(key,sdslen(key));
+
+                mixDigest(digest,key,sdslen(key));
+
+                o = dictGetVal(de);
+
+                aux = htonl(o->type);
+                mixDigest(digest,&aux,sizeof(aux));
+                expiretime = segmentGetExpire(seg,key);
+
+                /* Save the key and associated value */
+                if (o->type == REDIS_STRING) {
+                    mixObjectDigest(digest,o);
+                } else if (o->type == REDIS_LIST) {
+                    listTypeIterator *li = listTypeInitIterator(o,0,REDIS_TAIL);
+                    listTypeEntry entry;
+                    while(listTypeNext(li,&entry)) {
+                        robj *eleobj = listTypeGet(&entry);
+                        mixObjectDigest(digest,eleobj);
+                        decrRefCount(eleobj);
+                    }
+                    listTypeReleaseIterator(li);
+                } else if (o->type == REDIS_SET) {
+                    setTypeIterator *si = setTypeInitIterator(o);
+                    robj *ele;
+                    while((ele = setTypeNextObject(si)) != NULL) {
+                        xorObjectDigest(digest,ele);
+                        decrRefCount(ele);
+                    }
+                    setTypeReleaseIterator(si);
+                } else if (o->type == REDIS_ZSET) {
+                    unsigned char eledigest[20];
 
-                        memset(eledigest,0,20);
-                        if (vstr != NULL) {
-                            mixDigest(eledigest,vstr,vlen);
-                        } else {
-                            ll2string(buf,sizeof(buf),vll);
+                    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+                        unsigned char *zl = o->ptr;
+                        unsigned char *eptr, *sptr;
+                        unsigned char *vstr;
+                        unsigned int vlen;
+                        long long vll;
+                        double score;
+
+                        eptr = ziplistIndex(zl,0);
+                        redisAssert(eptr != NULL);
+                        sptr = ziplistNext(zl,eptr);
+                        redisAssert(sptr != NULL);
+
+                        while (eptr != NULL) {
+                            redisAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                            score = zzlGetScore(sptr);
+
+                            memset(eledigest,0,20);
+                            if (vstr != NULL) {
+                                mixDigest(eledigest,vstr,vlen);
+                            } else {
+                                ll2string(buf,sizeof(buf),vll);
+                                mixDigest(eledigest,buf,strlen(buf));
+                            }
+
+                            snprintf(buf,sizeof(buf),"%.17g",score);
                             mixDigest(eledigest,buf,strlen(buf));
+                            xorDigest(digest,eledigest,20);
+                            zzlNext(zl,&eptr,&sptr);
                         }
-
-                        snprintf(buf,sizeof(buf),"%.17g",score);
-                        mixDigest(eledigest,buf,strlen(buf));
-                        xorDigest(digest,eledigest,20);
-                        zzlNext(zl,&eptr,&sptr);
+                    } else if (o->encoding == REDIS_ENCODING_SKIPLIST) {
+                        zset *zs = o->ptr;
+                        dictIterator *di = dictGetIterator(zs->dict);
+                        dictEntry *de;
+
+                        while((de = dictNext(di)) != NULL) {
+                            robj *eleobj = dictGetKey(de);
+                            double *score = dictGetVal(de);
+
+                            snprintf(buf,sizeof(buf),"%.17g",*score);
+                            memset(eledigest,0,20);
+                            mixObjectDigest(eledigest,eleobj);
+                            mixDigest(eledigest,buf,strlen(buf));
+                            xorDigest(digest,eledigest,20);
+                        }
+                        dictReleaseIterator(di);
+                    } else {
+                        redisPanic("Unknown sorted set encoding");
                     }
-                } else if (o->encoding == REDIS_ENCODING_SKIPLIST) {
-                    zset *zs = o->ptr;
-                    dictIterator *di = dictGetIterator(zs->dict);
-                    dictEntry *de;
+                } else if (o->type == REDIS_HASH) {
+                    hashTypeIterator *hi;
+                    robj *obj;
 
-                    while((de = dictNext(di)) != NULL) {
-                        robj *eleobj = dictGetKey(de);
-                        double *score = dictGetVal(de);
+                    hi = hashTypeInitIterator(o);
+                    while (hashTypeNext(hi) != REDIS_ERR) {
+                        unsigned char eledigest[20];
 
-                        snprintf(buf,sizeof(buf),"%.17g",*score);
                         memset(eledigest,0,20);
-                        mixObjectDigest(eledigest,eleobj);
-                        mixDigest(eledigest,buf,strlen(buf));
+                        obj = hashTypeCurrentObject(hi,REDIS_HASH_KEY);
+                        mixObjectDigest(eledigest,obj);
+                        decrRefCount(obj);
+                        obj = hashTypeCurrentObject(hi,REDIS_HASH_VALUE);
+                        mixObjectDigest(eledigest,obj);
+                        decrRefCount(obj);
                         xorDigest(digest,eledigest,20);
                     }
-                    dictReleaseIterator(di);
+                    hashTypeReleaseIterator(hi);
                 } else {
-                    redisPanic("Unknown sorted set encoding");
-                }
-            } else if (o->type == REDIS_HASH) {
-                hashTypeIterator *hi;
-                robj *obj;
-
-                hi = hashTypeInitIterator(o);
-                while (hashTypeNext(hi) != REDIS_ERR) {
-                    unsigned char eledigest[20];
-
-                    memset(eledigest,0,20);
-                    obj = hashTypeCurrentObject(hi,REDIS_HASH_KEY);
-                    mixObjectDigest(eledigest,obj);
-                    decrRefCount(obj);
-                    obj = hashTypeCurrentObject(hi,REDIS_HASH_VALUE);
-                    mixObjectDigest(eledigest,obj);
-                    decrRefCount(obj);
-                    xorDigest(digest,eledigest,20);
+                    redisPanic("Unknown object type");
                 }
-                hashTypeReleaseIterator(hi);
-            } else {
-                redisPanic("Unknown object type");
+                /* If the key has an expire, add it to the mix */
+                if (expiretime != -1) xorDigest(digest,"!!expire!!",10);
+                /* We can finally xor the key-val digest to the final digest */
+                xorDigest(final,digest,20);
+                decrRefCount(keyobj);
             }
-            /* If the key has an expire, add it to the mix */
-            if (expiretime != -1) xorDigest(digest,"!!expire!!",10);
-            /* We can finally xor the key-val digest to the final digest */
-            xorDigest(final,digest,20);
-            decrRefCount(keyobj);
+            dictReleaseIterator(di);
+            pthread_mutex_unlock(&seg->lock);
         }
-        dictReleaseIterator(di);
     }
 }
 
@@ -276,15 +284,13 @@ void debugCommand(redisClient *c) {
         redisLog(REDIS_WARNING,"Append Only File loaded by DEBUG LOADAOF");
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"object") && c->argc == 3) {
-        dictEntry *de;
         robj *val;
         char *strenc;
 
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        if ((val = objectCommandLookup(c,c->argv[2])) == NULL) {
             addReply(c,shared.nokeyerr);
             return;
         }
-        val = dictGetVal(de);
         strenc = strEncoding(val->encoding);
 
         addReplyStatusFormat(c,
@@ -656,8 +662,9 @@ void logCurrentClient(void) {
         robj *val, *key;
         dictEntry *de;
 
+        /* No locking: we are crashing, and the lock may be held already. */
         key = getDecodedObject(cc->argv[1]);
-        de = dictFind(cc->db->dict, key->ptr);
+        de = dictFind(dbSegment(cc->db,key->ptr)->dict, key->ptr);
         if (de) {
             val = dictGetVal(de);
             redisLog(REDIS_WARNING,"key '%s' found in DB containing the following object:", key->ptr);
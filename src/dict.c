@@ -303,9 +303,12 @@ int dictRehashMilliseconds(dict *d, int ms) {
  * middle of a rehashing we can't mess with the two hash tables otherwise
  * some element can be missed or duplicated.
  *
- * This function is called by common lookup or update operations in the
- * dictionary so that the hash table automatically migrates from H1 to H2
- * while it is actively used. */
+ * This function is called by common update operations in the dictionary
+ * so that the hash table automatically migrates from H1 to H2 while it is
+ * actively used. Lookups (dictFind, dictGetRandomKey) don't rehash: they
+ * never modify the dictionary, so that several threads can read it at the
+ * same time. Dictionaries that are only read are rehashed by the caller
+ * when it knows no other thread can be using them (see lookupKey()). */
 static void _dictRehashStep(dict *d) {
     if (d->iterators == 0) dictRehash(d,1);
 }
@@ -483,7 +486,6 @@ dictEntry *dictFind(dict *d, const void *key)
     unsigned int h, idx, table;
 
     if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
-    if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
@@ -572,7 +574,6 @@ dictEntry *dictGetRandomKey(dict *d)
     int listlen, listele;
 
     if (dictSize(d) == 0) return NULL;
-    if (dictIsRehashing(d)) _dictRehashStep(d);
     if (dictIsRehashing(d)) {
         do {
             h = random() % (d->ht[0].size+d->ht[1].size);
@@ -602,6 +603,34 @@ dictEntry *dictGetRandomKey(dict *d)
     return he;
 }
 
+/* Return the number of buckets of the dictionary, the buckets of the two
+ * tables of a rehashing dictionary being numbered one after the other. */
+unsigned long dictBuckets(dict *d)
+{
+    return d->ht[0].size + d->ht[1].size;
+}
+
+/* Call "fn" for every entry of the buckets from "start" (included) to "end"
+ * (excluded), in the same order as an iterator would. Like lookups, this
+ * never modifies the dictionary: different ranges of the same dictionary
+ * can be scanned by several threads at the same time. */
+void dictScanBuckets(dict *d, unsigned long start, unsigned long end,
+                     dictScanFunction *fn, void *privdata)
+{
+    unsigned long idx;
+    dictEntry *he;
+
+    if (end > dictBuckets(d)) end = dictBuckets(d);
+    for (idx = start; idx < end; idx++) {
+        he = (idx >= d->ht[0].size) ? d->ht[1].table[idx - d->ht[0].size] :
+                                      d->ht[0].table[idx];
+        while(he) {
+            fn(privdata,he);
+            he = he->next;
+        }
+    }
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
@@ -90,6 +90,8 @@ typedef struct dictIterator {
     dictEntry *entry, *nextEntry;
 } dictIterator;
 
+typedef void dictScanFunction(void *privdata, const dictEntry *de);
+
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
@@ -154,6 +156,9 @@ dictIterator *dictGetSafeIterator(dict *d);
 dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
+unsigned long dictBuckets(dict *d);
+void dictScanBuckets(dict *d, unsigned long start, unsigned long end,
+                     dictScanFunction *fn, void *privdata);
 void dictPrintStats(dict *d);
 unsigned int dictGenHashFunction(const void *key, int len);
 unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
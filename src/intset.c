@@ -276,6 +276,76 @@ uint32_t intsetLen(intset *is) {
     return intrev32ifbe(is->length);
 }
 
+/* Create an intset holding the "len" values, that must be sorted in
+ * ascending order and unique. */
+intset *intsetFromSorted(const int64_t *values, uint32_t len) {
+    intset *is = intsetNew();
+    uint8_t enc = INTSET_ENC_INT16;
+    uint32_t i;
+
+    if (len) {
+        /* The widest value is either the smallest or the biggest one. */
+        enc = _intsetValueEncoding(values[0]);
+        if (_intsetValueEncoding(values[len-1]) > enc)
+            enc = _intsetValueEncoding(values[len-1]);
+    }
+    is->encoding = intrev32ifbe(enc);
+    is = intsetResize(is,len);
+    for (i = 0; i < len; i++) _intsetSet(is,i,values[i]);
+    is->length = intrev32ifbe(len);
+    return is;
+}
+
+/* Return the position of the first value >= "value" at or after "from",
+ * or the length of the intset if there is none. The range is found by
+ * galloping (doubling the step) and then searched with a binary search,
+ * which is cheaper than a binary search of the whole intset when the
+ * values looked up are ascending and near each other. */
+static uint32_t intsetGallop(intset *is, uint32_t from, int64_t value) {
+    uint32_t len = intrev32ifbe(is->length);
+    uint32_t lo = from, hi = from, step = 1, mid;
+
+    /* Every position before lo holds a smaller value, the value at hi (if
+     * any) is >= value. */
+    while (hi < len && _intsetGet(is,hi) < value) {
+        lo = hi+1;
+        hi = (len-hi > step) ? hi+step : len;
+        step <<= 1;
+    }
+    while (lo < hi) {
+        mid = lo+(hi-lo)/2;
+        if (_intsetGet(is,mid) < value)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Intersect "setnum" intsets, writing the values they have in common to
+ * "dst" in ascending order. The first intset should be the smallest one,
+ * "dst" must have room for all its values. As intsets are sorted, every
+ * other intset is scanned once by a cursor moving forward. Returns the
+ * number of values written. */
+uint32_t intsetIntersect(intset **sets, uint32_t setnum, int64_t *dst) {
+    uint32_t *cursor = zcalloc(sizeof(uint32_t)*setnum);
+    uint32_t i, j, len = intrev32ifbe(sets[0]->length), count = 0;
+    int64_t value;
+
+    for (i = 0; i < len; i++) {
+        value = _intsetGet(sets[0],i);
+        for (j = 1; j < setnum; j++) {
+            cursor[j] = intsetGallop(sets[j],cursor[j],value);
+            if (cursor[j] == intrev32ifbe(sets[j]->length)) goto done;
+            if (_intsetGet(sets[j],cursor[j]) != value) break;
+        }
+        if (j == setnum) dst[count++] = value;
+    }
+done:
+    zfree(cursor);
+    return count;
+}
+
 /* Return intset blob size in bytes. */
 size_t intsetBlobLen(intset *is) {
     return sizeof(intset)+intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
@@ -479,5 +549,33 @@ int main(int argc, char **argv) {
         checkConsistency(is);
         ok();
     }
+
+    printf("Intersection: "); {
+        intset *sets[3];
+        int64_t *dst;
+        uint32_t count, j;
+
+        sets[0] = createSet(10,200);
+        sets[1] = createSet(12,2000);
+        sets[2] = intsetAdd(createSet(10,500),4294967296LL,NULL);
+        dst = zmalloc(sizeof(int64_t)*intsetLen(sets[0]));
+        count = intsetIntersect(sets,3,dst);
+        for (i = 0, j = 0; i < intsetLen(sets[0]); i++) {
+            int64_t v;
+
+            assert(intsetGet(sets[0],i,&v));
+            if (intsetFind(sets[1],v) && intsetFind(sets[2],v)) {
+                assert(j < count && dst[j] == v);
+                j++;
+            }
+        }
+        assert(j == count);
+
+        is = intsetFromSorted(dst,count);
+        assert(intsetLen(is) == count);
+        checkConsistency(is);
+        for (j = 0; j < count; j++) assert(intsetFind(is,dst[j]));
+        ok();
+    }
 }
 #endif
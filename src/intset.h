@@ -46,5 +46,7 @@ int64_t intsetRandom(intset *is);
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);
 uint32_t intsetLen(intset *is);
 size_t intsetBlobLen(intset *is);
+intset *intsetFromSorted(const int64_t *values, uint32_t len);
+uint32_t intsetIntersect(intset **sets, uint32_t setnum, int64_t *dst);
 
 #endif // __INTSET_H
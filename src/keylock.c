@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2009-2013, Gregory Trubetskoy <grisha@apache.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+
+/* Key lock manager.
+ *
+ * A key in use by a command is represented by a keyLock object, stored in a
+ * fixed size table of buckets hashed by DB id and key name. Every bucket has
+ * its own mutex, protecting the chain of keyLock objects of the bucket and
+ * their state. A keyLock is created by the first client locking the key and
+ * freed when the last holder releases it and nobody is waiting for it.
+ *
+ * A key can be held in shared mode by any number of clients, or in
+ * exclusive mode by a single client. Clients that can't be granted the lock
+ * are queued in FIFO order and sleep on a condition variable until the
+ * releasing client hands the lock over to them: a shared request is queued
+ * as well if somebody is already waiting, so that writers don't starve.
+ * A holder can upgrade its shared lock to exclusive only while no other
+ * client shares the key.
+ *
+ * Deadlocks are avoided by ordering: lockKeys() acquires the keys sorted by
+ * name, so no spinning or unrolling is needed. Commands that need more than
+ * one key must use lockKeys(), or lockDbKeys() for keys of several DBs,
+ * sorted by DB and then by name. */
+
+#define REDIS_KEYLOCK_BUCKETS 1024      /* Must be a power of two */
+#define REDIS_KEYLOCK_HOT_KEYS 8        /* Hot keys reported by INFO */
+
+typedef struct keyLockWaiter {
+    redisClient *client;
+    int mode;
+    int granted;
+    pthread_cond_t cond;
+    struct keyLockWaiter *next;
+} keyLockWaiter;
+
+typedef struct keyLock {
+    int dbid;
+    sds key;
+    int mode;                   /* Mode the holders have the key in */
+    list *holders;              /* Clients holding the key */
+    keyLockWaiter *head, *tail; /* Clients waiting for the key, FIFO */
+    struct keyLock *next;       /* Next keyLock in the same bucket */
+} keyLock;
+
+typedef struct keyLockBucket {
+    pthread_mutex_t lock;
+    keyLock *locks;
+    long long acquired;         /* Locks granted */
+    long long contended;        /* Locks granted after waiting */
+    long long wait_us;          /* Time spent waiting */
+    int waiting;                /* Clients waiting right now */
+} keyLockBucket;
+
+typedef struct keyLockHotKey {
+    int dbid;
+    sds key;
+    long long waits;
+} keyLockHotKey;
+
+static keyLockBucket keyLockTable[REDIS_KEYLOCK_BUCKETS];
+static keyLockHotKey keyLockHotKeys[REDIS_KEYLOCK_HOT_KEYS];
+static pthread_mutex_t keyLockHotKeysLock = PTHREAD_MUTEX_INITIALIZER;
+
+void keyLockInit(void) {
+    int j;
+
+    for (j = 0; j < REDIS_KEYLOCK_BUCKETS; j++) {
+        pthread_mutex_init(&keyLockTable[j].lock,NULL);
+        keyLockTable[j].locks = NULL;
+        keyLockTable[j].acquired = 0;
+        keyLockTable[j].contended = 0;
+        keyLockTable[j].wait_us = 0;
+        keyLockTable[j].waiting = 0;
+    }
+}
+
+static keyLockBucket *keyLockGetBucket(int dbid, sds key) {
+    unsigned int h = dictGenHashFunction(key,sdslen(key)) + dbid;
+
+    return keyLockTable + (h & (REDIS_KEYLOCK_BUCKETS-1));
+}
+
+/* Return the keyLock of the key, or NULL. Called with the bucket locked. */
+static keyLock *keyLockFind(keyLockBucket *b, int dbid, sds key) {
+    keyLock *kl;
+
+    for (kl = b->locks; kl; kl = kl->next) {
+        if (kl->dbid == dbid && sdslen(kl->key) == sdslen(key) &&
+            memcmp(kl->key,key,sdslen(key)) == 0) return kl;
+    }
+    return NULL;
+}
+
+static int keyLockIsHolder(keyLock *kl, redisClient *c) {
+    return listSearchKey(kl->holders,c) != NULL;
+}
+
+/* Keep track of the keys clients waited for the most. This is the "space
+ * saving" algorithm: when the table is full the key with the least waits is
+ * replaced, inheriting its count. */
+static void keyLockRecordHotKey(int dbid, sds key) {
+    keyLockHotKey *min = NULL;
+    int j;
+
+    pthread_mutex_lock(&keyLockHotKeysLock);
+    for (j = 0; j < REDIS_KEYLOCK_HOT_KEYS; j++) {
+        keyLockHotKey *hk = keyLockHotKeys+j;
+
+        if (hk->key && hk->dbid == dbid && sdscmp(hk->key,key) == 0) {
+            hk->waits++;
+            pthread_mutex_unlock(&keyLockHotKeysLock);
+            return;
+        }
+        if (min == NULL || hk->waits < min->waits) min = hk;
+    }
+    if (min->key) sdsfree(min->key);
+    min->dbid = dbid;
+    min->key = sdsdup(key);
+    min->waits++;
+    pthread_mutex_unlock(&keyLockHotKeysLock);
+}
+
+/* Hand the key over to the clients at the head of the queue: the first
+ * exclusive waiter alone, or all the shared waiters up to the next exclusive
+ * one. Called with the bucket locked when the key has no holders left. */
+static void keyLockGrantWaiters(keyLock *kl) {
+    while (kl->head) {
+        keyLockWaiter *w = kl->head;
+
+        if (listLength(kl->holders) &&
+            (w->mode == REDIS_KEYLOCK_EXCLUSIVE ||
+             kl->mode == REDIS_KEYLOCK_EXCLUSIVE)) break;
+        kl->head = w->next;
+        if (kl->head == NULL) kl->tail = NULL;
+        kl->mode = w->mode;
+        listAddNodeTail(kl->holders,w->client);
+        w->granted = 1;
+        pthread_cond_signal(&w->cond);
+    }
+}
+
+/* Acquire the key for client 'c' in the given mode, waiting if needed.
+ * If 'trylock' is true the function never waits: REDIS_ERR is returned if
+ * the key can't be granted right away. 'c' may be NULL for locks taken by
+ * the server itself, for instance to evict a key. */
+static int keyLockAcquire(redisClient *c, int dbid, sds key, int mode,
+                          int trylock)
+{
+    keyLockBucket *b = keyLockGetBucket(dbid,key);
+    keyLockWaiter w;
+    keyLock *kl;
+    long long start;
+
+    pthread_mutex_lock(&b->lock);
+    kl = keyLockFind(b,dbid,key);
+    if (kl == NULL) {
+        kl = zmalloc(sizeof(*kl));
+        kl->dbid = dbid;
+        kl->key = sdsdup(key);
+        kl->mode = mode;
+        kl->holders = listCreate();
+        kl->head = kl->tail = NULL;
+        kl->next = b->locks;
+        b->locks = kl;
+        listAddNodeTail(kl->holders,c);
+        b->acquired++;
+        pthread_mutex_unlock(&b->lock);
+        return REDIS_OK;
+    }
+
+    if (c && keyLockIsHolder(kl,c)) {
+        /* We are already holding this key. Upgrading a shared lock is
+         * immediate if nobody else holds it. Otherwise it is refused: giving
+         * our shared lock up to queue for the exclusive one would let
+         * another writer modify the key in the middle of our command, and
+         * two clients upgrading would wait for each other. Callers lock a
+         * key in the strongest mode they need up front, only SQL upgrades,
+         * without waiting (see trylockDbKey()). */
+        if (kl->mode == REDIS_KEYLOCK_EXCLUSIVE ||
+            mode == REDIS_KEYLOCK_SHARED ||
+            listLength(kl->holders) == 1)
+        {
+            kl->mode = kl->mode > mode ? kl->mode : mode;
+            pthread_mutex_unlock(&b->lock);
+            return REDIS_OK;
+        }
+        if (!trylock)
+            redisPanic("Upgrade of a key lock shared with other clients");
+        pthread_mutex_unlock(&b->lock);
+        return REDIS_ERR;
+    } else if (listLength(kl->holders) == 0 ||
+               (kl->head == NULL && mode == REDIS_KEYLOCK_SHARED &&
+                kl->mode == REDIS_KEYLOCK_SHARED))
+    {
+        kl->mode = mode;
+        listAddNodeTail(kl->holders,c);
+        b->acquired++;
+        pthread_mutex_unlock(&b->lock);
+        return REDIS_OK;
+    }
+
+    if (trylock) {
+        pthread_mutex_unlock(&b->lock);
+        return REDIS_ERR;
+    }
+
+    /* Queue and sleep until a releasing client grants us the key. */
+    w.client = c;
+    w.mode = mode;
+    w.granted = 0;
+    w.next = NULL;
+    pthread_cond_init(&w.cond,NULL);
+    if (kl->tail) kl->tail->next = &w; else kl->head = &w;
+    kl->tail = &w;
+    if (listLength(kl->holders) == 0) keyLockGrantWaiters(kl);
+    b->waiting++;
+    start = ustime();
+    while (!w.granted) pthread_cond_wait(&w.cond,&b->lock);
+    b->waiting--;
+    b->acquired++;
+    b->contended++;
+    b->wait_us += ustime()-start;
+    pthread_mutex_unlock(&b->lock);
+    pthread_cond_destroy(&w.cond);
+
+    keyLockRecordHotKey(dbid,key);
+    return REDIS_OK;
+}
+
+static void keyLockRelease(redisClient *c, int dbid, sds key) {
+    keyLockBucket *b = keyLockGetBucket(dbid,key);
+    keyLock *kl, **prev;
+    listNode *ln;
+
+    pthread_mutex_lock(&b->lock);
+    for (prev = &b->locks; (kl = *prev) != NULL; prev = &kl->next) {
+        if (kl->dbid == dbid && sdslen(kl->key) == sdslen(key) &&
+            memcmp(kl->key,key,sdslen(key)) == 0) break;
+    }
+    if (kl == NULL || (ln = listSearchKey(kl->holders,c)) == NULL) {
+        /* Not holding this key, nothing to do. */
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+    listDelNode(kl->holders,ln);
+    if (listLength(kl->holders) == 0) keyLockGrantWaiters(kl);
+    if (listLength(kl->holders) == 0 && kl->head == NULL) {
+        *prev = kl->next;
+        sdsfree(kl->key);
+        listRelease(kl->holders);
+        zfree(kl);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Return true if some client holds or waits for the key. */
+int keyIsLocked(redisDb *db, sds key) {
+    keyLockBucket *b = keyLockGetBucket(db->id,key);
+    int locked;
+
+    pthread_mutex_lock(&b->lock);
+    locked = keyLockFind(b,db->id,key) != NULL;
+    pthread_mutex_unlock(&b->lock);
+    return locked;
+}
+
+/* Return true if the key is held in shared mode: the readers holding it may
+ * be using its value, so it must not be deleted from under them. */
+int keyIsShared(redisDb *db, sds key) {
+    keyLockBucket *b = keyLockGetBucket(db->id,key);
+    keyLock *kl;
+    int shared;
+
+    pthread_mutex_lock(&b->lock);
+    kl = keyLockFind(b,db->id,key);
+    shared = kl && listLength(kl->holders) &&
+             kl->mode == REDIS_KEYLOCK_SHARED;
+    pthread_mutex_unlock(&b->lock);
+    return shared;
+}
+
+/* Lock the key on behalf of the server, without waiting: used to delete
+ * keys (eviction, active expire) while threads may be using them. Returns
+ * REDIS_ERR if the key is in use. */
+int trylockKeyForDelete(redisDb *db, sds key) {
+    return keyLockAcquire(NULL,db->id,key,REDIS_KEYLOCK_EXCLUSIVE,1);
+}
+
+void unlockKeyForDelete(redisDb *db, sds key) {
+    keyLockRelease(NULL,db->id,key);
+}
+
+/* Lock a key of the given DB for the client, waiting for it like
+ * genericLockKey(). SQL locks the keys of its virtual tables in db 0
+ * whatever the DB of the client. */
+void lockDbKey(redisClient *c, redisDb *db, sds key, int mode) {
+    keyLockAcquire(c,db->id,key,mode,0);
+}
+
+/* Lock a key of the given DB for the client without waiting, returns
+ * REDIS_ERR if it can't be granted right away. Used by SQL, which locks
+ * the keys matching a pattern one at a time while already holding the keys
+ * of the statement: waiting for them could deadlock. */
+int trylockDbKey(redisClient *c, redisDb *db, sds key, int mode) {
+    return keyLockAcquire(c,db->id,key,mode,1);
+}
+
+void unlockDbKey(redisClient *c, redisDb *db, sds key) {
+    keyLockRelease(c,db->id,key);
+}
+
+/* Return true if the client is one of the holders of the key. */
+int keyIsHeldBy(redisClient *c, redisDb *db, sds key) {
+    keyLockBucket *b = keyLockGetBucket(db->id,key);
+    keyLock *kl;
+    int held;
+
+    pthread_mutex_lock(&b->lock);
+    kl = keyLockFind(b,db->id,key);
+    held = kl && keyLockIsHolder(kl,c);
+    pthread_mutex_unlock(&b->lock);
+    return held;
+}
+
+/* ============================ Client interface ============================ */
+
+/* Keys are ordered the way locks tell them apart: binary safe and case
+ * sensitive, so that the same keys are always taken in the same order and
+ * the copies of a key end up next to each other. */
+static int _compare_keys(const void *k1, const void *k2) {
+    return sdscmp((*(robj **)k1)->ptr, (*(robj **)k2)->ptr);
+}
+
+/* The lock mode is chosen from the flags of the command being executed:
+ * read only commands ("r" flag) share the key with other readers, anything
+ * else takes it exclusively.
+ *
+ * While a client runs a batch of pipelined commands (REDIS_KEYS_LOCKED, see
+ * callCommandBatch()) the keys of all the commands are already held, so the
+ * functions below leave them alone. */
+static int keyLockCommandMode(redisClient *c) {
+    if (c->cmd && (c->cmd->flags & REDIS_CMD_READONLY))
+        return REDIS_KEYLOCK_SHARED;
+    return REDIS_KEYLOCK_EXCLUSIVE;
+}
+
+void lockKeys(redisClient *c, robj **keys, int n_keys) {
+    if (!server.locking_mode) return;
+    genericLockKeys(c, keys, n_keys, keyLockCommandMode(c));
+}
+
+void genericLockKeys(redisClient *c, robj **keys, int n_keys, int mode) {
+    int i;
+
+    if (!server.locking_mode || c->flags & REDIS_KEYS_LOCKED) return;
+
+    /* keys must be sorted to avoid deadlock: every client acquires them in
+     * the same order, so waiting is always safe. A key repeated right after
+     * itself is already held. */
+    qsort(keys, n_keys, sizeof(robj *), _compare_keys);
+    for (i=0; i<n_keys; i++) {
+        if (i && sdscmp(keys[i]->ptr,keys[i-1]->ptr) == 0) continue;
+        genericLockKey(c,keys[i],mode);
+    }
+}
+
+void unlockKeys(redisClient *c, robj **keys, int n_keys) {
+    int i;
+
+    if (!server.locking_mode) return;
+
+    /* we assume that the keys have already been sorted in lockKeys! */
+    for (i=n_keys-1; i>=0; i--) {
+        if (i && sdscmp(keys[i]->ptr,keys[i-1]->ptr) == 0) continue;
+        unlockKey(c,keys[i]);
+    }
+}
+
+static int _compare_db_keys(const void *k1, const void *k2) {
+    const dbKey *a = k1, *b = k2;
+
+    if (a->db->id != b->db->id) return a->db->id - b->db->id;
+    return sdscmp(a->key->ptr, b->key->ptr);
+}
+
+/* Like lockKeys() for keys of different DBs, such as the source and the
+ * target key of MOVE. */
+void lockDbKeys(redisClient *c, dbKey *keys, int n_keys) {
+    int i, mode;
+
+    if (!server.locking_mode || c->flags & REDIS_KEYS_LOCKED) return;
+
+    mode = keyLockCommandMode(c);
+    qsort(keys, n_keys, sizeof(dbKey), _compare_db_keys);
+    for (i=0; i<n_keys; i++) {
+        if (i && _compare_db_keys(&keys[i],&keys[i-1]) == 0) continue;
+        keyLockAcquire(c,keys[i].db->id,keys[i].key->ptr,mode,0);
+    }
+}
+
+void unlockDbKeys(redisClient *c, dbKey *keys, int n_keys) {
+    int i;
+
+    if (!server.locking_mode || c->flags & REDIS_KEYS_LOCKED) return;
+
+    /* sorted by lockDbKeys() */
+    for (i=n_keys-1; i>=0; i--) {
+        if (i && _compare_db_keys(&keys[i],&keys[i-1]) == 0) continue;
+        keyLockRelease(c,keys[i].db->id,keys[i].key->ptr);
+    }
+}
+
+void lockKey(redisClient *c, robj *key) {
+    if (!server.locking_mode) return;
+    genericLockKey(c, key, keyLockCommandMode(c));
+}
+
+void genericLockKey(redisClient *c, robj *key, int mode) {
+    if (!server.locking_mode || c->flags & REDIS_KEYS_LOCKED) return;
+
+#ifdef MONITOR_LOCKS
+    if (listLength(server.monitors) && !server.loading) {
+        robj **argv = zcalloc(sizeof(robj)*2);
+        argv[0] = createStringObject("locking", 7);
+        argv[1] = key;
+        replicationFeedMonitors(c,server.monitors,c->db->id,argv,2);
+        decrRefCount(argv[0]);
+        zfree(argv);
+    }
+#endif /* MONITOR_LOCKS */
+
+    keyLockAcquire(c,c->db->id,key->ptr,mode,0);
+}
+
+void unlockKey(redisClient *c, robj *key) {
+
+    if (!server.locking_mode || c->flags & REDIS_KEYS_LOCKED) return;
+
+    keyLockRelease(c,c->db->id,key->ptr);
+
+#ifdef MONITOR_LOCKS
+    if (listLength(server.monitors) && !server.loading) {
+        robj **argv = zcalloc(sizeof(robj)*2);
+        argv[0] = createStringObject("unlocked", 8);
+        argv[1] = key;
+        replicationFeedMonitors(c,server.monitors,c->db->id,argv,2);
+        decrRefCount(argv[0]);
+        zfree(argv);
+    }
+#endif /* MONITOR_LOCKS */
+}
+
+/* ================================== INFO ================================== */
+
+static int keyLockCompareHotKeys(const void *a, const void *b) {
+    const keyLockHotKey *ha = a, *hb = b;
+
+    return (ha->waits < hb->waits) - (ha->waits > hb->waits);
+}
+
+sds genKeyLockInfoString(sds info) {
+    long long acquired = 0, contended = 0, wait_us = 0;
+    keyLockHotKey hot[REDIS_KEYLOCK_HOT_KEYS];
+    int j, waiting = 0, keys = 0;
+
+    for (j = 0; j < REDIS_KEYLOCK_BUCKETS; j++) {
+        keyLockBucket *b = keyLockTable+j;
+        keyLock *kl;
+
+        pthread_mutex_lock(&b->lock);
+        acquired += b->acquired;
+        contended += b->contended;
+        wait_us += b->wait_us;
+        waiting += b->waiting;
+        for (kl = b->locks; kl; kl = kl->next) keys++;
+        pthread_mutex_unlock(&b->lock);
+    }
+    info = sdscatprintf(info,
+        "keylock_acquired:%lld\r\n"
+        "keylock_contended:%lld\r\n"
+        "keylock_wait_usec:%lld\r\n"
+        "keylock_wait_usec_per_contended:%.2f\r\n"
+        "keylock_locked_keys:%d\r\n"
+        "keylock_waiting_clients:%d\r\n",
+        acquired, contended, wait_us,
+        contended ? (float)wait_us/contended : 0,
+        keys, waiting);
+
+    /* Hot keys, most waited for first. */
+    pthread_mutex_lock(&keyLockHotKeysLock);
+    for (j = 0; j < REDIS_KEYLOCK_HOT_KEYS; j++) {
+        hot[j] = keyLockHotKeys[j];
+        if (hot[j].key) hot[j].key = sdsdup(hot[j].key);
+    }
+    pthread_mutex_unlock(&keyLockHotKeysLock);
+    qsort(hot,REDIS_KEYLOCK_HOT_KEYS,sizeof(keyLockHotKey),
+          keyLockCompareHotKeys);
+    for (j = 0; j < REDIS_KEYLOCK_HOT_KEYS; j++) {
+        if (hot[j].key == NULL) continue;
+        info = sdscatprintf(info,"keylock_hot_key_%d:db=%d,waits=%lld,key=",
+            j, hot[j].dbid, hot[j].waits);
+        info = sdscatrepr(info,hot[j].key,sdslen(hot[j].key));
+        info = sdscat(info,"\r\n");
+        sdsfree(hot[j].key);
+    }
+    return info;
+}
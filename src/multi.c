@@ -292,10 +292,8 @@ void touchWatchedKeysOnFlush(int dbid) {
              * key exists, mark the client as dirty, as the key will be
              * removed. */
             if (dbid == -1 || wk->db->id == dbid) {
-                pthread_mutex_lock(wk->db->lock);
-                if (dictFind(wk->db->dict, wk->key->ptr) != NULL)
+                if (dbExists(wk->db, wk->key))
                     c->flags |= REDIS_DIRTY_CAS;
-                pthread_mutex_unlock(wk->db->lock);
             }
         }
     }
@@ -29,6 +29,13 @@
 
 #include "redis.h"
 #include <sys/uio.h>
+#include <limits.h>
+
+#ifdef IOV_MAX
+#define REDIS_IOV_MAX (IOV_MAX > 1024 ? 1024 : IOV_MAX)
+#else
+#define REDIS_IOV_MAX 16
+#endif
 
 static void setProtocolError(redisClient *c, int pos);
 
@@ -76,6 +83,7 @@ redisClient *createClient(int fd) {
     c->reqtype = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argpoollen = 0;
     c->cmd = c->lastcmd = NULL;
     c->multibulklen = 0;
     c->bulklen = -1;
@@ -108,15 +116,21 @@ redisClient *createClient(int fd) {
     pthread_mutex_init(c->lock, NULL);
     c->refcount = 0;
     c->busy = 0;
-    if (fd != -1) {
-        scriptingInit(c);
-        sqlClientInit(c);
-    } else {
-        c->lua = NULL;
-        c->lua_client = NULL;
-        c->sql_db = NULL;
-        c->sql_client = NULL;
-    }
+    /* The Lua interpreter and the SQLite connection are only set up the
+     * first time the client runs a script or SQL. */
+    c->lua = NULL;
+    c->lua_client = NULL;
+    c->sql_conn = NULL;
+    c->sql_cursors = NULL;
+    c->sql_stmts = NULL;
+    c->sql_stmt_lru = NULL;
+    c->sql_stmt_tables = NULL;
+    c->sql_cursor_fetch = 0;
+    c->sql_stmt_writes = 0;
+    c->sql_binary = 0;
+    c->io_thread = 0;
+    c->io_nread = 0;
+    c->io_errno = 0;
     c->lua_time_start = 0;
     
     return c;
@@ -135,16 +149,34 @@ redisClient *createClient(int fd) {
  *
  * Typically gets called every time a reply is built, before adding more
  * data to the clients output buffers. If the function returns REDIS_ERR no
- * data should be appended to the output buffers. */
+ * data should be appended to the output buffers.
+ *
+ * With I/O threads the replies built in the event loop are not written
+ * by a write handler but queued in server.clients_pending_write, and
+ * written by the I/O threads before the event loop sleeps, see
+ * handleClientsWithPendingWrites(). A client being read by an I/O thread
+ * (a protocol error) is queued by handleClientsWithPendingReads(). */
 int prepareClientToWrite(redisClient *c) {
     if ((c->flags & REDIS_LUA_CLIENT) ||
         (c->flags & REDIS_SQLITE_CLIENT)) return REDIS_OK;
     if (c->fd <= 0) return REDIS_ERR; /* Fake client */
 
+    if (c->flags & REDIS_IO_PENDING_READ) return REDIS_OK;
     if (c->bufpos == 0 && listLength(c->reply) == 0 &&
         (c->replstate == REDIS_REPL_NONE ||
          c->replstate == REDIS_REPL_ONLINE)) {
             int rc;
+
+            if (server.io_threads &&
+                !(c->flags & (REDIS_SLAVE|REDIS_MASTER)) &&
+                pthread_equal(pthread_self(),server.main_thread))
+            {
+                if (!(c->flags & REDIS_IO_PENDING_WRITE)) {
+                    c->flags |= REDIS_IO_PENDING_WRITE;
+                    listAddNodeTail(server.clients_pending_write,c);
+                }
+                return REDIS_OK;
+            }
             rc = aeCreateFileEvent(server.el, c->fd, AE_WRITABLE, sendReplyToClient, c);
             if (rc == AE_ERR) return REDIS_ERR;
     }
@@ -200,8 +232,9 @@ void _addReplyObjectToList(redisClient *c, robj *o) {
     } else {
         tail = listNodeValue(listLast(c->reply));
 
-        /* Append to this object when possible. */
-        if (tail->ptr != NULL &&
+        /* Append to this object when possible, unless it is a value
+         * referenced by the reply, see _addReplyObjectRefToList(). */
+        if (tail->ptr != NULL && tail->refcount == 1 &&
             sdslen(tail->ptr)+sdslen(o->ptr) <= REDIS_REPLY_CHUNK_BYTES)
         {
             c->reply_bytes -= zmalloc_size_sds(tail->ptr);
@@ -233,8 +266,9 @@ void _addReplySdsToList(redisClient *c, sds s) {
     } else {
         tail = listNodeValue(listLast(c->reply));
 
-        /* Append to this object when possible. */
-        if (tail->ptr != NULL &&
+        /* Append to this object when possible, unless it is a value
+         * referenced by the reply, see _addReplyObjectRefToList(). */
+        if (tail->ptr != NULL && tail->refcount == 1 &&
             sdslen(tail->ptr)+sdslen(s) <= REDIS_REPLY_CHUNK_BYTES)
         {
             c->reply_bytes -= zmalloc_size_sds(tail->ptr);
@@ -263,8 +297,9 @@ void _addReplyStringToList(redisClient *c, char *s, size_t len) {
     } else {
         tail = listNodeValue(listLast(c->reply));
 
-        /* Append to this object when possible. */
-        if (tail->ptr != NULL &&
+        /* Append to this object when possible, unless it is a value
+         * referenced by the reply, see _addReplyObjectRefToList(). */
+        if (tail->ptr != NULL && tail->refcount == 1 &&
             sdslen(tail->ptr)+len <= REDIS_REPLY_CHUNK_BYTES)
         {
             c->reply_bytes -= zmalloc_size_sds(tail->ptr);
@@ -281,6 +316,19 @@ void _addReplyStringToList(redisClient *c, char *s, size_t len) {
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Add the object to the reply list as it is, without copying it, holding a
+ * reference to it until it is written: it is sent by writeToClient() with
+ * writev() along with the nodes around it. Objects with more than one
+ * reference are never modified in place (see APPEND or SETRANGE). */
+void _addReplyObjectRefToList(redisClient *c, robj *o) {
+    if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
+
+    incrRefCount(o);
+    listAddNodeTail(c->reply,o);
+    c->reply_bytes += zmalloc_size_sds(o->ptr);
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -296,7 +344,9 @@ void addReply(redisClient *c, robj *obj) {
      * we'll be able to send the object to the client without
      * messing with its page. */
     if (obj->encoding == REDIS_ENCODING_RAW) {
-        if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != REDIS_OK)
+        if (sdslen(obj->ptr) >= REDIS_REPLY_REF_MIN_BYTES)
+            _addReplyObjectRefToList(c,obj);
+        else if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != REDIS_OK)
             _addReplyObjectToList(c,obj);
     } else if (obj->encoding == REDIS_ENCODING_INT) {
         /* Optimization: if there is room in the static buffer for 32 bytes
@@ -410,8 +460,9 @@ void setDeferredMultiBulkLength(redisClient *c, void *node, long length) {
     if (ln->next != NULL) {
         next = listNodeValue(ln->next);
 
-        /* Only glue when the next node is non-NULL (an sds in this case) */
-        if (next->ptr != NULL) {
+        /* Only glue when the next node is non-NULL (an sds in this case)
+         * and not a value referenced by the reply. */
+        if (next->ptr != NULL && next->refcount == 1) {
             c->reply_bytes -= zmalloc_size_sds(len->ptr);
             c->reply_bytes -= zmalloc_size_sds(next->ptr);
             len->ptr = sdscatlen(len->ptr,next->ptr,sdslen(next->ptr));
@@ -422,6 +473,22 @@ void setDeferredMultiBulkLength(redisClient *c, void *node, long length) {
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Drop the reply from the deferred length node to the end, so that an
+ * error can be sent in its place. The replies of the previous commands
+ * of the client, if still unsent, are left alone. */
+void discardDeferredReply(redisClient *c, void *node) {
+    listNode *ln = (listNode*)node, *next;
+
+    while (ln) {
+        robj *o = listNodeValue(ln);
+
+        next = ln->next;
+        if (o->ptr) c->reply_bytes -= zmalloc_size_sds(o->ptr);
+        listDelNode(c->reply,ln);
+        ln = next;
+    }
+}
+
 /* Add a duble as a bulk reply */
 void addReplyDouble(redisClient *c, double d) {
     char dbuf[128], sbuf[128];
@@ -557,6 +624,11 @@ static void acceptCommonHandler(int fd, int flags) {
     }
     server.stat_numconnections++;
     c->flags |= flags;
+    if (server.io_threads) {
+        c->io_thread = server.io_next_thread;
+        server.io_next_thread = (server.io_next_thread+1) %
+                                (server.io_threads+1);
+    }
 }
 
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -591,14 +663,50 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 }
 
 
+/* Free the arguments of the last command of the client. Small string
+ * arguments no longer referenced by anything else, that is not retained by
+ * the command (stored in a key, queued by MULTI, ...), are kept in the
+ * argument pool of the client instead, and reused by the protocol parser
+ * for the arguments of the next commands: most commands are then parsed
+ * without allocating (and later freeing) two objects per argument. */
 static void freeClientArgv(redisClient *c) {
     int j;
-    for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
+    for (j = 0; j < c->argc; j++) {
+        robj *o = c->argv[j];
+
+        if (o->refcount == 1 &&
+            c->argpoollen < REDIS_ARGPOOL_SIZE &&
+            o->type == REDIS_STRING &&
+            o->encoding == REDIS_ENCODING_RAW &&
+            sdslen(o->ptr)+sdsavail(o->ptr) <= REDIS_ARGPOOL_MAX_LEN)
+        {
+            c->argpool[c->argpoollen++] = o;
+        } else {
+            decrRefCount(o);
+        }
+    }
     c->argc = 0;
     c->cmd = NULL;
 }
 
+/* Release the argument objects kept for reuse by freeClientArgv(). */
+void freeClientArgPool(redisClient *c) {
+    while (c->argpoollen) decrRefCount(c->argpool[--c->argpoollen]);
+}
+
+/* Create a string object for an argument of the request being parsed,
+ * reusing an object from the argument pool of the client if any. */
+static robj *createArgObject(redisClient *c, char *ptr, size_t len) {
+    robj *o;
+
+    if (c->argpoollen == 0 || len > REDIS_ARGPOOL_MAX_LEN)
+        return createStringObject(ptr,len);
+    o = c->argpool[--c->argpoollen];
+    o->ptr = sdscpylen(o->ptr,ptr,len);
+    o->lru = server.lruclock;
+    return o;
+}
+
 /* Close all the slaves connections. This is useful in chained replication
  * when we resync with our own master and want to force all our slaves to
  * resync with us as well. */
@@ -615,9 +723,9 @@ void deallocateClient(redisClient *c) {
     /* If this is marked as current client unset it */
     if (server.current_client == c) server.current_client = NULL;
 
-    /* Delete timeEvent if any */
-    if (c->time_event_id)
-        aeDeleteTimeEvent(server.el, c->time_event_id);
+    /* Drop the pending completion event if any. It will never run, so
+     * account here for the locking_mode decrement it would have done. */
+    server.locking_mode -= aeDeleteAsyncEvents(server.el, c);
 
     /* Note that if the client we are freeing is blocked into a blocking
      * call, we have to set querybuf to NULL *before* to call
@@ -626,8 +734,12 @@ void deallocateClient(redisClient *c) {
      * this, because this call adds the READABLE event. */
     sdsfree(c->querybuf);
     c->querybuf = NULL;
-    if (c->flags & REDIS_BLOCKED)
-        unblockClientWaitingData(c);
+    if (c->flags & REDIS_BLOCKED) {
+        if (c->bpop.keys)
+            unblockClientWaitingData(c);
+        else
+            sqlSaveUnblockClient(c);
+    }
 
     /* UNWATCH all the keys */
     unwatchAllKeys(c);
@@ -642,6 +754,7 @@ void deallocateClient(redisClient *c) {
     aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
     listRelease(c->reply);
     freeClientArgv(c);
+    freeClientArgPool(c);
     close(c->fd);
     /* Remove from the list of clients */
     ln = listSearchKey(server.clients,c);
@@ -654,6 +767,23 @@ void deallocateClient(redisClient *c) {
         redisAssert(ln != NULL);
         listDelNode(server.unblocked_clients,ln);
     }
+    /* And for the clients waiting for an I/O thread. */
+    if (c->flags & REDIS_IO_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read,c);
+        redisAssert(ln != NULL);
+        listDelNode(server.clients_pending_read,ln);
+    }
+    if (c->flags & REDIS_IO_PENDING_WRITE) {
+        ln = listSearchKey(server.clients_pending_write,c);
+        redisAssert(ln != NULL);
+        listDelNode(server.clients_pending_write,ln);
+    }
+    /* Same for clients paused waiting for room in the threadpool queue. */
+    if (c->flags & REDIS_THREADPOOL_WAIT) {
+        ln = listSearchKey(server.threadpool_waiting_clients,c);
+        redisAssert(ln != NULL);
+        listDelNode(server.threadpool_waiting_clients,ln);
+    }
     listRelease(c->io_keys);
     /* Master/slave cleanup.
      * Case 1: we lost the connection with a slave. */
@@ -691,9 +821,6 @@ void deallocateClient(redisClient *c) {
     zfree(c->argv);
     freeClientMultiState(c);
 
-    /* free lua interpreter */
-    scriptingRelease(c);
-
     pthread_mutex_unlock(c->lock); /* just in case */
     if (!pthread_mutex_destroy(c->lock))
       zfree(c->lock);
@@ -705,9 +832,7 @@ void freeClient(redisClient *c) {
     if (c->refcount <= 1)
         deallocateClient(c);
     else {
-        pthread_mutex_lock(ref_lock);
-        c->refcount--;
-        pthread_mutex_unlock(ref_lock);
+        refCountAdd(c->refcount,-1);
         pthread_mutex_unlock(c->lock);
     }
 
@@ -734,66 +859,82 @@ void freeClientsInAsyncFreeQueue(void) {
     }
 }
 
-void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    redisClient *c = privdata;
-    int nwritten = 0, totwritten = 0, objlen;
-    size_t objmem;
+/* Write as much of the output buffers of the client as the socket takes,
+ * setting *totwritten to the bytes written. The static buffer and up to
+ * IOV_MAX nodes of the reply list are written with a single writev().
+ * Returns -1 on a write error (errno is in c->io_errno), 0 otherwise.
+ * Called with the client locked, in the event loop or in an I/O thread. */
+static int writeToClient(redisClient *c, int *totwritten) {
+    struct iovec iov[REDIS_IOV_MAX];
+    int iovcnt, nwritten = 0;
+    size_t towrite, written;
+    listNode *ln;
     robj *o;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
 
-    /* an addReply* at the beginning of a long-running command,
-     * e.g. EXEC would block here on a writable event, so we use a
-     * trylock here, if it fails, we can always get it next time. */
+    *totwritten = 0;
+    while(c->bufpos > 0 || listLength(c->reply)) {
+        /* Gather the static buffer, then the reply list. c->sentlen is
+         * the part of the first of them that was already written. */
+        iovcnt = 0;
+        towrite = 0;
+        if (c->bufpos > 0) {
+            iov[iovcnt].iov_base = c->buf+c->sentlen;
+            iov[iovcnt].iov_len = c->bufpos-c->sentlen;
+            towrite += iov[iovcnt++].iov_len;
+        }
+        ln = listFirst(c->reply);
+        while (ln && iovcnt < REDIS_IOV_MAX &&
+               towrite < REDIS_MAX_WRITE_PER_EVENT)
+        {
+            size_t skip = iovcnt ? 0 : c->sentlen;
+
+            o = listNodeValue(ln);
+            ln = listNextNode(ln);
+            if (sdslen(o->ptr) == skip) continue;
+            iov[iovcnt].iov_base = ((char*)o->ptr)+skip;
+            iov[iovcnt].iov_len = sdslen(o->ptr)-skip;
+            towrite += iov[iovcnt++].iov_len;
+        }
 
-    if (pthread_mutex_trylock(c->lock))
-        return;
+        if (c->flags & REDIS_MASTER) {
+            /* Don't reply to a master */
+            nwritten = towrite;
+        } else if (iovcnt) {
+            nwritten = writev(c->fd,iov,iovcnt);
+            if (nwritten <= 0) break;
+        } else {
+            nwritten = 0;
+        }
+        *totwritten += nwritten;
+        written = nwritten;
 
-    while(c->bufpos > 0 || listLength(c->reply)) {
+        /* Drop what was written, the static buffer first. */
         if (c->bufpos > 0) {
-            if (c->flags & REDIS_MASTER) {
-                /* Don't reply to a master */
-                nwritten = c->bufpos - c->sentlen;
+            if ((size_t)nwritten < (size_t)(c->bufpos-c->sentlen)) {
+                c->sentlen += nwritten;
+                nwritten = 0;
             } else {
-                nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
-                if (nwritten <= 0) break;
-            }
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if (c->sentlen == c->bufpos) {
+                nwritten -= c->bufpos-c->sentlen;
                 c->bufpos = 0;
                 c->sentlen = 0;
             }
-        } else {
+        }
+        while (listLength(c->reply)) {
+            size_t objlen;
+
             o = listNodeValue(listFirst(c->reply));
             objlen = sdslen(o->ptr);
-            objmem = zmalloc_size_sds(o->ptr);
-
-            if (objlen == 0) {
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
-
-            if (c->flags & REDIS_MASTER) {
-                /* Don't reply to a master */
-                nwritten = objlen - c->sentlen;
-            } else {
-                nwritten = write(fd, ((char*)o->ptr)+c->sentlen,objlen-c->sentlen);
-                if (nwritten <= 0) break;
-            }
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                c->reply_bytes -= objmem;
+            if ((size_t)nwritten < objlen-c->sentlen) {
+                c->sentlen += nwritten;
+                break;
             }
+            nwritten -= objlen-c->sentlen;
+            c->sentlen = 0;
+            c->reply_bytes -= zmalloc_size_sds(o->ptr);
+            listDelNode(c->reply,listFirst(c->reply));
         }
+        /* Partial write: the socket buffer is full. */
+        if (written < towrite) break;
         /* Note that we avoid to send more than REDIS_MAX_WRITE_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -802,19 +943,36 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
          *
          * However if we are over the maxmemory limit we ignore that and
          * just deliver as much data as it is possible to deliver. */
-        if (totwritten > REDIS_MAX_WRITE_PER_EVENT &&
+        if (*totwritten > REDIS_MAX_WRITE_PER_EVENT &&
             (server.maxmemory == 0 ||
              zmalloc_used_memory() < server.maxmemory)) break;
     }
-    if (nwritten == -1) {
-        if (errno == EAGAIN) {
-            nwritten = 0;
-        } else {
-            redisLog(REDIS_VERBOSE,
-                "Error writing to client: %s", strerror(errno));
-            freeClient(c);
-            return;
-        }
+    if (nwritten == -1 && errno != EAGAIN) {
+        c->io_errno = errno;
+        return -1;
+    }
+    return 0;
+}
+
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    redisClient *c = privdata;
+    int totwritten;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+
+    /* an addReply* at the beginning of a long-running command,
+     * e.g. EXEC would block here on a writable event, so we use a
+     * trylock here, if it fails, we can always get it next time. */
+
+    if (pthread_mutex_trylock(c->lock))
+        return;
+
+    if (writeToClient(c,&totwritten) == -1) {
+        redisLog(REDIS_VERBOSE,
+            "Error writing to client: %s", strerror(c->io_errno));
+        freeClient(c);
+        return;
     }
     if (totwritten > 0) c->lastinteraction = server.unixtime;
     if (c->bufpos == 0 && listLength(c->reply) == 0) {
@@ -822,7 +980,10 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
 
         /* Close connection after entire reply has been sent. */
-        if (c->flags & REDIS_CLOSE_AFTER_REPLY) freeClient(c);
+        if (c->flags & REDIS_CLOSE_AFTER_REPLY) {
+            freeClient(c);
+            return;
+        }
     }
     pthread_mutex_unlock(c->lock);
 }
@@ -836,9 +997,7 @@ void resetClient(redisClient *c) {
     c->bulklen = -1;
     /* We clear the ASKING flag as well if we are not inside a MULTI. */
     if (!(c->flags & REDIS_MULTI)) c->flags &= (~REDIS_ASKING);
-    pthread_mutex_lock(ref_lock);
-    c->refcount--;
-    pthread_mutex_unlock(ref_lock);
+    refCountAdd(c->refcount,-1);
 }
 
 int processInlineBuffer(redisClient *c) {
@@ -1007,7 +1166,7 @@ int processMultibulkBuffer(redisClient *c) {
                 pos = 0;
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+pos,c->bulklen);
+                    createArgObject(c,c->querybuf+pos,c->bulklen);
                 pos += c->bulklen+2;
             }
             c->bulklen = -1;
@@ -1025,7 +1184,61 @@ int processMultibulkBuffer(redisClient *c) {
     return REDIS_ERR;
 }
 
+/* Execute the command parsed in c->argv. Returns REDIS_OK if the caller
+ * can go on processing the input buffer, otherwise the command was handed
+ * to a thread (the client is still locked and busy) or the client was
+ * paused because the threadpool queue is full (the client was unlocked). */
+static int processParsedCommand(redisClient *c) {
+    int retval = processCommand(c);
+
+    if (retval == REDIS_ADDED_TO_THREAD) return REDIS_ERR;
+    if (retval == REDIS_THREADPOOL_FULL) {
+        c->busy = 0;
+        pthread_mutex_unlock(c->lock);
+        return REDIS_ERR;
+    }
+    refCountAdd(c->refcount,1);
+    resetClient(c);
+    return REDIS_OK;
+}
+
+/* Stop reading from a client whose command can't be queued because the
+ * threadpool queue is full. beforeSleep() resumes it once there is room,
+ * so the command is delayed instead of dropped, and the client can't keep
+ * filling the queue meanwhile. */
+void pauseThreadpoolWaitingClient(redisClient *c) {
+    c->flags |= REDIS_THREADPOOL_WAIT;
+    listAddNodeTail(server.threadpool_waiting_clients,c);
+    aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
+}
+
+/* Resume a client paused by pauseThreadpoolWaitingClient(): the command
+ * still in c->argv is processed again, then the rest of the input buffer.
+ * The caller must have removed it from server.threadpool_waiting_clients. */
+void resumeThreadpoolWaitingClient(redisClient *c) {
+    pthread_mutex_lock(c->lock);
+    c->busy = 1;
+    if (aeCreateFileEvent(server.el,c->fd,AE_READABLE,
+        clientReadHandler, c) == AE_ERR)
+    {
+        c->flags &= ~REDIS_THREADPOOL_WAIT;
+        c->busy = 0;
+        pthread_mutex_unlock(c->lock);
+        freeClient(c);
+        return;
+    }
+    server.current_client = c;
+    processInputBuffer(c);
+    server.current_client = NULL;
+}
+
 void processInputBuffer(redisClient *c) {
+    /* Execute first the command that could not be queued the last time. */
+    if (c->flags & REDIS_THREADPOOL_WAIT) {
+        c->flags &= ~REDIS_THREADPOOL_WAIT;
+        if (processParsedCommand(c) != REDIS_OK) return;
+    }
+
     /* Keep processing while there is something in the input buffer */
     while(c->querybuf && sdslen(c->querybuf)) {
 
@@ -1064,21 +1277,14 @@ void processInputBuffer(redisClient *c) {
 
         /* Multibulk processing could see a <= 0 length. */
         if (c->argc == 0) {
-            pthread_mutex_lock(ref_lock);
-            c->refcount++; /* because resetClient will decrement it */
-            pthread_mutex_unlock(ref_lock);
+            refCountAdd(c->refcount,1); /* because resetClient will decrement it */
             resetClient(c);
         } else {
-            if (processCommand(c) != REDIS_ADDED_TO_THREAD) {
-                pthread_mutex_lock(ref_lock);
-                c->refcount++;
-                pthread_mutex_unlock(ref_lock);
-                resetClient(c);
-            } else {
+            if (processParsedCommand(c) != REDIS_OK) {
                 /* at this point there may still be more pipelined
                  * commands to process in querybuf. We leave this
-                 * loop without unlocking, and a timedEvent will be
-                 * scheduled when the thread is done which will
+                 * loop without unlocking, and an async event will be
+                 * queued when the thread is done which will
                  * re-enter this function and process remaining
                  * commands, if any, or unlock. Important implication
                  * here is that pipelined commands are certainly not
@@ -1091,6 +1297,193 @@ void processInputBuffer(redisClient *c) {
     pthread_mutex_unlock(c->lock);
 }
 
+/* -----------------------------------------------------------------------------
+ * Batches of pipelined commands
+ * -------------------------------------------------------------------------- */
+
+typedef struct pipelinedCommand {
+    struct redisCommand *cmd;
+    robj **argv;
+    int argc;
+} pipelinedCommand;
+
+/* Return the command of the next request in the query buffer if the whole
+ * request is already there, setting *argc to its number of arguments,
+ * otherwise NULL. Only multi bulk requests are considered, and nothing is
+ * consumed: processMultibulkBuffer() will then parse the request at once.
+ * 'prev' is the command of the previous request, pipelines often repeat
+ * the same command. */
+static struct redisCommand *peekPipelinedCommand(redisClient *c, int *argc,
+                                                 struct redisCommand *prev)
+{
+    char *p = c->querybuf, *end = c->querybuf+sdslen(c->querybuf), *nl;
+    struct redisCommand *cmd = NULL;
+    long long mbulklen, bulklen;
+    int j;
+
+    if (c->multibulklen || p == end || *p != '*') return NULL;
+    if ((nl = memchr(p,'\r',end-p)) == NULL || end-nl < 2) return NULL;
+    if (!string2ll(p+1,nl-(p+1),&mbulklen) ||
+        mbulklen <= 0 || mbulklen > 1024*1024) return NULL;
+    p = nl+2;
+    for (j = 0; j < mbulklen; j++) {
+        if (p == end || *p != '$') return NULL;
+        if ((nl = memchr(p,'\r',end-p)) == NULL || end-nl < 2) return NULL;
+        if (!string2ll(p+1,nl-(p+1),&bulklen) ||
+            bulklen < 0 || bulklen > 512*1024*1024) return NULL;
+        p = nl+2;
+        if (end-p < bulklen+2) return NULL;
+        if (j == 0) {
+            if (bulklen == (long long)strlen(prev->name) &&
+                !strncasecmp(p,prev->name,bulklen))
+            {
+                cmd = prev;
+            } else {
+                sds name = sdsnewlen(p,bulklen);
+
+                cmd = lookupCommand(name);
+                sdsfree(name);
+                if (cmd == NULL) return NULL;
+            }
+        }
+        p += bulklen+2;
+    }
+    *argc = mbulklen;
+    return cmd;
+}
+
+/* Call the command of the client, already checked by processCommand(),
+ * and the commands pipelined after it that are already in the query buffer
+ * and can run right away (see commandCanBatch()), up to pipeline-batch-size
+ * commands in all.
+ *
+ * The keys of the whole batch are locked once, sorted, exclusively if any
+ * of the commands is a write: the commands then run one after the other,
+ * so the replies are in order, without locking their keys themselves
+ * (REDIS_KEYS_LOCKED). This saves a lock round trip per command to
+ * pipelines of many small commands and, when called by a thread of the
+ * pool, the trip back to the event loop to parse the next command.
+ *
+ * The event loop only batches commands while threads are running (without
+ * them keys are not locked at all), and only commands that would not be
+ * handed to a thread. A thread of the pool only batches threaded commands:
+ * the cheap ones are better left to the event loop, which runs them
+ * without locking anything once no thread is running.
+ *
+ * Called with the client locked. On return c->argv holds the last command
+ * of the batch, to be freed by resetClient(). */
+void callCommandBatch(redisClient *c) {
+    int inthread = !pthread_equal(pthread_self(),server.main_thread);
+    pipelinedCommand *batch;
+    struct redisCommand *cmd;
+    robj **keys;
+    int n, j, k, argc, numkeys = 0, maxkeys, mode = REDIS_KEYLOCK_SHARED;
+
+    if (server.pipeline_batch_size < 2 ||
+        !(server.locking_mode || inthread) ||
+        (cmd = peekPipelinedCommand(c,&argc,c->cmd)) == NULL ||
+        !commandCanBatch(c,c->cmd,c->argc) ||
+        !commandCanBatch(c,cmd,argc) ||
+        inthread != !!(cmd->flags & REDIS_CMD_THREADED))
+    {
+        call(c,REDIS_CALL_FULL);
+        pthread_mutex_lock(server.lock);
+        if (listLength(server.ready_keys))
+            handleClientsBlockedOnLists();
+        pthread_mutex_unlock(server.lock);
+        return;
+    }
+
+    /* Parse the next commands, taking over the argv of every one. */
+    batch = zmalloc(sizeof(pipelinedCommand)*server.pipeline_batch_size);
+    batch[0].cmd = c->cmd;
+    batch[0].argv = c->argv;
+    batch[0].argc = c->argc;
+    n = 1;
+    do {
+        c->argv = NULL;
+        c->argc = 0;
+        c->reqtype = REDIS_REQ_MULTIBULK;
+        redisAssertWithInfo(c,NULL,processMultibulkBuffer(c) == REDIS_OK);
+        batch[n].cmd = cmd;
+        batch[n].argv = c->argv;
+        batch[n].argc = c->argc;
+        n++;
+    } while (n < server.pipeline_batch_size &&
+             (cmd = peekPipelinedCommand(c,&argc,cmd)) != NULL &&
+             commandCanBatch(c,cmd,argc) &&
+             inthread == !!(cmd->flags & REDIS_CMD_THREADED));
+
+    /* Lock the keys of all the commands at once. The arguments are
+     * retained, as the commands may replace them in their argv. */
+    maxkeys = n;
+    keys = zmalloc(sizeof(robj*)*maxkeys);
+    for (j = 0; j < n; j++) {
+        int *keyidx, nk;
+
+        if (!(batch[j].cmd->flags & REDIS_CMD_READONLY))
+            mode = REDIS_KEYLOCK_EXCLUSIVE;
+        if (batch[j].cmd->getkeys_proc == NULL &&
+            batch[j].cmd->firstkey == batch[j].cmd->lastkey)
+        {
+            keys[numkeys] = batch[j].argv[batch[j].cmd->firstkey];
+            incrRefCount(keys[numkeys]);
+            numkeys++;
+            continue;
+        }
+        keyidx = getKeysFromCommand(batch[j].cmd,batch[j].argv,batch[j].argc,
+                                    &nk,REDIS_GETKEYS_ALL);
+        if (numkeys+nk+(n-j) > maxkeys) {
+            maxkeys = (numkeys+nk+(n-j))*2;
+            keys = zrealloc(keys,sizeof(robj*)*maxkeys);
+        }
+        for (k = 0; k < nk; k++) {
+            keys[numkeys] = batch[j].argv[keyidx[k]];
+            incrRefCount(keys[numkeys]);
+            numkeys++;
+        }
+        getKeysFreeResult(keyidx);
+    }
+    genericLockKeys(c,keys,numkeys,mode);
+
+    c->flags |= REDIS_KEYS_LOCKED;
+    for (j = 0; j < n; j++) {
+        if (j) {
+            freeClientArgv(c);
+            zfree(c->argv);
+        }
+        c->argv = batch[j].argv;
+        c->argc = batch[j].argc;
+        c->cmd = c->lastcmd = batch[j].cmd;
+        /* The commands were allowed before the ones ahead of them in the
+         * batch ran: check maxmemory again as processCommand() would.
+         * Threads don't gather commands with maxmemory set. */
+        if (j && server.maxmemory && !inthread &&
+            (c->cmd->flags & REDIS_CMD_DENYOOM) &&
+            freeMemoryIfNeeded() == REDIS_ERR)
+        {
+            addReply(c, shared.oomerr);
+            continue;
+        }
+        call(c,REDIS_CALL_FULL);
+        pthread_mutex_lock(server.lock);
+        if (listLength(server.ready_keys))
+            handleClientsBlockedOnLists();
+        pthread_mutex_unlock(server.lock);
+    }
+    c->flags &= ~REDIS_KEYS_LOCKED;
+
+    unlockKeys(c,keys,numkeys);
+    for (k = 0; k < numkeys; k++) decrRefCount(keys[k]);
+    zfree(keys);
+    zfree(batch);
+
+    pthread_mutex_lock(server.lock);
+    server.stat_pipeline_batches++;
+    server.stat_pipeline_batched_cmds += n;
+    pthread_mutex_unlock(server.lock);
+}
+
 void clientReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     redisClient *c = privdata;
     REDIS_NOTUSED(el);
@@ -1103,17 +1496,29 @@ void clientReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             pthread_mutex_unlock(c->lock);
             return;
         }
+        /* The client may be freed by readQueryFromClient(), which clears
+         * busy itself whenever it unlocks the client. */
         c->busy = 1;
+        if (server.io_threads &&
+            !(c->flags & (REDIS_SLAVE|REDIS_MASTER|REDIS_MONITOR)))
+        {
+            /* Read by an I/O thread before sleeping, the client stays
+             * locked and busy until then. */
+            c->flags |= REDIS_IO_PENDING_READ;
+            listAddNodeTail(server.clients_pending_read,c);
+            return;
+        }
         readQueryFromClient(privdata);
-        c->busy = 0;
     }
 }
 
-void readQueryFromClient(redisClient *c) {
+/* Read what the socket has for the query buffer of the client, setting
+ * c->io_nread to the result of read(2) and c->io_errno to its errno. Called
+ * in the event loop or in an I/O thread. */
+static void readFromClient(redisClient *c) {
     int nread, readlen;
     size_t qblen;
 
-    server.current_client = c; // THREDIS TODO - remove me?
     readlen = REDIS_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -1133,26 +1538,36 @@ void readQueryFromClient(redisClient *c) {
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
     nread = read(c->fd, c->querybuf+qblen, readlen);
-    if (nread == -1) {
-        if (errno == EAGAIN) {
-            nread = 0;
+    c->io_nread = nread;
+    c->io_errno = nread == -1 ? errno : 0;
+    if (nread > 0) sdsIncrLen(c->querybuf,nread);
+}
+
+/* Handle the outcome of readFromClient(): free the client on errors and
+ * on EOF, unlock it if there was nothing to read. Returns REDIS_OK if the
+ * query buffer has new data to process. */
+static int readFromClientDone(redisClient *c) {
+    if (c->io_nread == -1) {
+        if (c->io_errno == EAGAIN) {
+            c->io_nread = 0;
         } else {
-            redisLog(REDIS_VERBOSE, "Reading from client: %s",strerror(errno));
+            redisLog(REDIS_VERBOSE, "Reading from client: %s",
+                strerror(c->io_errno));
             freeClient(c);
-            return;
+            return REDIS_ERR;
         }
-    } else if (nread == 0) {
+    } else if (c->io_nread == 0) {
         redisLog(REDIS_VERBOSE, "Client closed connection");
         freeClient(c);
-        return;
+        return REDIS_ERR;
     }
-    if (nread) {
-        sdsIncrLen(c->querybuf,nread);
+    if (c->io_nread) {
         c->lastinteraction = server.unixtime;
     } else {
         server.current_client = NULL;
-	pthread_mutex_unlock(c->lock);
-        return;
+        c->busy = 0;
+        pthread_mutex_unlock(c->lock);
+        return REDIS_ERR;
     }
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = getClientInfoString(c), bytes = sdsempty();
@@ -1162,9 +1577,15 @@ void readQueryFromClient(redisClient *c) {
         sdsfree(ci);
         sdsfree(bytes);
         freeClient(c);
-        return;
+        return REDIS_ERR;
     }
+    return REDIS_OK;
+}
 
+void readQueryFromClient(redisClient *c) {
+    server.current_client = c; // THREDIS TODO - remove me?
+    readFromClient(c);
+    if (readFromClientDone(c) == REDIS_ERR) return;
     processInputBuffer(c);
     server.current_client = NULL;
 }
@@ -1468,3 +1889,265 @@ void flushSlavesOutputBuffers(void) {
         }
     }
 }
+
+/* -----------------------------------------------------------------------------
+ * Threaded I/O
+ *
+ * With io-threads N > 0 the readable clients are not read by the event
+ * loop as soon as their socket is readable, but queued in
+ * server.clients_pending_read, and the clients with new replies in
+ * server.clients_pending_write. Before the event loop sleeps again the
+ * queued clients are read, and the first command in their query buffer
+ * parsed, or their replies written, by N threads plus the main thread,
+ * each handling the clients assigned to it round robin when accepted,
+ * while the main thread waits for them. The commands are then executed by
+ * the event loop (or handed to the threadpool) as usual.
+ *
+ * The clients are locked by the main thread the whole time, and only the
+ * sockets and the buffers of the client are touched by the I/O threads:
+ * the event loop still owns the file events and executes the commands.
+ * -------------------------------------------------------------------------- */
+
+#define REDIS_IO_READ 0
+#define REDIS_IO_WRITE 1
+
+static list *ioThreadClients[REDIS_IO_THREADS_MAX+1];
+static pthread_mutex_t ioMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioStartCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ioDoneCond = PTHREAD_COND_INITIALIZER;
+static int ioOp;                 /* REDIS_IO_READ or REDIS_IO_WRITE */
+static long long ioGeneration;   /* Incremented for every batch */
+static int ioPending;            /* I/O threads not done with the batch */
+
+/* Parse the first command in the query buffer of a client just read by an
+ * I/O thread. The command is complete if c->argc > 0 and
+ * c->multibulklen == 0, the rest of the buffer is left to
+ * processInputBuffer(). */
+static void ioParseCommand(redisClient *c) {
+    if (c->flags & (REDIS_BLOCKED|REDIS_CLOSE_AFTER_REPLY|
+                    REDIS_THREADPOOL_WAIT)) return;
+    if (sdslen(c->querybuf) > server.client_max_querybuf_len) return;
+
+    while(c->argc == 0 && sdslen(c->querybuf) &&
+          !(c->flags & REDIS_CLOSE_AFTER_REPLY))
+    {
+        if (!c->reqtype) {
+            if (c->querybuf[0] == '*') {
+                c->reqtype = REDIS_REQ_MULTIBULK;
+            } else {
+                c->reqtype = REDIS_REQ_INLINE;
+            }
+        }
+        if (c->reqtype == REDIS_REQ_INLINE) {
+            if (processInlineBuffer(c) != REDIS_OK) break;
+        } else {
+            if (processMultibulkBuffer(c) != REDIS_OK) break;
+        }
+        /* An empty command, see processInputBuffer(). */
+        if (c->argc == 0) {
+            c->reqtype = 0;
+            c->multibulklen = 0;
+            c->bulklen = -1;
+        }
+    }
+}
+
+/* Read from or write to the clients assigned to I/O thread id. */
+static void ioThreadWork(int id) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(ioThreadClients[id],&li);
+    while((ln = listNext(&li))) {
+        redisClient *c = listNodeValue(ln);
+
+        if (ioOp == REDIS_IO_READ) {
+            readFromClient(c);
+            if (c->io_nread > 0) ioParseCommand(c);
+        } else {
+            int totwritten;
+
+            if (writeToClient(c,&totwritten) == -1)
+                c->io_nread = -1;
+            else
+                c->io_nread = totwritten;
+        }
+    }
+}
+
+static void *ioThreadMain(void *arg) {
+    int id = (long)arg;
+    long long seen = 0;
+
+    while(1) {
+        pthread_mutex_lock(&ioMutex);
+        while (ioGeneration == seen)
+            pthread_cond_wait(&ioStartCond,&ioMutex);
+        seen = ioGeneration;
+        pthread_mutex_unlock(&ioMutex);
+
+        ioThreadWork(id);
+
+        pthread_mutex_lock(&ioMutex);
+        if (--ioPending == 0) pthread_cond_signal(&ioDoneCond);
+        pthread_mutex_unlock(&ioMutex);
+    }
+    return NULL;
+}
+
+void initIOThreads(void) {
+    long j;
+
+    for (j = 0; j <= server.io_threads; j++)
+        ioThreadClients[j] = listCreate();
+    for (j = 1; j <= server.io_threads; j++) {
+        pthread_t tid;
+
+        if (pthread_create(&tid,NULL,ioThreadMain,(void*)j) != 0) {
+            redisLog(REDIS_WARNING,"Fatal: Can't initialize I/O threads.");
+            exit(1);
+        }
+    }
+}
+
+/* Run op on the clients, every client in the I/O thread assigned to it.
+ * The main thread handles its share of the clients, then waits for the
+ * other threads. Returns the number of clients handled by them. */
+static long ioThreadsRun(int op, list *clients) {
+    listIter li;
+    listNode *ln;
+    long threaded = 0;
+    int j;
+
+    listRewind(clients,&li);
+    while((ln = listNext(&li))) {
+        redisClient *c = listNodeValue(ln);
+        int id = listLength(clients) > 1 ? c->io_thread : 0;
+
+        listAddNodeTail(ioThreadClients[id],c);
+        if (id) threaded++;
+    }
+
+    /* Object reference counts must be updated atomically while the I/O
+     * threads free the replies they wrote, see refCountAdd(). */
+    server.locking_mode++;
+    ioOp = op;
+    if (threaded) {
+        pthread_mutex_lock(&ioMutex);
+        ioPending = server.io_threads;
+        ioGeneration++;
+        pthread_cond_broadcast(&ioStartCond);
+        pthread_mutex_unlock(&ioMutex);
+    }
+    ioThreadWork(0);
+    if (threaded) {
+        pthread_mutex_lock(&ioMutex);
+        while (ioPending)
+            pthread_cond_wait(&ioDoneCond,&ioMutex);
+        pthread_mutex_unlock(&ioMutex);
+    }
+    server.locking_mode--;
+
+    for (j = 0; j <= server.io_threads; j++) {
+        while (listLength(ioThreadClients[j]))
+            listDelNode(ioThreadClients[j],listFirst(ioThreadClients[j]));
+    }
+    return threaded;
+}
+
+/* Read the clients queued by clientReadHandler() and process their
+ * commands. Called before the event loop sleeps. */
+void handleClientsWithPendingReads(void) {
+    list *clients = server.clients_pending_read;
+    listNode *ln;
+
+    if (listLength(clients) == 0) return;
+    server.stat_io_threaded_reads += ioThreadsRun(REDIS_IO_READ,clients);
+
+    /* In the order the clients were readable. A client freed meanwhile by
+     * the commands of another one removed itself from the list. */
+    while((ln = listFirst(clients))) {
+        redisClient *c = listNodeValue(ln);
+
+        listDelNode(clients,ln);
+        c->flags &= ~REDIS_IO_PENDING_READ;
+        /* A protocol error replied by the I/O thread. */
+        if ((c->bufpos || listLength(c->reply)) &&
+            !(c->flags & REDIS_IO_PENDING_WRITE))
+        {
+            c->flags |= REDIS_IO_PENDING_WRITE;
+            listAddNodeTail(server.clients_pending_write,c);
+        }
+
+        server.current_client = c;
+        if (readFromClientDone(c) == REDIS_ERR) continue;
+        if (c->argc && c->multibulklen == 0 &&
+            processParsedCommand(c) != REDIS_OK)
+        {
+            server.current_client = NULL;
+            continue;
+        }
+        processInputBuffer(c);
+        server.current_client = NULL;
+    }
+}
+
+/* Write the replies of the clients queued by prepareClientToWrite(),
+ * installing the write handler only for the ones whose socket didn't
+ * take the whole reply. Called before the event loop sleeps. */
+void handleClientsWithPendingWrites(void) {
+    list *clients;
+    listNode *ln;
+    listIter li;
+
+    if (listLength(server.clients_pending_write) == 0) return;
+    clients = listCreate();
+    while((ln = listFirst(server.clients_pending_write))) {
+        redisClient *c = listNodeValue(ln);
+
+        listDelNode(server.clients_pending_write,ln);
+        c->flags &= ~REDIS_IO_PENDING_WRITE;
+        /* Running a command in a thread, which may be adding to the
+         * reply: leave it to the write handler. */
+        if (pthread_mutex_trylock(c->lock)) {
+            aeCreateFileEvent(server.el,c->fd,AE_WRITABLE,
+                sendReplyToClient,c);
+            continue;
+        }
+        if (c->bufpos == 0 && listLength(c->reply) == 0) {
+            pthread_mutex_unlock(c->lock);
+            continue;
+        }
+        listAddNodeTail(clients,c);
+    }
+    server.stat_io_threaded_writes += ioThreadsRun(REDIS_IO_WRITE,clients);
+
+    listRewind(clients,&li);
+    while((ln = listNext(&li))) {
+        redisClient *c = listNodeValue(ln);
+
+        if (c->io_nread == -1) {
+            redisLog(REDIS_VERBOSE,
+                "Error writing to client: %s", strerror(c->io_errno));
+            freeClient(c);
+            continue;
+        }
+        if (c->io_nread > 0) c->lastinteraction = server.unixtime;
+        if (c->bufpos || listLength(c->reply)) {
+            if (aeCreateFileEvent(server.el,c->fd,AE_WRITABLE,
+                sendReplyToClient,c) == AE_ERR)
+            {
+                freeClient(c);
+                continue;
+            }
+        } else {
+            c->sentlen = 0;
+            if (c->flags & REDIS_CLOSE_AFTER_REPLY) {
+                freeClient(c);
+                continue;
+            }
+        }
+        pthread_mutex_unlock(c->lock);
+    }
+    listRelease(clients);
+}
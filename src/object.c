@@ -212,17 +212,13 @@ void freeHashObject(robj *o) {
 }
 
 void incrRefCount(robj *o) {
-    pthread_mutex_lock(ref_lock);
-    o->refcount++;
-    pthread_mutex_unlock(ref_lock);
+    refCountAdd(o->refcount,1);
 }
 
 void decrRefCount(void *obj) {
     robj *o = obj;
-    pthread_mutex_lock(ref_lock);
     if (o->refcount <= 0) redisPanic("decrRefCount against refcount <= 0");
-    if (o->refcount == 1) {
-        pthread_mutex_unlock(ref_lock);
+    if (refCountAdd(o->refcount,-1) == 0) {
         switch(o->type) {
         case REDIS_STRING: freeStringObject(o); break;
         case REDIS_LIST: freeListObject(o); break;
@@ -232,12 +228,20 @@ void decrRefCount(void *obj) {
         default: redisPanic("Unknown object type"); break;
         }
         zfree(o);
-    } else {
-        o->refcount--;
-        pthread_mutex_unlock(ref_lock);
     }
 }
 
+/* Fallback used by refCountAdd() when the compiler provides no atomic
+ * builtins: serialize every refcount update on the global ref_lock. */
+int lockedRefCountAdd(int *refcount, int delta) {
+    int val;
+
+    pthread_mutex_lock(ref_lock);
+    val = (*refcount += delta);
+    pthread_mutex_unlock(ref_lock);
+    return val;
+}
+
 /* This function set the ref count to zero without freeing the object.
  * It is useful in order to pass a new object to functions incrementing
  * the ref count of the received object. Example:
@@ -542,10 +546,15 @@ unsigned long estimateObjectIdleTime(robj *o) {
 /* This is an helper function for the DEBUG command. We need to lookup keys
  * without any modification of LRU or other parameters. */
 robj *objectCommandLookup(redisClient *c, robj *key) {
+    redisDbSegment *seg = dbSegment(c->db,key->ptr);
     dictEntry *de;
+    robj *val = NULL;
 
-    if ((de = dictFind(c->db->dict,key->ptr)) == NULL) return NULL;
-    return (robj*) dictGetVal(de);
+    pthread_mutex_lock(&seg->lock);
+    if ((de = dictFind(seg->dict,key->ptr)) != NULL)
+        val = (robj*) dictGetVal(de);
+    pthread_mutex_unlock(&seg->lock);
+    return val;
 }
 
 robj *objectCommandLookupOrReply(redisClient *c, robj *key, robj *reply) {
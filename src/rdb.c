@@ -632,7 +632,7 @@ int rdbSave(char *filename) {
     dictEntry *de;
     char tmpfile[256];
     char magic[10];
-    int j;
+    int j, k;
     long long now = mstime();
     FILE *fp;
     rio rdb;
@@ -654,29 +654,34 @@ int rdbSave(char *filename) {
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
-        if (!di) {
-            fclose(fp);
-            return REDIS_ERR;
-        }
+        if (dbSize(db) == 0) continue;
 
         /* Write the SELECT DB opcode */
         if (rdbSaveType(&rdb,REDIS_RDB_OPCODE_SELECTDB) == -1) goto werr;
         if (rdbSaveLen(&rdb,j) == -1) goto werr;
 
-        /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
-            sds keystr = dictGetKey(de);
-            robj key, *o = dictGetVal(de);
-            long long expire;
+        for (k = 0; k < REDIS_DB_SEGMENTS; k++) {
+            redisDbSegment *seg = db->segments+k;
+
+            di = dictGetSafeIterator(seg->dict);
+            if (!di) {
+                fclose(fp);
+                return REDIS_ERR;
+            }
+
+            /* Iterate this segment writing every entry */
+            while((de = dictNext(di)) != NULL) {
+                sds keystr = dictGetKey(de);
+                robj key, *o = dictGetVal(de);
+                long long expire;
             
-            initStaticStringObject(key,keystr);
-            expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(&rdb,&key,o,expire,now) == -1) goto werr;
+                initStaticStringObject(key,keystr);
+                expire = segmentGetExpire(seg,keystr);
+                if (rdbSaveKeyValuePair(&rdb,&key,o,expire,now) == -1) goto werr;
+            }
+            dictReleaseIterator(di);
+            di = NULL;
         }
-        dictReleaseIterator(di);
     }
     di = NULL; /* So that we don't release it again on error. */
 
@@ -722,8 +727,8 @@ int rdbSaveBackground(char *filename) {
     if (server.rdb_child_pid != -1) return REDIS_ERR;
 
     /* make sure the sqldb is not locked BEFORE we fork */
-    if (sqlExclusiveLock()) {
-        redisLog(REDIS_WARNING,"Can't save in background: failed to obtain exclusive SQL lock.");
+    if (sqlSaveBegin() != REDIS_OK) {
+        redisLog(REDIS_WARNING,"Can't save in background: SQL save in progress or failed to obtain exclusive SQL lock.");
         return REDIS_ERR;
     }
 
@@ -738,14 +743,12 @@ int rdbSaveBackground(char *filename) {
         if (server.sofd > 0) close(server.sofd);
         retval = rdbSave(filename);
         if (retval == REDIS_OK)
-            if (!(retval = sqlExclusiveUnlock()))
-                retval = (loadOrSaveDb(server.sql_db, server.sql_filename, 1) != SQLITE_OK);
+            retval = sqlSaveChild(server.sql_filename);
         exitFromChild((retval == REDIS_OK) ? 0 : 1);
     } else {
         /* Parent */
         server.stat_fork_time = ustime()-start;
-        if (sqlExclusiveUnlock())
-            redisPanic("Error releasing exclusive lock in rdbSaveBackground()");
+        sqlSaveForked(childpid);
         if (childpid == -1) {
             redisLog(REDIS_WARNING,"Can't save in background: fork: %s",
                 strerror(errno));
@@ -1183,6 +1186,7 @@ eoferr: /* unexpected end of file is handled here with a fatal exit */
 
 /* A background saving child (BGSAVE) terminated its work. Handle this. */
 void backgroundSaveDoneHandler(int exitcode, int bysignal) {
+    sqlSaveDone(server.rdb_child_pid, !bysignal && exitcode == 0);
     if (!bysignal && exitcode == 0) {
         redisLog(REDIS_NOTICE,
             "Background saving terminated with success");
@@ -470,6 +470,8 @@ usage:
 "   $ redis-benchmark -t set -n 1000000 -r 100000000\n\n"
 " Benchmark 127.0.0.1:6379 for a few commands producing CSV output:\n"
 "   $ redis-benchmark -t ping,set,get -n 100000 --csv\n\n"
+" Benchmark LRANGE_100 on a list of 1k values (not in the default suite):\n"
+"   $ redis-benchmark -t lrange_100_big -n 100000 -c 50\n\n"
 " Fill a list with 10000 random elements:\n"
 "   $ redis-benchmark -r 10000 -n 10000 lpush mylist ele:rand:000000000000\n\n"
     );
@@ -662,6 +664,25 @@ int main(int argc, const char **argv) {
             free(cmd);
         }
 
+        /* Not part of the default suite: LRANGE_100 against a list whose
+         * values are too big for a ziplist, so every element is a shared
+         * object referenced by the reply. With many clients this stresses
+         * object refcounting across worker threads. */
+        if (config.tests && test_is_selected("lrange_100_big")) {
+            char *bigdata = zmalloc(1024+1);
+
+            memset(bigdata,'x',1024);
+            bigdata[1024] = '\0';
+            len = redisFormatCommand(&cmd,"LPUSH mybiglist %s",bigdata);
+            benchmark("LPUSH (needed to benchmark LRANGE_100_BIG)",cmd,len);
+            free(cmd);
+            zfree(bigdata);
+
+            len = redisFormatCommand(&cmd,"LRANGE mybiglist 0 99");
+            benchmark("LRANGE_100_BIG (first 100 elements of 1k)",cmd,len);
+            free(cmd);
+        }
+
         if (test_is_selected("mset")) {
             const char *argv[21];
             argv[0] = "MSET";
@@ -63,7 +63,7 @@ double R_Zero, R_PosInf, R_NegInf, R_Nan;
 /*================================= Globals ================================= */
 
 /* Global vars */
-pthread_mutex_t *ref_lock; /* incr/decrRef lock */
+pthread_mutex_t *ref_lock; /* refcount lock, used only without HAVE_ATOMIC */
 struct redisServer server; /* server global state */
 struct redisCommand *commandTable;
 
@@ -112,6 +112,12 @@ struct redisCommand *commandTable;
  *    server this data. Normally no command is accepted in this condition
  *    but just a few.
  * M: Do not automatically propagate the command on MONITOR.
+ * T: Threaded command, executed by the thread pool instead of the main
+ *    event loop when its estimated cost is at least thread-min-cost (see
+ *    commandThreadCost()). Can be overridden with thread-commands.
+ * C: The reply can be kept in the reply cache, see replycache.c. The
+ *    reply must only depend on the arguments and on the value of the
+ *    first key, the only key of the command.
  */
 struct redisCommand redisCommandTable[] = {
     {"get",getCommand,2,"r",0,NULL,1,1,1,0,0},
@@ -135,7 +141,7 @@ struct redisCommand redisCommandTable[] = {
     {"lpush",lpushCommand,-3,"wm",0,NULL,1,1,1,0,0},
     {"rpushx",rpushxCommand,3,"wm",0,NULL,1,1,1,0,0},
     {"lpushx",lpushxCommand,3,"wm",0,NULL,1,1,1,0,0},
-    {"linsert",linsertCommand,5,"wm",0,NULL,1,1,1,0,0},
+    {"linsert",linsertCommand,5,"wmT",0,NULL,1,1,1,0,0},
     {"rpop",rpopCommand,2,"w",0,NULL,1,1,1,0,0},
     {"lpop",lpopCommand,2,"w",0,NULL,1,1,1,0,0},
     {"brpop",brpopCommand,-3,"ws",0,NULL,1,1,1,0,0},
@@ -143,10 +149,10 @@ struct redisCommand redisCommandTable[] = {
     {"blpop",blpopCommand,-3,"ws",0,NULL,1,-2,1,0,0},
     {"llen",llenCommand,2,"r",0,NULL,1,1,1,0,0},
     {"lindex",lindexCommand,3,"r",0,NULL,1,1,1,0,0},
-    {"lset",lsetCommand,4,"wm",0,NULL,1,1,1,0,0},
-    {"lrange",lrangeCommand,4,"r",0,NULL,1,1,1,0,0},
-    {"ltrim",ltrimCommand,4,"w",0,NULL,1,1,1,0,0},
-    {"lrem",lremCommand,4,"w",0,NULL,1,1,1,0,0},
+    {"lset",lsetCommand,4,"wmT",0,NULL,1,1,1,0,0},
+    {"lrange",lrangeCommand,4,"rTC",0,NULL,1,1,1,0,0},
+    {"ltrim",ltrimCommand,4,"wT",0,NULL,1,1,1,0,0},
+    {"lrem",lremCommand,4,"wT",0,NULL,1,1,1,0,0},
     {"rpoplpush",rpoplpushCommand,3,"wm",0,NULL,1,2,1,0,0},
     {"sadd",saddCommand,-3,"wm",0,NULL,1,1,1,0,0},
     {"srem",sremCommand,-3,"w",0,NULL,1,1,1,0,0},
@@ -155,25 +161,25 @@ struct redisCommand redisCommandTable[] = {
     {"scard",scardCommand,2,"r",0,NULL,1,1,1,0,0},
     {"spop",spopCommand,2,"wRs",0,NULL,1,1,1,0,0},
     {"srandmember",srandmemberCommand,-2,"rR",0,NULL,1,1,1,0,0},
-    {"sinter",sinterCommand,-2,"rS",0,NULL,1,-1,1,0,0},
-    {"sinterstore",sinterstoreCommand,-3,"wm",0,NULL,1,-1,1,0,0},
-    {"sunion",sunionCommand,-2,"rS",0,NULL,1,-1,1,0,0},
-    {"sunionstore",sunionstoreCommand,-3,"wm",0,NULL,1,-1,1,0,0},
-    {"sdiff",sdiffCommand,-2,"rS",0,NULL,1,-1,1,0,0},
-    {"sdiffstore",sdiffstoreCommand,-3,"wm",0,NULL,1,-1,1,0,0},
-    {"smembers",sinterCommand,2,"rS",0,NULL,1,1,1,0,0},
+    {"sinter",sinterCommand,-2,"rST",0,NULL,1,-1,1,0,0},
+    {"sinterstore",sinterstoreCommand,-3,"wmT",0,NULL,1,-1,1,0,0},
+    {"sunion",sunionCommand,-2,"rST",0,NULL,1,-1,1,0,0},
+    {"sunionstore",sunionstoreCommand,-3,"wmT",0,NULL,1,-1,1,0,0},
+    {"sdiff",sdiffCommand,-2,"rST",0,NULL,1,-1,1,0,0},
+    {"sdiffstore",sdiffstoreCommand,-3,"wmT",0,NULL,1,-1,1,0,0},
+    {"smembers",sinterCommand,2,"rSTC",0,NULL,1,1,1,0,0},
     {"zadd",zaddCommand,-4,"wm",0,NULL,1,1,1,0,0},
     {"zincrby",zincrbyCommand,4,"wm",0,NULL,1,1,1,0,0},
     {"zrem",zremCommand,-3,"w",0,NULL,1,1,1,0,0},
-    {"zremrangebyscore",zremrangebyscoreCommand,4,"w",0,NULL,1,1,1,0,0},
-    {"zremrangebyrank",zremrangebyrankCommand,4,"w",0,NULL,1,1,1,0,0},
-    {"zunionstore",zunionstoreCommand,-4,"wm",0,zunionInterGetKeys,0,0,0,0,0},
-    {"zinterstore",zinterstoreCommand,-4,"wm",0,zunionInterGetKeys,0,0,0,0,0},
-    {"zrange",zrangeCommand,-4,"r",0,NULL,1,1,1,0,0},
-    {"zrangebyscore",zrangebyscoreCommand,-4,"r",0,NULL,1,1,1,0,0},
-    {"zrevrangebyscore",zrevrangebyscoreCommand,-4,"r",0,NULL,1,1,1,0,0},
-    {"zcount",zcountCommand,4,"r",0,NULL,1,1,1,0,0},
-    {"zrevrange",zrevrangeCommand,-4,"r",0,NULL,1,1,1,0,0},
+    {"zremrangebyscore",zremrangebyscoreCommand,4,"wT",0,NULL,1,1,1,0,0},
+    {"zremrangebyrank",zremrangebyrankCommand,4,"wT",0,NULL,1,1,1,0,0},
+    {"zunionstore",zunionstoreCommand,-4,"wmT",0,zunionInterGetKeys,0,0,0,0,0},
+    {"zinterstore",zinterstoreCommand,-4,"wmT",0,zunionInterGetKeys,0,0,0,0,0},
+    {"zrange",zrangeCommand,-4,"rTC",0,NULL,1,1,1,0,0},
+    {"zrangebyscore",zrangebyscoreCommand,-4,"rT",0,NULL,1,1,1,0,0},
+    {"zrevrangebyscore",zrevrangebyscoreCommand,-4,"rT",0,NULL,1,1,1,0,0},
+    {"zcount",zcountCommand,4,"rT",0,NULL,1,1,1,0,0},
+    {"zrevrange",zrevrangeCommand,-4,"rTC",0,NULL,1,1,1,0,0},
     {"zcard",zcardCommand,2,"r",0,NULL,1,1,1,0,0},
     {"zscore",zscoreCommand,3,"r",0,NULL,1,1,1,0,0},
     {"zrank",zrankCommand,3,"r",0,NULL,1,1,1,0,0},
@@ -187,9 +193,9 @@ struct redisCommand redisCommandTable[] = {
     {"hincrbyfloat",hincrbyfloatCommand,4,"wm",0,NULL,1,1,1,0,0},
     {"hdel",hdelCommand,-3,"w",0,NULL,1,1,1,0,0},
     {"hlen",hlenCommand,2,"r",0,NULL,1,1,1,0,0},
-    {"hkeys",hkeysCommand,2,"rS",0,NULL,1,1,1,0,0},
-    {"hvals",hvalsCommand,2,"rS",0,NULL,1,1,1,0,0},
-    {"hgetall",hgetallCommand,2,"r",0,NULL,1,1,1,0,0},
+    {"hkeys",hkeysCommand,2,"rST",0,NULL,1,1,1,0,0},
+    {"hvals",hvalsCommand,2,"rST",0,NULL,1,1,1,0,0},
+    {"hgetall",hgetallCommand,2,"rTC",0,NULL,1,1,1,0,0},
     {"hexists",hexistsCommand,3,"r",0,NULL,1,1,1,0,0},
     {"incrby",incrbyCommand,3,"wm",0,NULL,1,1,1,0,0},
     {"decrby",decrbyCommand,3,"wm",0,NULL,1,1,1,0,0},
@@ -206,25 +212,25 @@ struct redisCommand redisCommandTable[] = {
     {"expireat",expireatCommand,3,"w",0,NULL,1,1,1,0,0},
     {"pexpire",pexpireCommand,3,"w",0,NULL,1,1,1,0,0},
     {"pexpireat",pexpireatCommand,3,"w",0,NULL,1,1,1,0,0},
-    {"keys",keysCommand,2,"rS",0,NULL,0,0,0,0,0},
+    {"keys",keysCommand,2,"rST",0,NULL,0,0,0,0,0},
     {"dbsize",dbsizeCommand,1,"r",0,NULL,0,0,0,0,0},
     {"auth",authCommand,2,"rs",0,NULL,0,0,0,0,0},
     {"ping",pingCommand,1,"r",0,NULL,0,0,0,0,0},
     {"echo",echoCommand,2,"r",0,NULL,0,0,0,0,0},
     {"save",saveCommand,1,"ars",0,NULL,0,0,0,0,0},
-    {"bgsave",bgsaveCommand,1,"ar",0,NULL,0,0,0,0,0},
+    {"bgsave",bgsaveCommand,1,"arT",0,NULL,0,0,0,0,0},
     {"bgrewriteaof",bgrewriteaofCommand,1,"ar",0,NULL,0,0,0,0,0},
     {"shutdown",shutdownCommand,-1,"ar",0,NULL,0,0,0,0,0},
     {"lastsave",lastsaveCommand,1,"r",0,NULL,0,0,0,0,0},
     {"type",typeCommand,2,"r",0,NULL,1,1,1,0,0},
     {"multi",multiCommand,1,"rs",0,NULL,0,0,0,0,0},
-    {"exec",execCommand,1,"sM",0,NULL,0,0,0,0,0},
+    {"exec",execCommand,1,"sMT",0,NULL,0,0,0,0,0},
     {"discard",discardCommand,1,"rs",0,NULL,0,0,0,0,0},
     {"sync",syncCommand,1,"ars",0,NULL,0,0,0,0,0},
     {"replconf",replconfCommand,-1,"ars",0,NULL,0,0,0,0,0},
     {"flushdb",flushdbCommand,1,"w",0,NULL,0,0,0,0,0},
     {"flushall",flushallCommand,1,"w",0,NULL,0,0,0,0,0},
-    {"sort",sortCommand,-2,"wm",0,NULL,1,1,1,0,0},
+    {"sort",sortCommand,-2,"wmT",0,NULL,1,1,1,0,0},
     {"info",infoCommand,-1,"rlt",0,NULL,0,0,0,0,0},
     {"monitor",monitorCommand,1,"ars",0,NULL,0,0,0,0,0},
     {"ttl",ttlCommand,2,"r",0,NULL,1,1,1,0,0},
@@ -240,21 +246,24 @@ struct redisCommand redisCommandTable[] = {
     {"publish",publishCommand,3,"pflt",0,NULL,0,0,0,0,0},
     {"watch",watchCommand,-2,"rs",0,noPreloadGetKeys,1,-1,1,0,0},
     {"unwatch",unwatchCommand,1,"rs",0,NULL,0,0,0,0,0},
-    {"restore",restoreCommand,4,"awm",0,NULL,1,1,1,0,0},
-    {"migrate",migrateCommand,6,"aw",0,NULL,0,0,0,0,0},
+    {"restore",restoreCommand,4,"awmT",0,NULL,1,1,1,0,0},
+    {"migrate",migrateCommand,6,"awT",0,NULL,0,0,0,0,0},
     {"dump",dumpCommand,2,"ar",0,NULL,1,1,1,0,0},
     {"object",objectCommand,-2,"r",0,NULL,2,2,2,0,0},
     {"client",clientCommand,-2,"ar",0,NULL,0,0,0,0,0},
-    {"eval",evalCommand,-3,"s",0,zunionInterGetKeys,0,0,0,0,0},
-    {"evalsha",evalShaCommand,-3,"s",0,zunionInterGetKeys,0,0,0,0,0},
+    {"eval",evalCommand,-3,"sT",0,zunionInterGetKeys,0,0,0,0,0},
+    {"evalsha",evalShaCommand,-3,"sT",0,zunionInterGetKeys,0,0,0,0,0},
     {"slowlog",slowlogCommand,-2,"r",0,NULL,0,0,0,0,0},
     {"script",scriptCommand,-2,"ras",0,NULL,0,0,0,0,0},
     {"time",timeCommand,1,"rR",0,NULL,0,0,0,0,0},
-    {"bitop",bitopCommand,-4,"wm",0,NULL,2,-1,1,0,0},
-    {"bitcount",bitcountCommand,-2,"r",0,NULL,1,1,1,0,0},
-    {"sql",sqlCommand,-2,"wm",0,NULL,1,1,1,0,0},
-    {"sqlprepare",sqlprepareCommand,-2,"wm",0,NULL,1,1,1,0,0},
-    {"sqlsave",sqlsaveCommand,1,"ar",0,NULL,0,0,0,0,0}
+    {"bitop",bitopCommand,-4,"wmT",0,NULL,2,-1,1,0,0},
+    {"bitcount",bitcountCommand,-2,"rT",0,NULL,1,1,1,0,0},
+    {"sql",sqlCommand,-2,"wmT",0,NULL,1,1,1,0,0},
+    {"sqlprepare",sqlprepareCommand,2,"wm",0,NULL,0,0,0,0,0},
+    {"sqlexec",sqlexecCommand,-2,"wmT",0,NULL,0,0,0,0,0},
+    {"sqlcursor",sqlcursorCommand,-3,"wmT",0,NULL,0,0,0,0,0},
+    {"sqlformat",sqlformatCommand,-1,"rs",0,NULL,0,0,0,0,0},
+    {"sqlsave",sqlsaveCommand,1,"arT",0,NULL,0,0,0,0,0}
 };
 
 /*============================ Utility functions ============================ */
@@ -552,16 +561,6 @@ dictType keylistDictType = {
     dictListDestructor          /* val destructor */
 };
 
-/* locked keys hash table, mapping keys to client locks */
-dictType lockedKeysDictType = {
-    dictSdsHash,                /* hash function */
-    NULL,                       /* key dup */
-    NULL,                       /* val dup */
-    dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    NULL                        /* val destructor */
-};
-
 int htNeedsResize(dict *dict) {
     long long size, used;
 
@@ -576,13 +575,16 @@ int htNeedsResize(dict *dict) {
 void tryResizeHashTables(void) {
     int j;
 
-    for (j = 0; j < server.dbnum; j++) {
-        pthread_mutex_lock(server.db[j].lock);
-        if (htNeedsResize(server.db[j].dict))
-            dictResize(server.db[j].dict);
-        if (htNeedsResize(server.db[j].expires))
-            dictResize(server.db[j].expires);
-        pthread_mutex_unlock(server.db[j].lock);
+    for (j = 0; j < server.dbnum*REDIS_DB_SEGMENTS; j++) {
+        redisDbSegment *seg =
+            server.db[j/REDIS_DB_SEGMENTS].segments+(j%REDIS_DB_SEGMENTS);
+
+        pthread_mutex_lock(&seg->lock);
+        if (htNeedsResize(seg->dict))
+            dictResize(seg->dict);
+        if (htNeedsResize(seg->expires))
+            dictResize(seg->expires);
+        pthread_mutex_unlock(&seg->lock);
     }
 }
 
@@ -593,21 +595,24 @@ void tryResizeHashTables(void) {
 void incrementallyRehash(void) {
     int j;
 
-    for (j = 0; j < server.dbnum; j++) {
-        pthread_mutex_lock(server.db[j].lock);
+    for (j = 0; j < server.dbnum*REDIS_DB_SEGMENTS; j++) {
+        redisDbSegment *seg =
+            server.db[j/REDIS_DB_SEGMENTS].segments+(j%REDIS_DB_SEGMENTS);
+
+        pthread_mutex_lock(&seg->lock);
         /* Keys dictionary */
-        if (dictIsRehashing(server.db[j].dict)) {
-            dictRehashMilliseconds(server.db[j].dict,1);
-            pthread_mutex_unlock(server.db[j].lock);
+        if (dictIsRehashing(seg->dict)) {
+            dictRehashMilliseconds(seg->dict,1);
+            pthread_mutex_unlock(&seg->lock);
             break; /* already used our millisecond for this loop... */
         }
         /* Expires */
-        if (dictIsRehashing(server.db[j].expires)) {
-            dictRehashMilliseconds(server.db[j].expires,1);
-            pthread_mutex_unlock(server.db[j].lock);
+        if (dictIsRehashing(seg->expires)) {
+            dictRehashMilliseconds(seg->expires,1);
+            pthread_mutex_unlock(&seg->lock);
             break; /* already used our millisecond for this loop... */
         }
-        pthread_mutex_unlock(server.db[j].lock);
+        pthread_mutex_unlock(&seg->lock);
     }
 }
 
@@ -641,15 +646,16 @@ void activeExpireCycle(void) {
     timelimit = 1000000*REDIS_EXPIRELOOKUPS_TIME_PERC/REDIS_HZ/100;
     if (timelimit <= 0) timelimit = 1;
 
-    for (j = 0; j < server.dbnum; j++) {
+    for (j = 0; j < server.dbnum*REDIS_DB_SEGMENTS; j++) {
         int expired;
-        redisDb *db = server.db+j;
+        redisDb *db = server.db+(j/REDIS_DB_SEGMENTS);
+        redisDbSegment *seg = db->segments+(j%REDIS_DB_SEGMENTS);
 
         /* Continue to expire if at the end of the cycle more than 25%
          * of the keys were expired. */
         do {
-            unsigned long num = dictSize(db->expires);
-            unsigned long slots = dictSlots(db->expires);
+            unsigned long num = dictSize(seg->expires);
+            unsigned long slots = dictSlots(seg->expires);
             long long now = mstime();
 
             /* When there are less than 1% filled slots getting random
@@ -667,17 +673,26 @@ void activeExpireCycle(void) {
                 dictEntry *de;
                 long long t;
 
-                if ((de = dictGetRandomKey(db->expires)) == NULL) break;
+                pthread_mutex_lock(&seg->lock);
+                if ((de = dictGetRandomKey(seg->expires)) == NULL) {
+                    pthread_mutex_unlock(&seg->lock);
+                    break;
+                }
                 t = dictGetSignedIntegerVal(de);
-                if (now > t) {
+                if (now > t && !(server.locking_mode &&
+                                 keyIsLocked(db,dictGetKey(de))))
+                {
                     sds key = dictGetKey(de);
                     robj *keyobj = createStringObject(key,sdslen(key));
 
-                    propagateExpire(db,keyobj);
                     dbDelete(db,keyobj);
+                    pthread_mutex_unlock(&seg->lock);
+                    propagateExpire(db,keyobj);
                     decrRefCount(keyobj);
                     expired++;
                     server.stat_expiredkeys++;
+                } else {
+                    pthread_mutex_unlock(&seg->lock);
                 }
             }
             /* We can't block forever here even if there are many keys to
@@ -753,6 +768,9 @@ int clientsCronResizeQueryBuffer(redisClient *c) {
     size_t querybuf_size = sdsAllocSize(c->querybuf);
     time_t idletime = server.unixtime - c->lastinteraction;
 
+    /* The argument objects kept for reuse are not needed by idle clients. */
+    if (idletime > 2) freeClientArgPool(c);
+
     /* There are two conditions to resize the query buffer:
      * 1) Query buffer is > BIG_ARG and too big for latest peak.
      * 2) Client is inactive and the buffer is bigger than 1k. */
@@ -804,6 +822,7 @@ void clientsCron(void) {
                 pthread_mutex_unlock(c->lock);
                 continue;
             }
+            sqlClientCursorsCron(c);
             pthread_mutex_unlock(c->lock);
 	}
     }
@@ -876,15 +895,17 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         for (j = 0; j < server.dbnum; j++) {
             long long size, used, vkeys;
 
-            pthread_mutex_lock(server.db[j].lock);
-            size = dictSlots(server.db[j].dict);
-            used = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            int k;
+
+            size = 0;
+            for (k = 0; k < REDIS_DB_SEGMENTS; k++)
+                size += dictSlots(server.db[j].segments[k].dict);
+            used = dbSize(server.db+j);
+            vkeys = dbExpiresSize(server.db+j);
             if (used || vkeys) {
                 redisLog(REDIS_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
                 /* dictPrintStats(server.dict); */
             }
-            pthread_mutex_unlock(server.db[j].lock);
         }
     }
 
@@ -913,6 +934,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* We need to do a few operations on clients asynchronously. */
     clientsCron();
 
+    /* Start or reap the SQL save requested by SQLSAVE, if any. */
+    sqlSaveCron();
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
@@ -926,7 +950,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         int statloc;
         pid_t pid;
 
-        if ((pid = wait3(&statloc,WNOHANG,NULL)) != 0) {
+        /* Only wait for our child: SQLSAVE has its own, see sqlSaveCron() */
+        pid = server.rdb_child_pid != -1 ? server.rdb_child_pid :
+                                           server.aof_child_pid;
+        if ((pid = waitpid(pid,&statloc,WNOHANG)) != 0) {
             int exitcode = WEXITSTATUS(statloc);
             int bysignal = 0;
             
@@ -1007,6 +1034,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     listNode *ln;
     redisClient *c;
 
+    /* Read the clients that were readable, with the I/O threads. */
+    handleClientsWithPendingReads();
+
     /* Try to process pending commands for clients that were just unblocked. */
     while (listLength(server.unblocked_clients)) {
         ln = listFirst(server.unblocked_clients);
@@ -1023,8 +1053,27 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
         }
     }
 
+    /* Resume clients paused because the threadpool queue was full, as
+     * long as there is room for their command. */
+    if (listLength(server.threadpool_waiting_clients)) {
+        threadpool_stats_t stats;
+
+        threadpool_get_stats(server.tpool,&stats);
+        while (stats.queue_depth++ < stats.queue_size &&
+               listLength(server.threadpool_waiting_clients))
+        {
+            ln = listFirst(server.threadpool_waiting_clients);
+            c = ln->value;
+            listDelNode(server.threadpool_waiting_clients,ln);
+            resumeThreadpoolWaitingClient(c);
+        }
+    }
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
+
+    /* Then the replies, with the I/O threads. */
+    handleClientsWithPendingWrites();
 }
 
 /* =========================== Server initialization ======================== */
@@ -1137,6 +1186,13 @@ void initServerConfig() {
     server.pidfile = zstrdup("/var/run/redis.pid");
     server.rdb_filename = zstrdup("dump.rdb");
     server.sql_filename = zstrdup("dump.sqlite");
+    server.sql_stmt_cache_size = REDIS_SQL_STMT_CACHE_SIZE;
+    server.sql_pool_size = REDIS_SQL_POOL_SIZE;
+    server.sql_cursor_timeout = REDIS_SQL_CURSOR_TIMEOUT;
+    server.sql_wal = 0;
+    server.sql_mmap_size = 0;
+    server.sql_cache_size = 0;
+    server.sql_wal_checkpoint = REDIS_SQL_WAL_CHECKPOINT;
     server.aof_filename = zstrdup("appendonly.aof");
     server.requirepass = NULL;
     server.rdb_compression = 1;
@@ -1159,6 +1215,15 @@ void initServerConfig() {
     server.repl_timeout = REDIS_REPL_TIMEOUT;
     server.lua_time_limit = REDIS_LUA_TIME_LIMIT;
     server.threadpool_size = -1;
+    server.io_threads = 0;
+    server.threadpool_queue_size = REDIS_THREADPOOL_DEFAULT_QUEUE_SIZE;
+    server.thread_min_cost = REDIS_THREAD_MIN_COST;
+    server.parallel_min_cost = REDIS_PARALLEL_MIN_COST;
+    server.parallel_max_parts = 0;
+    server.pipeline_batch_size = REDIS_PIPELINE_BATCH_SIZE;
+    server.thread_commands = sdsempty();
+    server.reply_cache_max_memory = 0;
+    server.reply_cache_min_size = REDIS_REPLY_CACHE_MIN_SIZE;
 
     updateLRUClock();
     resetServerSaveParams();
@@ -1286,6 +1351,11 @@ void initServer() {
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.unblocked_clients = listCreate();
+    server.threadpool_waiting_clients = listCreate();
+    server.clients_pending_read = listCreate();
+    server.clients_pending_write = listCreate();
+    server.io_next_thread = 0;
+    server.main_thread = pthread_self();
     server.ready_keys = listCreate();
 
     createSharedObjects();
@@ -1313,13 +1383,12 @@ void initServer() {
         redisLog(REDIS_WARNING, "Configured to not listen anywhere, exiting.");
         exit(1);
     }
+    keyLockInit();
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&dbDictType,NULL);
-        server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+        dbInitSegments(server.db+j);
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&setDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
-        server.db[j].locked_keys = dictCreate(&lockedKeysDictType,NULL);
         server.db[j].lock = zmalloc(sizeof(pthread_mutex_t));
         pthread_mutex_init(server.db[j].lock, NULL);
         server.db[j].id = j;
@@ -1347,6 +1416,13 @@ void initServer() {
     server.stat_peak_memory = 0;
     server.stat_fork_time = 0;
     server.stat_rejected_conn = 0;
+    server.stat_sql_stmt_hits = 0;
+    server.stat_sql_stmt_misses = 0;
+    server.stat_sql_stmt_evictions = 0;
+    server.stat_io_threaded_reads = 0;
+    server.stat_io_threaded_writes = 0;
+    server.stat_pipeline_batches = 0;
+    server.stat_pipeline_batched_cmds = 0;
     memset(server.ops_sec_samples,0,sizeof(server.ops_sec_samples));
     server.ops_sec_idx = 0;
     server.ops_sec_last_sample_time = mstime();
@@ -1373,8 +1449,12 @@ void initServer() {
     if (server.threadpool_size == -1)
         if ((server.threadpool_size = (getNumCPUs()*2)) < REDIS_THREADPOOL_DEFAULT_SIZE)
             server.threadpool_size = REDIS_THREADPOOL_DEFAULT_SIZE;
-    redisLog(REDIS_NOTICE,"Starting %d worker threads with a threadpool queue of size %d.", server.threadpool_size, REDIS_THREADPOOL_DEFAULT_QUEUE_SIZE);
-    server.tpool = threadpool_create(server.threadpool_size, REDIS_THREADPOOL_DEFAULT_QUEUE_SIZE, 0); // THREDIS TODO - queue size should be configurable
+    redisLog(REDIS_NOTICE,"Starting %d worker threads with a threadpool queue of size %d.", server.threadpool_size, server.threadpool_queue_size);
+    server.tpool = threadpool_create(server.threadpool_size, server.threadpool_queue_size, 0);
+    if (server.io_threads) {
+        redisLog(REDIS_NOTICE,"Starting %d I/O threads.", server.io_threads);
+        initIOThreads();
+    }
     server.lock = zmalloc(sizeof(pthread_mutex_t));
     pthread_mutex_init(server.lock, NULL);
     server.locking_mode = 0;
@@ -1424,6 +1504,8 @@ void populateCommandTable(void) {
             case 'l': c->flags |= REDIS_CMD_LOADING; break;
             case 't': c->flags |= REDIS_CMD_STALE; break;
             case 'M': c->flags |= REDIS_CMD_SKIP_MONITOR; break;
+            case 'T': c->flags |= REDIS_CMD_THREADED; break;
+            case 'C': c->flags |= REDIS_CMD_REPLY_CACHE; break;
             default: redisPanic("Unsupported command flag"); break;
             }
             f++;
@@ -1434,6 +1516,61 @@ void populateCommandTable(void) {
     }
 }
 
+/* Apply the thread-commands setting: a list of "+name" and "-name" tokens
+ * that respectively set and clear the threaded ("T") flag of a command.
+ * Commands not listed get back the flag of the command table, so an empty
+ * list restores the defaults.
+ *
+ * Admin, Pub/Sub and commands not allowed in scripts can't be moved to a
+ * thread unless they are threaded by default. On error REDIS_ERR is
+ * returned and the current setting is left untouched. */
+int setThreadedCommands(sds *argv, int argc) {
+    int numcommands = sizeof(redisCommandTable)/sizeof(struct redisCommand);
+    int j;
+    sds spec = sdsempty();
+
+    for (j = 0; j < argc; j++) {
+        struct redisCommand *cmd;
+
+        if ((argv[j][0] != '+' && argv[j][0] != '-') ||
+            (cmd = lookupCommandByCString(argv[j]+1)) == NULL) goto err;
+        /* Write commands without keys (FLUSHDB, FLUSHALL, ...) don't lock
+         * anything: in a thread they could free values other threads are
+         * using. */
+        if (argv[j][0] == '+' && !strchr(cmd->sflags,'T') &&
+            ((cmd->flags & (REDIS_CMD_ADMIN|REDIS_CMD_PUBSUB|
+                            REDIS_CMD_NOSCRIPT)) ||
+             (cmd->firstkey == 0 && !(cmd->flags & REDIS_CMD_READONLY))))
+            goto err;
+        if (j) spec = sdscatlen(spec," ",1);
+        spec = sdscatsds(spec,argv[j]);
+    }
+
+    for (j = 0; j < numcommands; j++) {
+        struct redisCommand *cmd = redisCommandTable+j;
+
+        if (strchr(cmd->sflags,'T'))
+            cmd->flags |= REDIS_CMD_THREADED;
+        else
+            cmd->flags &= ~REDIS_CMD_THREADED;
+    }
+    for (j = 0; j < argc; j++) {
+        struct redisCommand *cmd = lookupCommandByCString(argv[j]+1);
+
+        if (argv[j][0] == '+')
+            cmd->flags |= REDIS_CMD_THREADED;
+        else
+            cmd->flags &= ~REDIS_CMD_THREADED;
+    }
+    sdsfree(server.thread_commands);
+    server.thread_commands = spec;
+    return REDIS_OK;
+
+err:
+    sdsfree(spec);
+    return REDIS_ERR;
+}
+
 void resetCommandTableStats(void) {
     int numcommands = sizeof(redisCommandTable)/sizeof(struct redisCommand);
     int j;
@@ -1541,7 +1678,10 @@ void call(redisClient *c, int flags) {
     redisOpArrayInit(&server.also_propagate);
     dirty = server.dirty;
     pthread_mutex_unlock(server.lock);
-    c->cmd->proc(c);
+    if (c->cmd->flags & REDIS_CMD_REPLY_CACHE && server.reply_cache_max_memory)
+        replyCacheCall(c);
+    else
+        c->cmd->proc(c);
     pthread_mutex_lock(server.lock);
     dirty = server.dirty-dirty;
     duration = ustime()-start;
@@ -1587,10 +1727,8 @@ void call(redisClient *c, int flags) {
     pthread_mutex_unlock(server.lock);
 }
 
-int timeEventProcessInputBufferHandler(aeEventLoop *el, long long id, void *clientData) {
+void asyncProcessInputBufferHandler(aeEventLoop *el, void *clientData) {
     redisClient *c = (redisClient *) clientData;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(id);
 
     if (c->lock && !pthread_mutex_trylock(c->lock)) {
         server.locking_mode--;
@@ -1598,38 +1736,25 @@ int timeEventProcessInputBufferHandler(aeEventLoop *el, long long id, void *clie
 
         /* process next command, if any... */
         processInputBuffer(c);
-        pthread_mutex_lock(ref_lock);
-        c->refcount--;
-        pthread_mutex_unlock(ref_lock);
-        return AE_NOMORE;
+        refCountAdd(c->refcount,-1);
+    } else {
+        /* The thread queued this event just before releasing the client
+         * lock: try again at the next iteration of the event loop. */
+        aeCreateAsyncEvent(el, asyncProcessInputBufferHandler, c);
     }
-    else
-        /* Try again at the earliest opportunity. (This should never
-         * nappen because this event is scheduled after the command is
-         * complete?) */
-        return 0;
 }
 
 void callCommandAndResetClient(redisClient *c) {
     /** thread start */
-    /* call the actual command */
-    call(c,REDIS_CALL_FULL);
-
-    /* let the response be sent to the client */
-    pthread_mutex_lock(server.lock);
-    if (listLength(server.ready_keys))
-        handleClientsBlockedOnLists();
-    pthread_mutex_unlock(server.lock);
+    /* call the actual command, and the pipelined commands following it
+     * that can run in the same batch */
+    callCommandBatch(c);
 
-    /* We are in a thread. Create a timeEvent (which will run in the
-     * main loop) to check if there are more pipelined commands to
-     * process. */
-    pthread_mutex_lock(ref_lock);
-    c->refcount++;
-    pthread_mutex_unlock(ref_lock);
-    pthread_mutex_lock(server.el->lock);
-    c->time_event_id = aeCreateTimeEvent(server.el, 0, timeEventProcessInputBufferHandler, (void *)c, NULL);
-    pthread_mutex_unlock(server.el->lock);
+    /* We are in a thread. Queue an async event (which will run in the
+     * main loop, waking it up if it is sleeping) to check if there are
+     * more pipelined commands to process. */
+    refCountAdd(c->refcount,1);
+    aeCreateAsyncEvent(server.el, asyncProcessInputBufferHandler, c);
 
     /* reset client and unlock */
     resetClient(c);
@@ -1637,44 +1762,153 @@ void callCommandAndResetClient(redisClient *c) {
     /** thread finish */
 }
 
-/* If this function gets called we already read a whole
- * command, arguments are in the client argv/argc fields.
- * processCommand() execute the command or prepare the
- * server for a bulk read from the client.
+/* Return the number of elements of the value stored at 'key', for the
+ * purpose of estimating the cost of a command before it is executed.
+ * This never blocks the event loop waiting for a key: if some other client
+ * holds the key -1 is returned and the command is better off in a thread. */
+static long long keyCardinality(redisClient *c, robj *key) {
+    redisDbSegment *seg = dbSegment(c->db,key->ptr);
+    dictEntry *de;
+    robj *o;
+    long long card = 0;
+
+    pthread_mutex_lock(c->db->lock);
+    if (server.locking_mode && keyIsLocked(c->db,key->ptr)) {
+        pthread_mutex_unlock(c->db->lock);
+        return -1;
+    }
+    pthread_mutex_lock(&seg->lock);
+    if ((de = dictFind(seg->dict,key->ptr)) != NULL) {
+        o = dictGetVal(de);
+        switch(o->type) {
+        case REDIS_LIST: card = listTypeLength(o); break;
+        case REDIS_SET: card = setTypeSize(o); break;
+        case REDIS_ZSET: card = zsetLength(o); break;
+        case REDIS_HASH: card = hashTypeLength(o); break;
+        default: card = 1; break;
+        }
+    }
+    pthread_mutex_unlock(&seg->lock);
+    pthread_mutex_unlock(c->db->lock);
+    return card;
+}
+
+/* Number of elements in the [start,end] range of a list or sorted set of
+ * 'len' elements, with LRANGE/ZRANGE semantics for negative indexes. */
+static long long rangeCardinality(robj *startobj, robj *endobj, long long len) {
+    long long start, end;
+
+    if (getLongLongFromObject(startobj,&start) != REDIS_OK ||
+        getLongLongFromObject(endobj,&end) != REDIS_OK) return 0;
+    if (start < 0) start = len+start;
+    if (end < 0) end = len+end;
+    if (start < 0) start = 0;
+    if (start > end || start >= len) return 0;
+    if (end >= len) end = len-1;
+    return (end-start)+1;
+}
+
+/* Estimate the cost of executing the current command of the client, as the
+ * number of elements it is going to touch. processCommand() uses this for
+ * commands flagged as threaded: handing a command to the thread pool is not
+ * free, so cheap calls such as ZRANGE key 0 0 are better executed directly.
  *
- * If 1 is returned the client is still alive and valid and
- * and other operations can be performed by the caller. Otherwise
- * if 0 is returned the client was destroied (i.e. after QUIT). */
-int processCommand(redisClient *c) {
-    /* The QUIT command is handled separately. Normal command procs will
-     * go through checking for replication and QUIT will cause trouble
-     * when FORCE_REPLICATION is enabled and would be implemented in
-     * a regular command proc. */
-    if (!strcasecmp(c->argv[0]->ptr,"quit")) {
-        addReply(c,shared.ok);
-        c->flags |= REDIS_CLOSE_AFTER_REPLY;
-        return REDIS_ERR;
+ * -1 is returned when the cost can't be estimated cheaply, in which case
+ * the command always goes to a thread. */
+long long commandThreadCost(redisClient *c) {
+    redisCommandProc *p = c->cmd->proc;
+    long long card, cost = 0;
+    int j;
+
+    if (p == lrangeCommand || p == zrangeCommand || p == zrevrangeCommand) {
+        if ((card = keyCardinality(c,c->argv[1])) == -1) return -1;
+        return rangeCardinality(c->argv[2],c->argv[3],card);
+    } else if (p == zrangebyscoreCommand || p == zrevrangebyscoreCommand) {
+        if ((card = keyCardinality(c,c->argv[1])) == -1) return -1;
+        /* With LIMIT we know the upper bound of the reply size. */
+        for (j = 4; j < c->argc-2; j++) {
+            long long offset, count;
+
+            if (!strcasecmp(c->argv[j]->ptr,"limit") &&
+                getLongLongFromObject(c->argv[j+1],&offset) == REDIS_OK &&
+                getLongLongFromObject(c->argv[j+2],&count) == REDIS_OK &&
+                offset >= 0 && count >= 0 && count < card-offset)
+                return offset+count;
+        }
+        return card;
+    } else if (p == sinterCommand || p == sinterstoreCommand) {
+        /* The smallest set is iterated, probing all the others. */
+        int first = (p == sinterCommand) ? 1 : 2;
+        long long min = -1;
+
+        for (j = first; j < c->argc; j++) {
+            if ((card = keyCardinality(c,c->argv[j])) == -1) return -1;
+            if (min == -1 || card < min) min = card;
+        }
+        return min*(c->argc-first);
+    } else if (p == sunionCommand || p == sunionstoreCommand ||
+               p == sdiffCommand || p == sdiffstoreCommand)
+    {
+        j = (p == sunionCommand || p == sdiffCommand) ? 1 : 2;
+        for (; j < c->argc; j++) {
+            if ((card = keyCardinality(c,c->argv[j])) == -1) return -1;
+            cost += card;
+        }
+        return cost;
+    } else if (p == zunionstoreCommand || p == zinterstoreCommand) {
+        long long setnum;
+
+        if (getLongLongFromObject(c->argv[2],&setnum) != REDIS_OK ||
+            setnum < 1 || setnum > c->argc-3) return 0;
+        for (j = 0; j < setnum; j++) {
+            if ((card = keyCardinality(c,c->argv[3+j])) == -1) return -1;
+            cost += card;
+        }
+        return cost;
+    } else if (p == hgetallCommand || p == hkeysCommand ||
+               p == hvalsCommand || p == linsertCommand ||
+               p == lremCommand || p == lsetCommand ||
+               p == ltrimCommand || p == zcountCommand ||
+               p == zremrangebyrankCommand || p == zremrangebyscoreCommand)
+    {
+        return keyCardinality(c,c->argv[1]);
     }
+    return -1;
+}
 
-    /* Now lookup the command and check ASAP about trivial error conditions
-     * such as wrong arity, bad command name and so forth. */
-    c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
-    if (!c->cmd) {
-        addReplyErrorFormat(c,"unknown command '%s'",
-            (char*)c->argv[0]->ptr);
-        return REDIS_OK;
-    } else if ((c->cmd->arity > 0 && c->cmd->arity != c->argc) ||
-               (c->argc < -c->cmd->arity)) {
-        addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
-            c->cmd->name);
-        return REDIS_OK;
+/* Returns true if the current command of the client should be executed by
+ * the thread pool rather than in the event loop. */
+static int shouldThreadCommand(redisClient *c) {
+    long long cost;
+
+    if (!(c->cmd->flags & REDIS_CMD_THREADED)) return 0;
+    if (server.thread_min_cost <= 0) return 1;
+    cost = commandThreadCost(c);
+    return cost == -1 || cost >= server.thread_min_cost;
+}
+
+/* Check that the client can execute the command with argc arguments right
+ * now: arity, authentication, maxmemory (freeing memory if needed), disk
+ * and replication state, Pub/Sub context and loading. Returns REDIS_OK if
+ * it can, otherwise REDIS_ERR, replying with the error if 'reply' is true.
+ * Used by processCommand() and by callCommandBatch() for the commands it
+ * gathers, see commandCanBatch(). */
+static int checkCommandAllowed(redisClient *c, struct redisCommand *cmd,
+                               int argc, int reply)
+{
+    /* Check ASAP about trivial error conditions such as wrong arity. */
+    if ((cmd->arity > 0 && cmd->arity != argc) || (argc < -cmd->arity)) {
+        if (reply)
+            addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
+                cmd->name);
+        return REDIS_ERR;
     }
 
     /* Check if the user is authenticated */
-    if (server.requirepass && !c->authenticated && c->cmd->proc != authCommand)
+    if (server.requirepass && !c->authenticated && cmd->proc != authCommand)
     {
-        addReplyError(c,"operation not permitted");
-        return REDIS_OK;
+        if (reply) addReplyError(c,"operation not permitted");
+        return REDIS_ERR;
     }
 
     /* Handle the maxmemory directive.
@@ -1683,10 +1917,16 @@ int processCommand(redisClient *c) {
      * keys in the dataset). If there are not the only thing we can do
      * is returning an error. */
     if (server.maxmemory) {
-        int retval = freeMemoryIfNeeded();
-        if ((c->cmd->flags & REDIS_CMD_DENYOOM) && retval == REDIS_ERR) {
-            addReply(c, shared.oomerr);
-            return REDIS_OK;
+        int retval;
+
+        /* Only the event loop frees memory: a thread of the pool gathering
+         * a batch leaves the command to processCommand(). */
+        if (!pthread_equal(pthread_self(),server.main_thread))
+            return REDIS_ERR;
+        retval = freeMemoryIfNeeded();
+        if ((cmd->flags & REDIS_CMD_DENYOOM) && retval == REDIS_ERR) {
+            if (reply) addReply(c, shared.oomerr);
+            return REDIS_ERR;
         }
     }
 
@@ -1694,49 +1934,115 @@ int processCommand(redisClient *c) {
     if (server.stop_writes_on_bgsave_err &&
         server.saveparamslen > 0
         && server.lastbgsave_status == REDIS_ERR &&
-        c->cmd->flags & REDIS_CMD_WRITE)
+        cmd->flags & REDIS_CMD_WRITE)
     {
-        addReply(c, shared.bgsaveerr);
-        return REDIS_OK;
+        if (reply) addReply(c, shared.bgsaveerr);
+        return REDIS_ERR;
     }
 
     /* Don't accept write commands if this is a read only slave. But
      * accept write commands if this is our master. */
     if (server.masterhost && server.repl_slave_ro &&
         !(c->flags & REDIS_MASTER) &&
-        c->cmd->flags & REDIS_CMD_WRITE)
+        cmd->flags & REDIS_CMD_WRITE)
     {
-        addReply(c, shared.roslaveerr);
-        return REDIS_OK;
+        if (reply) addReply(c, shared.roslaveerr);
+        return REDIS_ERR;
     }
 
     /* Only allow SUBSCRIBE and UNSUBSCRIBE in the context of Pub/Sub */
     if ((dictSize(c->pubsub_channels) > 0 || listLength(c->pubsub_patterns) > 0)
         &&
-        c->cmd->proc != subscribeCommand &&
-        c->cmd->proc != unsubscribeCommand &&
-        c->cmd->proc != psubscribeCommand &&
-        c->cmd->proc != punsubscribeCommand) {
-        addReplyError(c,"only (P)SUBSCRIBE / (P)UNSUBSCRIBE / QUIT allowed in this context");
-        return REDIS_OK;
+        cmd->proc != subscribeCommand &&
+        cmd->proc != unsubscribeCommand &&
+        cmd->proc != psubscribeCommand &&
+        cmd->proc != punsubscribeCommand) {
+        if (reply)
+            addReplyError(c,"only (P)SUBSCRIBE / (P)UNSUBSCRIBE / QUIT allowed in this context");
+        return REDIS_ERR;
     }
 
     /* Only allow INFO and SLAVEOF when slave-serve-stale-data is no and
      * we are a slave with a broken link with master. */
     if (server.masterhost && server.repl_state != REDIS_REPL_CONNECTED &&
         server.repl_serve_stale_data == 0 &&
-        !(c->cmd->flags & REDIS_CMD_STALE))
+        !(cmd->flags & REDIS_CMD_STALE))
     {
-        addReply(c, shared.masterdownerr);
-        return REDIS_OK;
+        if (reply) addReply(c, shared.masterdownerr);
+        return REDIS_ERR;
     }
 
     /* Loading DB? Return an error if the command has not the
      * REDIS_CMD_LOADING flag. */
-    if (server.loading && !(c->cmd->flags & REDIS_CMD_LOADING)) {
-        addReply(c, shared.loadingerr);
+    if (server.loading && !(cmd->flags & REDIS_CMD_LOADING)) {
+        if (reply) addReply(c, shared.loadingerr);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Return true if the command, pipelined by the client after the one being
+ * executed, can be executed in the same batch (see callCommandBatch()):
+ * it is a command processCommand() would execute right away, without
+ * replying with an error or queueing it, it only accesses the keys returned
+ * by getKeysFromCommand() in the DB of the client and it doesn't block. */
+int commandCanBatch(redisClient *c, struct redisCommand *cmd, int argc) {
+    if (cmd->firstkey == 0 ||
+        cmd->flags & (REDIS_CMD_ADMIN|REDIS_CMD_PUBSUB|REDIS_CMD_NOSCRIPT) ||
+        cmd->proc == sortCommand || cmd->proc == moveCommand ||
+        cmd->proc == sqlCommand) return 0;
+    if (c->flags & (REDIS_MULTI|REDIS_BLOCKED|REDIS_CLOSE_AFTER_REPLY))
+        return 0;
+    return checkCommandAllowed(c,cmd,argc,0) == REDIS_OK;
+}
+
+/* Returns the number of parts a command should split its work in, to have
+ * them run in parallel by the threads of the pool (see
+ * threadpool_run_parallel()), given its cost, an estimate of the number of
+ * elements it is going to process. 1 means no split. */
+int parallelCommandParts(long long cost) {
+    int parts = server.parallel_max_parts;
+
+    if (server.tpool == NULL || server.parallel_min_cost <= 0 ||
+        cost < server.parallel_min_cost) return 1;
+
+    /* By default one part per CPU: more parts than CPUs only add the
+     * overhead of the split. */
+    if (parts <= 0) parts = getNumCPUs();
+    if (parts > server.threadpool_size) parts = server.threadpool_size;
+    if (parts > REDIS_PARALLEL_MAX_PARTS) parts = REDIS_PARALLEL_MAX_PARTS;
+    return parts > 1 ? parts : 1;
+}
+
+/* If this function gets called we already read a whole
+ * command, arguments are in the client argv/argc fields.
+ * processCommand() execute the command or prepare the
+ * server for a bulk read from the client.
+ *
+ * If 1 is returned the client is still alive and valid and
+ * and other operations can be performed by the caller. Otherwise
+ * if 0 is returned the client was destroied (i.e. after QUIT). */
+int processCommand(redisClient *c) {
+    /* The QUIT command is handled separately. Normal command procs will
+     * go through checking for replication and QUIT will cause trouble
+     * when FORCE_REPLICATION is enabled and would be implemented in
+     * a regular command proc. */
+    if (!strcasecmp(c->argv[0]->ptr,"quit")) {
+        addReply(c,shared.ok);
+        c->flags |= REDIS_CLOSE_AFTER_REPLY;
+        return REDIS_ERR;
+    }
+
+    /* Now lookup the command and check ASAP about trivial error conditions
+     * such as wrong arity, bad command name and so forth. */
+    c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
+    if (!c->cmd) {
+        addReplyErrorFormat(c,"unknown command '%s'",
+            (char*)c->argv[0]->ptr);
         return REDIS_OK;
     }
+    if (checkCommandAllowed(c,c->cmd,c->argc,1) == REDIS_ERR)
+        return REDIS_OK;
 
     /* Exec the command */
     if (c->flags & REDIS_MULTI &&
@@ -1746,38 +2052,21 @@ int processCommand(redisClient *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
-        redisCommandProc *p = c->cmd->proc;
-
-        if (p == bitcountCommand || p == bitopCommand ||
-            p == evalCommand || p == evalShaCommand ||
-            p == execCommand || p == hkeysCommand ||
-            p == hvalsCommand || p == keysCommand ||
-            p == linsertCommand || p == lrangeCommand ||
-            p == lremCommand || p == lsetCommand ||
-            p == ltrimCommand || p == migrateCommand ||
-            p == restoreCommand || p == bgsaveCommand ||
-            p == sqlsaveCommand || p == sqlCommand ||
-            p == sdiffCommand || p == sdiffstoreCommand ||
-            p == sinterCommand || p == sinterstoreCommand ||
-            p == sortCommand || p == sunionCommand ||
-            p == sunionstoreCommand || p == zcountCommand ||
-            p == zinterstoreCommand || p == zrangeCommand ||
-            p == zrangebyscoreCommand || p == zremrangebyrankCommand ||
-            p == zremrangebyscoreCommand || p == zrevrangeCommand ||
-            p == zrevrangebyscoreCommand || p == zunionstoreCommand) {
-
-            pthread_mutex_lock(ref_lock);
-            c->refcount++;
-            pthread_mutex_unlock(ref_lock);
+        if (shouldThreadCommand(c)) {
+            refCountAdd(c->refcount,1);
             server.locking_mode++;
-            threadpool_add(server.tpool, (void (*)(void *)) callCommandAndResetClient, (void *)c, 0);
+            if (threadpool_add(server.tpool, (void (*)(void *)) callCommandAndResetClient, (void *)c, 0) != 0) {
+                /* The queue is full: stop reading from this client until
+                 * there is room again, see beforeSleep(). The command is
+                 * left in c->argv and will be processed again. */
+                refCountAdd(c->refcount,-1);
+                server.locking_mode--;
+                pauseThreadpoolWaitingClient(c);
+                return REDIS_THREADPOOL_FULL;
+            }
             return REDIS_ADDED_TO_THREAD;
         } else {
-            call(c,REDIS_CALL_FULL);
-            pthread_mutex_lock(server.lock);
-            if (listLength(server.ready_keys))
-                handleClientsBlockedOnLists();
-            pthread_mutex_unlock(server.lock);
+            callCommandBatch(c);
         }
     }
     return REDIS_OK;
@@ -2147,7 +2436,12 @@ sds genRedisInfoString(char *section) {
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
-            "latest_fork_usec:%lld\r\n",
+            "latest_fork_usec:%lld\r\n"
+            "io_threads:%d\r\n"
+            "io_threaded_reads:%lld\r\n"
+            "io_threaded_writes:%lld\r\n"
+            "pipeline_batches:%lld\r\n"
+            "pipeline_batched_commands:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getOperationsPerSecond(),
@@ -2158,7 +2452,14 @@ sds genRedisInfoString(char *section) {
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
             listLength(server.pubsub_patterns),
-            server.stat_fork_time);
+            server.stat_fork_time,
+            server.io_threads,
+            server.stat_io_threaded_reads,
+            server.stat_io_threaded_writes,
+            server.stat_pipeline_batches,
+            server.stat_pipeline_batched_cmds);
+        info = genLuaInfoString(info);
+        info = genReplyCacheInfoString(info);
     }
 
     /* Replication */
@@ -2279,8 +2580,8 @@ sds genRedisInfoString(char *section) {
         for (j = 0; j < server.dbnum; j++) {
             long long keys, vkeys;
 
-            keys = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            keys = dbSize(server.db+j);
+            vkeys = dbExpiresSize(server.db+j);
             if (keys || vkeys) {
                 info = sdscatprintf(info, "db%d:keys=%lld,expires=%lld\r\n",
                     j, keys, vkeys);
@@ -2288,6 +2589,43 @@ sds genRedisInfoString(char *section) {
         }
     }
 
+    /* Threadpool */
+    if (allsections || defsections || !strcasecmp(section,"threadpool")) {
+        threadpool_stats_t stats;
+
+        threadpool_get_stats(server.tpool,&stats);
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Threadpool\r\n"
+            "threadpool_threads:%d\r\n"
+            "threadpool_queue_size:%d\r\n"
+            "threadpool_queue_depth:%d\r\n"
+            "threadpool_queue_depth_peak:%d\r\n"
+            "threadpool_tasks:%lld\r\n"
+            "threadpool_steals:%lld\r\n"
+            "threadpool_rejected:%lld\r\n"
+            "threadpool_wait_usec:%lld\r\n"
+            "threadpool_wait_usec_per_task:%.2f\r\n"
+            "threadpool_waiting_clients:%lu\r\n",
+            stats.thread_count,
+            stats.queue_size,
+            stats.queue_depth,
+            stats.queue_depth_max,
+            stats.executed,
+            stats.steals,
+            stats.rejected,
+            stats.wait_us,
+            stats.executed ? (float)stats.wait_us/stats.executed : 0,
+            listLength(server.threadpool_waiting_clients));
+    }
+
+    /* Key locks */
+    if (allsections || defsections || !strcasecmp(section,"keylocks")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info,"# Keylocks\r\n");
+        info = genKeyLockInfoString(info);
+    }
+
     /* SQLite */
     if (allsections || defsections || !strcasecmp(section,"sqlite")) {
         int curr, high;
@@ -2377,6 +2715,15 @@ sds genRedisInfoString(char *section) {
         info = sdscatprintf(info,
         "sqlite_db_total_changes:%d\r\n",
         sqlite3_total_changes(server.sql_db));
+        info = sdscatprintf(info,
+        "sqlite_stmt_cache_hits:%lld\r\n"
+        "sqlite_stmt_cache_misses:%lld\r\n"
+        "sqlite_stmt_cache_evictions:%lld\r\n",
+        server.stat_sql_stmt_hits,
+        server.stat_sql_stmt_misses,
+        server.stat_sql_stmt_evictions);
+        info = genSqlPoolInfoString(info);
+        info = genSqlSaveInfoString(info);
     }
 
     return info;
@@ -2469,18 +2816,26 @@ int freeMemoryIfNeeded(void) {
             sds bestkey = NULL;
             struct dictEntry *de;
             redisDb *db = server.db+j;
-            dict *dict;
+            redisDbSegment *seg = NULL;
+            robj *keyobj = NULL;
+            dict *dict = NULL;
+            int allkeys, start;
+
+            allkeys = server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
+                      server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM;
 
             pthread_mutex_lock(db->lock);
 
-            if (server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
-                server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM)
-            {
-                dict = server.db[j].dict;
-            } else {
-                dict = server.db[j].expires;
+            /* Sample keys from a random non empty segment. */
+            start = random() & (REDIS_DB_SEGMENTS-1);
+            for (k = 0; k < REDIS_DB_SEGMENTS; k++) {
+                seg = db->segments+((start+k)&(REDIS_DB_SEGMENTS-1));
+                pthread_mutex_lock(&seg->lock);
+                dict = allkeys ? seg->dict : seg->expires;
+                if (dictSize(dict) != 0) break;
+                pthread_mutex_unlock(&seg->lock);
             }
-            if (dictSize(dict) == 0) {
+            if (k == REDIS_DB_SEGMENTS) {
                 pthread_mutex_unlock(db->lock);
                 continue;
             }
@@ -2491,7 +2846,8 @@ int freeMemoryIfNeeded(void) {
             {
                 de = dictGetRandomKey(dict);
                 bestkey = dictGetKey(de);
-                if (dictFind(db->locked_keys, bestkey)) {
+                if (keyIsLocked(db,bestkey)) {
+                    pthread_mutex_unlock(&seg->lock);
                     pthread_mutex_unlock(db->lock);
                     continue; /* never free locked keys */
                 }
@@ -2509,13 +2865,13 @@ int freeMemoryIfNeeded(void) {
                     de = dictGetRandomKey(dict);
                     thiskey = dictGetKey(de);
 
-                    if (dictFind(db->locked_keys, thiskey))
+                    if (keyIsLocked(db,thiskey))
                         continue; /* never free locked keys */
 
                     /* When policy is volatile-lru we need an additonal lookup
                      * to locate the real key, as dict is set to db->expires. */
                     if (server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU)
-                        de = dictFind(db->dict, thiskey);
+                        de = dictFind(seg->dict, thiskey);
                     o = dictGetVal(de);
                     thisval = estimateObjectIdleTime(o);
 
@@ -2535,7 +2891,7 @@ int freeMemoryIfNeeded(void) {
 
                     de = dictGetRandomKey(dict);
                     thiskey = dictGetKey(de);
-                    if (dictFind(db->locked_keys, thiskey)) {
+                    if (keyIsLocked(db,thiskey)) {
                         continue; /* never free locked keys */
                     }
                     thisval = (long) dictGetVal(de);
@@ -2549,11 +2905,20 @@ int freeMemoryIfNeeded(void) {
                 }
             }
 
-            /* Finally remove the selected key. */
-            if (bestkey) {
+            if (bestkey) keyobj = createStringObject(bestkey,sdslen(bestkey));
+            pthread_mutex_unlock(&seg->lock);
+
+            /* Finally remove the selected key, unless some thread locked
+             * it in the meantime. */
+            if (keyobj && server.locking_mode &&
+                trylockKeyForDelete(db,keyobj->ptr) == REDIS_ERR)
+            {
+                decrRefCount(keyobj);
+                keyobj = NULL;
+            }
+            if (keyobj) {
                 long long delta;
 
-                robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
                 propagateExpire(db,keyobj);
                 /* We compute the amount of memory freed by dbDelete() alone.
                  * It is possible that actually the memory needed to propagate
@@ -2568,6 +2933,7 @@ int freeMemoryIfNeeded(void) {
                 delta -= (long long) zmalloc_used_memory();
                 mem_freed += delta;
                 server.stat_evictedkeys++;
+                if (server.locking_mode) unlockKeyForDelete(db,keyobj->ptr);
                 decrRefCount(keyobj);
                 keys_freed++;
 
@@ -2584,122 +2950,6 @@ int freeMemoryIfNeeded(void) {
     return REDIS_OK;
 }
 
-/* ================================= Locking ================================ */
-
-static int _compare_keys(const void *k1, const void *k2) {
-    return strcasecmp((*(robj **)k1)->ptr, (*(robj **)k2)->ptr);
-}
-
-void lockKeys(redisClient *c, robj **keys, int n_keys) {
-    int i;
-
-    if (!server.locking_mode) return;
-
-    /* keys must be sorted to avoid deadlock */
-    qsort(keys, n_keys, sizeof(robj *), _compare_keys);
-
-    /* and if any of locks fails, we unroll all locks and try again -
-     * this is a simple and effective circular deadlock prevention
-     * technique */
-    while (1) {
-        for (i=0; i<n_keys; i++)
-            if (genericLockKey(c,keys[i],1))
-                break;
-        if (i < n_keys) {
-            /* we failed above, unroll */
-            for (i--; i>=0; i--)
-                unlockKey(c,keys[i]);
-            pthread_yield();
-        } else
-            break; /* success */
-    }
-}
-
-void unlockKeys(redisClient *c, robj **keys, int n_keys) {
-    int i;
-
-    if (!server.locking_mode) return;
-
-    /* we assume that the keys have already been sorted in lockKeys! */
-    for (i=n_keys-1; i>=0; i--)
-        unlockKey(c,keys[i]);
-}
-
-void lockKey(redisClient *c, robj *key) {
-    genericLockKey(c, key, 0);
-}
-
-int genericLockKey(redisClient *c, robj *key, int trylock) {
-    dictEntry *de;
-
-    if (!server.locking_mode) return 0;
-
-#ifdef MONITOR_LOCKS
-    if (listLength(server.monitors) && !server.loading) {
-        robj **argv = zcalloc(sizeof(robj)*2);
-        argv[0] = createStringObject("locking", 7);
-        argv[1] = key;
-        replicationFeedMonitors(c,server.monitors,c->db->id,argv,2);
-        decrRefCount(argv[0]);
-        zfree(argv);
-    }
-#endif /* MONITOR_LOCKS */
-
-    pthread_mutex_lock(c->db->lock);
-    de = dictFind(c->db->locked_keys, key->ptr);
-    if (!de) {
-        dictAdd(c->db->locked_keys, sdsdup(key->ptr), c->lock);
-        pthread_mutex_unlock(c->db->lock);
-    } else {
-        pthread_mutex_t *lock = dictGetVal(de);
-
-        if (lock == c->lock) {
-            /* we are already holding this lock */
-            pthread_mutex_unlock(c->db->lock);
-            return 0;
-        } else
-            pthread_mutex_unlock(c->db->lock);
-
-        if (trylock) {
-            struct timespec   ts;
-            struct timeval    tp;
-            if (gettimeofday(&tp, NULL))
-                redisPanic("gettimeofday failed, on Linux make sure the process has CAP_SYS_TIME");
-            ts.tv_sec  = tp.tv_sec;
-            ts.tv_nsec = tp.tv_usec * 100000000; /* 100ms */
-            if (pthread_mutex_timedlock(lock, &ts))
-                return 1;
-        } else
-            pthread_mutex_lock(lock);
-
-        pthread_mutex_lock(c->db->lock);
-        dictReplace(c->db->locked_keys, sdsdup(key->ptr), c->lock);
-        pthread_mutex_unlock(c->db->lock);
-        pthread_mutex_unlock(lock);
-    }
-    return 0;
-}
-
-void unlockKey(redisClient *c, robj *key) {
-
-    if (!server.locking_mode) return;
-
-    pthread_mutex_lock(c->db->lock);
-    dictDelete(c->db->locked_keys, key->ptr);
-    pthread_mutex_unlock(c->db->lock);
-
-#ifdef MONITOR_LOCKS
-    if (listLength(server.monitors) && !server.loading) {
-        robj **argv = zcalloc(sizeof(robj)*2);
-        argv[0] = createStringObject("unlocked", 8);
-        argv[1] = key;
-        replicationFeedMonitors(c,server.monitors,c->db->id,argv,2);
-        decrRefCount(argv[0]);
-        zfree(argv);
-    }
-#endif /* MONITOR_LOCKS */
-}
-
 /* =================================== Main! ================================ */
 
 #ifdef __linux__
@@ -2853,6 +3103,7 @@ void loadDataFromDisk(void) {
             exit(1);
         }
     }
+    if (server.sql_wal) return; /* the SQL DB is the file itself */
     start = ustime();
     if (loadOrSaveDb(server.sql_db, server.sql_filename, 0) != SQLITE_OK) {
         redisLog(REDIS_WARNING,"Fatal error loading SQL DB. Exiting");
@@ -68,6 +68,11 @@
 #define REDIS_OK                0
 #define REDIS_ERR               -1
 #define REDIS_ADDED_TO_THREAD   1
+#define REDIS_THREADPOOL_FULL   2
+
+/* Key lock modes */
+#define REDIS_KEYLOCK_SHARED 0
+#define REDIS_KEYLOCK_EXCLUSIVE 1
 
 /* Static server configuration */
 #define REDIS_HZ                100     /* Time interrupt calls/sec. */
@@ -99,11 +104,17 @@
 #define REDIS_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define REDIS_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define REDIS_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define REDIS_REPLY_REF_MIN_BYTES 1024 /* Values replied by reference */
+#define REDIS_REPLY_CACHE_MIN_SIZE 4096 /* Smaller replies are not cached */
 #define REDIS_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define REDIS_MBULK_BIG_ARG     (1024*32)
+#define REDIS_ARGPOOL_SIZE      16 /* Argument objects kept for reuse */
+#define REDIS_ARGPOOL_MAX_LEN   128 /* Bigger arguments are not kept */
 
 /* Hash table parameters */
 #define REDIS_HT_MINFILL        10      /* Minimal hash table fill 10% */
+#define REDIS_DB_SEGMENTS_BITS  4       /* 16 keyspace segments per DB */
+#define REDIS_DB_SEGMENTS       (1<<REDIS_DB_SEGMENTS_BITS)
 
 /* Command flags. Please check the command table defined in the redis.c file
  * for more information about the meaning of every flag. */
@@ -119,6 +130,8 @@
 #define REDIS_CMD_LOADING 512               /* "l" flag */
 #define REDIS_CMD_STALE 1024                /* "t" flag */
 #define REDIS_CMD_SKIP_MONITOR 2048         /* "M" flag */
+#define REDIS_CMD_THREADED 4096             /* "T" flag */
+#define REDIS_CMD_REPLY_CACHE 8192          /* "C" flag */
 
 /* Object types */
 #define REDIS_STRING 0
@@ -186,6 +199,14 @@
 #define REDIS_CLOSE_ASAP 2048 /* Close this client ASAP */
 #define REDIS_UNIX_SOCKET 4096 /* Client connected via Unix domain socket */
 #define REDIS_SQLITE_CLIENT 8192 /* This is a non connected client used by SQLite */
+#define REDIS_THREADPOOL_WAIT 16384 /* The threadpool queue was full: reading is
+                                       paused, the client is stored in
+                                       server.threadpool_waiting_clients */
+#define REDIS_IO_PENDING_READ 32768 /* Readable, in server.clients_pending_read */
+#define REDIS_IO_PENDING_WRITE 65536 /* Has a reply to write, in
+                                        server.clients_pending_write */
+#define REDIS_KEYS_LOCKED 131072 /* Running a batch of pipelined commands,
+                                    their keys are already locked */
 
 /* Client request types */
 #define REDIS_REQ_INLINE 1
@@ -296,6 +317,19 @@
 #define REDIS_THREADPOOL_DEFAULT_SIZE 8
 #define REDIS_THREADPOOL_MAX_SIZE 1024
 #define REDIS_THREADPOOL_DEFAULT_QUEUE_SIZE 1024
+#define REDIS_THREAD_MIN_COST 128 /* Min estimated elements to use a thread */
+#define REDIS_PARALLEL_MIN_COST 65536 /* Min elements to split a command */
+#define REDIS_PARALLEL_MAX_PARTS 16 /* Max parts a command is split in */
+#define REDIS_IO_THREADS_MAX 128 /* Max threads reading and writing sockets */
+#define REDIS_PIPELINE_BATCH_SIZE 64 /* Pipelined commands run as a batch */
+#define REDIS_PIPELINE_BATCH_MAX 1024 /* Max pipeline-batch-size */
+
+/* SQL */
+#define REDIS_SQL_STMT_CACHE_SIZE 64 /* Prepared statements kept per client */
+#define REDIS_SQL_POOL_SIZE 16 /* Idle SQLite connections kept */
+#define REDIS_SQL_CURSOR_TIMEOUT 60 /* Seconds an idle SQLCURSOR is kept */
+#define REDIS_SQL_WAL_CHECKPOINT 1000 /* WAL pages triggering a checkpoint */
+#define REDIS_SQL_BUSY_TIMEOUT 5000 /* ms waiting for the SQL write lock */
 
 /* Using the following macro you can run code inside serverCron() with the
  * specified period, specified in milliseconds.
@@ -336,14 +370,23 @@ typedef struct redisObject {
     _var.ptr = _ptr; \
 } while(0);
 
-typedef struct redisDb {
-    dict *dict;                 /* The keyspace for this DB */
+/* The keyspace of a DB is split by key hash in REDIS_DB_SEGMENTS segments,
+ * each one protected by its own recursive lock, so that threads working on
+ * different keys don't serialize on a single lock and a dict is never
+ * rehashed while some other thread is reading it. The expire of a key is
+ * stored in the same segment as the key. */
+typedef struct redisDbSegment {
+    dict *dict;                 /* Keys of this segment */
     dict *expires;              /* Timeout of keys with a timeout set */
+    pthread_mutex_t lock;
+} redisDbSegment;
+
+typedef struct redisDb {
+    redisDbSegment segments[REDIS_DB_SEGMENTS]; /* The keyspace for this DB */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP) */
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
-    dict *locked_keys;          /* Locked keys */
-    pthread_mutex_t *lock;
+    pthread_mutex_t *lock;      /* Protects every dict but the keyspace */
     int id;
 } redisDb;
 
@@ -395,6 +438,8 @@ typedef struct redisClient {
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size */
     int argc;
     robj **argv;
+    robj *argpool[REDIS_ARGPOOL_SIZE]; /* Arguments of past commands to reuse */
+    int argpoollen;
     struct redisCommand *cmd, *lastcmd;
     int reqtype;
     int multibulklen;       /* number of multi bulk arguments left to read */
@@ -428,12 +473,21 @@ typedef struct redisClient {
     pthread_mutex_t *lock;
     int refcount;
     int busy;
-    long long time_event_id;          /* aeCreateTimeEvent id */
     struct redisClient *lua_client;   /* The "fake client" to query Redis from Lua */
-    lua_State *lua;                   /* The Lua interpreter for this client */
+    lua_State *lua;                   /* The Lua interpreter of the running script */
     long long lua_time_start;         /* Start time of script */
-    sqlite3 *sql_db;                  /* SQLite db */
-    struct redisClient *sql_client;   /* The "fake client" to query Redis from SQL */
+    struct sqlConn *sql_conn;         /* SQLite connection, NULL until used */
+    dict *sql_cursors;                /* SQLCURSOR statements open, by name */
+    int sql_cursor_fetch;             /* Stepping a SQLCURSOR statement */
+    dict *sql_stmts;                  /* Prepared statements, by SQL text */
+    list *sql_stmt_lru;               /* Prepared statements, MRU first */
+    long long sql_stmt_next_handle;   /* Handle of the next SQLPREPARE */
+    dict *sql_stmt_tables;            /* Tables of the statement prepared */
+    int sql_stmt_writes;              /* The running statement writes */
+    int sql_binary;                   /* SQL rows in binary, see SQLFORMAT */
+    int io_thread;          /* I/O thread of the client, 0 is the main thread */
+    ssize_t io_nread;       /* Result of read(2) in the I/O thread */
+    int io_errno;           /* errno of the last read or write in it */
 } redisClient;
 
 struct saveparam {
@@ -558,6 +612,13 @@ struct redisServer {
     size_t stat_peak_memory;        /* Max used memory record */
     long long stat_fork_time;       /* Time needed to perform latets fork() */
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
+    long long stat_sql_stmt_hits;   /* SQL statements found prepared */
+    long long stat_sql_stmt_misses; /* SQL statements prepared again */
+    long long stat_sql_stmt_evictions; /* Prepared statements evicted */
+    long long stat_io_threaded_reads;  /* Reads done by the I/O threads */
+    long long stat_io_threaded_writes; /* Writes done by the I/O threads */
+    long long stat_pipeline_batches;   /* Batches of pipelined commands */
+    long long stat_pipeline_batched_cmds; /* Commands run in those batches */
     list *slowlog;                  /* SLOWLOG list of commands */
     long long slowlog_entry_id;     /* SLOWLOG current entry ID */
     long long slowlog_log_slower_than; /* SLOWLOG time limit (to get logged) */
@@ -676,12 +737,36 @@ struct redisServer {
 
     threadpool_t *tpool;
     int threadpool_size;
+    int threadpool_queue_size;
+    list *threadpool_waiting_clients; /* Clients paused by a full queue */
+    int io_threads;          /* Threads reading and writing sockets, 0: off */
+    int io_next_thread;      /* I/O thread of the next client accepted */
+    list *clients_pending_read;  /* Clients to read from before sleeping */
+    list *clients_pending_write; /* Clients to write to before sleeping */
+    pthread_t main_thread;   /* The thread of the event loop */
     pthread_mutex_t *lock;
     int locking_mode;        /* if this is 0, locking should be unnecessary */
+    long long thread_min_cost; /* Threaded commands cheaper than this run
+                                  in the event loop, see commandThreadCost */
+    long long parallel_min_cost; /* Commands processing at least this many
+                                    elements split the work across threads */
+    int parallel_max_parts;  /* Max parts of a split command, 0 = CPUs */
+    int pipeline_batch_size; /* Max pipelined commands locking their keys
+                                at once, see callCommandBatch() */
+    sds thread_commands;     /* thread-commands overrides, "+cmd -cmd ..." */
+    unsigned long long reply_cache_max_memory; /* Reply cache size, 0: off */
+    long long reply_cache_min_size; /* Smaller replies are not cached */
 
     sqlite3 *sql_db;                  /* SQLite db */
     int sql_threads;
     char *sql_filename;               /* Name of SQL dump file */
+    int sql_stmt_cache_size;          /* Prepared statements per client */
+    int sql_pool_size;                /* Idle SQLite connections kept */
+    time_t sql_cursor_timeout;        /* Idle SQLCURSOR lifetime, 0: none */
+    int sql_wal;                      /* SQL DB in sql_filename, WAL mode */
+    long long sql_mmap_size;          /* WAL mode: bytes of the file mmap'd */
+    long long sql_cache_size;         /* WAL mode: page cache per conn, bytes */
+    int sql_wal_checkpoint;           /* WAL pages triggering a checkpoint */
 };
 
 typedef struct pubsubPattern {
@@ -765,6 +850,19 @@ typedef struct {
 #define REDIS_HASH_KEY 1
 #define REDIS_HASH_VALUE 2
 
+/* Object and client reference counting. When server.locking_mode is 0 no
+ * command is running in a thread, so only the main thread can be touching
+ * refcounts and a plain add is enough. Otherwise use an atomic add (or the
+ * global ref_lock where atomics are not available). Both return the new
+ * value of the counter. */
+#ifdef HAVE_ATOMIC
+#define atomicRefCountAdd(_v,_d) __sync_add_and_fetch(&(_v),(_d))
+#else
+#define atomicRefCountAdd(_v,_d) lockedRefCountAdd(&(_v),(_d))
+#endif
+#define refCountAdd(_v,_d) \
+    (server.locking_mode ? atomicRefCountAdd(_v,_d) : ((_v) += (_d)))
+
 /*-----------------------------------------------------------------------------
  * Extern declarations
  *----------------------------------------------------------------------------*/
@@ -775,14 +873,22 @@ extern struct sharedObjectsStruct shared;
 extern dictType setDictType;
 extern dictType zsetDictType;
 extern dictType dbDictType;
+extern dictType keyptrDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
+extern dictType sqlCursorDictType;
+extern dictType sqlStmtDictType;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
  *----------------------------------------------------------------------------*/
 
 /* Utils */
+unsigned int dictSdsHash(const void *key);
+unsigned int dictSdsCaseHash(const void *key);
+int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
+int dictSdsKeyCaseCompare(void *privdata, const void *key1, const void *key2);
+void dictSdsDestructor(void *privdata, void *val);
 long long ustime(void);
 long long mstime(void);
 void getRandomHexChars(char *p, unsigned int len);
@@ -794,20 +900,30 @@ redisClient *createClient(int fd);
 void closeTimedoutClients(void);
 void freeClient(redisClient *c);
 void resetClient(redisClient *c);
+void freeClientArgPool(redisClient *c);
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReply(redisClient *c, robj *obj);
 void *addDeferredMultiBulkLength(redisClient *c);
 void setDeferredMultiBulkLength(redisClient *c, void *node, long length);
+void discardDeferredReply(redisClient *c, void *node);
 void addReplySds(redisClient *c, sds s);
 void processInputBuffer(redisClient *c);
+void callCommandBatch(redisClient *c);
+void pauseThreadpoolWaitingClient(redisClient *c);
+void resumeThreadpoolWaitingClient(redisClient *c);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void clientReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(redisClient *c);
+void initIOThreads(void);
+void handleClientsWithPendingReads(void);
+void handleClientsWithPendingWrites(void);
 void addReplyBulk(redisClient *c, robj *obj);
 void addReplyBulkCString(redisClient *c, char *s);
 void addReplyBulkCBuffer(redisClient *c, void *p, size_t len);
 void addReplyBulkLongLong(redisClient *c, long long ll);
+void addReplyString(redisClient *c, char *s, size_t len);
+void addReplyLongLongWithPrefix(redisClient *c, long long ll, char prefix);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReply(redisClient *c, robj *obj);
 void addReplySds(redisClient *c, sds s);
@@ -871,6 +987,7 @@ void discardTransaction(redisClient *c);
 /* Redis object implementation */
 void decrRefCount(void *o);
 void incrRefCount(robj *o);
+int lockedRefCountAdd(int *refcount, int delta);
 robj *resetRefCount(robj *obj);
 void freeStringObject(robj *o);
 void freeListObject(robj *o);
@@ -904,6 +1021,7 @@ char *strEncoding(int encoding);
 int compareStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long estimateObjectIdleTime(robj *o);
+robj *objectCommandLookup(redisClient *c, robj *key);
 
 /* Synchronous I/O with timeout */
 ssize_t syncWrite(int fd, char *ptr, ssize_t size, long long timeout);
@@ -950,15 +1068,21 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj);
 unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score);
 int zslDelete(zskiplist *zsl, double score, robj *obj);
 zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec range);
+unsigned long zslGetRank(zskiplist *zsl, double score, robj *o);
+zskiplistNode *zslGetElementByRank(zskiplist *zsl, unsigned long rank);
+unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec range);
 double zzlGetScore(unsigned char *sptr);
 void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 unsigned int zsetLength(robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
+int zsetAdd(robj *zobj, robj *ele, double score);
+int zsetDel(robj *zobj, robj *ele);
 
 /* Core functions */
 int freeMemoryIfNeeded(void);
 int processCommand(redisClient *c);
+int commandCanBatch(redisClient *c, struct redisCommand *cmd, int argc);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
 struct redisCommand *lookupCommandByCString(char *s);
@@ -975,6 +1099,9 @@ int htNeedsResize(dict *dict);
 void oom(const char *msg);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
+int setThreadedCommands(sds *argv, int argc);
+long long commandThreadCost(redisClient *c);
+int parallelCommandParts(long long cost);
 
 /* Set data type */
 robj *setTypeCreate(robj *value);
@@ -993,6 +1120,8 @@ void setTypeConvert(robj *subject, int enc);
 void hashTypeConvert(robj *o, int enc);
 void hashTypeTryConversion(robj *subject, robj **argv, int start, int end);
 void hashTypeTryObjectEncoding(robj *subject, robj **o1, robj **o2);
+int hashTypeGetFromZiplist(robj *o, robj *field, unsigned char **vstr, unsigned int *vlen, long long *vll);
+int hashTypeGetFromHashTable(robj *o, robj *field, robj **value);
 robj *hashTypeGetObject(robj *o, robj *key);
 int hashTypeExists(robj *o, robj *key);
 int hashTypeSet(robj *o, robj *key, robj *value);
@@ -1039,6 +1168,12 @@ int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbDelete(redisDb *db, robj *key);
 long long emptyDb();
+redisDbSegment *dbSegment(redisDb *db, sds key);
+void dbInitSegments(redisDb *db);
+unsigned long dbSize(redisDb *db);
+unsigned long dbExpiresSize(redisDb *db);
+long long dbEmpty(redisDb *db);
+long long segmentGetExpire(redisDbSegment *seg, sds key);
 int selectDb(redisClient *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
@@ -1060,27 +1195,61 @@ void sentinelTimer(void);
 char *sentinelHandleConfiguration(char **argv, int argc);
 
 /* Scripting */
-void scriptingInit(redisClient *c);
-void scriptingRelease(redisClient *c);
+sds genLuaInfoString(sds info);
+
+/* Reply cache */
+void replyCacheCall(redisClient *c);
+void replyCacheInvalidateKey(redisDb *db, robj *key);
+void replyCacheInvalidateDb(int dbid);
+void replyCacheTrim(void);
+sds genReplyCacheInfoString(sds info);
 
 /* SQLite */
 void sqlInit(void);
-void sqlClientInit(redisClient *c);
 void sqlClientClose(redisClient *c);
+void sqlClientCursorsCron(redisClient *c);
+void sqlStmtCacheRelease(redisClient *c);
 int loadOrSaveDb(sqlite3 *inmemory, const char *filename, int is_save);
 int sqlExclusiveLock(void);
 int sqlExclusiveUnlock(void);
+int sqlSaveBegin(void);
+void sqlSaveForked(pid_t childpid);
+void sqlSaveDone(pid_t childpid, int ok);
+void sqlSaveCron(void);
+void sqlSaveUnblockClient(redisClient *c);
+int sqlSaveChild(const char *filename);
+sds genSqlSaveInfoString(sds info);
+sds genSqlPoolInfoString(sds info);
+int sqlCheckpoint(int mode);
 
 /* Git SHA1 */
 char *redisGitSHA1(void);
 char *redisGitDirty(void);
 
 /* Locking */
+typedef struct dbKey {
+    redisDb *db;
+    robj *key;
+} dbKey;
+
+void keyLockInit(void);
 void lockKey(redisClient *c, robj *key);
-int genericLockKey(redisClient *c, robj *key, int trylock);
+void genericLockKey(redisClient *c, robj *key, int mode);
 void unlockKey(redisClient *c, robj *key);
 void lockKeys(redisClient *c, robj **keys, int n_keys);
+void genericLockKeys(redisClient *c, robj **keys, int n_keys, int mode);
 void unlockKeys(redisClient *c, robj **keys, int n_keys);
+void lockDbKeys(redisClient *c, dbKey *keys, int n_keys);
+void unlockDbKeys(redisClient *c, dbKey *keys, int n_keys);
+int keyIsLocked(redisDb *db, sds key);
+int keyIsShared(redisDb *db, sds key);
+void lockDbKey(redisClient *c, redisDb *db, sds key, int mode);
+int trylockDbKey(redisClient *c, redisDb *db, sds key, int mode);
+void unlockDbKey(redisClient *c, redisDb *db, sds key);
+int keyIsHeldBy(redisClient *c, redisDb *db, sds key);
+int trylockKeyForDelete(redisDb *db, sds key);
+void unlockKeyForDelete(redisDb *db, sds key);
+sds genKeyLockInfoString(sds info);
 
 /* Commands prototypes */
 void authCommand(redisClient *c);
@@ -1220,6 +1389,9 @@ void bitcountCommand(redisClient *c);
 void replconfCommand(redisClient *c);
 void sqlCommand(redisClient *c);
 void sqlprepareCommand(redisClient *c);
+void sqlcursorCommand(redisClient *c);
+void sqlexecCommand(redisClient *c);
+void sqlformatCommand(redisClient *c);
 void sqlsaveCommand(redisClient *c);
 
 #if defined(__GNUC__)
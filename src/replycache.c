@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2009-2013, Gregory Trubetskoy <grisha@apache.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+
+/* Reply cache.
+ *
+ * The protocol of the replies of the commands flagged "C" in the command
+ * table (LRANGE, ZRANGE, HGETALL, ...) can be kept once built, so that the
+ * same command with the same arguments against an unchanged key is served
+ * by linking the cached reply object to the client output, by reference
+ * (see addReply()), instead of walking the value and serializing it again.
+ *
+ * The cache is a dict keyed by DB id and key name, every entry holding the
+ * replies built from the value of the key, keyed by command name and
+ * arguments. An entry is dropped as a whole when the key is modified
+ * (signalModifiedKey()), deleted (dbDelete(), so that expired and evicted
+ * keys are covered) or its DB flushed. The value object the replies were
+ * built from is remembered too, and a reply is only served if the key still
+ * holds the very same object.
+ *
+ * A reply is only cached when its command started with an empty output
+ * buffer, so that the whole output is the reply: a reply built while
+ * previous pipelined replies are still in the buffer is sent as usual.
+ *
+ * A reply built by a thread may race with a write to the same key running
+ * right after it released the key: every invalidation bumps the generation
+ * of a bucket hashed by key name, and a reply is stored only if the
+ * generation of its key didn't change while it was being built.
+ *
+ * The cache is limited to reply-cache-max-memory bytes: random entries are
+ * evicted to make room for new replies. */
+
+#define REDIS_REPLY_CACHE_GENERATIONS 1024  /* Must be a power of two */
+
+typedef struct replyCacheEntry {
+    robj *val;      /* Value of the key the replies were built from */
+    list *replies;  /* replyCacheReply structures */
+    size_t bytes;   /* Memory accounted for the entry */
+} replyCacheEntry;
+
+typedef struct replyCacheReply {
+    sds args;       /* Command name and arguments after the key */
+    robj *reply;    /* The protocol, a RAW string object */
+} replyCacheReply;
+
+static void replyCacheEntryFree(void *privdata, void *val);
+
+/* DB id + key -> replyCacheEntry */
+static dictType replyCacheDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    replyCacheEntryFree         /* val destructor */
+};
+
+static pthread_mutex_t replyCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static dict *replyCache = NULL;
+static size_t replyCacheBytes = 0;
+static unsigned long replyCacheReplies = 0;
+static unsigned long replyCacheEpoch = 0; /* Bumped by flushes */
+static unsigned long replyCacheGenerations[REDIS_REPLY_CACHE_GENERATIONS];
+static long long replyCacheHits = 0;
+static long long replyCacheMisses = 0;
+
+static void replyCacheEntryFree(void *privdata, void *val) {
+    replyCacheEntry *e = val;
+    listNode *ln;
+    REDIS_NOTUSED(privdata);
+
+    while((ln = listFirst(e->replies)) != NULL) {
+        replyCacheReply *r = listNodeValue(ln);
+
+        sdsfree(r->args);
+        decrRefCount(r->reply);
+        zfree(r);
+        listDelNode(e->replies,ln);
+        replyCacheReplies--;
+    }
+    listRelease(e->replies);
+    replyCacheBytes -= e->bytes;
+    zfree(e);
+}
+
+/* Dict key of the entry of a key: the DB id followed by the key name. */
+static sds replyCacheKey(int dbid, robj *key) {
+    sds k = sdsnewlen(&dbid,sizeof(dbid));
+
+    return sdscatlen(k,key->ptr,sdslen(key->ptr));
+}
+
+/* Arguments of the command other than the key, every one prefixed by its
+ * length so that different argument lists can't collide. */
+static sds replyCacheArgs(redisClient *c) {
+    sds args = sdsnew(c->cmd->name);
+    int j;
+
+    for (j = 2; j < c->argc; j++) {
+        robj *o = getDecodedObject(c->argv[j]);
+
+        args = sdscatprintf(args,":%lu:",(unsigned long)sdslen(o->ptr));
+        args = sdscatlen(args,o->ptr,sdslen(o->ptr));
+        decrRefCount(o);
+    }
+    return args;
+}
+
+static unsigned long *replyCacheGeneration(sds key) {
+    return replyCacheGenerations+
+        (dictSdsHash(key) & (REDIS_REPLY_CACHE_GENERATIONS-1));
+}
+
+/* Return the cached reply for the command of the client, with its refcount
+ * incremented, or NULL. Called with the mutex held. */
+static robj *replyCacheLookup(sds key, sds args, robj **val) {
+    dictEntry *de;
+    replyCacheEntry *e;
+    listNode *ln;
+    listIter li;
+
+    if (replyCache == NULL || (de = dictFind(replyCache,key)) == NULL)
+        return NULL;
+    e = dictGetVal(de);
+    listRewind(e->replies,&li);
+    while((ln = listNext(&li)) != NULL) {
+        replyCacheReply *r = listNodeValue(ln);
+
+        if (sdslen(r->args) == sdslen(args) &&
+            memcmp(r->args,args,sdslen(args)) == 0)
+        {
+            *val = e->val;
+            incrRefCount(r->reply);
+            return r->reply;
+        }
+    }
+    return NULL;
+}
+
+/* Evict random entries until the cache fits in its limit. Called with the
+ * mutex held. */
+static void replyCacheEvict(void) {
+    while(replyCache && dictSize(replyCache) &&
+          replyCacheBytes > server.reply_cache_max_memory)
+    {
+        dictEntry *de = dictGetRandomKey(replyCache);
+
+        dictDelete(replyCache,dictGetKey(de));
+    }
+}
+
+/* Store the reply of a command. Called with the mutex held. */
+static void replyCacheStore(sds key, sds args, robj *val, robj *reply) {
+    size_t bytes = sizeof(replyCacheReply)+sdslen(args)+sdslen(reply->ptr);
+    dictEntry *de;
+    replyCacheEntry *e;
+    replyCacheReply *r;
+
+    robj *cached, *cachedval;
+
+    if (bytes > server.reply_cache_max_memory) return;
+    if (replyCache == NULL) replyCache = dictCreate(&replyCacheDictType,NULL);
+
+    /* Built by another client meanwhile? */
+    if ((cached = replyCacheLookup(key,args,&cachedval)) != NULL) {
+        decrRefCount(cached);
+        if (cachedval == val) return;
+    }
+
+    de = dictFind(replyCache,key);
+    if (de && ((replyCacheEntry*)dictGetVal(de))->val != val) {
+        dictDelete(replyCache,key);
+        de = NULL;
+    }
+    if (de == NULL) {
+        e = zmalloc(sizeof(*e));
+        e->val = val;
+        e->replies = listCreate();
+        e->bytes = sizeof(*e)+sdslen(key);
+        replyCacheBytes += e->bytes;
+        dictAdd(replyCache,sdsdup(key),e);
+    } else {
+        e = dictGetVal(de);
+    }
+
+    r = zmalloc(sizeof(*r));
+    r->args = sdsdup(args);
+    r->reply = reply;
+    incrRefCount(reply);
+    listAddNodeTail(e->replies,r);
+    e->bytes += bytes;
+    replyCacheBytes += bytes;
+    replyCacheReplies++;
+    replyCacheEvict();
+}
+
+/* Move the whole output of the client, which is the reply of the command
+ * just called, into a single string object and queue it back. Returns NULL
+ * if the reply is too small to be worth caching, or too big to fit. */
+static robj *replyCacheCapture(redisClient *c) {
+    size_t len = c->bufpos;
+    listNode *ln;
+    listIter li;
+    sds s;
+    robj *reply;
+
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li)) != NULL) {
+        robj *o = listNodeValue(ln);
+
+        if (o->ptr == NULL) return NULL; /* Deferred length never set. */
+        len += sdslen(o->ptr);
+    }
+    if ((long long)len < server.reply_cache_min_size ||
+        len > server.reply_cache_max_memory) return NULL;
+
+    s = sdsMakeRoomFor(sdsempty(),len);
+    s = sdscatlen(s,c->buf,c->bufpos);
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li)) != NULL) {
+        robj *o = listNodeValue(ln);
+
+        s = sdscatlen(s,o->ptr,sdslen(o->ptr));
+    }
+    while((ln = listFirst(c->reply)) != NULL) listDelNode(c->reply,ln);
+    c->bufpos = 0;
+    c->reply_bytes = 0;
+
+    reply = createObject(REDIS_STRING,s);
+    addReply(c,reply);
+    return reply;
+}
+
+/* Call the command of the client, a command flagged "C", through the
+ * cache. */
+void replyCacheCall(redisClient *c) {
+    robj *key = c->argv[1], *reply, *cachedval = NULL, *val;
+    sds k, args;
+    unsigned long epoch, generation;
+    int capture;
+
+    if (c->fd <= 0 || c->argc < 2 ||
+        c->flags & (REDIS_MULTI|REDIS_LUA_CLIENT|REDIS_SQLITE_CLIENT|
+                    REDIS_MASTER|REDIS_SLAVE|REDIS_MONITOR))
+    {
+        c->cmd->proc(c);
+        return;
+    }
+
+    k = replyCacheKey(c->db->id,key);
+    args = replyCacheArgs(c);
+
+    lockKey(c,key);
+    pthread_mutex_lock(&replyCacheMutex);
+    reply = replyCacheLookup(k,args,&cachedval);
+    epoch = replyCacheEpoch;
+    generation = *replyCacheGeneration(k);
+    pthread_mutex_unlock(&replyCacheMutex);
+    if (reply) {
+        /* Check the key still holds the value the reply was built from,
+         * this also expires the key if needed. */
+        if (lookupKeyRead(c->db,key) == cachedval) {
+            unlockKey(c,key);
+            pthread_mutex_lock(&replyCacheMutex);
+            replyCacheHits++;
+            pthread_mutex_unlock(&replyCacheMutex);
+            addReply(c,reply);
+            decrRefCount(reply);
+            sdsfree(k);
+            sdsfree(args);
+            return;
+        }
+        decrRefCount(reply);
+        pthread_mutex_lock(&replyCacheMutex);
+        if (replyCache) dictDelete(replyCache,k);
+        epoch = replyCacheEpoch;
+        generation = *replyCacheGeneration(k);
+        pthread_mutex_unlock(&replyCacheMutex);
+    }
+    unlockKey(c,key);
+
+    capture = c->bufpos == 0 && listLength(c->reply) == 0;
+    c->cmd->proc(c);
+    if (capture && (reply = replyCacheCapture(c)) != NULL) {
+        lockKey(c,key);
+        val = lookupKey(c->db,key);
+        pthread_mutex_lock(&replyCacheMutex);
+        if (val && epoch == replyCacheEpoch &&
+            generation == *replyCacheGeneration(k) &&
+            server.reply_cache_max_memory)
+            replyCacheStore(k,args,val,reply);
+        replyCacheMisses++;
+        pthread_mutex_unlock(&replyCacheMutex);
+        unlockKey(c,key);
+        decrRefCount(reply);
+    } else {
+        pthread_mutex_lock(&replyCacheMutex);
+        replyCacheMisses++;
+        pthread_mutex_unlock(&replyCacheMutex);
+    }
+    sdsfree(k);
+    sdsfree(args);
+}
+
+/* Drop the cached replies of a key, called when it is modified or
+ * deleted. */
+void replyCacheInvalidateKey(redisDb *db, robj *key) {
+    sds k = replyCacheKey(db->id,key);
+
+    /* The generation is bumped even if nothing is cached yet, a reply may
+     * be in the making. */
+    pthread_mutex_lock(&replyCacheMutex);
+    (*replyCacheGeneration(k))++;
+    if (replyCache) dictDelete(replyCache,k);
+    pthread_mutex_unlock(&replyCacheMutex);
+    sdsfree(k);
+}
+
+/* Drop the cached replies of the keys of a DB, or of every DB if dbid
+ * is -1. */
+void replyCacheInvalidateDb(int dbid) {
+    dictIterator *di;
+    dictEntry *de;
+
+    pthread_mutex_lock(&replyCacheMutex);
+    replyCacheEpoch++;
+    if (replyCache && dbid == -1) {
+        dictEmpty(replyCache);
+    } else if (replyCache) {
+        di = dictGetSafeIterator(replyCache);
+        while((de = dictNext(di)) != NULL) {
+            sds k = dictGetKey(de);
+
+            if (memcmp(k,&dbid,sizeof(dbid)) == 0)
+                dictDelete(replyCache,k);
+        }
+        dictReleaseIterator(di);
+    }
+    pthread_mutex_unlock(&replyCacheMutex);
+}
+
+/* Apply a new reply-cache-max-memory setting, 0 drops the whole cache. */
+void replyCacheTrim(void) {
+    if (replyCache == NULL) return;
+    pthread_mutex_lock(&replyCacheMutex);
+    replyCacheEvict();
+    pthread_mutex_unlock(&replyCacheMutex);
+}
+
+sds genReplyCacheInfoString(sds info) {
+    pthread_mutex_lock(&replyCacheMutex);
+    info = sdscatprintf(info,
+        "reply_cache_keys:%lu\r\n"
+        "reply_cache_replies:%lu\r\n"
+        "reply_cache_bytes:%zu\r\n"
+        "reply_cache_hits:%lld\r\n"
+        "reply_cache_misses:%lld\r\n",
+        replyCache ? dictSize(replyCache) : 0,
+        replyCacheReplies,
+        replyCacheBytes,
+        replyCacheHits,
+        replyCacheMisses);
+    pthread_mutex_unlock(&replyCacheMutex);
+    return info;
+}
@@ -37,6 +37,13 @@
 #include <ctype.h>
 #include <math.h>
 
+/* The Lua interpreter of a thread, see scriptingBindVm(). */
+typedef struct luaVm {
+    lua_State *lua;
+    redisClient *lua_client;    /* The "fake client" its scripts use */
+    long long generation;       /* luaGeneration it was set up in */
+} luaVm;
+
 char *redisProtocolToLuaType_Int(lua_State *lua, char *reply);
 char *redisProtocolToLuaType_Bulk(lua_State *lua, char *reply);
 char *redisProtocolToLuaType_Status(lua_State *lua, char *reply);
@@ -519,18 +526,17 @@ void scriptingEnableGlobalsProtection(lua_State *lua) {
     sdsfree(code);
 }
 
-/* Initialize the scripting environment.
- * It is possible to call this function to reset the scripting environment
- * assuming that we call scriptingRelease() before.
- * See scriptingReset() for more information. */
-void scriptingInit(redisClient *c) {
+/* Initialize a scripting environment, with the fake client its scripts
+ * query Redis with. */
+static void scriptingInit(luaVm *vm) {
     lua_State *lua = lua_open();
 
     luaLoadLibraries(lua);
     luaRemoveUnsupportedFunctions(lua);
 
-    /* Store the client pointer in lua */
-    lua_pushlightuserdata(lua, (void *) c);
+    /* The pointer to the client running the script is stored in lua by
+     * scriptingBindVm() before every call. */
+    lua_pushlightuserdata(lua, NULL);
     lua_setglobal(lua,"_client");
 
     /* Register the redis commands table and fields */
@@ -609,37 +615,172 @@ void scriptingInit(redisClient *c) {
     }
 
     /* Create the (non connected) client that we use to execute Redis commands
-     * inside the Lua interpreter.
-     * Note: there is no need to create it again when this function is called
-     * by scriptingReset(). */
-    c->lua_client = createClient(-1);
-    c->lua_client->flags |= REDIS_LUA_CLIENT;
+     * inside the Lua interpreter. */
+    vm->lua_client = createClient(-1);
+    vm->lua_client->flags |= REDIS_LUA_CLIENT;
 
     /* Lua beginners ofter don't use "local", this is likely to introduce
      * subtle bugs in their code. To prevent problems we protect accesses
      * to global variables. */
     scriptingEnableGlobalsProtection(lua);
 
-    c->lua = lua;
+    vm->lua = lua;
+}
+
+/* Release resources related to Lua scripting. */
+static void scriptingRelease(luaVm *vm) {
+    lua_close(vm->lua);
+    if (!pthread_mutex_destroy(vm->lua_client->lock))
+        zfree(vm->lua_client->lock);
+    zfree(vm->lua_client);
+    zfree(vm);
+}
+
+/* Every thread running scripts (the main thread and the threads of the
+ * pool) has a Lua interpreter of its own, set up the first time it runs a
+ * script, and EVAL and EVALSHA use the interpreter of the thread they run
+ * in. The functions of the scripts stay defined in the interpreter of the
+ * thread, so the number of interpreters doesn't grow with the clients.
+ *
+ * The bytecode of every function compiled by one of them is kept in
+ * luaBytecode (SHA1 -> lua_dump() of the chunk defining the function), so
+ * that the other interpreters load the function without parsing the
+ * script again. SCRIPT FLUSH empties it and bumps luaGeneration: the
+ * interpreter of a thread is closed and set up again the next time the
+ * thread runs a script. */
+static pthread_key_t luaVmKey;
+static pthread_once_t luaVmKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t luaCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static dict *luaBytecode;
+static size_t luaBytecodeBytes;
+static long long luaGeneration, luaVms;
+static long long luaBytecodeHits, luaBytecodeMisses;
+
+static void luaVmDestructor(void *vm) {
+    scriptingRelease(vm);
+    pthread_mutex_lock(&luaCacheMutex);
+    luaVms--;
+    pthread_mutex_unlock(&luaCacheMutex);
+}
+
+static void luaVmKeyCreate(void) {
+    pthread_key_create(&luaVmKey,luaVmDestructor);
 }
 
-/* Release resources related to Lua scripting.
- * This function is used in order to reset the scripting environment. */
-void scriptingRelease(redisClient *c) {
-    /* This will clear the lua_scripts dict, but weill leave functions
-     * in other client's lua states, though it seems like that is okay */
-    lua_close(c->lua);
-    if (!pthread_mutex_destroy(c->lua_client->lock))
-        zfree(c->lua_client->lock);
-    zfree(c->lua_client);
+/* Bind the interpreter of the current thread to the client, setting it up
+ * if the thread has none yet or if scripts were flushed since. The client
+ * keeps it until scriptingUnbindVm(). */
+static void scriptingBindVm(redisClient *c) {
+    luaVm *vm;
+    long long generation;
+
+    pthread_once(&luaVmKeyOnce,luaVmKeyCreate);
+    pthread_mutex_lock(&luaCacheMutex);
+    generation = luaGeneration;
+    pthread_mutex_unlock(&luaCacheMutex);
+
+    vm = pthread_getspecific(luaVmKey);
+    if (vm && vm->generation != generation) {
+        luaVmDestructor(vm);
+        vm = NULL;
+    }
+    if (vm == NULL) {
+        vm = zmalloc(sizeof(*vm));
+        scriptingInit(vm);
+        vm->generation = generation;
+        pthread_setspecific(luaVmKey,vm);
+        pthread_mutex_lock(&luaCacheMutex);
+        luaVms++;
+        pthread_mutex_unlock(&luaCacheMutex);
+    }
+    c->lua = vm->lua;
+    c->lua_client = vm->lua_client;
+    lua_pushlightuserdata(c->lua, (void *) c);
+    lua_setglobal(c->lua,"_client");
 }
 
-void scriptingReset(redisClient *c) {
-    scriptingRelease(c);
+static void scriptingUnbindVm(redisClient *c) {
+    c->lua = NULL;
+    c->lua_client = NULL;
+}
+
+static int luaBytecodeWriter(lua_State *lua, const void *p, size_t sz,
+                             void *ud) {
+    sds *bc = ud;
+    REDIS_NOTUSED(lua);
+
+    *bc = sdscatlen(*bc,p,sz);
+    return 0;
+}
+
+/* Load the chunk defining the function funcname from luaBytecode, leaving
+ * it on the stack. Returns 0 if the function was never compiled. */
+static int luaLoadBytecode(lua_State *lua, char *funcname) {
+    dictEntry *de;
+    int loaded = 0;
+    sds sha = sdsnewlen(funcname+2,40);
+
+    pthread_mutex_lock(&luaCacheMutex);
+    if (luaBytecode && (de = dictFind(luaBytecode,sha)) != NULL) {
+        sds bc = dictGetVal(de);
+
+        loaded = !luaL_loadbuffer(lua,bc,sdslen(bc),"@user_script");
+        if (loaded) luaBytecodeHits++;
+    }
+    pthread_mutex_unlock(&luaCacheMutex);
+    sdsfree(sha);
+    return loaded;
+}
+
+/* Save the bytecode of the chunk defining funcname, at the top of the
+ * stack, in luaBytecode. */
+static void luaSaveBytecode(lua_State *lua, char *funcname) {
+    static dictType bytecodeDictType = {
+        dictSdsHash, NULL, NULL, dictSdsKeyCompare,
+        dictSdsDestructor, dictSdsDestructor
+    };
+    sds bc = sdsempty();
+    sds sha;
+
+    lua_dump(lua,luaBytecodeWriter,&bc);
+    sha = sdsnewlen(funcname+2,40);
+    pthread_mutex_lock(&luaCacheMutex);
+    luaBytecodeMisses++;
+    if (luaBytecode == NULL) luaBytecode = dictCreate(&bytecodeDictType,NULL);
+    if (dictAdd(luaBytecode,sha,bc) == DICT_OK) {
+        luaBytecodeBytes += sdslen(bc);
+        sha = NULL;
+        bc = NULL;
+    }
+    pthread_mutex_unlock(&luaCacheMutex);
+    if (sha) sdsfree(sha);
+    if (bc) sdsfree(bc);
+}
+
+sds genLuaInfoString(sds info) {
+    pthread_mutex_lock(&luaCacheMutex);
+    info = sdscatprintf(info,
+        "lua_vms:%lld\r\n"
+        "lua_bytecode_scripts:%lu\r\n"
+        "lua_bytecode_bytes:%zu\r\n"
+        "lua_bytecode_hits:%lld\r\n"
+        "lua_bytecode_misses:%lld\r\n",
+        luaVms,
+        luaBytecode ? dictSize(luaBytecode) : 0,
+        luaBytecodeBytes, luaBytecodeHits, luaBytecodeMisses);
+    pthread_mutex_unlock(&luaCacheMutex);
+    return info;
+}
+
+void scriptingReset(void) {
     pthread_mutex_lock(server.lock);
     dictEmpty(server.lua_scripts);
     pthread_mutex_unlock(server.lock);
-    scriptingInit(c);
+    pthread_mutex_lock(&luaCacheMutex);
+    if (luaBytecode) dictEmpty(luaBytecode);
+    luaBytecodeBytes = 0;
+    luaGeneration++;
+    pthread_mutex_unlock(&luaCacheMutex);
 }
 
 /* Perform the SHA1 of the input string. We use this both for hasing script
@@ -760,12 +901,15 @@ int luaCreateFunction(redisClient *c, lua_State *lua, char *funcname, robj *body
     funcdef = sdscatlen(funcdef,body->ptr,sdslen(body->ptr));
     funcdef = sdscatlen(funcdef," end",4);
 
-    if (luaL_loadbuffer(lua,funcdef,sdslen(funcdef),"@user_script")) {
-        addReplyErrorFormat(c,"Error compiling script (new function): %s\n",
-            lua_tostring(lua,-1));
-        lua_pop(lua,1);
-        sdsfree(funcdef);
-        return REDIS_ERR;
+    if (!luaLoadBytecode(lua,funcname)) {
+        if (luaL_loadbuffer(lua,funcdef,sdslen(funcdef),"@user_script")) {
+            addReplyErrorFormat(c,"Error compiling script (new function): %s\n",
+                lua_tostring(lua,-1));
+            lua_pop(lua,1);
+            sdsfree(funcdef);
+            return REDIS_ERR;
+        }
+        luaSaveBytecode(lua,funcname);
     }
     sdsfree(funcdef);
     if (lua_pcall(lua,0,0,0)) {
@@ -794,7 +938,7 @@ int luaCreateFunction(redisClient *c, lua_State *lua, char *funcname, robj *body
     return REDIS_OK;
 }
 
-void evalGenericCommand(redisClient *c, int evalsha) {
+static void evalGenericCommandWithVm(redisClient *c, int evalsha) {
     lua_State *lua = c->lua;
     char funcname[43];
     long long numkeys;
@@ -915,6 +1059,12 @@ void evalGenericCommand(redisClient *c, int evalsha) {
     }
 }
 
+void evalGenericCommand(redisClient *c, int evalsha) {
+    scriptingBindVm(c);
+    evalGenericCommandWithVm(c,evalsha);
+    scriptingUnbindVm(c);
+}
+
 void evalCommand(redisClient *c) {
     evalGenericCommand(c,0);
 }
@@ -977,7 +1127,7 @@ int redis_math_randomseed (lua_State *L) {
 void scriptCommand(redisClient *c) {
     dictEntry *d;
     if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"flush")) {
-        scriptingReset(c);
+        scriptingReset();
         addReply(c,shared.ok);
         server.dirty++; /* Replicating this command is a good idea. */
     } else if (c->argc >= 2 && !strcasecmp(c->argv[1]->ptr,"exists")) {
@@ -1005,8 +1155,12 @@ void scriptCommand(redisClient *c) {
         d = dictFind(server.lua_scripts,sha);
         pthread_mutex_unlock(server.lock);
         if (d == NULL) {
-            if (luaCreateFunction(c,c->lua,funcname,c->argv[2])
-                    == REDIS_ERR) {
+            int retval;
+
+            scriptingBindVm(c);
+            retval = luaCreateFunction(c,c->lua,funcname,c->argv[2]);
+            scriptingUnbindVm(c);
+            if (retval == REDIS_ERR) {
                 sdsfree(sha);
                 return;
             }
@@ -29,11 +29,15 @@
 
 
 #include "redis.h"
+#include "bio.h"
 #include "sqlite3.h"
+#include "endianconv.h"
 
 #include <assert.h>
-
-#define REDIS_VTAB_MAGIC 12122012
+#include <ctype.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 
 /* BEGIN copy from t_zset.c */
@@ -92,19 +96,81 @@ void zuiClearIterator(zsetopsrc *op);
 robj *zuiObjectFromValue(zsetopval *val);
 /* END copy from t_zset.c */
 
+/* What a column of a virtual table holds, see vt_create(). */
+#define VT_COL_KEY     0    /* (key, val) tables: field, score or position */
+#define VT_COL_VAL     1    /* (key, val) tables: value or member */
+#define VT_COL_MEMBER  2    /* member of a set or sorted set */
+#define VT_COL_SCORE   3    /* score of a sorted set member */
+#define VT_COL_RANK    4    /* rank of a sorted set member, from 0 */
+#define VT_COL_FIELD   5    /* field of a hash */
+#define VT_COL_VALUE   6    /* value of a hash field, list element or string */
+#define VT_COL_POS     7    /* index of a list element, from 0 */
+#define VT_COL_HKEY    8    /* pattern tables: name of the hash of the row */
+#define VT_COL_HFIELD  9    /* pattern tables: a field of the hash */
+
+/* Affinity of a column, from its declared type like in SQLite. Values are
+ * converted to it by the virtual table itself: SQLite doesn't apply the
+ * affinity of virtual table columns. */
+#define VT_AFF_NONE    0
+#define VT_AFF_TEXT    1
+#define VT_AFF_NUMERIC 2
+#define VT_AFF_INTEGER 3
+#define VT_AFF_REAL    4
+
+typedef struct vt_column_def {
+    int role;
+    int affinity;
+    robj *field;            /* VT_COL_HFIELD only */
+} vt_column_def;
+
+/* A connection to the SQL DB, with what is attached to it. A client gets one
+ * the first time it runs SQL and gives it back to a pool when it is freed,
+ * see sqlClientConn(): the Redis vtabs of the connection stay connected
+ * from a client to the next. */
+typedef struct sqlConn {
+    sqlite3 *db;
+    redisClient *client;        /* Client using it, NULL in the pool */
+    redisClient *sql_client;    /* The "fake client" to query Redis from SQL */
+    list *vtabs;                /* Redis vtabs used by the statement */
+    long long lock_deadline;    /* ustime() the statement stops waiting for
+                                   busy keys, see VT_LOCK_TIMEOUT */
+    dict *vtab_tables;          /* Redis vtabs, by table name */
+} sqlConn;
+
 typedef struct redis_vtab {
     sqlite3_vtab base;
-    int magic;
-    robj *name;
+    robj *name;             /* the key, or the pattern of the keys */
+    int pattern;            /* one row per hash matching name */
+    int n_cols;
+    vt_column_def *cols;
+    sqlConn *conn;          /* SQLite connection of the table */
+    sds table;              /* in conn->vtab_tables */
+    /* State of the statement using the table, see vt_stmt_begin(). */
+    listNode *node;         /* in conn->vtabs, NULL between statements */
+    dict *locked;           /* keys locked by the table */
+    robj **rowids;          /* element of every row, by rowid */
+    long n_rowids, size_rowids;
+    long *deleted;          /* list: indexes of the elements deleted, sorted */
+    long n_deleted;
 } redis_vtab;
 
 typedef struct redis_cursor {
     sqlite3_vtab_cursor base;
-    long pos;
+    redis_vtab *vt;
+    long pos;               /* rows so far, the rowid */
+    long index;             /* index of the list element, rank in the zset */
     int eof;
-    int opened_first;
     robj *robj;
-    robj *name;
+    int has_max;            /* the scan stops past max, see vt_filter() */
+    int maxex;
+    int max_by_score;       /* max is a score, else an index */
+    double max;
+    struct {                /* pattern tables */
+        sds *names;         /* keys matching the pattern */
+        long count, next;
+        robj *key;          /* key of the current row */
+        int locked;         /* the cursor locked key */
+    } rows;
     union iter {
         struct {   /* REDIS_LIST */
             listTypeIterator *li;
@@ -112,6 +178,7 @@ typedef struct redis_cursor {
         } list;
         struct {   /* REDIS_HASH */
             hashTypeIterator *hi;
+            robj *field, *value;  /* when looked up by key, no iterator */
         } hash;
         struct {   /* REDIS_SET and REDIS_ZSET */
             zsetopsrc *zi;
@@ -120,31 +187,196 @@ typedef struct redis_cursor {
     } iter;
 } redis_cursor;
 
+/* vt_best_index() passes the constraints on one column it uses to
+ * vt_filter() as argv, idxNum tells which ones they are and the column
+ * (idxNum >> VT_IDX_COL_SHIFT). Depending on the column and the type of
+ * the key, vt_filter() seeks to them: the field of a hash, the score or
+ * rank of a sorted set, the position of a list element, the name of the
+ * hash of pattern tables. */
+#define VT_IDX_KEY_EQ    1
+#define VT_IDX_KEY_MIN   2
+#define VT_IDX_KEY_MINEX 4
+#define VT_IDX_KEY_MAX   8
+#define VT_IDX_KEY_MAXEX 16
+#define VT_IDX_COL_SHIFT 8
+
+/* Estimated cost of a full scan, for lack of the number of elements of the
+ * key when the statement is planned. Every bound of a range divides it. */
+#define VT_SCAN_COST 1000000.0
+
+/* A pattern table locks the hash of every row in turn, and writes lock
+ * the keys they modify, without waiting, see trylockDbKey(). A busy key is
+ * tried again every millisecond. The time a statement spends on busy keys,
+ * all of them together, is limited to this number of milliseconds, counted
+ * from the first busy key: past it, the statement fails on the next busy
+ * key, so that a pattern scan over many contended keys doesn't tie up its
+ * thread for long. */
+#define VT_LOCK_TIMEOUT 1000
+
+static void vt_stmt_end(redis_vtab *vt);
+
 static int vt_destructor(sqlite3_vtab *pVtab)
 {
     redis_vtab *p = (redis_vtab*)pVtab;
-    p->magic = 0;
+    int i;
+
+    if (p->node) {
+        listNode *node = p->node;
+
+        vt_stmt_end(p);
+        listDelNode(p->conn->vtabs,node);
+    }
+    if (p->table) {
+        if (dictFetchValue(p->conn->vtab_tables,p->table) == p)
+            dictDelete(p->conn->vtab_tables,p->table);
+        sdsfree(p->table);
+    }
     decrRefCount(p->name);
+    for (i = 0; i < p->n_cols; i++)
+        if (p->cols[i].field) decrRefCount(p->cols[i].field);
+    zfree(p->cols);
     sqlite3_free(p);
     return 0;
 }
 
+static int vt_affinity(const char *type) {
+    if (strcasestr(type,"int")) return VT_AFF_INTEGER;
+    if (strcasestr(type,"char") || strcasestr(type,"clob") ||
+        strcasestr(type,"text")) return VT_AFF_TEXT;
+    if (type[0] == '\0' || strcasestr(type,"blob")) return VT_AFF_NONE;
+    if (strcasestr(type,"real") || strcasestr(type,"floa") ||
+        strcasestr(type,"doub")) return VT_AFF_REAL;
+    return VT_AFF_NUMERIC;
+}
+
+/* Arguments of the module come verbatim, quotes included. */
+static sds vt_unquote(const char *arg) {
+    sds s = sdstrim(sdsnew(arg)," \t\r\n");
+    size_t len = sdslen(s);
+
+    if (len >= 2 && (s[0] == '\'' || s[0] == '"') && s[len-1] == s[0])
+        sdsrange(s,1,-2);
+    return s;
+}
+
+static const struct {
+    const char *name;
+    int role;
+    const char *type;       /* when none is declared */
+} vt_element_columns[] = {
+    {"member", VT_COL_MEMBER, ""},
+    {"score", VT_COL_SCORE, "REAL"},
+    {"rank", VT_COL_RANK, "INTEGER"},
+    {"field", VT_COL_FIELD, ""},
+    {"value", VT_COL_VALUE, ""},
+    {"pos", VT_COL_POS, "INTEGER"},
+    {NULL, 0, NULL}
+};
+
+/* Parse the column definitions of the module arguments and build the
+ * schema of the table:
+ *
+ *   USING redis(key)                      (key, val), see vt_column()
+ *   USING redis(key, col [type], ...)     columns named after what they
+ *                                         hold: member, score, rank (sorted
+ *                                         sets), field, value (hashes), pos,
+ *                                         value (lists)
+ *   USING redis('pattern', field [type], ...)
+ *                                         a row per hash matching pattern,
+ *                                         a column per field, plus the hidden
+ *                                         column _key, the name of the hash
+ *
+ * Returns NULL, with *err set, if a column is not valid. */
+static sds vt_parse_schema(redis_vtab *vt, int argc, const char *const*argv,
+                           char **err) {
+    sds schema = sdsnew("create table vtable (");
+    int i, j, first = 1;
+
+    if (argc <= 4) {
+        vt->n_cols = 2;
+        vt->cols = zcalloc(sizeof(vt_column_def)*2);
+        vt->cols[0].role = VT_COL_KEY;
+        vt->cols[1].role = VT_COL_VAL;
+        return sdscat(schema,"key, val)");
+    }
+
+    vt->n_cols = argc-4+vt->pattern;
+    vt->cols = zcalloc(sizeof(vt_column_def)*vt->n_cols);
+    if (vt->pattern) {
+        vt->cols[0].role = VT_COL_HKEY;
+        vt->cols[0].affinity = VT_AFF_TEXT;
+        schema = sdscat(schema,"_key TEXT HIDDEN");
+        first = 0;
+    }
+    for (i = 4; i < argc; i++) {
+        vt_column_def *col = vt->cols+(i-4+vt->pattern);
+        sds def = sdstrim(sdsnew(argv[i])," \t\r\n");
+        char *sp = def+strcspn(def," \t\r\n");
+        sds name, type;
+
+        type = sdstrim(sdsnew(sp)," \t\r\n");
+        *sp = '\0';
+        name = vt_unquote(def);
+        sdsfree(def);
+
+        if (vt->pattern) {
+            col->role = VT_COL_HFIELD;
+            col->field = createStringObject(name,sdslen(name));
+        } else {
+            for (j = 0; vt_element_columns[j].name; j++)
+                if (!strcasecmp(name,vt_element_columns[j].name)) break;
+            if (vt_element_columns[j].name == NULL) {
+                *err = sqlite3_mprintf("unknown column '%s', expected member, "
+                    "score, rank, field, value or pos", name);
+                sdsfree(name);
+                sdsfree(type);
+                sdsfree(schema);
+                return NULL;
+            }
+            col->role = vt_element_columns[j].role;
+            if (sdslen(type) == 0) type = sdscat(type,vt_element_columns[j].type);
+        }
+        col->affinity = vt_affinity(type);
+        schema = sdscatprintf(schema,"%s\"%s\" %s", first ? "" : ", ", name, type);
+        first = 0;
+        sdsfree(name);
+        sdsfree(type);
+    }
+    return sdscat(schema,")");
+}
+
 static int vt_create(sqlite3 *db, void *aux, int argc, const char *const*argv,
                      sqlite3_vtab **s3_vtab, char **err ) {
     redis_vtab* vt;
+    sds name, schema;
 
     if ((vt = (redis_vtab*) sqlite3_malloc(sizeof(*vt))) == NULL)
         return SQLITE_NOMEM;
+    memset(vt, 0, sizeof(*vt));
 
-    vt->magic = REDIS_VTAB_MAGIC;
     vt->base.zErrMsg = 0; /* SQLite insists on this */
-    vt->name = createObject(REDIS_STRING,sdsnew(argc > 3 ? argv[3] : argv[2]));
+    name = vt_unquote(argc > 3 ? argv[3] : argv[2]);
+    vt->pattern = argc > 4 && name[strcspn(name,"*?[")] != '\0';
+    vt->name = createObject(REDIS_STRING,name);
+    vt->conn = aux;
 
     /* declare the definition */
-    if (sqlite3_declare_vtab(db,"create table vtable (key text, val text)") != SQLITE_OK) {
+    if ((schema = vt_parse_schema(vt, argc, argv, err)) == NULL) {
+        vt_destructor((sqlite3_vtab*)vt);
+        return SQLITE_ERROR;
+    }
+    if (sqlite3_declare_vtab(db,schema) != SQLITE_OK) {
+        sdsfree(schema);
         vt_destructor((sqlite3_vtab*)vt);
         return SQLITE_ERROR;
     }
+    sdsfree(schema);
+
+    /* The keys a statement uses are found by the name of its tables, see
+     * sqlLockStmtKeys(). */
+    vt->table = sdsnew(argv[2]);
+    dictDelete(vt->conn->vtab_tables,vt->table);
+    dictAdd(vt->conn->vtab_tables,vt->table,vt);
 
     /* Success. Set *result and return */
     *s3_vtab = &vt->base;
@@ -165,31 +397,198 @@ static int vt_destroy(sqlite3_vtab *s3_vt) {
     return vt_destructor(s3_vt);
 }
 
+static int vt_error(redis_vtab *vt, int rc, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap,fmt);
+    sqlite3_free(vt->base.zErrMsg);
+    vt->base.zErrMsg = sqlite3_vmprintf(fmt,ap);
+    va_end(ap);
+    return rc;
+}
+
+/* Lock a key of db 0 for the client of the table, see VT_LOCK_TIMEOUT. */
+static int vt_lock_key(redis_vtab *vt, sds key, int mode) {
+    sqlConn *conn = vt->conn;
+
+    while (trylockDbKey(conn->client,&server.db[0],key,mode) == REDIS_ERR) {
+        long long now = ustime();
+
+        if (conn->lock_deadline == 0)
+            conn->lock_deadline = now + (long long)VT_LOCK_TIMEOUT*1000;
+        else if (now >= conn->lock_deadline)
+            return vt_error(vt,SQLITE_BUSY,"key %s is busy",key);
+        usleep(1000);
+    }
+    return SQLITE_OK;
+}
+
+/* Keys a table locks while the statement runs, in vt->locked, are released
+ * at the end of the statement: vt_stmt_begin() adds the table to the tables
+ * of the statement, conn->vtabs, the first time it locks a key or
+ * hands out a rowid for vt_update(), and sqlVtabsStatementEnd() releases
+ * them all. */
+static void vt_stmt_begin(redis_vtab *vt) {
+    if (vt->node) return;
+    listAddNodeTail(vt->conn->vtabs,vt);
+    vt->node = listLast(vt->conn->vtabs);
+    vt->locked = dictCreate(&setDictType,NULL);
+}
+
+/* Unlock the keys of the table and forget the rowids of the statement. */
+static void vt_stmt_end(redis_vtab *vt) {
+    dictIterator *di;
+    dictEntry *de;
+    long j;
+
+    di = dictGetIterator(vt->locked);
+    while ((de = dictNext(di)) != NULL) {
+        robj *key = dictGetKey(de);
+
+        unlockDbKey(vt->conn->client,&server.db[0],key->ptr);
+    }
+    dictReleaseIterator(di);
+    dictRelease(vt->locked);
+    for (j = 0; j < vt->n_rowids; j++) decrRefCount(vt->rowids[j]);
+    zfree(vt->rowids);
+    zfree(vt->deleted);
+    vt->locked = NULL;
+    vt->rowids = NULL;
+    vt->n_rowids = vt->size_rowids = 0;
+    vt->deleted = NULL;
+    vt->n_deleted = 0;
+    vt->node = NULL;
+}
+
+/* Called at the end of every statement. */
+static void sqlVtabsStatementEnd(redisClient *c) {
+    c->sql_conn->lock_deadline = 0;
+    while (listLength(c->sql_conn->vtabs)) {
+        listNode *node = listFirst(c->sql_conn->vtabs);
+
+        vt_stmt_end(listNodeValue(node));
+        listDelNode(c->sql_conn->vtabs,node);
+    }
+}
+
+/* Lock a key until the end of the statement, unless the statement already
+ * holds it, see sqlLockStmtKeys(). A key held shared, for instance the row
+ * of a pattern table being read, is upgraded for a write: the lock is then
+ * kept until the end of the statement, and not released with the row, see
+ * vt_release_row(). */
+static int vt_lock_stmt_key(redis_vtab *vt, robj *key, int mode) {
+    int rc, held;
+
+    vt_stmt_begin(vt);
+    if (!server.locking_mode) return SQLITE_OK;
+    held = dictFind(vt->locked,key) != NULL;
+    if (held && mode == REDIS_KEYLOCK_SHARED) return SQLITE_OK;
+    if (!held && keyIsHeldBy(vt->conn->client,&server.db[0],key->ptr)) {
+        if (mode == REDIS_KEYLOCK_SHARED) return SQLITE_OK;
+        held = !vt->pattern; /* locked by sqlLockStmtKeys() */
+    }
+    if ((rc = vt_lock_key(vt,key->ptr,mode)) != SQLITE_OK)
+        return rc;
+    if (!held) {
+        incrRefCount(key);
+        dictAdd(vt->locked,key,NULL);
+    }
+    return SQLITE_OK;
+}
+
 static int vt_open(sqlite3_vtab *s3_vt, sqlite3_vtab_cursor **s3_cur) {
     redis_vtab *vt = (redis_vtab*)s3_vt;
     redis_cursor *cur;
 
+    /* The key would not stay locked between two FETCH, see SQLCURSOR. */
+    if (vt->conn->client->sql_cursor_fetch) {
+        sqlite3_free(s3_vt->zErrMsg);
+        s3_vt->zErrMsg = sqlite3_mprintf("statements over Redis keys can't be used with a cursor, use SQL");
+        return SQLITE_ERROR;
+    }
+
+    /* The key was locked before the statement ran unless SQLite didn't
+     * report the table to sqlAuthorizer(): lock it now. */
+    if (!vt->pattern) {
+        int rc = vt_lock_stmt_key(vt, vt->name, vt->conn->client->sql_stmt_writes ?
+                                  REDIS_KEYLOCK_EXCLUSIVE : REDIS_KEYLOCK_SHARED);
+        if (rc != SQLITE_OK) return rc;
+    }
+
     if (!(cur = (redis_cursor*)sqlite3_malloc(sizeof(redis_cursor)))) 
         return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(*cur));
 
-    cur->name = vt->name;
-    cur->pos = 0;
+    cur->vt = vt;
+    cur->eof = 1;
 
     *s3_cur = (sqlite3_vtab_cursor*)cur;
     return SQLITE_OK;
 }
 
-static int vt_close(sqlite3_vtab_cursor *s3_cur) {
-    redis_cursor *cur = (redis_cursor*)s3_cur;
+/* Return true if a table of the statement locked the key until the end of
+ * the statement. */
+static int vt_stmt_holds(sqlConn *conn, robj *key) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(conn->vtabs,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        redis_vtab *vt = listNodeValue(ln);
+
+        if (dictFind(vt->locked,key)) return 1;
+    }
+    return 0;
+}
+
+/* Unlock the hash of the current row of a pattern table, unless the row
+ * was written and its key is now locked until the end of the statement. */
+static void vt_release_row(redis_cursor *cur) {
+    if (cur->rows.key) {
+        if (cur->rows.locked && !vt_stmt_holds(cur->vt->conn,cur->rows.key))
+            unlockDbKey(cur->vt->conn->client,&server.db[0],cur->rows.key->ptr);
+        decrRefCount(cur->rows.key);
+    }
+    cur->rows.key = NULL;
+    cur->rows.locked = 0;
+    cur->robj = NULL;
+}
 
-    if (cur->robj) {
+/* Release the iterator of the cursor. This happens at the end of the scan,
+ * and before a new one since vt_filter() is called again for every row of
+ * the outer table of a join. */
+static void vt_release(redis_cursor *cur) {
+    long j;
+
+    if (cur->vt->pattern) {
+        vt_release_row(cur);
+        for (j = 0; j < cur->rows.count; j++) sdsfree(cur->rows.names[j]);
+        zfree(cur->rows.names);
+        memset(&cur->rows, 0, sizeof(cur->rows));
+    } else if (cur->robj) {
         if (cur->robj->type == REDIS_LIST) {
+            if (cur->iter.list.li) listTypeReleaseIterator(cur->iter.list.li);
             zfree(cur->iter.list.le);
+        } else if (cur->robj->type == REDIS_HASH) {
+            if (cur->iter.hash.hi) hashTypeReleaseIterator(cur->iter.hash.hi);
+            if (cur->iter.hash.field) decrRefCount(cur->iter.hash.field);
+            if (cur->iter.hash.value) decrRefCount(cur->iter.hash.value);
         } else if (cur->robj->type == REDIS_ZSET || cur->robj->type == REDIS_SET) {
+            zuiClearIterator(cur->iter.zset.zi);
+            if (cur->iter.zset.zv->flags & OPVAL_DIRTY_ROBJ)
+                decrRefCount(cur->iter.zset.zv->ele);
             zfree(cur->iter.zset.zi);
             zfree(cur->iter.zset.zv);
-        } /* nothing to do for REDIS_HASH */
+        } /* nothing to do for REDIS_STRING */
     }
+    memset(&cur->iter, 0, sizeof(cur->iter));
+    cur->robj = NULL;
+}
+
+static int vt_close(sqlite3_vtab_cursor *s3_cur) {
+    redis_cursor *cur = (redis_cursor*)s3_cur;
+
+    vt_release(cur);
     sqlite3_free(cur);
     return SQLITE_OK;
 }
@@ -198,168 +597,959 @@ static int vt_eof(sqlite3_vtab_cursor *cur) {
     return ((redis_cursor*)cur)->eof;
 }
 
+/* Lock the hash of the next row of a pattern table and look it up, skipping
+ * the keys deleted since vt_filter() or that are not hashes. */
+static int vt_next_row(redis_cursor *cur) {
+    redisClient *c = cur->vt->conn->client;
+    redisDb *db = &server.db[0];
+
+    vt_release_row(cur);
+    while (cur->rows.next < cur->rows.count) {
+        sds name = cur->rows.names[cur->rows.next++];
+        robj *o;
+
+        cur->rows.key = createStringObject(name,sdslen(name));
+        if (server.locking_mode && !keyIsHeldBy(c,db,name)) {
+            if (vt_lock_key(cur->vt,name,REDIS_KEYLOCK_SHARED) != SQLITE_OK) {
+                decrRefCount(cur->rows.key);
+                cur->rows.key = NULL;
+                return SQLITE_BUSY;
+            }
+            cur->rows.locked = 1;
+        }
+        if ((o = lookupKeyRead(db,cur->rows.key)) != NULL && o->type == REDIS_HASH) {
+            cur->robj = o;
+            cur->pos += 1;
+            return SQLITE_OK;
+        }
+        vt_release_row(cur);
+    }
+    cur->eof = 1;
+    return SQLITE_OK;
+}
+
 static int vt_next(sqlite3_vtab_cursor *s3_cur) {
     redis_cursor *cur = (redis_cursor*)s3_cur;
+    double score = 0;
+
+    if (cur->vt->pattern) return vt_next_row(cur);
 
     if (cur->robj->type == REDIS_LIST) {
-        if (!listTypeNext(cur->iter.list.li, cur->iter.list.le)) {
+        if (!listTypeNext(cur->iter.list.li, cur->iter.list.le))
             cur->eof = 1;
-            listTypeReleaseIterator(cur->iter.list.li);
-            return SQLITE_OK;
-        }
     } else if (cur->robj->type == REDIS_HASH) {
-        if (hashTypeNext(cur->iter.hash.hi) == REDIS_ERR) {
+        if (cur->iter.hash.hi == NULL)
+            cur->eof = cur->pos; /* looked up by key: a single row */
+        else if (hashTypeNext(cur->iter.hash.hi) == REDIS_ERR)
             cur->eof = 1;
-            hashTypeReleaseIterator(cur->iter.hash.hi);
-            return SQLITE_OK;
-        }
     } else if (cur->robj->type == REDIS_ZSET || cur->robj->type == REDIS_SET) {
-        if (!zuiNext(cur->iter.zset.zi, cur->iter.zset.zv)) {
+        if (!zuiNext(cur->iter.zset.zi, cur->iter.zset.zv))
             cur->eof = 1;
-            zuiClearIterator(cur->iter.zset.zi);
-            return SQLITE_OK;
-        }
+        score = cur->iter.zset.zv->score;
     } else if (cur->robj->type == REDIS_STRING)
         cur->eof = cur->pos;
 
+    /* The index of the first row is set by vt_filter(). */
+    if (cur->pos > 0) cur->index++;
+
+    /* Past the upper bound of the range: no more rows can match. */
+    if (!cur->eof && cur->has_max) {
+        double key = cur->max_by_score ? score : cur->index;
+
+        if (cur->maxex ? key >= cur->max : key > cur->max) cur->eof = 1;
+    }
+
+    if (cur->eof) {
+        vt_release(cur);
+        return SQLITE_OK;
+    }
     cur->pos += 1;
     return SQLITE_OK;
 }
 
+/* Results with the affinity of the column. 'zerocopy' tells that the string
+ * belongs to the Redis object, which is locked for the whole statement: it
+ * is passed to SQLite as SQLITE_STATIC. */
+static void vt_result_ll(sqlite3_context *ctx, long long ll, int aff) {
+    if (aff == VT_AFF_TEXT) {
+        char buf[32];
+        int len = ll2string(buf,sizeof(buf),ll);
+
+        sqlite3_result_text(ctx,buf,len,SQLITE_TRANSIENT);
+    } else if (aff == VT_AFF_REAL)
+        sqlite3_result_double(ctx,(double)ll);
+    else
+        sqlite3_result_int64(ctx,ll);
+}
+
+static void vt_result_double(sqlite3_context *ctx, double d, int aff) {
+    if (aff == VT_AFF_TEXT) {
+        char buf[128];
+        int len = snprintf(buf,sizeof(buf),"%.17g",d);
+
+        sqlite3_result_text(ctx,buf,len,SQLITE_TRANSIENT);
+    } else if ((aff == VT_AFF_INTEGER || aff == VT_AFF_NUMERIC) &&
+               d == (long long)d)
+        sqlite3_result_int64(ctx,(long long)d);
+    else
+        sqlite3_result_double(ctx,d);
+}
+
+static void vt_result_str(sqlite3_context *ctx, char *s, size_t len,
+                          int aff, int zerocopy) {
+    if (aff != VT_AFF_NONE && aff != VT_AFF_TEXT) {
+        long long ll;
+        double d;
+        char buf[128], *eptr;
+
+        if (aff != VT_AFF_REAL && string2ll(s,len,&ll)) {
+            sqlite3_result_int64(ctx,ll);
+            return;
+        }
+        if (len > 0 && len < sizeof(buf) && !isspace(s[0])) {
+            memcpy(buf,s,len);
+            buf[len] = '\0';
+            d = strtod(buf,&eptr);
+            if (*eptr == '\0' && !isnan(d)) {
+                vt_result_double(ctx,d,aff);
+                return;
+            }
+        }
+    }
+    sqlite3_result_text(ctx,s,len,zerocopy ? SQLITE_STATIC : SQLITE_TRANSIENT);
+}
+
+static void vt_result_object(sqlite3_context *ctx, robj *o, int aff,
+                             int zerocopy) {
+    if (o->encoding == REDIS_ENCODING_RAW)
+        vt_result_str(ctx,o->ptr,sdslen(o->ptr),aff,zerocopy);
+    else
+        vt_result_ll(ctx,(long)o->ptr,aff);
+}
+
+/* A field of the hash of the current row of a pattern table, or NULL. */
+static void vt_column_hash_field(redis_cursor *cur, sqlite3_context *ctx,
+                                 vt_column_def *col) {
+    robj *o = cur->robj;
+
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+
+        if (hashTypeGetFromZiplist(o,col->field,&vstr,&vlen,&vll) == -1)
+            sqlite3_result_null(ctx);
+        else if (vstr)
+            vt_result_str(ctx,(char*)vstr,vlen,col->affinity,0);
+        else
+            vt_result_ll(ctx,vll,col->affinity);
+    } else {
+        robj *value;
+
+        if (hashTypeGetFromHashTable(o,col->field,&value) == -1)
+            sqlite3_result_null(ctx);
+        else
+            vt_result_object(ctx,value,col->affinity,0);
+    }
+}
+
 static int vt_column(sqlite3_vtab_cursor *s3_cur, sqlite3_context *ctx, int i)
 {
     redis_cursor *cur = (redis_cursor *) s3_cur;
-    robj *o;
+    vt_column_def *col = cur->vt->cols+i;
+    int type = cur->robj->type, role = col->role, aff = col->affinity;
+    robj *o = NULL;
 
-    /* If the object is encoded as a ziplist, we get a copy, which we
-     * must decref right here (which causes the memory to be freed
-     * immediately). For other types of encoding, we should get an
-     * actual memory pointer, zero-copy. We use a trick here - examine
-     * the refcount. If it is greater than 1, then we have a zero-copy
-     * object, and it is safe to pass it to SQLite as SQLITE_STATIC.
-     * Otherwise (refcount is 1), means we have a freshly created copy
-     * which we must pass as SQLITE_TRANSIENT (causing SQLite to make
-     * a second copy!) then free. Curiously, we can only have either
-     * zero-copy or double-copy behaviour. */
-
-    if (cur->robj->type == REDIS_STRING) {
-        if (i == 0)
-            sqlite3_result_int(ctx, cur->pos);
+    /* The objects we get from the iterators are either a reference to the
+     * element (refcount greater than 1), zero-copy, or a fresh copy of an
+     * element of a ziplist, which SQLite has to copy again. */
+
+    if (role == VT_COL_HKEY) {
+        o = cur->rows.key;
+        sqlite3_result_text(ctx,o->ptr,sdslen(o->ptr),SQLITE_TRANSIENT);
+        return SQLITE_OK;
+    } else if (role == VT_COL_HFIELD) {
+        vt_column_hash_field(cur, ctx, col);
+        return SQLITE_OK;
+    }
+
+    /* (key, val) tables: the key is the field of a hash, the score of a
+     * sorted set and the position of a list element from 1. */
+    if (role == VT_COL_KEY) {
+        if (type == REDIS_HASH) role = VT_COL_FIELD;
+        else if (type == REDIS_ZSET || type == REDIS_SET) role = VT_COL_SCORE;
         else {
-            o = cur->robj;
-            if (o->encoding == REDIS_ENCODING_RAW)
-                sqlite3_result_text(ctx,o->ptr,sdslen(o->ptr),SQLITE_STATIC);
-            else
-                sqlite3_result_int64(ctx,(long)o->ptr);
+            sqlite3_result_int64(ctx,cur->index+1);
+            return SQLITE_OK;
         }
-    } else if (cur->robj->type == REDIS_LIST) {
-        if (i == 0)
-            sqlite3_result_int(ctx, cur->pos);
-        else {
+    } else if (role == VT_COL_VAL) {
+        role = (type == REDIS_ZSET || type == REDIS_SET) ? VT_COL_MEMBER : VT_COL_VALUE;
+    }
+
+    switch(type) {
+    case REDIS_STRING:
+        if (role == VT_COL_VALUE) vt_result_object(ctx,cur->robj,aff,1);
+        else sqlite3_result_null(ctx);
+        break;
+    case REDIS_LIST:
+        if (role == VT_COL_POS) {
+            vt_result_ll(ctx,cur->index,aff);
+        } else if (role == VT_COL_VALUE) {
             o = listTypeGet(cur->iter.list.le);
-            if (o->encoding == REDIS_ENCODING_RAW)
-                sqlite3_result_text(ctx,o->ptr,sdslen(o->ptr),
-                                    cur->robj->refcount > 1 ?
-                                    SQLITE_STATIC : SQLITE_TRANSIENT);
-            else
-                sqlite3_result_int64(ctx,(long)o->ptr);
+            vt_result_object(ctx,o,aff,o->refcount > 1);
+            decrRefCount(o);
+        } else
+            sqlite3_result_null(ctx);
+        break;
+    case REDIS_HASH:
+        if (role != VT_COL_FIELD && role != VT_COL_VALUE) {
+            sqlite3_result_null(ctx);
+        } else if (cur->iter.hash.hi == NULL) {
+            o = (role == VT_COL_FIELD) ? cur->iter.hash.field : cur->iter.hash.value;
+            vt_result_object(ctx,o,aff,0);
+        } else {
+            o = hashTypeCurrentObject(cur->iter.hash.hi, role == VT_COL_FIELD ?
+                                      REDIS_HASH_KEY : REDIS_HASH_VALUE);
+            vt_result_object(ctx,o,aff,o->refcount > 1);
             decrRefCount(o);
         }
-    } else if (cur->robj->type == REDIS_HASH) {
-        if (i == 0)
-            o = hashTypeCurrentObject(cur->iter.hash.hi, REDIS_HASH_KEY);
-        else
-            o = hashTypeCurrentObject(cur->iter.hash.hi, REDIS_HASH_VALUE);
-        if (o->encoding == REDIS_ENCODING_RAW)
-            sqlite3_result_text(ctx,o->ptr,sdslen(o->ptr),
-                                cur->robj->refcount > 1 ?
-                                SQLITE_STATIC : SQLITE_TRANSIENT);
-        else
-            sqlite3_result_int64(ctx,(long)o->ptr);
-        decrRefCount(o);
+        break;
+    case REDIS_SET:
+    case REDIS_ZSET:
+        if (role == VT_COL_SCORE) {
+            vt_result_double(ctx,cur->iter.zset.zv->score,aff);
+        } else if (role == VT_COL_RANK && type == REDIS_ZSET) {
+            vt_result_ll(ctx,cur->index,aff);
+        } else if (role == VT_COL_MEMBER) {
+            zsetopval *zv = cur->iter.zset.zv;
+
+            /* no need for decrRefCount, zuiNext will do that */
+            if (zv->ele) {
+                vt_result_object(ctx,zv->ele,aff,zv->ele->refcount > 1);
+            } else if (zv->estr) {
+                vt_result_str(ctx,(char*)zv->estr,zv->elen,aff,1);
+            } else {
+                vt_result_ll(ctx,zv->ell,aff);
+            }
+        } else
+            sqlite3_result_null(ctx);
+        break;
+    }
+    return SQLITE_OK;
+}
 
-    } else if (cur->robj->type == REDIS_ZSET || cur->robj->type == REDIS_SET) {
-        if (i == 0)
-            sqlite3_result_double(ctx, cur->iter.zset.zv->score);
-        else {
-            o = zuiObjectFromValue(cur->iter.zset.zv);
-            if (o->encoding == REDIS_ENCODING_RAW)
-                sqlite3_result_text(ctx,o->ptr,sdslen(o->ptr),
-                                    cur->robj->refcount > 1 ?
-                                    SQLITE_STATIC : SQLITE_TRANSIENT);
-            else
-                sqlite3_result_int64(ctx,(long)o->ptr);
-            /* no need for decrRefCount(o), zuiNext will do that */
+/* The element of the current row, what identifies it for vt_update(). */
+static robj *vt_current_element(redis_cursor *cur) {
+    zsetopval *zv;
+    robj *o;
+
+    if (cur->vt->pattern) {
+        incrRefCount(cur->rows.key);
+        return cur->rows.key;
+    }
+    switch(cur->robj->type) {
+    case REDIS_LIST:
+        return createStringObjectFromLongLong(cur->index);
+    case REDIS_HASH:
+        if (cur->iter.hash.hi == NULL) {
+            incrRefCount(cur->iter.hash.field);
+            return cur->iter.hash.field;
+        }
+        return hashTypeCurrentObject(cur->iter.hash.hi,REDIS_HASH_KEY);
+    case REDIS_SET:
+    case REDIS_ZSET:
+        zv = cur->iter.zset.zv;
+        if (zv->ele) {
+            incrRefCount(zv->ele);
+            return zv->ele;
+        } else if (zv->estr) {
+            o = createStringObject((char*)zv->estr,zv->elen);
+            return tryObjectEncoding(o);
         }
+        return createStringObjectFromLongLong(zv->ell);
     }
-    return SQLITE_OK;
+    return createStringObject("",0); /* REDIS_STRING, a single row */
 }
 
 static int vt_rowid(sqlite3_vtab_cursor *s3_cur, sqlite_int64 *p_rowid) {
-    /* Just use the current row count as the rowid. */
-    *p_rowid = ((redis_cursor*)s3_cur)->pos;
+    redis_cursor *cur = (redis_cursor*)s3_cur;
+    redis_vtab *vt = cur->vt;
+
+    /* Just use the current row count as the rowid, unless the statement
+     * writes: the rows it updates or deletes are then looked up by rowid,
+     * after the scan, so every rowid is a new one. */
+    if (!vt->conn->client->sql_stmt_writes) {
+        *p_rowid = cur->pos;
+        return SQLITE_OK;
+    }
+    vt_stmt_begin(vt);
+    if (vt->n_rowids == vt->size_rowids) {
+        vt->size_rowids = vt->size_rowids ? vt->size_rowids*2 : 64;
+        vt->rowids = zrealloc(vt->rowids,sizeof(robj*)*vt->size_rowids);
+    }
+    vt->rowids[vt->n_rowids++] = vt_current_element(cur);
+    *p_rowid = vt->n_rowids;
     return SQLITE_OK;
 }
 
+/* Store in *d the value of a bound of a column if it is a number: SQLite
+ * compares any number as less than any text, so a text bound can't be used
+ * to seek a position or a score. */
+static int vt_numeric_bound(sqlite3_value *v, double *d) {
+    int type = sqlite3_value_type(v);
+
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) return 0;
+    *d = sqlite3_value_double(v);
+    return 1;
+}
+
+/* Look up the field of a hash equal to the constraint. The field is
+ * encoded the way the hash returns it while iterating, so that SQLite
+ * compares it with the constraint exactly like in a scan. */
+static void vt_filter_hash_field(redis_cursor *cur, sqlite3_value *v) {
+    robj *field;
+    double d = sqlite3_value_double(v);
+
+    if (sqlite3_value_type(v) == SQLITE_NULL) return;
+    if (sqlite3_value_type(v) == SQLITE_FLOAT && d == (long long)d)
+        field = createStringObjectFromLongLong((long long)d);
+    else
+        field = createStringObject((char*)sqlite3_value_text(v),sqlite3_value_bytes(v));
+    field = tryObjectEncoding(field);
+
+    if ((cur->iter.hash.value = hashTypeGetObject(cur->robj, field)) != NULL) {
+        cur->iter.hash.field = field;
+        cur->pos = 1;
+        cur->eof = 0;
+    } else
+        decrRefCount(field);
+}
+
+/* Collect the names of the keys matching the pattern of the table, the
+ * rows are looked up one at a time by vt_next_row(). */
+static void vt_filter_pattern(redis_cursor *cur, int idxNum,
+                              sqlite3_value **argv) {
+    redisDb *db = &server.db[0];
+    sds pattern = cur->vt->name->ptr;
+    long size = 0;
+    int j;
+
+    /* A key outside of the pattern isn't a row of the table. */
+    if ((idxNum & VT_IDX_KEY_EQ) &&
+        cur->vt->cols[idxNum >> VT_IDX_COL_SHIFT].role == VT_COL_HKEY)
+    {
+        const char *key;
+        int len;
+
+        if (sqlite3_value_type(argv[0]) == SQLITE_NULL) return;
+        key = (const char*)sqlite3_value_text(argv[0]);
+        len = sqlite3_value_bytes(argv[0]);
+        if (!stringmatchlen(pattern,sdslen(pattern),key,len,0)) return;
+        cur->rows.names = zmalloc(sizeof(sds));
+        cur->rows.names[0] = sdsnewlen(key,len);
+        cur->rows.count = 1;
+        return;
+    }
+
+    for (j = 0; j < REDIS_DB_SEGMENTS; j++) {
+        redisDbSegment *seg = db->segments+j;
+        dictIterator *di;
+        dictEntry *de;
+
+        pthread_mutex_lock(&seg->lock);
+        di = dictGetSafeIterator(seg->dict);
+        while ((de = dictNext(di)) != NULL) {
+            sds key = dictGetKey(de);
+
+            if (!stringmatchlen(pattern,sdslen(pattern),key,sdslen(key),0))
+                continue;
+            if (cur->rows.count == size) {
+                size = size ? size*2 : 16;
+                cur->rows.names = zrealloc(cur->rows.names,sizeof(sds)*size);
+            }
+            cur->rows.names[cur->rows.count++] = sdsdup(key);
+        }
+        dictReleaseIterator(di);
+        pthread_mutex_unlock(&seg->lock);
+    }
+}
+
+/* Seek a sorted set to the first element in range, by score like
+ * ZRANGEBYSCORE or by rank like ZRANGE, setting the rank of the element. */
+static void vt_filter_zset(redis_cursor *cur, zrangespec *range, int by_score,
+                           long start) {
+    zsetopsrc *zi = cur->iter.zset.zi;
+
+    if (zi->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = zi->iter.zset.zl.zl, *eptr, *sptr;
+
+        if (by_score) {
+            eptr = zzlFirstInRange(zl,*range);
+            /* the ziplist is small, walk it to find the rank */
+            start = 0;
+            if (eptr) {
+                unsigned char *p = ziplistIndex(zl,0), *s = ziplistNext(zl,p);
+
+                while (p != eptr) {
+                    zzlNext(zl,&p,&s);
+                    start++;
+                }
+            }
+        } else
+            eptr = ziplistIndex(zl,2*start);
+        sptr = eptr ? ziplistNext(zl,eptr) : NULL;
+        zi->iter.zset.zl.eptr = eptr;
+        zi->iter.zset.zl.sptr = sptr;
+    } else {
+        zskiplist *zsl = zi->iter.zset.sl.zs->zsl;
+        zskiplistNode *node;
+
+        if (by_score) {
+            node = zslFirstInRange(zsl,*range);
+            if (node) start = zslGetRank(zsl,node->score,node->obj)-1;
+        } else
+            node = zslGetElementByRank(zsl,start+1);
+        zi->iter.zset.sl.node = node;
+    }
+    cur->index = start;
+}
+
+/* Constraints pushed down by vt_best_index() are only used to skip the
+ * elements that can't match, SQLite still checks them on every row. */
 static int vt_filter( sqlite3_vtab_cursor *s3_cur,
                       int idxNum, const char *idxStr,
                       int argc, sqlite3_value **argv ) {
     redis_cursor *cur = (redis_cursor*)s3_cur;
+    int role = cur->vt->cols[idxNum >> VT_IDX_COL_SHIFT].role;
+    zrangespec range;
+    int has_min = 0, has_max = 0, j = 0;
+    long start = 0, end = 0;
+
+    vt_release(cur);
+    cur->pos = 0;
+    cur->index = 0;
+    cur->eof = 1;
+    cur->has_max = 0;
+
+    if (cur->vt->pattern) {
+        vt_filter_pattern(cur, idxNum, argv);
+        cur->eof = 0;
+        return vt_next_row(cur);
+    }
 
-    if ((cur->robj = lookupKeyRead(&server.db[0], cur->name)) == NULL) {
+    if ((cur->robj = lookupKeyRead(&server.db[0], cur->vt->name)) == NULL) {
         /* non-existent redis object will simply result in an empty set */
-        cur->eof = 1;
         return SQLITE_OK;
     }
-    cur->eof = 0;
+
+    range.min = -HUGE_VAL; range.max = HUGE_VAL;
+    range.minex = range.maxex = 0;
+    if (idxNum & VT_IDX_KEY_EQ) {
+        if (vt_numeric_bound(argv[j], &range.min)) {
+            range.max = range.min;
+            has_min = has_max = 1;
+        }
+        j++;
+    } else {
+        if (idxNum & VT_IDX_KEY_MIN) {
+            has_min = vt_numeric_bound(argv[j++], &range.min);
+            range.minex = (idxNum & VT_IDX_KEY_MINEX) != 0;
+        }
+        if (idxNum & VT_IDX_KEY_MAX) {
+            has_max = vt_numeric_bound(argv[j++], &range.max);
+            range.maxex = (idxNum & VT_IDX_KEY_MAXEX) != 0;
+        }
+    }
+
+    /* Positions and ranks are integers from 0 (from 1 for the key column
+     * of a list): the first and last one in range. */
+    if (role == VT_COL_KEY || role == VT_COL_POS || role == VT_COL_RANK) {
+        int base = (role == VT_COL_KEY);
+
+        if (has_min && range.min-base > 0)
+            start = (long)(range.minex ? floor(range.min)+1 : ceil(range.min))-base;
+        if (has_max)
+            end = (long)(range.maxex ? ceil(range.max)-1 : floor(range.max))-base;
+    }
 
     if (cur->robj->type == REDIS_LIST) {
+        if (role != VT_COL_KEY && role != VT_COL_POS) has_min = has_max = 0;
+        if (has_min && start >= listTypeLength(cur->robj)) goto empty;
+        if (!has_min) start = 0;
+        cur->index = start;
+        cur->has_max = has_max;
+        cur->max = end;
         cur->iter.list.le = zmalloc(sizeof(listTypeEntry));
-        cur->iter.list.li = listTypeInitIterator(cur->robj,0,REDIS_TAIL);
+        cur->iter.list.li = listTypeInitIterator(cur->robj,start,REDIS_TAIL);
     } else if (cur->robj->type == REDIS_ZSET || cur->robj->type == REDIS_SET) {
-        cur->iter.zset.zi = zcalloc(sizeof(zsetopsrc));
+        zsetopsrc *zi;
+        int by_score = (role == VT_COL_KEY || role == VT_COL_SCORE);
+
+        cur->iter.zset.zi = zi = zcalloc(sizeof(zsetopsrc));
         cur->iter.zset.zv = zcalloc(sizeof(zsetopval));
-        cur->iter.zset.zi->subject = cur->robj;
-        cur->iter.zset.zi->type = cur->robj->type;
-        cur->iter.zset.zi->encoding = cur->robj->encoding;
-        zuiInitIterator(cur->iter.zset.zi);
-    } else if (cur->robj->type == REDIS_HASH)
+        zi->subject = cur->robj;
+        zi->type = cur->robj->type;
+        zi->encoding = cur->robj->encoding;
+        zuiInitIterator(zi);
+
+        /* The score of the members of a set is always 1, no seek there. */
+        if (cur->robj->type == REDIS_ZSET && (by_score || role == VT_COL_RANK) &&
+            (has_min || has_max))
+        {
+            if (!by_score && has_min && start >= zsetLength(cur->robj)) goto empty;
+            vt_filter_zset(cur, &range, by_score, has_min ? start : 0);
+            cur->has_max = has_max;
+            cur->max_by_score = by_score;
+            cur->maxex = by_score && range.maxex;
+            cur->max = by_score ? range.max : end;
+        }
+    } else if (cur->robj->type == REDIS_HASH) {
+        if ((idxNum & VT_IDX_KEY_EQ) &&
+            (role == VT_COL_KEY || role == VT_COL_FIELD))
+        {
+            vt_filter_hash_field(cur, argv[0]);
+            if (cur->eof) goto empty;
+            return SQLITE_OK;
+        }
         cur->iter.hash.hi = hashTypeInitIterator(cur->robj);
-    /* nothing to do for other types */
+    }
+    /* nothing to do for other types, a string is a single row */
+
+    cur->eof = 0;
 
     /* Move cursor to first row. */
     return vt_next(s3_cur);
+
+empty:
+    vt_release(cur);
+    cur->eof = 1;
+    return SQLITE_OK;
 }
 
+/* Tell SQLite which constraints can be pushed down to vt_filter():
+ * equality, or a range with a lower and/or upper bound, on one of the
+ * columns it can seek. What vt_filter() does with them depends on the type
+ * of the key, which is not known at this point, so SQLite is left to check
+ * them anyway (omit is not set). */
 static int vt_best_index(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    redis_vtab *vt = (redis_vtab*)tab;
+    int i, col = -1, eq = -1, min = -1, max = -1, argc = 0;
+
+    for (i = 0; i < pIdxInfo->nConstraint; i++) {
+        const struct sqlite3_index_constraint *cons = &pIdxInfo->aConstraint[i];
+        int role;
+
+        if (!cons->usable || cons->iColumn < 0) continue;
+        role = vt->cols[cons->iColumn].role;
+        if (role == VT_COL_VAL || role == VT_COL_VALUE ||
+            role == VT_COL_MEMBER || role == VT_COL_HFIELD) continue;
+        if ((role == VT_COL_FIELD || role == VT_COL_HKEY) &&
+            cons->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+
+        /* An equality is the best we can get, else the range of the first
+         * column with one. */
+        if (cons->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            if (eq == -1) {
+                eq = i;
+                col = cons->iColumn;
+            }
+            continue;
+        }
+        if (eq != -1 || (col != -1 && col != cons->iColumn)) continue;
+        col = cons->iColumn;
+        switch (cons->op) {
+        case SQLITE_INDEX_CONSTRAINT_GT:
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            min = i;
+            break;
+        case SQLITE_INDEX_CONSTRAINT_LT:
+        case SQLITE_INDEX_CONSTRAINT_LE:
+            max = i;
+            break;
+        }
+    }
+
+    pIdxInfo->idxNum = 0;
+    pIdxInfo->estimatedCost = VT_SCAN_COST;
+    if (col == -1) return SQLITE_OK;
+    pIdxInfo->idxNum = col << VT_IDX_COL_SHIFT;
+    if (eq != -1) {
+        pIdxInfo->idxNum |= VT_IDX_KEY_EQ;
+        pIdxInfo->aConstraintUsage[eq].argvIndex = ++argc;
+        pIdxInfo->estimatedCost = 10;
+        return SQLITE_OK;
+    }
+    if (min != -1) {
+        pIdxInfo->idxNum |= VT_IDX_KEY_MIN;
+        if (pIdxInfo->aConstraint[min].op == SQLITE_INDEX_CONSTRAINT_GT)
+            pIdxInfo->idxNum |= VT_IDX_KEY_MINEX;
+        pIdxInfo->aConstraintUsage[min].argvIndex = ++argc;
+        pIdxInfo->estimatedCost /= 4;
+    }
+    if (max != -1) {
+        pIdxInfo->idxNum |= VT_IDX_KEY_MAX;
+        if (pIdxInfo->aConstraint[max].op == SQLITE_INDEX_CONSTRAINT_LT)
+            pIdxInfo->idxNum |= VT_IDX_KEY_MAXEX;
+        pIdxInfo->aConstraintUsage[max].argvIndex = ++argc;
+        pIdxInfo->estimatedCost /= 4;
+    }
     return SQLITE_OK;
 }
 
-static sqlite3_module redis_module =
-{
-    0,              /* iVersion */
-    vt_create,      /* xCreate       - create a vtable */
-    vt_connect,     /* xConnect      - associate a vtable with a connection */
-    vt_best_index,  /* xBestIndex    - best index */
-    vt_disconnect,  /* xDisconnect   - disassociate a vtable with a connection */
-    vt_destroy,     /* xDestroy      - destroy a vtable */
-    vt_open,        /* xOpen         - open a cursor */
-    vt_close,       /* xClose        - close a cursor */
-    vt_filter,      /* xFilter       - configure scan constraints */
-    vt_next,        /* xNext         - advance a cursor */
-    vt_eof,         /* xEof          - inidicate end of result set*/
-    vt_column,      /* xColumn       - read data */
-    vt_rowid,       /* xRowid        - read data */
-    NULL,           /* xUpdate       - write data */
-    NULL,           /* xBegin        - begin transaction */
-    NULL,           /* xSync         - sync transaction */
-    NULL,           /* xCommit       - commit transaction */
-    NULL,           /* xRollback     - rollback transaction */
-    NULL,           /* xFindFunction - function overloading */
-};
+/* Writes: INSERT, UPDATE and DELETE on a table of a key are applied to the
+ * key directly with the API of its type, like ZADD, HSET, RPUSH or SADD
+ * would, and on a pattern table to the hash of every row.
+ *
+ * The key of a table the statement writes is locked exclusively before it
+ * runs, see sqlLockStmtKeys(), and the hash of a row of a pattern table the
+ * first time it is written, until the end of the statement.
+ * Like the commands run by redis(), writes are not undone when the
+ * statement or the transaction fails. */
+
+/* The value of a column as a Redis object, NULL for SQL NULL. */
+static robj *vt_value_object(sqlite3_value *v) {
+    switch(sqlite3_value_type(v)) {
+    case SQLITE_NULL:
+        return NULL;
+    case SQLITE_INTEGER:
+        return createStringObjectFromLongLong(sqlite3_value_int64(v));
+    case SQLITE_BLOB:
+        return tryObjectEncoding(createStringObject(
+            (char*)sqlite3_value_blob(v),sqlite3_value_bytes(v)));
+    default:
+        return tryObjectEncoding(createStringObject(
+            (char*)sqlite3_value_text(v),sqlite3_value_bytes(v)));
+    }
+}
 
+/* What the column of a (key, val) table holds for a key of this type. */
+static int vt_column_role(int role, int type) {
+    if (role == VT_COL_KEY) {
+        if (type == REDIS_HASH) return VT_COL_FIELD;
+        if (type == REDIS_ZSET) return VT_COL_SCORE;
+        if (type == REDIS_LIST) return VT_COL_POS;
+        return -1;
+    } else if (role == VT_COL_VAL) {
+        return (type == REDIS_ZSET || type == REDIS_SET) ? VT_COL_MEMBER : VT_COL_VALUE;
+    }
+    return role;
+}
 
-/************************************************/
+/* The type of the key to create from the columns of the table, or -1. */
+static int vt_columns_type(redis_vtab *vt) {
+    int i, type = -1;
+
+    for (i = 0; i < vt->n_cols; i++) {
+        switch(vt->cols[i].role) {
+        case VT_COL_SCORE:
+        case VT_COL_RANK:
+            return REDIS_ZSET;
+        case VT_COL_FIELD:
+            return REDIS_HASH;
+        case VT_COL_MEMBER:
+            type = REDIS_SET;
+            break;
+        case VT_COL_POS:
+        case VT_COL_VALUE:
+            if (type == -1) type = REDIS_LIST;
+            break;
+        }
+    }
+    return type;
+}
+
+/* Index of a list element deleted by the statement: the elements after it
+ * moved, the rowids of the statement still have their old index. Returns
+ * the index of the element now, -1 if it is deleted. */
+static long vt_list_index(redis_vtab *vt, robj *rowid, int delete) {
+    long long index;
+    long lo = 0, hi = vt->n_deleted;
+
+    getLongLongFromObject(rowid,&index);
+    while (lo < hi) {
+        long mid = (lo+hi)/2;
+
+        if (vt->deleted[mid] < index) lo = mid+1;
+        else hi = mid;
+    }
+    if (lo < vt->n_deleted && vt->deleted[lo] == index) return -1;
+    if (delete) {
+        vt->deleted = zrealloc(vt->deleted,sizeof(long)*(vt->n_deleted+1));
+        memmove(vt->deleted+lo+1,vt->deleted+lo,sizeof(long)*(vt->n_deleted-lo));
+        vt->deleted[lo] = index;
+        vt->n_deleted++;
+    }
+    return index-lo;
+}
+
+static void vt_list_delete(robj *o, long index) {
+    listTypeIterator *li = listTypeInitIterator(o,index,REDIS_TAIL);
+    listTypeEntry entry;
+
+    if (listTypeNext(li,&entry)) listTypeDelete(&entry);
+    listTypeReleaseIterator(li);
+}
+
+/* LSET */
+static void vt_list_set(robj *o, long index, robj *value) {
+    listTypeTryConversion(o,value);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr,index);
+
+        if (p == NULL) return;
+        o->ptr = ziplistDelete(o->ptr,&p);
+        value = getDecodedObject(value);
+        o->ptr = ziplistInsert(o->ptr,p,value->ptr,sdslen(value->ptr));
+        decrRefCount(value);
+    } else {
+        listNode *ln = listIndex(o->ptr,index);
+
+        if (ln == NULL) return;
+        decrRefCount((robj*)listNodeValue(ln));
+        listNodeValue(ln) = value;
+        incrRefCount(value);
+    }
+}
+
+static void vt_hash_set(robj *o, robj *field, robj *value) {
+    robj *kv[2];
+
+    kv[0] = field;
+    kv[1] = value;
+    hashTypeTryConversion(o,kv,0,1);
+    hashTypeTryObjectEncoding(o,&kv[0],&kv[1]);
+    hashTypeSet(o,kv[0],kv[1]);
+}
+
+static robj *vt_create_object(int type, robj *member) {
+    switch(type) {
+    case REDIS_ZSET:
+        if (server.zset_max_ziplist_entries == 0)
+            return createZsetObject();
+        return createZsetZiplistObject();
+    case REDIS_SET:
+        return setTypeCreate(member);
+    case REDIS_HASH:
+        return createHashObject();
+    default:
+        return createZiplistObject();
+    }
+}
+
+/* Write to the key of the table. 'old' is the element of the row updated
+ * or deleted, 'vals' the new values of the columns, NULL for DELETE. */
+static int vt_update_key(redis_vtab *vt, robj *old, sqlite3_value **vals) {
+    redisDb *db = &server.db[0];
+    sqlite3_value *cols[VT_COL_HFIELD+1];
+    robj *o, *member = NULL, *value = NULL;
+    double score = 0;
+    int i, type, rc = SQLITE_OK;
+    long index;
+
+    if ((rc = vt_lock_stmt_key(vt,vt->name,REDIS_KEYLOCK_EXCLUSIVE)) != SQLITE_OK) return rc;
+    o = lookupKeyWrite(db,vt->name);
+    if (o == NULL && old) return SQLITE_OK; /* deleted meanwhile */
+    if ((type = o ? o->type : vt_columns_type(vt)) == -1)
+        return vt_error(vt,SQLITE_ERROR,"no such key %s, declare the columns "
+                        "of the table to create it",vt->name->ptr);
+
+    if (vals == NULL) { /* DELETE */
+        switch(type) {
+        case REDIS_ZSET: zsetDel(o,old); break;
+        case REDIS_SET: setTypeRemove(o,old); break;
+        case REDIS_HASH: hashTypeDelete(o,old); break;
+        case REDIS_LIST:
+            if ((index = vt_list_index(vt,old,1)) != -1) vt_list_delete(o,index);
+            break;
+        case REDIS_STRING: dbDelete(db,vt->name); break;
+        }
+        goto modified;
+    }
+
+    memset(cols,0,sizeof(cols));
+    for (i = 0; i < vt->n_cols; i++) {
+        int role = vt_column_role(vt->cols[i].role,type);
+
+        if (role != -1) cols[role] = vals[i];
+    }
+    if (type == REDIS_ZSET) {
+        if (cols[VT_COL_SCORE] == NULL ||
+            sqlite3_value_numeric_type(cols[VT_COL_SCORE]) == SQLITE_TEXT ||
+            sqlite3_value_type(cols[VT_COL_SCORE]) == SQLITE_NULL)
+            return vt_error(vt,SQLITE_MISMATCH,"the score must be a number");
+        score = sqlite3_value_double(cols[VT_COL_SCORE]);
+        if (isnan(score))
+            return vt_error(vt,SQLITE_MISMATCH,"the score is not a number (NaN)");
+    }
+    if (type == REDIS_ZSET || type == REDIS_SET) {
+        if (cols[VT_COL_MEMBER] == NULL ||
+            (member = vt_value_object(cols[VT_COL_MEMBER])) == NULL)
+            return vt_error(vt,SQLITE_CONSTRAINT,"the member can't be NULL");
+    } else if (type == REDIS_HASH) {
+        if (cols[VT_COL_FIELD] == NULL ||
+            (member = vt_value_object(cols[VT_COL_FIELD])) == NULL)
+            return vt_error(vt,SQLITE_CONSTRAINT,"the field can't be NULL");
+    }
+    if (type == REDIS_HASH || type == REDIS_LIST || type == REDIS_STRING) {
+        if (cols[VT_COL_VALUE] == NULL ||
+            (value = vt_value_object(cols[VT_COL_VALUE])) == NULL)
+        {
+            if (member) decrRefCount(member);
+            return vt_error(vt,SQLITE_CONSTRAINT,"the value can't be NULL");
+        }
+    }
+    if (type == REDIS_STRING && old == NULL) {
+        decrRefCount(value);
+        return vt_error(vt,SQLITE_ERROR,"%s is a string, it has a single row",
+                        vt->name->ptr);
+    }
+
+    if (o == NULL) {
+        o = vt_create_object(type,member);
+        dbAdd(db,vt->name,o);
+    }
+    /* An element renamed by UPDATE is replaced. */
+    if (old && member && !equalStringObjects(old,member)) {
+        if (type == REDIS_ZSET) zsetDel(o,old);
+        else if (type == REDIS_SET) setTypeRemove(o,old);
+        else hashTypeDelete(o,old);
+    }
+    switch(type) {
+    case REDIS_ZSET: zsetAdd(o,member,score); break;
+    case REDIS_SET: setTypeAdd(o,member); break;
+    case REDIS_HASH: vt_hash_set(o,member,value); break;
+    case REDIS_LIST:
+        if (old == NULL) {
+            listTypeTryConversion(o,value);
+            listTypePush(o,value,REDIS_TAIL);
+        } else if ((index = vt_list_index(vt,old,0)) != -1) {
+            vt_list_set(o,index,value);
+        }
+        break;
+    case REDIS_STRING: setKey(db,vt->name,value); break;
+    }
+    if (member) decrRefCount(member);
+    if (value) decrRefCount(value);
+
+modified:
+    if ((o = lookupKeyWrite(db,vt->name)) != NULL &&
+        ((o->type == REDIS_ZSET && zsetLength(o) == 0) ||
+         (o->type == REDIS_SET && setTypeSize(o) == 0) ||
+         (o->type == REDIS_HASH && hashTypeLength(o) == 0) ||
+         (o->type == REDIS_LIST && listTypeLength(o) == 0)))
+        dbDelete(db,vt->name);
+    signalModifiedKey(db,vt->name);
+    return SQLITE_OK;
+}
+
+/* Write to the hash of a row of a pattern table: the fields of the columns
+ * are set, or deleted when NULL. A row deleted deletes the hash. */
+static int vt_update_row(redis_vtab *vt, robj *old, sqlite3_value **vals) {
+    redisDb *db = &server.db[0];
+    sds pattern = vt->name->ptr;
+    robj *key, *o;
+    int i, rc;
+
+    if (vals) {
+        if (sqlite3_value_type(vals[0]) == SQLITE_NULL)
+            return vt_error(vt,SQLITE_CONSTRAINT,"_key can't be NULL");
+        key = createStringObject((char*)sqlite3_value_text(vals[0]),
+                                 sqlite3_value_bytes(vals[0]));
+        if (old && !equalStringObjects(old,key)) {
+            decrRefCount(key);
+            return vt_error(vt,SQLITE_CONSTRAINT,"_key can't be changed");
+        }
+        if (!stringmatchlen(pattern,sdslen(pattern),key->ptr,sdslen(key->ptr),0)) {
+            rc = vt_error(vt,SQLITE_CONSTRAINT,"%s doesn't match %s",
+                          key->ptr,pattern);
+            decrRefCount(key);
+            return rc;
+        }
+    } else {
+        key = old;
+        incrRefCount(key);
+    }
+
+    if ((rc = vt_lock_stmt_key(vt,key,REDIS_KEYLOCK_EXCLUSIVE)) != SQLITE_OK) {
+        decrRefCount(key);
+        return rc;
+    }
+    o = lookupKeyWrite(db,key);
+    if (o && o->type != REDIS_HASH) {
+        rc = vt_error(vt,SQLITE_MISMATCH,"%s is not a hash",key->ptr);
+        decrRefCount(key);
+        return rc;
+    }
+
+    if (vals == NULL) {
+        if (o) dbDelete(db,key);
+    } else {
+        for (i = 0; i < vt->n_cols; i++) {
+            robj *value;
+
+            if (vt->cols[i].role != VT_COL_HFIELD) continue;
+            if ((value = vt_value_object(vals[i])) == NULL) {
+                if (o) hashTypeDelete(o,vt->cols[i].field);
+                continue;
+            }
+            if (o == NULL) {
+                o = createHashObject();
+                dbAdd(db,key,o);
+            }
+            vt_hash_set(o,vt->cols[i].field,value);
+            decrRefCount(value);
+        }
+        if (o && hashTypeLength(o) == 0) dbDelete(db,key);
+    }
+    signalModifiedKey(db,key);
+    decrRefCount(key);
+    return SQLITE_OK;
+}
+
+static int vt_update(sqlite3_vtab *s3_vt, int argc, sqlite3_value **argv,
+                     sqlite_int64 *p_rowid) {
+    redis_vtab *vt = (redis_vtab*)s3_vt;
+    sqlite3_value **vals = argc > 1 ? argv+2 : NULL;
+    robj *old = NULL;
+
+    vt_stmt_begin(vt);
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+        sqlite_int64 rowid = sqlite3_value_int64(argv[0]);
+
+        if (rowid < 1 || rowid > vt->n_rowids)
+            return vt_error(vt,SQLITE_ERROR,"no such row");
+        old = vt->rowids[rowid-1];
+    }
+    *p_rowid = 0;
+    if (vt->pattern) return vt_update_row(vt,old,vals);
+    return vt_update_key(vt,old,vals);
+}
+
+static sqlite3_module redis_module =
+{
+    0,              /* iVersion */
+    vt_create,      /* xCreate       - create a vtable */
+    vt_connect,     /* xConnect      - associate a vtable with a connection */
+    vt_best_index,  /* xBestIndex    - best index */
+    vt_disconnect,  /* xDisconnect   - disassociate a vtable with a connection */
+    vt_destroy,     /* xDestroy      - destroy a vtable */
+    vt_open,        /* xOpen         - open a cursor */
+    vt_close,       /* xClose        - close a cursor */
+    vt_filter,      /* xFilter       - configure scan constraints */
+    vt_next,        /* xNext         - advance a cursor */
+    vt_eof,         /* xEof          - inidicate end of result set*/
+    vt_column,      /* xColumn       - read data */
+    vt_rowid,       /* xRowid        - read data */
+    vt_update,      /* xUpdate       - write data */
+    NULL,           /* xBegin        - begin transaction */
+    NULL,           /* xSync         - sync transaction */
+    NULL,           /* xCommit       - commit transaction */
+    NULL,           /* xRollback     - rollback transaction */
+    NULL,           /* xFindFunction - function overloading */
+};
+
+
+/************************************************/
 
 char *redisProtocolToSQLType(sqlite3_context *ctx, sds *sql_reply, char *reply);
 char *redisProtocolToSQLType_Int(sqlite3_context *ctx, sds *sql_reply, char *reply);
@@ -371,7 +1561,7 @@ static void redis_func(sqlite3_context *ctx, int argc, sqlite3_value **sql_argv)
     robj **argv;
     struct redisCommand *cmd;
     sds reply, sql_reply;
-    redisClient *c = ((redisClient *)sqlite3_user_data(ctx))->sql_client;
+    redisClient *c = ((sqlConn *)sqlite3_user_data(ctx))->sql_client;
 
     /* require at least one argument */
     if (argc == 0) {
@@ -449,6 +1639,7 @@ static void redis_func(sqlite3_context *ctx, int argc, sqlite3_value **sql_argv)
     if (redisProtocolToSQLType(ctx, &sql_reply, reply) != NULL)
         sqlite3_result_text(ctx, sql_reply, sdslen(sql_reply), SQLITE_TRANSIENT);
     sdsfree(sql_reply);
+    sdsfree(reply);
 
   cleanup:
     /* Clean up. Command code may have changed argv/argc so we use the
@@ -460,102 +1651,359 @@ static void redis_func(sqlite3_context *ctx, int argc, sqlite3_value **sql_argv)
     pthread_mutex_unlock(c->lock);
 }
 
-/* initialize the SQLite in-memory database */
+/*-----------------------------------------------------------------------------
+ * Keys of the statements
+ *
+ * A statement over the virtual tables of Redis keys must hold the keys while
+ * it runs. The tables a statement uses are collected by sqlAuthorizer() when
+ * it is prepared, and sqlLockStmtKeys() locks the keys of these tables before
+ * it runs, all at once and sorted like lockKeys(), so that it never
+ * deadlocks: shared for the tables the statement only reads, so that any
+ * number of them run in parallel, exclusive for the ones it writes. In case
+ * SQLite didn't report a table, vt_open() locks its key anyway.
+ *----------------------------------------------------------------------------*/
+
+/* Table name (sds) -> 1 if the statement writes it, else 0 */
+static dictType sqlStmtTablesDictType = {
+    dictSdsCaseHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCaseCompare,      /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Table name (sds, owned by the redis_vtab) -> redis_vtab */
+static dictType sqlVtabTablesDictType = {
+    dictSdsCaseHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCaseCompare,      /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Called by SQLite for every table and column a statement uses while it is
+ * prepared. Only collects the tables in c->sql_stmt_tables, when set: SQLite
+ * may prepare a statement again in sqlite3_step() after a schema change, the
+ * tables are looked up by name anyway. */
+static int sqlAuthorizer(void *arg, int action, const char *arg1,
+                         const char *arg2, const char *dbname,
+                         const char *trigger) {
+    redisClient *c = ((sqlConn *)arg)->client;
+    dictEntry *de;
+    long writes;
+
+    REDIS_NOTUSED(arg2);
+    REDIS_NOTUSED(dbname);
+    REDIS_NOTUSED(trigger);
+    if (c == NULL || c->sql_stmt_tables == NULL || arg1 == NULL)
+        return SQLITE_OK;
+    switch(action) {
+    case SQLITE_READ:
+        writes = 0;
+        break;
+    case SQLITE_INSERT:
+    case SQLITE_UPDATE:
+    case SQLITE_DELETE:
+        writes = 1;
+        break;
+    default:
+        return SQLITE_OK;
+    }
+    if ((de = dictFind(c->sql_stmt_tables,arg1)) == NULL)
+        dictAdd(c->sql_stmt_tables,sdsnew(arg1),(void*)writes);
+    else if (writes)
+        dictSetVal(c->sql_stmt_tables,de,(void*)writes);
+    return SQLITE_OK;
+}
+
+/* Return true if the statement uses the virtual table of a Redis key. */
+static int sqlStmtUsesRedisKeys(redisClient *c, dict *tables) {
+    dictIterator *di = dictGetIterator(tables);
+    dictEntry *de;
+    int found = 0;
+
+    while (!found && (de = dictNext(di)) != NULL)
+        found = dictFind(c->sql_conn->vtab_tables,dictGetKey(de)) != NULL;
+    dictReleaseIterator(di);
+    return found;
+}
+
+typedef struct sqlStmtKey {
+    robj *key;
+    int mode;
+} sqlStmtKey;
+
+/* Same order as lockKeys(), so that clients and statements locking the same
+ * keys of db 0 never wait for each other in a cycle. */
+static int sqlCompareStmtKeys(const void *a, const void *b) {
+    return sdscmp(((sqlStmtKey*)a)->key->ptr, ((sqlStmtKey*)b)->key->ptr);
+}
+
+/* Lock the keys of the tables of the statement. Pattern tables lock the hash
+ * of every row in turn instead, see vt_next_row(). Returns the keys to pass
+ * to sqlUnlockStmtKeys(). */
+static sqlStmtKey *sqlLockStmtKeys(redisClient *c, dict *tables, int *n_keys) {
+    sqlStmtKey *keys;
+    dictIterator *di;
+    dictEntry *de;
+    int j, n = 0;
+
+    *n_keys = 0;
+    if (!server.locking_mode || tables == NULL || dictSize(tables) == 0)
+        return NULL;
+
+    keys = zmalloc(sizeof(sqlStmtKey)*dictSize(tables));
+    di = dictGetIterator(tables);
+    while ((de = dictNext(di)) != NULL) {
+        redis_vtab *vt = dictFetchValue(c->sql_conn->vtab_tables,dictGetKey(de));
+        int mode = dictGetVal(de) ? REDIS_KEYLOCK_EXCLUSIVE : REDIS_KEYLOCK_SHARED;
+
+        if (vt == NULL || vt->pattern) continue;
+        /* Two tables of the same key. */
+        for (j = 0; j < n; j++)
+            if (equalStringObjects(keys[j].key,vt->name)) break;
+        if (j < n) {
+            if (mode == REDIS_KEYLOCK_EXCLUSIVE) keys[j].mode = mode;
+            continue;
+        }
+        incrRefCount(vt->name);
+        keys[n].key = vt->name;
+        keys[n].mode = mode;
+        n++;
+    }
+    dictReleaseIterator(di);
+
+    qsort(keys, n, sizeof(sqlStmtKey), sqlCompareStmtKeys);
+    for (j = 0; j < n; j++)
+        lockDbKey(c, &server.db[0], keys[j].key->ptr, keys[j].mode);
+    *n_keys = n;
+    return keys;
+}
+
+static void sqlUnlockStmtKeys(redisClient *c, sqlStmtKey *keys, int n_keys) {
+    int j;
+
+    for (j = n_keys-1; j >= 0; j--) {
+        unlockDbKey(c, &server.db[0], keys[j].key->ptr);
+        decrRefCount(keys[j].key);
+    }
+    zfree(keys);
+}
+
+static void sqlSaveInit(void);
+static int sqlWalHook(void *arg, sqlite3 *db, const char *name, int pages);
+
+static sqlite3 *sqlCheckpointDb;    /* WAL mode: connection of checkpoints */
+
+/* Open a connection to the SQL DB. By default the DB is in memory and the
+ * connections share it through the shared cache of SQLite. With sql-wal it
+ * is sql_filename itself in WAL mode: every connection has a cache of its
+ * own and readers don't wait for writers, while a writer waits up to
+ * REDIS_SQL_BUSY_TIMEOUT for another one to commit. The WAL is not
+ * checkpointed by the connection committing, see sqlWalHook(). */
+static int sqlOpen(sqlite3 **db) {
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX;
+    sds pragmas;
+    int rc;
+
+    if (!server.sql_wal)
+        return sqlite3_open_v2("file::memory:?cache=shared", db,
+                               flags | SQLITE_OPEN_SHAREDCACHE, NULL);
+
+    if ((rc = sqlite3_open_v2(server.sql_filename, db,
+                              flags | SQLITE_OPEN_PRIVATECACHE, NULL)) != SQLITE_OK)
+        return rc;
+    sqlite3_busy_timeout(*db, REDIS_SQL_BUSY_TIMEOUT);
+    pragmas = sdsnew("PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;");
+    if (server.sql_mmap_size)
+        pragmas = sdscatprintf(pragmas, "PRAGMA mmap_size=%lld;", server.sql_mmap_size);
+    if (server.sql_cache_size)
+        pragmas = sdscatprintf(pragmas, "PRAGMA cache_size=-%lld;", server.sql_cache_size/1024);
+    rc = sqlite3_exec(*db, pragmas, NULL, NULL, NULL);
+    sdsfree(pragmas);
+    if (rc == SQLITE_OK)
+        sqlite3_wal_hook(*db, sqlWalHook, NULL);
+    return rc;
+}
+
+/* initialize the SQLite database */
 void sqlInit(void) {
-    sqlite3_enable_shared_cache(1); /* for some reason this makes a difference, even though we use the flags below */
-    if (sqlite3_open_v2("file::memory:?cache=shared", &server.sql_db,
-                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_SHAREDCACHE,
-                        NULL)) {
+    if (!server.sql_wal)
+        sqlite3_enable_shared_cache(1); /* for some reason this makes a difference, even though we use the flags below */
+    if (sqlOpen(&server.sql_db) ||
+        (server.sql_wal && sqlOpen(&sqlCheckpointDb))) {
         redisLog(REDIS_WARNING, "Could not initialize SQLite database, exiting.");
         exit(1);
     }
     server.sql_threads = 0;
+    sqlSaveInit();
 }
 
-/* initialize the per-client SQLite in-memory database connection */
-void sqlClientInit(redisClient *c) {
-    if (sqlite3_open_v2("file::memory:?cache=shared", &c->sql_db,
-                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_SHAREDCACHE,
-                        NULL)) {
-        redisLog(REDIS_WARNING, "Could not create SQLite database connection, exiting.");
-        exit(1);
+/*-----------------------------------------------------------------------------
+ * Connections
+ *
+ * Opening a connection to the SQL DB and registering our functions with it
+ * is not free, and most clients never run SQL: a client gets a connection
+ * the first time it does, and gives it back to a pool of at most
+ * sql-pool-size idle connections when it is freed. What the client could
+ * see of it is dropped first: its cursors, prepared statements and open
+ * transaction. A connection with temp tables or attached databases is
+ * closed rather than pooled.
+ *----------------------------------------------------------------------------*/
+
+static list *sqlConnPool;               /* idle connections */
+static pthread_mutex_t sqlConnPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static long long sqlConnsCreated, sqlConnsReused, sqlConnsClosed;
+
+static sqlConn *sqlConnCreate(void) {
+    sqlConn *conn = zmalloc(sizeof(*conn));
+
+    if (sqlOpen(&conn->db)) {
+        redisLog(REDIS_WARNING, "Could not create SQLite database connection: %s",
+                 sqlite3_errmsg(conn->db));
+        sqlite3_close(conn->db);
+        zfree(conn);
+        return NULL;
+    }
+    conn->client = NULL;
+    conn->lock_deadline = 0;
+    conn->sql_client = createClient(-1);
+    conn->sql_client->flags |= REDIS_SQLITE_CLIENT;
+    conn->vtabs = listCreate();
+    conn->vtab_tables = dictCreate(&sqlVtabTablesDictType,NULL);
+
+    sqlite3_create_function(conn->db, "redis", -1, SQLITE_ANY, conn, redis_func, NULL, NULL);
+    sqlite3_create_module(conn->db, "redis", &redis_module, conn);
+    sqlite3_set_authorizer(conn->db, sqlAuthorizer, conn);
+
+    pthread_mutex_lock(&sqlConnPoolMutex);
+    sqlConnsCreated++;
+    pthread_mutex_unlock(&sqlConnPoolMutex);
+    return conn;
+}
+
+static void sqlConnFree(sqlConn *conn) {
+    /* the vtabs are disconnected by sqlite3_close_v2() */
+    if (sqlite3_close_v2(conn->db) != SQLITE_OK)
+        redisLog(REDIS_WARNING, "Call to sqlite3_close_v2() failed.");
+    listRelease(conn->vtabs);
+    dictRelease(conn->vtab_tables);
+    if (!pthread_mutex_destroy(conn->sql_client->lock))
+        zfree(conn->sql_client->lock);
+    zfree(conn->sql_client);
+    zfree(conn);
+
+    pthread_mutex_lock(&sqlConnPoolMutex);
+    sqlConnsClosed++;
+    pthread_mutex_unlock(&sqlConnPoolMutex);
+}
+
+/* Return true if the connection has no temp tables and no attached
+ * databases, which the next client would see. */
+static int sqlConnIsClean(sqlConn *conn) {
+    sqlite3_stmt *stmt;
+    int clean = 0, rc;
+
+    /* The pragma_database_list table needs SQLite 3.16: step the pragma. */
+    if (sqlite3_prepare_v2(conn->db, "PRAGMA database_list", -1, &stmt,
+                           NULL) != SQLITE_OK)
+        return 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *name = (const char*)sqlite3_column_text(stmt,1);
+
+        if (name && strcmp(name,"main") && strcmp(name,"temp")) break;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return 0;
+
+    if (sqlite3_prepare_v2(conn->db, "SELECT count(*) FROM temp.sqlite_master",
+                           -1, &stmt, NULL) != SQLITE_OK)
+        return 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        clean = sqlite3_column_int(stmt,0) == 0;
+    sqlite3_finalize(stmt);
+    return clean;
+}
+
+/* Give the client a connection to the SQL DB, if it has none yet. Replies
+ * with an error and returns REDIS_ERR if it can't be opened. */
+static int sqlClientConn(redisClient *c) {
+    sqlConn *conn = NULL;
+
+    if (c->sql_conn) return REDIS_OK;
+    if (c->flags & (REDIS_LUA_CLIENT|REDIS_SQLITE_CLIENT)) {
+        addReplyError(c,"SQL is not available to this client");
+        return REDIS_ERR;
     }
-    c->sql_client = createClient(-1);
-    c->sql_client->flags |= REDIS_SQLITE_CLIENT;
 
-    sqlite3_create_function(c->sql_db, "redis", -1, SQLITE_ANY, (void*)c, redis_func, NULL, NULL);
-    sqlite3_create_module(c->sql_db, "redis", &redis_module, NULL);
+    pthread_mutex_lock(&sqlConnPoolMutex);
+    if (sqlConnPool && listLength(sqlConnPool)) {
+        listNode *ln = listLast(sqlConnPool);
+
+        conn = listNodeValue(ln);
+        listDelNode(sqlConnPool,ln);
+        sqlConnsReused++;
+    }
+    pthread_mutex_unlock(&sqlConnPoolMutex);
+    if (conn == NULL && (conn = sqlConnCreate()) == NULL) {
+        addReplyError(c,"Could not create SQLite database connection");
+        return REDIS_ERR;
+    }
+
+    conn->client = c;
+    c->sql_conn = conn;
+    c->sql_cursors = dictCreate(&sqlCursorDictType,NULL);
+    c->sql_stmts = dictCreate(&sqlStmtDictType,NULL);
+    c->sql_stmt_lru = listCreate();
+    c->sql_stmt_next_handle = 1;
+    return REDIS_OK;
 }
 
-/* close per-client SQLite in-memory database connection */
+/* Give the connection of the client back to the pool, or close it. */
 void sqlClientClose(redisClient *c) {
-    if (sqlite3_close_v2(c->sql_db) != SQLITE_OK)
-        redisLog(REDIS_WARNING, "Call to sqlite3_close_v2() failed.");
-    zfree(c->sql_client);
+    sqlConn *conn = c->sql_conn;
+    int pooled = 0;
+
+    if (conn == NULL) return;
+    /* the statements of the cursors must be finalized before closing */
+    dictRelease(c->sql_cursors);
+    sqlStmtCacheRelease(c);
+    c->sql_cursors = NULL;
+    c->sql_stmts = NULL;
+    c->sql_stmt_lru = NULL;
+    c->sql_conn = NULL;
+
+    if (!sqlite3_get_autocommit(conn->db))
+        sqlite3_exec(conn->db, "ROLLBACK", NULL, NULL, NULL);
+    conn->client = NULL;
+    if (sqlite3_get_autocommit(conn->db) && sqlConnIsClean(conn)) {
+        pthread_mutex_lock(&sqlConnPoolMutex);
+        if (sqlConnPool == NULL) sqlConnPool = listCreate();
+        if (listLength(sqlConnPool) < (unsigned long)server.sql_pool_size) {
+            listAddNodeTail(sqlConnPool,conn);
+            pooled = 1;
+        }
+        pthread_mutex_unlock(&sqlConnPoolMutex);
+    }
+    if (!pooled) sqlConnFree(conn);
 }
 
-/* These are necessary to scan Vdbe ops in the SQLite statement. Vdbe
- * interface is hidden and so we have to resort to brutal measures
- * like this to peek inside it  */
-#define OP_VOpen 135
-typedef struct fake_vtable {
-    sqlite3 *db;
-    char *pMod;
-    sqlite3_vtab *pVtab;
-    int nRef;
-    uint8_t bConstraint;
-    int iSavepoint;
-    struct fake_vtable *pNext;
-} fake_vtable;
-typedef struct fake_op {
-    uint8_t opcode;
-    signed char p4type;
-    uint8_t opflags;
-    uint8_t p5;
-    int p1;
-    int p2;
-    int p3;
-    fake_vtable *pVtab;
-} fake_op;
-typedef struct fake_vdbe {
-  sqlite3 *db;
-  fake_op *aOp;
-  char *aMem;
-  char **apArg;
-  char *aColName;
-  char *pResultSet;
-  int nMem;
-  int nOp;
-} fake_vdbe;
-
-/* scan the statement for any vtable open instructions, check whether
- * its one of ours (by looking for a magic number). this is used to
- * lock the affected redis keys */
-static robj **scan_stmt_for_redis_vtabs(sqlite3_stmt *stmt, int *n_keys) {
-    int i;
-    robj **keys = NULL;
-    listNode *ln;
-    listIter *li;
-    fake_vdbe *v = (fake_vdbe *)stmt;
-    list *list = listCreate();
-    for (i=0; i<v->nOp; i++) {
-        if (v->aOp[i].opcode == OP_VOpen) {
-            redis_vtab *vt = (redis_vtab *)v->aOp[i].pVtab->pVtab;
-            if (vt->magic == REDIS_VTAB_MAGIC)
-                listAddNodeTail(list, vt->name);
-        }
-    }
-    *n_keys = listLength(list);
-    if (*n_keys == 0)
-        return NULL;
-    keys = zmalloc(sizeof(robj *) * *n_keys);
-    li = listGetIterator(list,AL_START_HEAD);
-    i = 0;
-    while ((ln = listNext(li)))
-        keys[i++] = (robj*)ln->value;
-    listReleaseIterator(li);
-    listRelease(list);
-    return keys;
+sds genSqlPoolInfoString(sds info) {
+    unsigned long pooled;
+
+    pthread_mutex_lock(&sqlConnPoolMutex);
+    pooled = sqlConnPool ? listLength(sqlConnPool) : 0;
+    info = sdscatprintf(info,
+        "sqlite_conns_created:%lld\r\n"
+        "sqlite_conns_reused:%lld\r\n"
+        "sqlite_conns_in_use:%lld\r\n"
+        "sqlite_conns_pooled:%lu\r\n",
+        sqlConnsCreated, sqlConnsReused,
+        sqlConnsCreated-sqlConnsClosed-(long long)pooled, pooled);
+    pthread_mutex_unlock(&sqlConnPoolMutex);
+    return info;
 }
 
 /******************************************************
@@ -684,164 +2132,737 @@ int sqlite3_blocking_prepare_v2(
  * End of stuff from http://www.sqlite.org/unlock_notify.html
  */
 
-void sqlGenericCommand(redisClient *c, int prepare_only) {
-    int rc = SQLITE_OK;
-    const char *leftover;
-    const char *sql = c->argv[1]->ptr;
-    sqlite3_stmt *stmt = NULL;
-    int rows_sent = 0;
-    int *replylen = NULL;
-    robj **keys = NULL;
-    int n_keys = 0;
-    int retries = 0;
-
+/* Every SQL statement runs in a thread of the pool, and a statement can
+ * wait for another one to release its tables (see sqlite3_blocking_step),
+ * so the SQL threads must always leave some room in the pool. Returns
+ * REDIS_ERR, after replying with an error, if there is none. */
+static int sqlThreadEnter(redisClient *c) {
     pthread_mutex_lock(server.lock);
     if (server.sql_threads+2 >= server.threadpool_size) {
         redisLog(REDIS_WARNING, "Error: not enough threads for sql command, increase threadpool_size in config. [sql threads: %d, pool size %d].",
                  server.sql_threads,server.threadpool_size);
         addReplyErrorFormat(c, "Error: not enough threads for sql command, increase threadpool_size.");
         pthread_mutex_unlock(server.lock);
-        return;
-    } else {
-        server.sql_threads++;
-        pthread_mutex_unlock(server.lock);
+        return REDIS_ERR;
     }
+    server.sql_threads++;
+    pthread_mutex_unlock(server.lock);
+    return REDIS_OK;
+}
 
-    /* this is necessary to get enlish errors, see http://www.sqlite.org/c3ref/errcode.html */
-    sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_db));
+static void sqlThreadLeave(redisClient *c) {
+    REDIS_NOTUSED(c);
+    pthread_mutex_lock(server.lock);
+    redisAssert(server.sql_threads > 0);
+    server.sql_threads--;
+    pthread_mutex_unlock(server.lock);
+}
 
-    while ((rc==SQLITE_OK || (rc==SQLITE_SCHEMA && (++retries)<2)) && sql[0]) {
-        int n_cols, i;
+/* Bind the arguments of the client starting at argv[first] to the
+ * parameters of the statement. Statements run by the command itself bind
+ * them as SQLITE_STATIC; cursors are stepped by later commands, after the
+ * arguments were freed or reused by the parser, and pass SQLITE_TRANSIENT
+ * so that SQLite keeps its own copy. */
+static void sqlBindArgs(redisClient *c, sqlite3_stmt *stmt, int first,
+                        sqlite3_destructor_type destructor)
+{
+    int i;
 
-        if ((rc = sqlite3_blocking_prepare_v2(c->sql_db, sql, -1, &stmt, &leftover)) != SQLITE_OK)
-            continue;   /* possibly SQLITE_SCHEMA, try again, else will exit loop */
+    for (i=first; i<c->argc; i++) {
 
-        if (!stmt) {    /* this happens for a comment or white-space */
-            sql = leftover;
-            continue;
+        /* We need a way to pass a NULL here. We could use
+         * Redis's bulk $-1, but that would be too radical of
+         * a change to the protocol (currently only the server
+         * can send a $-1, if client sends a $-1 it's an
+         * error). We use ":NULL" to mean NULL, and for
+         * anything else that begins with a ":" we drop the
+         * first ":" */
+
+        if (sdslen(c->argv[i]->ptr) == 5 && !memcmp(c->argv[i]->ptr, ":NULL", 5))
+            sqlite3_bind_null(stmt, i-first+1);
+        else if (sdslen(c->argv[i]->ptr) > 1 && ((char*)c->argv[i]->ptr)[0] == ':')
+            sqlite3_bind_text(stmt, i-first+1, ((char*)c->argv[i]->ptr)+1, sdslen(c->argv[i]->ptr)-1, destructor);
+        else {
+            c->argv[i] = tryObjectEncoding(c->argv[i]);
+            if (c->argv[i]->encoding == REDIS_ENCODING_RAW)
+                sqlite3_bind_text(stmt, i-first+1, c->argv[i]->ptr, sdslen(c->argv[i]->ptr), destructor);
+            else
+                sqlite3_bind_int64(stmt, i-first+1, (long)c->argv[i]->ptr);
         }
+    }
+}
 
-        n_cols = sqlite3_column_count(stmt);
-
-        if (n_cols > 0) { /* write column names */
-            replylen = addDeferredMultiBulkLength(c);
-            addReplyMultiBulkLen(c, n_cols);
-            for (i=0; i<n_cols; i++) {
-                char *type;
-                addReplyMultiBulkLen(c,2);
-                addReplyBulkCString(c,(char *)sqlite3_column_name(stmt,i));
-                if ((type = (char *)sqlite3_column_decltype(stmt,i)) != NULL)
-                    addReplyBulkCString(c,type);
-                else {
-                    switch (sqlite3_column_type(stmt, i)) {
-                    case SQLITE_INTEGER:
-                        addReplyBulkCString(c,"int");
-                        break;
-                    case SQLITE_FLOAT:
-                        addReplyBulkCString(c,"real");
-                        break;
-                    case SQLITE_BLOB:
-                        addReplyBulkCString(c,"blob");
-                        break;
-                    default:
-                        addReplyBulkCString(c,"text");
-                    }
-                }
-            }
-            rows_sent++;
-        }
-
-        /* if this is a sqlprepare, there is nothing more to do. this
-         * is a hack, the real solution should cache the prepared
-         * statement locally in the connection and bind parameters to it
-         * without preparing at subsequent SQL commands with the same
-         * statment. THREDIS TODO */
-        if (prepare_only) break;
-
-        /* bind parameters, if any */
-        if (c->argc > 2)
-            for (i=2; i<c->argc; i++) {
-
-                /* We need a way to pass a NULL here. We could use
-                 * Redis's bulk $-1, but that would be too radical of
-                 * a change to the protocol (currently only the server
-                 * can send a $-1, if client sends a $-1 it's an
-                 * error). We use ":NULL" to mean NULL, and for
-                 * anything else that begins with a ":" we drop the
-                 * first ":" */
-
-                if (sdslen(c->argv[i]->ptr) == 5 && !memcmp(c->argv[i]->ptr, ":NULL", 5))
-                    sqlite3_bind_null(stmt, i-1);
-                else if (sdslen(c->argv[i]->ptr) > 1 && ((char*)c->argv[i]->ptr)[0] == ':')
-                    sqlite3_bind_text(stmt, i-1, ((char*)c->argv[i]->ptr)+1, sdslen(c->argv[1]->ptr)-1, SQLITE_STATIC);
-                else {
-                    c->argv[i] = tryObjectEncoding(c->argv[i]);
-                    if (c->argv[i]->encoding == REDIS_ENCODING_RAW)
-                        sqlite3_bind_text(stmt, i-1, c->argv[i]->ptr, sdslen(c->argv[i]->ptr), SQLITE_STATIC);
-                    else
-                        sqlite3_bind_int64(stmt, i-1, (long)c->argv[i]->ptr);
-                }
-            }
-        /* figure out which keys to lock by using this crazy hack */
-        keys = scan_stmt_for_redis_vtabs(stmt, &n_keys);
-        if (keys)
-            lockKeys(c, keys, n_keys);
-
-        while ((rc = sqlite3_blocking_step(stmt)) == SQLITE_ROW) {
-            sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_db));
-
-            addReplyMultiBulkLen(c,n_cols);
-            for (i=0; i<n_cols; i++) {
-                if (sqlite3_column_type(stmt,i) == SQLITE_INTEGER)
-                    addReplyLongLong(c,sqlite3_column_int64(stmt,i));
-                else {
-                    char *txt = (char *)sqlite3_column_text(stmt,i);
-                    if (!txt)
-                        addReply(c,shared.nullbulk);
-                    else
-                        addReplyBulkCBuffer(c,(void*)txt,sqlite3_column_bytes(stmt,i));
-                }
-            }
-            rows_sent++;
+/* Reply with the name and type of every column of the statement. */
+static void addReplySqlColumns(redisClient *c, sqlite3_stmt *stmt, int n_cols) {
+    int i;
 
-            sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_db));
+    addReplyMultiBulkLen(c, n_cols);
+    for (i=0; i<n_cols; i++) {
+        char *type;
+        addReplyMultiBulkLen(c,2);
+        addReplyBulkCString(c,(char *)sqlite3_column_name(stmt,i));
+        if ((type = (char *)sqlite3_column_decltype(stmt,i)) != NULL)
+            addReplyBulkCString(c,type);
+        else {
+            switch (sqlite3_column_type(stmt, i)) {
+            case SQLITE_INTEGER:
+                addReplyBulkCString(c,"int");
+                break;
+            case SQLITE_FLOAT:
+                addReplyBulkCString(c,"real");
+                break;
+            case SQLITE_BLOB:
+                addReplyBulkCString(c,"blob");
+                break;
+            default:
+                addReplyBulkCString(c,"text");
+            }
         }
     }
+}
 
-    if (stmt) sqlite3_finalize(stmt);
+/* Reply with the current row of the statement as a single bulk string,
+ * for the clients that asked for it with SQLFORMAT BINARY: a bitmap of the
+ * NULL columns (bit i%8 of byte i/8 is set if column i is NULL), followed
+ * by every column that isn't NULL, as a type byte and its value:
+ *
+ *   'i' <int64>                 integer
+ *   'f' <double>                real, IEEE 754
+ *   's' <uint32 len> <bytes>    text, UTF-8
+ *   'b' <uint32 len> <bytes>    blob
+ *
+ * All the numbers are little endian. Numbers are sent as SQLite has them,
+ * without formatting them as text. */
+static void addReplySqlRowBinary(redisClient *c, sqlite3_stmt *stmt,
+                                 int n_cols) {
+    unsigned char nulls[64], *bitmap = nulls;
+    size_t bitmap_len = (n_cols+7)/8, len;
+    int i;
 
-    if (keys) {
-        unlockKeys(c, keys, n_keys);
-        zfree(keys);
+    if (bitmap_len > sizeof(nulls)) bitmap = zmalloc(bitmap_len);
+    memset(bitmap,0,bitmap_len);
+    len = bitmap_len;
+    for (i = 0; i < n_cols; i++) {
+        switch (sqlite3_column_type(stmt,i)) {
+        case SQLITE_NULL:
+            bitmap[i/8] |= 1<<(i%8);
+            break;
+        case SQLITE_INTEGER:
+        case SQLITE_FLOAT:
+            len += 1+8;
+            break;
+        case SQLITE_TEXT:
+            sqlite3_column_text(stmt,i);
+            len += 1+4+sqlite3_column_bytes(stmt,i);
+            break;
+        default:
+            sqlite3_column_blob(stmt,i);
+            len += 1+4+sqlite3_column_bytes(stmt,i);
+        }
     }
 
-    if (rc != SQLITE_OK && rc != SQLITE_DONE) {
-        if (replylen) /* clear the whole reply list */
-            while(listLength(c->reply))
-                listDelNode(c->reply,listFirst(c->reply));
-        addReplyErrorFormat(c,"SQL error: %s\n",sqlite3_errmsg(c->sql_db));
+    addReplyLongLongWithPrefix(c,len,'$');
+    addReplyString(c,(char*)bitmap,bitmap_len);
+    if (bitmap != nulls) zfree(bitmap);
+    for (i = 0; i < n_cols; i++) {
+        unsigned char buf[9];
+        int64_t ll;
+        double d;
+        uint32_t bytes;
+        const void *p;
+
+        switch (sqlite3_column_type(stmt,i)) {
+        case SQLITE_NULL:
+            continue;
+        case SQLITE_INTEGER:
+            buf[0] = 'i';
+            ll = sqlite3_column_int64(stmt,i);
+            memcpy(buf+1,&ll,8);
+            memrev64ifbe(buf+1);
+            addReplyString(c,(char*)buf,9);
+            continue;
+        case SQLITE_FLOAT:
+            buf[0] = 'f';
+            d = sqlite3_column_double(stmt,i);
+            memcpy(buf+1,&d,8);
+            memrev64ifbe(buf+1);
+            addReplyString(c,(char*)buf,9);
+            continue;
+        case SQLITE_TEXT:
+            buf[0] = 's';
+            p = sqlite3_column_text(stmt,i);
+            break;
+        default:
+            buf[0] = 'b';
+            p = sqlite3_column_blob(stmt,i);
+        }
+        bytes = sqlite3_column_bytes(stmt,i);
+        memcpy(buf+1,&bytes,4);
+        memrev32ifbe(buf+1);
+        addReplyString(c,(char*)buf,5);
+        if (bytes) addReplyString(c,(char*)p,bytes);
     }
-    else if (rows_sent > 0)
-        setDeferredMultiBulkLength(c,replylen,rows_sent);
-    else /* number of affected rows */
-        addReplyLongLong(c,sqlite3_changes(c->sql_db));
+    addReply(c,shared.crlf);
+}
+
+/* Reply with the current row of the statement. */
+static void addReplySqlRow(redisClient *c, sqlite3_stmt *stmt, int n_cols) {
+    int i;
 
-    sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_db));
+    if (c->sql_binary) {
+        addReplySqlRowBinary(c,stmt,n_cols);
+        return;
+    }
+    addReplyMultiBulkLen(c,n_cols);
+    for (i=0; i<n_cols; i++) {
+        if (sqlite3_column_type(stmt,i) == SQLITE_INTEGER)
+            addReplyLongLong(c,sqlite3_column_int64(stmt,i));
+        else {
+            char *txt = (char *)sqlite3_column_text(stmt,i);
+            if (!txt)
+                addReply(c,shared.nullbulk);
+            else
+                addReplyBulkCBuffer(c,(void*)txt,sqlite3_column_bytes(stmt,i));
+        }
+    }
+}
 
+/*-----------------------------------------------------------------------------
+ * Prepared statements cache
+ *
+ * Every client keeps the last sql-stmt-cache-size statements it ran
+ * prepared, by SQL text, so that running the same SQL again only needs
+ * binding the parameters and stepping the statement, skipping parsing and
+ * planning it. SQLPREPARE adds a statement to the cache and returns a handle
+ * to it, SQLEXEC <handle> [param ...] runs it. The least recently used
+ * statements are evicted first, after which their handle is unknown.
+ *----------------------------------------------------------------------------*/
+
+typedef struct sqlCachedStmt {
+    sds sql;                /* key in c->sql_stmts */
+    sqlite3_stmt *stmt;
+    long long handle;
+    listNode *node;         /* in c->sql_stmt_lru */
+    dict *tables;           /* see sqlAuthorizer() */
+} sqlCachedStmt;
+
+/* SQL text (sds, owned by the sqlCachedStmt) -> sqlCachedStmt */
+dictType sqlStmtDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+static void sqlStmtCacheStat(long long *counter) {
     pthread_mutex_lock(server.lock);
-    redisAssert(server.sql_threads > 0);
-    server.sql_threads--;
-    server.dirty += sqlite3_changes(c->sql_db); /* THREDIS TODO: if this transaction is rolled back, this is wrong */
+    (*counter)++;
     pthread_mutex_unlock(server.lock);
+}
 
+static void sqlStmtCacheDelete(redisClient *c, sqlCachedStmt *cs) {
+    dictDelete(c->sql_stmts,cs->sql);
+    listDelNode(c->sql_stmt_lru,cs->node);
+    sqlite3_finalize(cs->stmt);
+    dictRelease(cs->tables);
+    sdsfree(cs->sql);
+    zfree(cs);
+}
+
+/* Move the statement at the head of the LRU list. */
+static void sqlStmtCacheTouch(redisClient *c, sqlCachedStmt *cs) {
+    if (cs->node == listFirst(c->sql_stmt_lru)) return;
+    listDelNode(c->sql_stmt_lru,cs->node);
+    listAddNodeHead(c->sql_stmt_lru,cs);
+    cs->node = listFirst(c->sql_stmt_lru);
+}
+
+static sqlCachedStmt *sqlStmtCacheLookup(redisClient *c, sds sql) {
+    dictEntry *de = dictFind(c->sql_stmts,sql);
+    sqlCachedStmt *cs;
+
+    if (de == NULL) return NULL;
+    cs = dictGetVal(de);
+    sqlStmtCacheTouch(c,cs);
+    return cs;
+}
+
+/* Handles are only used by SQLEXEC, and the cache is small: no need for
+ * a second dictionary. */
+static sqlCachedStmt *sqlStmtCacheLookupHandle(redisClient *c, long long handle) {
+    listNode *ln;
+    listIter li;
+
+    listRewind(c->sql_stmt_lru,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        sqlCachedStmt *cs = listNodeValue(ln);
+
+        if (cs->handle == handle) {
+            sqlStmtCacheTouch(c,cs);
+            return cs;
+        }
+    }
+    return NULL;
+}
+
+/* Add a statement to the cache, which takes ownership of it, evicting the
+ * least recently used ones if it is full. The statement is always added,
+ * even with sql-stmt-cache-size 0, for SQLPREPARE. */
+static sqlCachedStmt *sqlStmtCacheAdd(redisClient *c, sds sql, sqlite3_stmt *stmt,
+                                      dict *tables) {
+    sqlCachedStmt *cs;
+
+    while (listLength(c->sql_stmt_lru) > 0 &&
+           listLength(c->sql_stmt_lru) >= (unsigned long)server.sql_stmt_cache_size)
+    {
+        sqlStmtCacheDelete(c,listNodeValue(listLast(c->sql_stmt_lru)));
+        sqlStmtCacheStat(&server.stat_sql_stmt_evictions);
+    }
+
+    cs = zmalloc(sizeof(*cs));
+    cs->sql = sdsdup(sql);
+    cs->stmt = stmt;
+    cs->tables = tables;
+    cs->handle = c->sql_stmt_next_handle++;
+    listAddNodeHead(c->sql_stmt_lru,cs);
+    cs->node = listFirst(c->sql_stmt_lru);
+    dictAdd(c->sql_stmts,cs->sql,cs);
+    return cs;
+}
+
+void sqlStmtCacheRelease(redisClient *c) {
+    while (listLength(c->sql_stmt_lru))
+        sqlStmtCacheDelete(c,listNodeValue(listFirst(c->sql_stmt_lru)));
+    dictRelease(c->sql_stmts);
+    listRelease(c->sql_stmt_lru);
+}
+
+/* Prepare the first statement of the SQL text, skipping comments and white
+ * space. *stmt is set to NULL if there is no statement at all, *leftover
+ * to what follows the statement, and *tables to the tables it uses (see
+ * sqlAuthorizer()), or NULL without a statement. */
+static int sqlPrepare(redisClient *c, const char *sql, sqlite3_stmt **stmt,
+                      const char **leftover, dict **tables) {
+    int rc = SQLITE_OK, retries = 0;
+
+    *stmt = NULL;
+    *leftover = sql;
+    *tables = NULL;
+    while (sql[0]) {
+        c->sql_stmt_tables = dictCreate(&sqlStmtTablesDictType,NULL);
+        rc = sqlite3_blocking_prepare_v2(c->sql_conn->db, sql, -1, stmt, leftover);
+        *tables = c->sql_stmt_tables;
+        c->sql_stmt_tables = NULL;
+        if (rc == SQLITE_OK && *stmt) return rc;
+        dictRelease(*tables);
+        *tables = NULL;
+        if (rc == SQLITE_SCHEMA && (++retries) < 2) continue;
+        if (rc != SQLITE_OK) return rc;
+        sql = *leftover;    /* this happens for a comment or white-space */
+    }
+    return SQLITE_OK;
+}
+
+/* Bind the arguments of the client from argv[first] to the parameters of
+ * the statement and run it, replying with the names and types of the
+ * columns followed by the rows, or with the number of rows changed if it
+ * returns no columns. The statement is reset afterwards so that it can be
+ * run again. Called with the db mutex of the connection held. */
+static int sqlRunStatement(redisClient *c, sqlite3_stmt *stmt, dict *tables,
+                           int first) {
+    int n_cols = sqlite3_column_count(stmt);
+    int rows_sent = 0, n_keys = 0, rc, writes;
+    int autocommit = sqlite3_get_autocommit(c->sql_conn->db);
+    void *replylen = NULL;
+    sqlStmtKey *keys;
+
+    if (n_cols > 0) { /* write column names */
+        replylen = addDeferredMultiBulkLength(c);
+        addReplySqlColumns(c, stmt, n_cols);
+        rows_sent++;
+    }
+
+    /* bind parameters, if any */
+    sqlBindArgs(c, stmt, first, SQLITE_STATIC);
+
+    c->sql_stmt_writes = writes = !sqlite3_stmt_readonly(stmt);
+    keys = sqlLockStmtKeys(c, tables, &n_keys);
+
+    while ((rc = sqlite3_blocking_step(stmt)) == SQLITE_ROW) {
+        sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+        addReplySqlRow(c, stmt, n_cols);
+        rows_sent++;
+        sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+    }
+
+    if (keys) sqlUnlockStmtKeys(c, keys, n_keys);
+    sqlVtabsStatementEnd(c);
+    c->sql_stmt_writes = 0;
+
+    if (rc != SQLITE_DONE) {
+        if (replylen) discardDeferredReply(c, replylen);
+        addReplyErrorFormat(c,"SQL error: %s\n",sqlite3_errmsg(c->sql_conn->db));
+    }
+    else if (rows_sent > 0)
+        setDeferredMultiBulkLength(c,replylen,rows_sent);
+    else /* number of affected rows */
+        addReplyLongLong(c,sqlite3_changes(c->sql_conn->db));
+
+    /* Statements that write, including DDL changing no rows, and the ones
+     * beginning or ending a transaction are propagated to the AOF and the
+     * slaves. sqlite3_changes() is only updated by INSERT, UPDATE and DELETE
+     * so it says nothing about the others. */
+    if (rc == SQLITE_DONE &&
+        (writes || autocommit != sqlite3_get_autocommit(c->sql_conn->db)))
+    {
+        pthread_mutex_lock(server.lock);
+        server.dirty++;
+        pthread_mutex_unlock(server.lock);
+    }
+
+    /* The parameters are bound to the arguments of the client as
+     * SQLITE_STATIC, they must not outlive this command. */
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
 }
 
 void sqlCommand(redisClient *c) {
-    sqlGenericCommand(c, 0);
+    sds sql = c->argv[1]->ptr;
+    sqlite3_stmt *stmt;
+    sqlCachedStmt *cs;
+    const char *leftover;
+    dict *tables;
+    int rc;
+
+    if (sqlClientConn(c) == REDIS_ERR) return;
+    if (sqlThreadEnter(c) == REDIS_ERR) return;
+
+    /* this is necessary to get enlish errors, see http://www.sqlite.org/c3ref/errcode.html */
+    sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+
+    if ((cs = sqlStmtCacheLookup(c, sql)) != NULL) {
+        sqlStmtCacheStat(&server.stat_sql_stmt_hits);
+        sqlRunStatement(c, cs->stmt, cs->tables, 2);
+    } else if ((rc = sqlPrepare(c, sql, &stmt, &leftover, &tables)) != SQLITE_OK) {
+        addReplyErrorFormat(c,"SQL error: %s\n",sqlite3_errmsg(c->sql_conn->db));
+    } else if (!stmt) {
+        addReplyLongLong(c,sqlite3_changes(c->sql_conn->db));
+    } else {
+        sqlStmtCacheStat(&server.stat_sql_stmt_misses);
+        /* Only the first statement of the text is run, so the text can be
+         * cached only if there is nothing else in it. */
+        if (server.sql_stmt_cache_size > 0 &&
+            leftover[strspn(leftover," \t\r\n;")] == '\0')
+        {
+            cs = sqlStmtCacheAdd(c, sql, stmt, tables);
+            sqlRunStatement(c, cs->stmt, cs->tables, 2);
+        } else {
+            sqlRunStatement(c, stmt, tables, 2);
+            sqlite3_finalize(stmt);
+            dictRelease(tables);
+        }
+    }
+
+    sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+
+    sqlThreadLeave(c);
 }
 
 void sqlprepareCommand(redisClient *c) {
-    sqlGenericCommand(c, 1);
+    sds sql = c->argv[1]->ptr;
+    sqlite3_stmt *stmt;
+    sqlCachedStmt *cs;
+    const char *leftover;
+    dict *tables;
+
+    if (sqlClientConn(c) == REDIS_ERR) return;
+    sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+    if ((cs = sqlStmtCacheLookup(c, sql)) != NULL) {
+        sqlStmtCacheStat(&server.stat_sql_stmt_hits);
+        addReplyLongLong(c,cs->handle);
+    } else if (sqlPrepare(c, sql, &stmt, &leftover, &tables) != SQLITE_OK) {
+        addReplyErrorFormat(c,"SQL error: %s\n",sqlite3_errmsg(c->sql_conn->db));
+    } else if (!stmt || leftover[strspn(leftover," \t\r\n;")] != '\0') {
+        if (stmt) {
+            sqlite3_finalize(stmt);
+            dictRelease(tables);
+        }
+        addReplyError(c,"SQLPREPARE takes exactly one SQL statement");
+    } else {
+        sqlStmtCacheStat(&server.stat_sql_stmt_misses);
+        cs = sqlStmtCacheAdd(c, sql, stmt, tables);
+        addReplyLongLong(c,cs->handle);
+    }
+    sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+}
+
+void sqlexecCommand(redisClient *c) {
+    sqlCachedStmt *cs;
+    robj *sql = NULL;
+    long long handle;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[1],&handle,NULL) != REDIS_OK)
+        return;
+    if (sqlClientConn(c) == REDIS_ERR) return;
+    if (sqlThreadEnter(c) == REDIS_ERR) return;
+
+    sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+    if ((cs = sqlStmtCacheLookupHandle(c, handle)) == NULL) {
+        addReplyError(c,"no such prepared statement, evicted or never prepared");
+    } else {
+        sqlStmtCacheStat(&server.stat_sql_stmt_hits);
+        sqlRunStatement(c, cs->stmt, cs->tables, 2);
+        sql = createStringObject(cs->sql,sdslen(cs->sql));
+    }
+    sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+
+    sqlThreadLeave(c);
+
+    /* The handle only means something to the statement cache of this
+     * client: the AOF and the slaves get the statement as SQL <sql> ... */
+    if (sql) {
+        rewriteClientCommandArgument(c,0,
+            resetRefCount(createStringObject("SQL",3)));
+        rewriteClientCommandArgument(c,1,sql);
+        decrRefCount(sql);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * SQL cursors
+ *
+ * SQL replies with the whole result of a statement at once, which for a big
+ * SELECT means holding all of it in the output buffer of the client. A
+ * cursor instead keeps the statement prepared in the client, and every
+ * FETCH steps it only as far as the number of rows asked for:
+ *
+ *   SQLCURSOR OPEN <name> <sql> [param ...]  -> names and types of columns
+ *   SQLCURSOR FETCH <name> <count>           -> up to count rows, none at end
+ *   SQLCURSOR CLOSE <name>                   -> OK
+ *
+ * The statement is finalized as soon as it runs out of rows, releasing the
+ * SQLite tables it reads; until then writers of those tables wait for it,
+ * each tying up a thread of the pool. So that a client that stops fetching
+ * can't hold them forever, clientsCron() finalizes the statement of cursors
+ * not fetched for sql-cursor-timeout seconds, and FETCH then fails.
+ *
+ * The virtual tables of Redis keys iterate the Redis objects directly, and
+ * the keys are locked only while the statement runs, so a cursor can't span
+ * several commands over them: such statements are refused.
+ *----------------------------------------------------------------------------*/
+
+typedef struct sqlCursor {
+    sqlite3_stmt *stmt;     /* NULL once all the rows were fetched */
+    int n_cols;
+    int timedout;           /* stmt finalized by sqlClientCursorsCron() */
+    time_t lastuse;         /* last OPEN or FETCH */
+} sqlCursor;
+
+static void sqlCursorDestructor(void *privdata, void *val) {
+    sqlCursor *cur = val;
+
+    DICT_NOTUSED(privdata);
+    if (cur->stmt) sqlite3_finalize(cur->stmt);
+    zfree(cur);
+}
+
+/* Cursor name (sds) -> sqlCursor */
+dictType sqlCursorDictType = {
+    dictSdsCaseHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCaseCompare,      /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    sqlCursorDestructor         /* val destructor */
+};
+
+static void sqlcursorOpen(redisClient *c) {
+    sqlite3_stmt *stmt = NULL;
+    const char *leftover;
+    dict *tables = NULL;
+    sqlCursor *cur;
+
+    if (dictFind(c->sql_cursors,c->argv[2]->ptr) != NULL) {
+        addReplyError(c,"cursor already open");
+        return;
+    }
+
+    sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+    if (sqlPrepare(c, c->argv[3]->ptr, &stmt, &leftover, &tables) != SQLITE_OK) {
+        addReplyErrorFormat(c,"SQL error: %s\n",sqlite3_errmsg(c->sql_conn->db));
+        goto cleanup;
+    }
+    if (!stmt || leftover[strspn(leftover," \t\r\n;")] != '\0') {
+        addReplyError(c,"a cursor takes exactly one SQL statement");
+        goto cleanup;
+    }
+    if (sqlStmtUsesRedisKeys(c, tables)) {
+        addReplyError(c,"statements over Redis keys can't be used with a cursor, use SQL");
+        goto cleanup;
+    }
+    sqlBindArgs(c, stmt, 4, SQLITE_TRANSIENT);
+
+    cur = zmalloc(sizeof(*cur));
+    cur->stmt = stmt;
+    cur->n_cols = sqlite3_column_count(stmt);
+    cur->timedout = 0;
+    cur->lastuse = server.unixtime;
+    stmt = NULL;
+    dictAdd(c->sql_cursors,sdsdup(c->argv[2]->ptr),cur);
+    addReplySqlColumns(c, cur->stmt, cur->n_cols);
+
+cleanup:
+    if (stmt) sqlite3_finalize(stmt);
+    if (tables) dictRelease(tables);
+    sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+}
+
+static void sqlcursorFetch(redisClient *c, sqlCursor *cur) {
+    long long count;
+    long rows_sent = 0;
+    void *replylen;
+    int rc = SQLITE_DONE;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[3],&count,NULL) != REDIS_OK)
+        return;
+    if (count <= 0) {
+        addReplyError(c,"count should be greater than 0");
+        return;
+    }
+    if (cur->timedout) {
+        addReplyError(c,"cursor timed out, see sql-cursor-timeout");
+        return;
+    }
+    cur->lastuse = server.unixtime;
+    if (!cur->stmt) {
+        addReply(c,shared.emptymultibulk);
+        return;
+    }
+
+    replylen = addDeferredMultiBulkLength(c);
+    sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+    c->sql_cursor_fetch = 1;
+    while (rows_sent < count &&
+           (rc = sqlite3_blocking_step(cur->stmt)) == SQLITE_ROW) {
+        sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+        addReplySqlRow(c, cur->stmt, cur->n_cols);
+        rows_sent++;
+        sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+    }
+
+    if (rc != SQLITE_ROW) {
+        /* Done, or failed: either way the statement is of no more use. */
+        if (rc != SQLITE_DONE) {
+            discardDeferredReply(c, replylen);
+            addReplyErrorFormat(c,"SQL error: %s\n",sqlite3_errmsg(c->sql_conn->db));
+        }
+        sqlite3_finalize(cur->stmt);
+        cur->stmt = NULL;
+    }
+    c->sql_cursor_fetch = 0;
+    sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE)
+        setDeferredMultiBulkLength(c,replylen,rows_sent);
+}
+
+/* Called by clientsCron() with the client locked: finalize the statement of
+ * the cursors of the client idle for more than sql-cursor-timeout seconds,
+ * releasing the tables they read. */
+void sqlClientCursorsCron(redisClient *c) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (c->sql_conn == NULL || server.sql_cursor_timeout == 0 ||
+        dictSize(c->sql_cursors) == 0) return;
+
+    sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+    di = dictGetIterator(c->sql_cursors);
+    while((de = dictNext(di)) != NULL) {
+        sqlCursor *cur = dictGetVal(de);
+
+        if (cur->stmt &&
+            server.unixtime - cur->lastuse > server.sql_cursor_timeout)
+        {
+            redisLog(REDIS_VERBOSE,"Closing idle SQL cursor %s",
+                (char*)dictGetKey(de));
+            sqlite3_finalize(cur->stmt);
+            cur->stmt = NULL;
+            cur->timedout = 1;
+        }
+    }
+    dictReleaseIterator(di);
+    sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+}
+
+void sqlcursorCommand(redisClient *c) {
+    sqlCursor *cur = NULL;
+    char *sub = c->argv[1]->ptr;
+    dictEntry *de;
+
+    if (sqlClientConn(c) == REDIS_ERR) return;
+    if (!strcasecmp(sub,"open")) {
+        if (c->argc < 4) goto syntaxerr;
+        if (sqlThreadEnter(c) == REDIS_ERR) return;
+        sqlcursorOpen(c);
+        sqlThreadLeave(c);
+        return;
+    }
+
+    if ((de = dictFind(c->sql_cursors,c->argv[2]->ptr)) != NULL)
+        cur = dictGetVal(de);
+
+    if (!strcasecmp(sub,"fetch")) {
+        if (c->argc != 4) goto syntaxerr;
+        if (!cur) {
+            addReplyError(c,"no such cursor");
+            return;
+        }
+        if (sqlThreadEnter(c) == REDIS_ERR) return;
+        sqlcursorFetch(c,cur);
+        sqlThreadLeave(c);
+    } else if (!strcasecmp(sub,"close")) {
+        if (c->argc != 3) goto syntaxerr;
+        if (!cur) {
+            addReplyError(c,"no such cursor");
+            return;
+        }
+        sqlite3_mutex_enter(sqlite3_db_mutex(c->sql_conn->db));
+        dictDelete(c->sql_cursors,c->argv[2]->ptr);
+        sqlite3_mutex_leave(sqlite3_db_mutex(c->sql_conn->db));
+        addReply(c,shared.ok);
+    } else {
+        addReplyErrorFormat(c,
+            "Unknown SQLCURSOR subcommand or wrong # of args '%s'", sub);
+    }
+    return;
+
+syntaxerr:
+    addReplyErrorFormat(c,
+        "Unknown SQLCURSOR subcommand or wrong # of args '%s'", sub);
+}
+
+/* SQLFORMAT [TEXT|BINARY]
+ *
+ * Set how SQL, SQLEXEC and SQLCURSOR FETCH reply with the rows of the
+ * statements for this connection: a multi bulk of the columns (TEXT, the
+ * default) or a bulk string per row, see addReplySqlRowBinary(). Without
+ * argument, reply with the current format. */
+void sqlformatCommand(redisClient *c) {
+    if (c->argc == 1) {
+        addReplyStatus(c,c->sql_binary ? "binary" : "text");
+    } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"text")) {
+        c->sql_binary = 0;
+        addReply(c,shared.ok);
+    } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"binary")) {
+        c->sql_binary = 1;
+        addReply(c,shared.ok);
+    } else {
+        addReply(c,shared.syntaxerr);
+    }
 }
 
 int loadOrSaveDb(sqlite3 *inmemory, const char *filename, int is_save) {
@@ -891,17 +2912,405 @@ int loadOrSaveDb(sqlite3 *inmemory, const char *filename, int is_save) {
     return rc;
 }
 
-void sqlsaveCommand(redisClient *c) {
+/*-----------------------------------------------------------------------------
+ * WAL checkpoints
+ *
+ * With sql-wal the SQL DB is always on disk and commits are appended to its
+ * WAL: there is nothing to save, but the WAL has to be copied back to the DB
+ * from time to time. Rather than have the connection committing do it when
+ * the WAL grows past sql-wal-checkpoint pages, sqlWalHook() queues a passive
+ * checkpoint to a bio.c thread, which neither waits for the readers nor
+ * holds the writers off. BGSAVE queues one too. SQLSAVE queues a restarting
+ * one, which waits for the readers so that the WAL starts over, and replies
+ * once it is done (see sqlSaveCron()).
+ *----------------------------------------------------------------------------*/
+
+static pthread_mutex_t sqlWalMutex = PTHREAD_MUTEX_INITIALIZER;
+static int sqlWalPages;                 /* pages in the WAL, last commit */
+static int sqlWalCheckpointQueued;
+static int sqlWalRestartQueued;         /* queued by SQLSAVE */
+static int sqlWalRestartStatus = REDIS_OK;
+static long long sqlWalCheckpoints;
+static int sqlWalLastStatus = REDIS_OK;
+static long long sqlWalLastUs = -1;
+
+static void sqlCheckpointBackground(void) {
+    pthread_mutex_lock(&sqlWalMutex);
+    if (!sqlWalCheckpointQueued) {
+        sqlWalCheckpointQueued = 1;
+        bioCreateBackgroundJob(REDIS_BIO_SQL_CHECKPOINT,
+            (void*)(long)SQLITE_CHECKPOINT_PASSIVE,NULL,NULL);
+    }
+    pthread_mutex_unlock(&sqlWalMutex);
+}
 
-    if (loadOrSaveDb(server.sql_db, server.sql_filename, 1) != SQLITE_OK)
-        addReplyError(c,"Error while saving SQL data.");
-    else
-        addReply(c, shared.ok);
+/* Called by SQLite after every commit, with the pages in the WAL. */
+static int sqlWalHook(void *arg, sqlite3 *db, const char *name, int pages) {
+    REDIS_NOTUSED(arg);
+    REDIS_NOTUSED(db);
+    REDIS_NOTUSED(name);
+
+    pthread_mutex_lock(&sqlWalMutex);
+    sqlWalPages = pages;
+    pthread_mutex_unlock(&sqlWalMutex);
+    if (server.sql_wal_checkpoint && pages >= server.sql_wal_checkpoint)
+        sqlCheckpointBackground();
+    return SQLITE_OK;
+}
+
+/* Checkpoint the WAL, mode is one of SQLITE_CHECKPOINT_*. Called by the
+ * bio.c thread. */
+int sqlCheckpoint(int mode) {
+    long long start = ustime();
+    int rc, pages, done;
+
+    rc = sqlite3_wal_checkpoint_v2(sqlCheckpointDb, NULL, mode, &pages, &done);
+    if (rc != SQLITE_OK)
+        redisLog(REDIS_WARNING, "Error checkpointing the SQL DB WAL: %s",
+                 sqlite3_errmsg(sqlCheckpointDb));
+    pthread_mutex_lock(&sqlWalMutex);
+    if (mode == SQLITE_CHECKPOINT_PASSIVE) sqlWalCheckpointQueued = 0;
+    if (mode == SQLITE_CHECKPOINT_RESTART) {
+        sqlWalRestartQueued = 0;
+        sqlWalRestartStatus = rc == SQLITE_OK ? REDIS_OK : REDIS_ERR;
+        if (rc == SQLITE_OK) sqlWalPages = 0;
+    }
+    sqlWalCheckpoints++;
+    sqlWalLastStatus = rc == SQLITE_OK ? REDIS_OK : REDIS_ERR;
+    sqlWalLastUs = ustime()-start;
+    pthread_mutex_unlock(&sqlWalMutex);
+    return rc == SQLITE_OK ? REDIS_OK : REDIS_ERR;
+}
+
+static sds genSqlWalInfoString(sds info) {
+    pthread_mutex_lock(&sqlWalMutex);
+    info = sdscatprintf(info,
+        "sqlite_wal_pages:%d\r\n"
+        "sqlite_wal_checkpoints:%lld\r\n"
+        "sqlite_wal_checkpoint_in_progress:%d\r\n"
+        "sqlite_last_checkpoint_status:%s\r\n"
+        "sqlite_last_checkpoint_time_ms:%lld\r\n",
+        sqlWalPages, sqlWalCheckpoints,
+        sqlWalCheckpointQueued || sqlWalRestartQueued,
+        sqlWalLastStatus == REDIS_OK ? "ok" : "err",
+        sqlWalLastUs == -1 ? -1 : sqlWalLastUs/1000);
+    pthread_mutex_unlock(&sqlWalMutex);
+    return info;
+}
+
+/*-----------------------------------------------------------------------------
+ * Saving
+ *
+ * The SQL DB is saved by a child process, by SQLSAVE as well as by BGSAVE:
+ * the parent only holds an exclusive transaction on the DB while it forks,
+ * so that the child gets a consistent copy of it, and SQL writers go on
+ * while the child copies it to the file.
+ *
+ * The child uses SQLite, so it must not be forked while another thread
+ * could hold one of its mutexes. SQLSAVE only queues its client, blocked:
+ * sqlSaveCron() forks from the main thread once no SQL statement runs,
+ * and replies to the clients when it reaps the child. The SQLite backup of an in-memory
+ * DB starts over every time the DB is written, so it can't be copied in
+ * place while it is in use.
+ *
+ * The child copies REDIS_SQL_SAVE_PAGES pages at a time to a temp file,
+ * renamed when complete, and reports its progress in sqlSaveState, which
+ * is shared with the parent, for INFO. With sql-wal the child doesn't save
+ * the SQL DB, BGSAVE checkpoints it instead.
+ *----------------------------------------------------------------------------*/
+
+#define REDIS_SQL_SAVE_PAGES 256
+
+typedef struct sqlSaveState {
+    pid_t pid;              /* child saving, 0 while forking, -1 if none */
+    long long start;        /* ustime() of the fork */
+    long long fork_us;      /* SQL writers locked out while forking */
+    int pages;              /* pages of the DB, set by the child */
+    int pages_done;         /* pages copied, set by the child */
+    int last_status;        /* REDIS_OK or REDIS_ERR */
+    long long last_us;      /* duration of the last save */
+} sqlSaveState;
+
+static sqlSaveState *sqlSave;   /* in shared memory */
+static pthread_mutex_t sqlSaveMutex = PTHREAD_MUTEX_INITIALIZER;
+static list *sqlSaveRequests;   /* SQLSAVE clients waiting for a fork */
+static list *sqlSaveWaiters;    /* SQLSAVE clients waiting for the child */
+static pid_t sqlSaveChildPid = -1; /* child forked by sqlSaveCron() */
+
+static void sqlSaveInit(void) {
+    sqlSave = mmap(NULL,sizeof(*sqlSave),PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    if (sqlSave == MAP_FAILED) {
+        redisLog(REDIS_WARNING, "Can't map the SQL save state: %s", strerror(errno));
+        exit(1);
+    }
+    memset(sqlSave,0,sizeof(*sqlSave));
+    sqlSave->pid = -1;
+    sqlSave->last_status = REDIS_OK;
+    sqlSave->last_us = -1;
+    sqlSaveRequests = listCreate();
+    sqlSaveWaiters = listCreate();
+}
+
+/* Take the exclusive transaction on the DB before fork(), unless a save is
+ * already in progress. */
+int sqlSaveBegin(void) {
+    int retval = REDIS_ERR;
+
+    if (server.sql_wal) return REDIS_OK;
+    pthread_mutex_lock(&sqlSaveMutex);
+    if (sqlSave->pid == -1) {
+        sqlSave->start = ustime();
+        if (sqlExclusiveLock() == SQLITE_OK) {
+            sqlSave->pid = 0;
+            sqlSave->pages = sqlSave->pages_done = 0;
+            retval = REDIS_OK;
+        }
+    }
+    pthread_mutex_unlock(&sqlSaveMutex);
+    return retval;
+}
+
+/* Called by the parent after fork(), childpid -1 if it failed. */
+void sqlSaveForked(pid_t childpid) {
+    if (server.sql_wal) {
+        if (childpid != -1) sqlCheckpointBackground();
+        return;
+    }
+    if (sqlExclusiveUnlock())
+        redisPanic("Error releasing exclusive lock after fork()");
+    pthread_mutex_lock(&sqlSaveMutex);
+    sqlSave->pid = childpid;
+    sqlSave->fork_us = ustime()-sqlSave->start;
+    sqlSave->start += sqlSave->fork_us;
+    pthread_mutex_unlock(&sqlSaveMutex);
+}
+
+/* Called by the parent when the child saving exited. */
+void sqlSaveDone(pid_t childpid, int ok) {
+    char tmpfile[256];
+
+    pthread_mutex_lock(&sqlSaveMutex);
+    if (childpid > 0 && sqlSave->pid == childpid) {
+        sqlSave->pid = -1;
+        sqlSave->last_status = ok ? REDIS_OK : REDIS_ERR;
+        sqlSave->last_us = ustime()-sqlSave->start;
+    }
+    pthread_mutex_unlock(&sqlSaveMutex);
+    if (!ok) {
+        snprintf(tmpfile,256,"temp-%d.sqlite",(int)childpid);
+        unlink(tmpfile);
+    }
+}
+
+/* Save the SQL DB to filename, in the child. */
+int sqlSaveChild(const char *filename) {
+    char tmpfile[256];
+    sqlite3 *file;
+    sqlite3_backup *backup;
+    sds err = NULL;
+    int rc;
+
+    if (server.sql_wal) return REDIS_OK;
+
+    /* The transaction taken by sqlSaveBegin() was copied by fork(). */
+    sqlExclusiveUnlock();
+
+    snprintf(tmpfile,256,"temp-%d.sqlite",(int)getpid());
+    unlink(tmpfile);
+    if ((rc = sqlite3_open(tmpfile, &file)) == SQLITE_OK) {
+        if ((backup = sqlite3_backup_init(file, "main", server.sql_db, "main"))) {
+            do {
+                rc = sqlite3_backup_step(backup, REDIS_SQL_SAVE_PAGES);
+                sqlSave->pages = sqlite3_backup_pagecount(backup);
+                sqlSave->pages_done = sqlSave->pages-sqlite3_backup_remaining(backup);
+            } while (rc == SQLITE_OK);
+            if (sqlite3_backup_finish(backup) == SQLITE_OK && rc == SQLITE_DONE)
+                rc = SQLITE_OK;
+            else if (rc == SQLITE_DONE)
+                rc = sqlite3_errcode(file);
+        } else
+            rc = sqlite3_errcode(file);
+    }
+    if (rc != SQLITE_OK) err = sdsnew(sqlite3_errmsg(file));
+    sqlite3_close(file);
+
+    if (rc == SQLITE_OK && rename(tmpfile,filename) == -1) {
+        redisLog(REDIS_WARNING, "Error moving temp SQL DB file on the final destination: %s", strerror(errno));
+        unlink(tmpfile);
+        return REDIS_ERR;
+    }
+    if (rc != SQLITE_OK) {
+        redisLog(REDIS_WARNING, "Error saving SQL DB [%s] on disk: %s", filename, err);
+        sdsfree(err);
+        unlink(tmpfile);
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE,"SQL DB [%s] saved on disk", filename);
+    return REDIS_OK;
+}
+
+sds genSqlSaveInfoString(sds info) {
+    sqlSaveState s;
+
+    info = sdscatprintf(info,"sqlite_wal:%d\r\n",server.sql_wal);
+    if (server.sql_wal) return genSqlWalInfoString(info);
+    pthread_mutex_lock(&sqlSaveMutex);
+    s = *sqlSave;
+    pthread_mutex_unlock(&sqlSaveMutex);
+    return sdscatprintf(info,
+        "sqlite_save_in_progress:%d\r\n"
+        "sqlite_save_pages:%d\r\n"
+        "sqlite_save_pages_done:%d\r\n"
+        "sqlite_save_current_time_ms:%lld\r\n"
+        "sqlite_last_save_status:%s\r\n"
+        "sqlite_last_save_time_ms:%lld\r\n"
+        "sqlite_last_save_fork_usec:%lld\r\n",
+        s.pid != -1, s.pages, s.pages_done,
+        s.pid != -1 ? (ustime()-s.start)/1000 : -1,
+        s.last_status == REDIS_OK ? "ok" : "err",
+        s.last_us == -1 ? -1 : s.last_us/1000,
+        s.fork_us);
+}
+
+/* Reply to the SQLSAVE clients of the list, with err if not NULL, and let
+ * them run their next commands. */
+static void sqlSaveReply(list *clients, char *err) {
+    while (listLength(clients)) {
+        listNode *ln = listFirst(clients);
+        redisClient *c = listNodeValue(ln);
+
+        listDelNode(clients,ln);
+        pthread_mutex_lock(c->lock);
+        if (err)
+            addReplyError(c,err);
+        else
+            addReply(c,shared.ok);
+        pthread_mutex_lock(server.lock);
+        c->flags &= ~REDIS_BLOCKED;
+        c->flags |= REDIS_UNBLOCKED;
+        listAddNodeTail(server.unblocked_clients,c);
+        pthread_mutex_unlock(server.lock);
+        pthread_mutex_unlock(c->lock);
+    }
+}
+
+/* The clients asking for a save from now on need a save of their own. */
+static void sqlSaveTakeRequests(void) {
+    pthread_mutex_lock(&sqlSaveMutex);
+    while (listLength(sqlSaveRequests)) {
+        listNode *ln = listFirst(sqlSaveRequests);
+
+        listAddNodeTail(sqlSaveWaiters,listNodeValue(ln));
+        listDelNode(sqlSaveRequests,ln);
+    }
+    pthread_mutex_unlock(&sqlSaveMutex);
+}
+
+/* WAL mode: reply to the SQLSAVE clients once the restarting checkpoint
+ * queued for them is done, and queue one for the clients that asked
+ * since. */
+static void sqlSaveCheckpointCron(void) {
+    int queued, status;
+
+    pthread_mutex_lock(&sqlWalMutex);
+    queued = sqlWalRestartQueued;
+    status = sqlWalRestartStatus;
+    pthread_mutex_unlock(&sqlWalMutex);
+    if (queued) return;
+    sqlSaveReply(sqlSaveWaiters,
+        status == REDIS_OK ? NULL : "Error while checkpointing SQL data.");
+    if (listLength(sqlSaveRequests) == 0) return;
+
+    sqlSaveTakeRequests();
+    pthread_mutex_lock(&sqlWalMutex);
+    sqlWalRestartQueued = 1;
+    bioCreateBackgroundJob(REDIS_BIO_SQL_CHECKPOINT,
+        (void*)(long)SQLITE_CHECKPOINT_RESTART,NULL,NULL);
+    pthread_mutex_unlock(&sqlWalMutex);
+}
+
+/* Called by serverCron(): reap the child of SQLSAVE, and fork a new one for
+ * the clients that asked for a save since. */
+void sqlSaveCron(void) {
+    pid_t childpid;
+    int statloc, ok, err;
+
+    if (server.sql_wal) {
+        sqlSaveCheckpointCron();
+        return;
+    }
+    if (sqlSaveChildPid != -1) {
+        if ((childpid = waitpid(sqlSaveChildPid,&statloc,WNOHANG)) == 0)
+            return;
+        ok = childpid == sqlSaveChildPid &&
+             WIFEXITED(statloc) && WEXITSTATUS(statloc) == 0;
+        sqlSaveDone(sqlSaveChildPid,ok);
+        sqlSaveChildPid = -1;
+        sqlSaveReply(sqlSaveWaiters, ok ? NULL : "Error while saving SQL data.");
+    }
+    if (listLength(sqlSaveRequests) == 0) return;
+
+    /* No SQL statement can start while the server lock is held. The
+     * exclusive transaction fails while a BGSAVE child saves the DB or a
+     * cursor reads it: try again at the next call. */
+    pthread_mutex_lock(server.lock);
+    if (server.sql_threads != 0 || sqlSaveBegin() != REDIS_OK) {
+        pthread_mutex_unlock(server.lock);
+        return;
+    }
+    if ((childpid = fork()) == 0) {
+        /* Child */
+        if (server.ipfd > 0) close(server.ipfd);
+        if (server.sofd > 0) close(server.sofd);
+        exitFromChild(sqlSaveChild(server.sql_filename) == REDIS_OK ? 0 : 1);
+    }
+    err = errno;
+    sqlSaveForked(childpid);
+    pthread_mutex_unlock(server.lock);
+
+    sqlSaveTakeRequests();
+    if (childpid == -1) {
+        redisLog(REDIS_WARNING,"Can't save the SQL DB: fork: %s",strerror(err));
+        sqlSaveReply(sqlSaveWaiters,"Can't save the SQL DB: fork failed");
+        return;
+    }
+    sqlSaveChildPid = childpid;
+}
+
+/* Called by freeClient() for a client blocked in SQLSAVE. */
+void sqlSaveUnblockClient(redisClient *c) {
+    listNode *ln;
+
+    pthread_mutex_lock(&sqlSaveMutex);
+    if ((ln = listSearchKey(sqlSaveRequests,c)) != NULL)
+        listDelNode(sqlSaveRequests,ln);
+    else if ((ln = listSearchKey(sqlSaveWaiters,c)) != NULL)
+        listDelNode(sqlSaveWaiters,ln);
+    pthread_mutex_unlock(&sqlSaveMutex);
+    c->flags &= ~REDIS_BLOCKED;
+}
+
+/* Save the SQL DB in a child like BGSAVE, or checkpoint the WAL in WAL
+ * mode, replying once done. The client is blocked meanwhile, see
+ * sqlSaveCron(). */
+void sqlsaveCommand(redisClient *c) {
+    if (c->flags & (REDIS_MULTI|REDIS_LUA_CLIENT) || c->fd == -1) {
+        addReplyError(c,"SQLSAVE can't block this client, use BGSAVE");
+        return;
+    }
+    pthread_mutex_lock(&sqlSaveMutex);
+    listAddNodeTail(sqlSaveRequests,c);
+    pthread_mutex_unlock(&sqlSaveMutex);
+    c->bpop.timeout = 0;
+    c->flags |= REDIS_BLOCKED;
 }
 
 void sqlloadCommand(redisClient *c) {
 
-    if (loadOrSaveDb(server.sql_db, server.sql_filename, 0) != SQLITE_OK)
+    if (server.sql_wal)
+        addReplyError(c,"The SQL DB is not in memory with sql-wal yes.");
+    else if (loadOrSaveDb(server.sql_db, server.sql_filename, 0) != SQLITE_OK)
         // THREDIS TODO - should we panic?
         addReplyError(c,"Error while loading SQL data.");
     else
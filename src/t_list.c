@@ -1077,7 +1077,10 @@ void handleClientsBlockedOnLists(void) {
                 
                 if (listTypeLength(o) == 0) dbDelete(rl->db,rl->key);
                 /* We don't call signalModifiedKey() as it was already called
-                 * when an element was pushed on the list. */
+                 * when an element was pushed on the list. But a reply cached
+                 * since then, by a command of the same MULTI or by a thread,
+                 * still has the elements popped above. */
+                replyCacheInvalidateKey(rl->db,rl->key);
             }
 
             /* Free this item. */
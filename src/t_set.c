@@ -621,6 +621,164 @@ int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
     return setTypeSize(*(robj**)s1)-setTypeSize(*(robj**)s2);
 }
 
+/* Return true if the member of sets[0], as returned by setTypeNext() with
+ * the given encoding, is a member of every other set (REDIS_OP_INTER) or of
+ * none of them (REDIS_OP_DIFF, where NULL sets are missing keys). Sets are
+ * only read: this can run in several threads at the same time. */
+static int setProbeMember(robj **sets, unsigned long setnum, int op,
+                          int encoding, robj *eleobj, int64_t intobj)
+{
+    unsigned long j;
+    int found;
+
+    for (j = 1; j < setnum; j++) {
+        if (sets[j] == NULL) continue;
+        if (sets[j] == sets[0]) {
+            found = 1;
+        } else if (encoding == REDIS_ENCODING_INTSET) {
+            /* intset with intset is simple... and fast */
+            if (sets[j]->encoding == REDIS_ENCODING_INTSET) {
+                found = intsetFind((intset*)sets[j]->ptr,intobj);
+            /* in order to compare an integer with an object we
+             * have to use the generic function, creating an object
+             * for this */
+            } else {
+                eleobj = createStringObjectFromLongLong(intobj);
+                found = setTypeIsMember(sets[j],eleobj);
+                decrRefCount(eleobj);
+            }
+        } else {
+            /* Optimization... if the source object is integer
+             * encoded AND the target set is an intset, we can get
+             * a much faster path. */
+            if (eleobj->encoding == REDIS_ENCODING_INT &&
+                sets[j]->encoding == REDIS_ENCODING_INTSET)
+            {
+                found = intsetFind((intset*)sets[j]->ptr,(long)eleobj->ptr);
+            /* else... object to object check is easy as we use the
+             * type agnostic API here. */
+            } else {
+                found = setTypeIsMember(sets[j],eleobj);
+            }
+        }
+        if (op == REDIS_OP_INTER && !found) return 0;
+        if (op == REDIS_OP_DIFF && found) return 0;
+    }
+    return 1;
+}
+
+/* The probe phase of SINTER and SDIFF (testing every member of the first set
+ * against the other sets) of big sets is split in parts run in parallel by
+ * the threads of the pool: every part probes a range of the positions of an
+ * intset, or of the buckets of a hash table, and collects the members that
+ * pass. Concatenating the parts gives the members in iteration order. */
+typedef struct {
+    robj **ele;
+    unsigned long len, size;
+} setProbeResult;
+
+typedef struct {
+    robj **sets;
+    unsigned long setnum;
+    int op;
+    int parts;
+    setProbeResult *results;
+} setProbeJob;
+
+typedef struct {
+    setProbeJob *job;
+    setProbeResult *r;
+} setProbeScan;
+
+static void setProbeResultAdd(setProbeResult *r, robj *ele) {
+    if (r->len == r->size) {
+        r->size = r->size ? r->size*2 : 64;
+        r->ele = zrealloc(r->ele,sizeof(robj*)*r->size);
+    }
+    r->ele[r->len++] = ele;
+}
+
+static void setProbeEntry(void *privdata, const dictEntry *de) {
+    setProbeScan *scan = privdata;
+    robj *ele = dictGetKey(de);
+
+    if (setProbeMember(scan->job->sets,scan->job->setnum,scan->job->op,
+                       REDIS_ENCODING_HT,ele,0))
+    {
+        incrRefCount(ele);
+        setProbeResultAdd(scan->r,ele);
+    }
+}
+
+static void setProbePart(void *arg, int part) {
+    setProbeJob *job = arg;
+    setProbeResult *r = job->results+part;
+    robj *set = job->sets[0];
+
+    if (set->encoding == REDIS_ENCODING_INTSET) {
+        intset *is = set->ptr;
+        uint32_t pos, end;
+        int64_t intobj;
+
+        pos = (uint64_t)intsetLen(is)*part/job->parts;
+        end = (uint64_t)intsetLen(is)*(part+1)/job->parts;
+        for (; pos < end; pos++) {
+            intsetGet(is,pos,&intobj);
+            if (setProbeMember(job->sets,job->setnum,job->op,
+                               REDIS_ENCODING_INTSET,NULL,intobj))
+                setProbeResultAdd(r,createStringObjectFromLongLong(intobj));
+        }
+    } else {
+        dict *d = set->ptr;
+        setProbeScan scan;
+        unsigned long buckets = dictBuckets(d);
+
+        scan.job = job;
+        scan.r = r;
+        dictScanBuckets(d,buckets/job->parts*part,
+                        part == job->parts-1 ? buckets :
+                        buckets/job->parts*(part+1),
+                        setProbeEntry,&scan);
+    }
+}
+
+/* Probe sets[0] against the other sets in "parts" parts. Returns the results
+ * of the parts, to be released with setProbeRelease(). */
+static setProbeResult *setProbeParallel(robj **sets, unsigned long setnum,
+                                        int op, int parts)
+{
+    setProbeJob job;
+
+    job.sets = sets;
+    job.setnum = setnum;
+    job.op = op;
+    job.parts = parts;
+    job.results = zcalloc(sizeof(setProbeResult)*parts);
+    threadpool_run_parallel(server.tpool,parts,setProbePart,&job);
+    return job.results;
+}
+
+static void setProbeRelease(setProbeResult *results, int parts) {
+    unsigned long k;
+    int i;
+
+    for (i = 0; i < parts; i++) {
+        for (k = 0; k < results[i].len; k++)
+            decrRefCount(results[i].ele[k]);
+        zfree(results[i].ele);
+    }
+    zfree(results);
+}
+
+/* Return true if every set is intset encoded. */
+static int setAllIntsets(robj **sets, unsigned long setnum) {
+    unsigned long j;
+
+    for (j = 0; j < setnum; j++)
+        if (sets[j]->encoding != REDIS_ENCODING_INTSET) return 0;
+    return 1;
+}
+
 void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum, robj *dstkey) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
     setTypeIterator *si;
@@ -628,7 +786,7 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
     int64_t intobj;
     void *replylen = NULL;
     unsigned long j, cardinality = 0;
-    int encoding;
+    int encoding, parts;
     robj **keys = zmalloc(sizeof(robj*)*(setnum+1));
     int n_keys;
 
@@ -653,6 +811,8 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
             } else {
                 addReply(c,shared.emptymultibulk);
             }
+            unlockKeys(c,keys,n_keys);
+            zfree(keys);
             return;
         }
         if (checkType(c,setobj,REDIS_SET)) {
@@ -680,67 +840,77 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
         dstset = createIntsetObject();
     }
 
-    /* Iterate all the elements of the first (smallest) set, and test
-     * the element against all the other sets, if at least one set does
-     * not include the element it is discarded */
-    si = setTypeInitIterator(sets[0]);
-    while((encoding = setTypeNext(si,&eleobj,&intobj)) != -1) {
-        for (j = 1; j < setnum; j++) {
-            if (sets[j] == sets[0]) continue;
-            if (encoding == REDIS_ENCODING_INTSET) {
-                /* intset with intset is simple... and fast */
-                if (sets[j]->encoding == REDIS_ENCODING_INTSET &&
-                    !intsetFind((intset*)sets[j]->ptr,intobj))
-                {
-                    break;
-                /* in order to compare an integer with an object we
-                 * have to use the generic function, creating an object
-                 * for this */
-                } else if (sets[j]->encoding == REDIS_ENCODING_HT) {
-                    eleobj = createStringObjectFromLongLong(intobj);
-                    if (!setTypeIsMember(sets[j],eleobj)) {
-                        decrRefCount(eleobj);
-                        break;
-                    }
-                    decrRefCount(eleobj);
-                }
-            } else if (encoding == REDIS_ENCODING_HT) {
-                /* Optimization... if the source object is integer
-                 * encoded AND the target set is an intset, we can get
-                 * a much faster path. */
-                if (eleobj->encoding == REDIS_ENCODING_INT &&
-                    sets[j]->encoding == REDIS_ENCODING_INTSET &&
-                    !intsetFind((intset*)sets[j]->ptr,(long)eleobj->ptr))
-                {
-                    break;
-                /* else... object to object check is easy as we use the
-                 * type agnostic API here. */
-                } else if (!setTypeIsMember(sets[j],eleobj)) {
-                    break;
-                }
+    if (setnum > 1 && setAllIntsets(sets,setnum)) {
+        /* Intsets are sorted: intersect them with a merge. */
+        intset **intsets = zmalloc(sizeof(intset*)*setnum);
+        int64_t *values;
+        uint32_t k, count;
+
+        for (j = 0; j < setnum; j++) intsets[j] = sets[j]->ptr;
+        values = zmalloc(sizeof(int64_t)*(intsetLen(intsets[0])+1));
+        count = intsetIntersect(intsets,setnum,values);
+        if (!dstkey) {
+            for (k = 0; k < count; k++)
+                addReplyBulkLongLong(c,values[k]);
+            cardinality = count;
+        } else if (count <= server.set_max_intset_entries) {
+            zfree(dstset->ptr);
+            dstset->ptr = intsetFromSorted(values,count);
+        } else {
+            for (k = 0; k < count; k++) {
+                eleobj = createStringObjectFromLongLong(values[k]);
+                setTypeAdd(dstset,eleobj);
+                decrRefCount(eleobj);
             }
         }
-
-        /* Only take action when all sets contain the member */
-        if (j == setnum) {
-            if (!dstkey) {
-                if (encoding == REDIS_ENCODING_HT)
-                    addReplyBulk(c,eleobj);
+        zfree(values);
+        zfree(intsets);
+    } else if ((parts = parallelCommandParts(
+                    (long long)setTypeSize(sets[0])*(setnum-1))) > 1)
+    {
+        setProbeResult *results = setProbeParallel(sets,setnum,
+                                                   REDIS_OP_INTER,parts);
+        unsigned long k;
+
+        for (j = 0; j < (unsigned long)parts; j++) {
+            for (k = 0; k < results[j].len; k++) {
+                if (!dstkey)
+                    addReplyBulk(c,results[j].ele[k]);
                 else
-                    addReplyBulkLongLong(c,intobj);
-                cardinality++;
-            } else {
-                if (encoding == REDIS_ENCODING_INTSET) {
-                    eleobj = createStringObjectFromLongLong(intobj);
-                    setTypeAdd(dstset,eleobj);
-                    decrRefCount(eleobj);
+                    setTypeAdd(dstset,results[j].ele[k]);
+            }
+            cardinality += results[j].len;
+        }
+        setProbeRelease(results,parts);
+    } else {
+        /* Iterate all the elements of the first (smallest) set, and test
+         * the element against all the other sets, if at least one set does
+         * not include the element it is discarded */
+        si = setTypeInitIterator(sets[0]);
+        while((encoding = setTypeNext(si,&eleobj,&intobj)) != -1) {
+            /* Only take action when all sets contain the member */
+            if (setProbeMember(sets,setnum,REDIS_OP_INTER,encoding,
+                               eleobj,intobj))
+            {
+                if (!dstkey) {
+                    if (encoding == REDIS_ENCODING_HT)
+                        addReplyBulk(c,eleobj);
+                    else
+                        addReplyBulkLongLong(c,intobj);
+                    cardinality++;
                 } else {
-                    setTypeAdd(dstset,eleobj);
+                    if (encoding == REDIS_ENCODING_INTSET) {
+                        eleobj = createStringObjectFromLongLong(intobj);
+                        setTypeAdd(dstset,eleobj);
+                        decrRefCount(eleobj);
+                    } else {
+                        setTypeAdd(dstset,eleobj);
+                    }
                 }
             }
         }
+        setTypeReleaseIterator(si);
     }
-    setTypeReleaseIterator(si);
 
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
@@ -779,7 +949,7 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
     robj **sets = zmalloc(sizeof(robj*)*setnum);
     setTypeIterator *si;
     robj *ele, *dstset = NULL;
-    int j, cardinality = 0;
+    int j, cardinality = 0, parts;
     robj **keys = zmalloc(sizeof(robj*)*(setnum+1));
     int n_keys;
 
@@ -811,29 +981,47 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
      * this set object will be the resulting object to set into the target key*/
     dstset = createIntsetObject();
 
-    /* Iterate all the elements of all the sets, add every element a single
-     * time to the result set */
-    for (j = 0; j < setnum; j++) {
-        if (op == REDIS_OP_DIFF && j == 0 && !sets[j]) break; /* result set is empty */
-        if (!sets[j]) continue; /* non existing keys are like empty sets */
-
-        si = setTypeInitIterator(sets[j]);
-        while((ele = setTypeNextObject(si)) != NULL) {
-            if (op == REDIS_OP_UNION || j == 0) {
-                if (setTypeAdd(dstset,ele)) {
-                    cardinality++;
-                }
-            } else if (op == REDIS_OP_DIFF) {
-                if (setTypeRemove(dstset,ele)) {
-                    cardinality--;
+    if (op == REDIS_OP_DIFF && setnum > 1 && sets[0] &&
+        (parts = parallelCommandParts(
+            (long long)setTypeSize(sets[0])*(setnum-1))) > 1)
+    {
+        /* Big SDIFF: keep the members of the first set found in no other
+         * set, probing them in parallel. */
+        setProbeResult *results = setProbeParallel(sets,setnum,
+                                                   REDIS_OP_DIFF,parts);
+        unsigned long k;
+
+        for (j = 0; j < parts; j++) {
+            for (k = 0; k < results[j].len; k++)
+                setTypeAdd(dstset,results[j].ele[k]);
+            cardinality += results[j].len;
+        }
+        setProbeRelease(results,parts);
+    } else {
+        /* Iterate all the elements of all the sets, add every element a
+         * single time to the result set */
+        for (j = 0; j < setnum; j++) {
+            if (op == REDIS_OP_DIFF && j == 0 && !sets[j]) break; /* result set is empty */
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+
+            si = setTypeInitIterator(sets[j]);
+            while((ele = setTypeNextObject(si)) != NULL) {
+                if (op == REDIS_OP_UNION || j == 0) {
+                    if (setTypeAdd(dstset,ele)) {
+                        cardinality++;
+                    }
+                } else if (op == REDIS_OP_DIFF) {
+                    if (setTypeRemove(dstset,ele)) {
+                        cardinality--;
+                    }
                 }
+                decrRefCount(ele);
             }
-            decrRefCount(ele);
-        }
-        setTypeReleaseIterator(si);
+            setTypeReleaseIterator(si);
 
-        /* Exit when result set is empty. */
-        if (op == REDIS_OP_DIFF && cardinality == 0) break;
+            /* Exit when result set is empty. */
+            if (op == REDIS_OP_DIFF && cardinality == 0) break;
+        }
     }
 
     /* Output the content of the resulting set, if not in STORE mode */
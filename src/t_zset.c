@@ -834,6 +834,86 @@ void zsetConvert(robj *zobj, int encoding) {
     }
 }
 
+/* Add an element to the sorted set, or update its score if it is already a
+ * member, converting the encoding as needed. Returns 1 if the element was
+ * added, 0 otherwise. This is ZADD for a single element. */
+int zsetAdd(robj *zobj, robj *ele, double score) {
+    double curscore = 0.0;
+
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *eptr;
+
+        ele = getDecodedObject(ele);
+        if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
+            /* Remove and re-insert when score changed. */
+            if (score != curscore) {
+                zobj->ptr = zzlDelete(zobj->ptr,eptr);
+                zobj->ptr = zzlInsert(zobj->ptr,ele,score);
+            }
+            decrRefCount(ele);
+            return 0;
+        }
+        zobj->ptr = zzlInsert(zobj->ptr,ele,score);
+        if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
+            sdslen(ele->ptr) > server.zset_max_ziplist_value)
+            zsetConvert(zobj,REDIS_ENCODING_SKIPLIST);
+        decrRefCount(ele);
+        return 1;
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = zobj->ptr;
+        zskiplistNode *znode;
+        dictEntry *de;
+
+        de = dictFind(zs->dict,ele);
+        if (de != NULL) {
+            robj *curobj = dictGetKey(de);
+
+            curscore = *(double*)dictGetVal(de);
+            if (score != curscore) {
+                redisAssertWithInfo(NULL,curobj,zslDelete(zs->zsl,curscore,curobj));
+                znode = zslInsert(zs->zsl,score,curobj);
+                incrRefCount(curobj); /* Re-inserted in skiplist. */
+                dictGetVal(de) = &znode->score; /* Update score ptr. */
+            }
+            return 0;
+        }
+        znode = zslInsert(zs->zsl,score,ele);
+        incrRefCount(ele); /* Inserted in skiplist. */
+        redisAssertWithInfo(NULL,ele,dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+        incrRefCount(ele); /* Added to dictionary. */
+        return 1;
+    } else {
+        redisPanic("Unknown sorted set encoding");
+    }
+    return 0; /* Avoid warning. */
+}
+
+/* Remove an element from the sorted set. Returns 1 if it was a member. The
+ * caller deletes the key when the sorted set is left empty. */
+int zsetDel(robj *zobj, robj *ele) {
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *eptr;
+
+        if ((eptr = zzlFind(zobj->ptr,ele,NULL)) == NULL) return 0;
+        zobj->ptr = zzlDelete(zobj->ptr,eptr);
+        return 1;
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+        double score;
+
+        if ((de = dictFind(zs->dict,ele)) == NULL) return 0;
+        score = *(double*)dictGetVal(de);
+        redisAssertWithInfo(NULL,ele,zslDelete(zs->zsl,score,ele));
+        dictDelete(zs->dict,ele);
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        return 1;
+    } else {
+        redisPanic("Unknown sorted set encoding");
+    }
+    return 0; /* Avoid warning. */
+}
+
 /*-----------------------------------------------------------------------------
  * Sorted set commands 
  *----------------------------------------------------------------------------*/
@@ -1496,6 +1576,174 @@ inline static void zunionInterAggregate(double *target, double val, int aggregat
     }
 }
 
+/* Compute the score of the member 'zval' of src[i], aggregating its score in
+ * every set src[j] with j > i. With 'inter' set, 0 is returned as soon as
+ * a set not containing the member is found, 1 otherwise. */
+static int zunionInterScore(zsetopsrc *src, int setnum, int i, zsetopval *zval,
+                            int aggregate, int inter, double *score)
+{
+    double value;
+    int j;
+
+    *score = src[i].weight * zval->score;
+    if (isnan(*score)) *score = 0;
+
+    for (j = (i+1); j < setnum; j++) {
+        /* It is not safe to access the zset we are
+         * iterating, so explicitly check for equal object. */
+        if (src[j].subject == src[i].subject) {
+            value = zval->score*src[j].weight;
+            zunionInterAggregate(score,value,aggregate);
+        } else if (zuiFind(&src[j],zval,&value)) {
+            value *= src[j].weight;
+            zunionInterAggregate(score,value,aggregate);
+        } else if (inter) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Big ZUNIONSTORE / ZINTERSTORE operations are split in parts by hash of
+ * the member, and the parts are aggregated in parallel by the threads of the
+ * pool: every part iterates all the input sets, skipping the members of
+ * other parts, so the results of the parts are disjoint and are merged into
+ * the destination without further checks. The input sets are only read. */
+typedef struct {
+    robj **ele;
+    double *score;
+    unsigned long len, size;
+    unsigned int maxelelen;
+} zunionInterResult;
+
+typedef struct {
+    zsetopsrc *src;
+    int setnum;
+    int op;
+    int aggregate;
+    int parts;
+    zunionInterResult *results;
+} zunionInterJob;
+
+/* Return the part of the member, hashing it the same way whatever its
+ * encoding. The high bits of the hash are used, as the low ones select the
+ * bucket in the dictionaries of the part. */
+static int zuiPartOfValue(zsetopval *val, int parts) {
+    char buf[32];
+    unsigned int h, len;
+
+    if (val->estr != NULL) {
+        h = dictGenHashFunction(val->estr,val->elen);
+    } else if (val->ele != NULL && val->ele->encoding == REDIS_ENCODING_RAW) {
+        h = dictGenHashFunction(val->ele->ptr,sdslen(val->ele->ptr));
+    } else {
+        len = ll2string(buf,sizeof(buf),val->ele != NULL ?
+                        (long)val->ele->ptr : val->ell);
+        h = dictGenHashFunction((unsigned char*)buf,len);
+    }
+    return (int)(((unsigned long long)h * parts) >> 32);
+}
+
+static void zunionInterResultAdd(zunionInterResult *r, robj *ele, double score) {
+    if (r->len == r->size) {
+        r->size = r->size ? r->size*2 : 64;
+        r->ele = zrealloc(r->ele,sizeof(robj*)*r->size);
+        r->score = zrealloc(r->score,sizeof(double)*r->size);
+    }
+    incrRefCount(ele);
+    r->ele[r->len] = ele;
+    r->score[r->len] = score;
+    r->len++;
+    if (ele->encoding == REDIS_ENCODING_RAW && sdslen(ele->ptr) > r->maxelelen)
+        r->maxelelen = sdslen(ele->ptr);
+}
+
+/* Aggregate one part. Runs in a pool thread: every part has its own
+ * iterators over the input sets. */
+static void zunionInterPart(void *arg, int part) {
+    zunionInterJob *job = arg;
+    zunionInterResult *r = job->results+part;
+    zsetopsrc *src = zmalloc(sizeof(zsetopsrc)*job->setnum);
+    zsetopval zval;
+    double score;
+    robj *tmp;
+    int i;
+
+    memcpy(src,job->src,sizeof(zsetopsrc)*job->setnum);
+    for (i = 0; i < job->setnum; i++)
+        zuiInitIterator(&src[i]);
+    memset(&zval, 0, sizeof(zval));
+
+    if (job->op == REDIS_OP_INTER) {
+        while (zuiNext(&src[0],&zval)) {
+            if (zuiPartOfValue(&zval,job->parts) != part) continue;
+            if (zunionInterScore(src,job->setnum,0,&zval,job->aggregate,1,
+                                 &score))
+                zunionInterResultAdd(r,zuiObjectFromValue(&zval),score);
+        }
+    } else {
+        dict *seen = dictCreate(&setDictType,NULL);
+
+        for (i = 0; i < job->setnum; i++) {
+            while (zuiNext(&src[i],&zval)) {
+                if (zuiPartOfValue(&zval,job->parts) != part) continue;
+
+                /* Skip key when already processed */
+                tmp = zuiObjectFromValue(&zval);
+                if (dictFind(seen,tmp) != NULL) continue;
+
+                zunionInterScore(src,job->setnum,i,&zval,job->aggregate,0,
+                                 &score);
+                zunionInterResultAdd(r,tmp,score);
+                dictAdd(seen,tmp,NULL);
+                incrRefCount(tmp); /* added to dictionary */
+            }
+        }
+        dictRelease(seen);
+    }
+
+    for (i = 0; i < job->setnum; i++)
+        zuiClearIterator(&src[i]);
+    zfree(src);
+}
+
+/* Run the union or intersection of the input sets in 'parts' parts, adding
+ * the result to 'dstzset'. Returns the length of the longest member. */
+static unsigned int zunionInterParallel(zsetopsrc *src, int setnum, int op,
+                                        int aggregate, int parts,
+                                        zset *dstzset)
+{
+    zunionInterJob job;
+    zskiplistNode *znode;
+    unsigned int maxelelen = 0;
+    unsigned long k;
+    int i;
+
+    job.src = src;
+    job.setnum = setnum;
+    job.op = op;
+    job.aggregate = aggregate;
+    job.parts = parts;
+    job.results = zcalloc(sizeof(zunionInterResult)*parts);
+    threadpool_run_parallel(server.tpool,parts,zunionInterPart,&job);
+
+    for (i = 0; i < parts; i++) {
+        zunionInterResult *r = job.results+i;
+
+        for (k = 0; k < r->len; k++) {
+            /* The reference of the result goes to the skiplist. */
+            znode = zslInsert(dstzset->zsl,r->score[k],r->ele[k]);
+            dictAdd(dstzset->dict,r->ele[k],&znode->score);
+            incrRefCount(r->ele[k]); /* added to dictionary */
+        }
+        if (r->maxelelen > maxelelen) maxelelen = r->maxelelen;
+        zfree(r->ele);
+        zfree(r->score);
+    }
+    zfree(job.results);
+    return maxelelen;
+}
+
 void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     int i, j;
     long setnum;
@@ -1509,6 +1757,8 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     zskiplistNode *znode;
     int touched = 0;
     robj **keys;
+    long long cost;
+    int parts;
 
     /* expect setnum input keys to be given */
     if ((getLongFromObjectOrReply(c, c->argv[2], &setnum, NULL) != REDIS_OK))
@@ -1611,33 +1861,28 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     dstzset = dstobj->ptr;
     memset(&zval, 0, sizeof(zval));
 
+    /* Split big operations across the threads of the pool. The cost is the
+     * number of members looked up in the input sets. */
     if (op == REDIS_OP_INTER) {
+        parts = parallelCommandParts((long long)zuiLength(&src[0])*setnum);
+    } else {
+        for (i = 0, cost = 0; i < setnum; i++)
+            cost += (long long)zuiLength(&src[i])*(setnum-i);
+        parts = parallelCommandParts(cost);
+    }
+
+    if (parts > 1) {
+        maxelelen = zunionInterParallel(src,setnum,op,aggregate,parts,dstzset);
+    } else if (op == REDIS_OP_INTER) {
         /* Skip everything if the smallest input is empty. */
         if (zuiLength(&src[0]) > 0) {
             /* Precondition: as src[0] is non-empty and the inputs are ordered
              * by size, all src[i > 0] are non-empty too. */
             while (zuiNext(&src[0],&zval)) {
-                double score, value;
-
-                score = src[0].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                for (j = 1; j < setnum; j++) {
-                    /* It is not safe to access the zset we are
-                     * iterating, so explicitly check for equal object. */
-                    if (src[j].subject == src[0].subject) {
-                        value = zval.score*src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else {
-                        break;
-                    }
-                }
+                double score;
 
                 /* Only continue when present in every input. */
-                if (j == setnum) {
+                if (zunionInterScore(src,setnum,0,&zval,aggregate,1,&score)) {
                     tmp = zuiObjectFromValue(&zval);
                     znode = zslInsert(dstzset->zsl,score,tmp);
                     incrRefCount(tmp); /* added to skiplist */
@@ -1657,29 +1902,15 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
                 continue;
 
             while (zuiNext(&src[i],&zval)) {
-                double score, value;
+                double score;
 
                 /* Skip key when already processed */
                 if (dictFind(dstzset->dict,zuiObjectFromValue(&zval)) != NULL)
                     continue;
 
-                /* Initialize score */
-                score = src[i].weight * zval.score;
-                if (isnan(score)) score = 0;
-
                 /* Because the inputs are sorted by size, it's only possible
                  * for sets at larger indices to hold this element. */
-                for (j = (i+1); j < setnum; j++) {
-                    /* It is not safe to access the zset we are
-                     * iterating, so explicitly check for equal object. */
-                    if(src[j].subject == src[i].subject) {
-                        value = zval.score*src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    }
-                }
+                zunionInterScore(src,setnum,i,&zval,aggregate,0,&score);
 
                 tmp = zuiObjectFromValue(&zval);
                 znode = zslInsert(dstzset->zsl,score,tmp);
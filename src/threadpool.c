@@ -29,97 +29,207 @@
 /**
  * @file threadpool.c
  * @brief Threadpool implementation file
+ *
+ * Every worker owns a deque of tasks protected by its own mutex, so that
+ * submitting and running tasks do not all serialize on a single lock.
+ * Tasks are submitted to an idle worker when there is one, round robin
+ * otherwise, and a worker that runs out of tasks steals the oldest task
+ * of the other workers before going to sleep on its own condition
+ * variable. The total number of queued tasks is bounded by queue_size:
+ * deques start small and grow on demand up to that bound.
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/time.h>
 
+#include "config.h"
 #include "threadpool.h"
 
+#define THREADPOOL_DEQUE_INITIAL_SIZE 16
+
 /**
  *  @struct threadpool_task
  *  @brief the work struct
  *
  *  @var function Pointer to the function that will perform the task.
  *  @var argument Argument to be passed to the function.
+ *  @var queued   Time the task was queued, in microseconds.
  */
 
 typedef struct {
     void (*function)(void *);
     void *argument;
+    long long queued;
 } threadpool_task_t;
 
+/**
+ *  @struct threadpool_deque
+ *  @brief The tasks queue of a worker thread
+ *
+ *  @var lock     Protects every other field of the deque.
+ *  @var notify   Condition variable the owner sleeps on.
+ *  @var tasks    Ring buffer containing the tasks.
+ *  @var size     Size of the ring buffer.
+ *  @var head     Index of the first element.
+ *  @var count    Number of tasks in the ring buffer.
+ *  @var sleeping The owner is (about to be) waiting on notify.
+ *  @var wakeup   Set by submitters to wake up a sleeping owner.
+ *  @var executed Tasks dequeued from this deque.
+ *  @var steals   Tasks dequeued by a worker other than the owner.
+ *  @var wait_us  Total time tasks spent in this deque.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t notify;
+  threadpool_task_t *tasks;
+  int size;
+  int head;
+  int count;
+  volatile int sleeping;
+  int wakeup;
+  long long executed;
+  long long steals;
+  long long wait_us;
+} threadpool_deque_t;
+
 /**
  *  @struct threadpool
  *  @brief The threadpool struct
  *
- *  @var notify       Condition variable to notify worker threads.
+ *  @var lock         Fallback for count updates without atomic builtins.
  *  @var threads      Array containing worker threads ID.
+ *  @var deques       Array containing the deque of every worker.
  *  @var thread_count Number of threads
- *  @var queue        Array containing the task queue.
- *  @var queue_size   Size of the task queue.
- *  @var head         Index of the first element.
- *  @var tail         Index of the next element.
+ *  @var queue_size   Maximum number of queued tasks.
+ *  @var count        Number of queued tasks, across all the deques.
+ *  @var next         Round robin index for submissions.
+ *  @var max_count    Highest value reached by count.
+ *  @var rejected     Submissions refused because the queue was full.
  *  @var shutdown     Flag indicating if the pool is shutting down
  */
 struct threadpool_t {
   pthread_mutex_t lock;
-  pthread_cond_t notify;
   pthread_t *threads;
-  threadpool_task_t *queue;
+  threadpool_deque_t *deques;
   int thread_count;
   int queue_size;
-  int head;
-  int tail;
-  int count;
-  int shutdown;
+  volatile int count;
+  int next;
+  int max_count;
+  long long rejected;
+  volatile int shutdown;
   int started;
 };
 
 /**
- * @function void *threadpool_thread(void *threadpool)
+ *  @struct threadpool_worker
+ *  @brief Argument of a worker thread
+ */
+typedef struct {
+    threadpool_t *pool;
+    int id;
+} threadpool_worker_t;
+
+#ifdef HAVE_ATOMIC
+#define threadpool_count_add(p,d) __sync_add_and_fetch(&(p)->count,(d))
+#define threadpool_barrier(p) __sync_synchronize()
+#else
+static int threadpool_locked_add(threadpool_t *pool, int delta) {
+    int val;
+
+    pthread_mutex_lock(&(pool->lock));
+    val = (pool->count += delta);
+    pthread_mutex_unlock(&(pool->lock));
+    return val;
+}
+#define threadpool_count_add(p,d) threadpool_locked_add((p),(d))
+#define threadpool_barrier(p) do { \
+    pthread_mutex_lock(&(p)->lock); \
+    pthread_mutex_unlock(&(p)->lock); \
+} while(0)
+#endif
+
+/**
+ * @function void *threadpool_thread(void *worker)
  * @brief the worker thread
- * @param threadpool the pool which own the thread
+ * @param worker the pool which own the thread and the thread id
  */
-static void *threadpool_thread(void *threadpool);
+static void *threadpool_thread(void *worker);
 
 int threadpool_free(threadpool_t *pool);
 
+static long long threadpool_ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
 threadpool_t *threadpool_create(int thread_count, int queue_size, int flags)
 {
     threadpool_t *pool;
-    int i;
+    threadpool_worker_t *worker;
+    int i, initial_size;
 
-    /* TODO: Check for negative or otherwise very big input parameters */
+    if(thread_count <= 0 || queue_size <= 0) {
+        return NULL;
+    }
 
     if((pool = (threadpool_t *)malloc(sizeof(threadpool_t))) == NULL) {
         goto err;
     }
 
     /* Initialize */
-    pool->thread_count = thread_count;
+    pool->thread_count = 0;
     pool->queue_size = queue_size;
-    pool->head = pool->tail = pool->count = 0;
+    pool->count = pool->next = pool->max_count = 0;
+    pool->rejected = 0;
     pool->shutdown = pool->started = 0;
 
-    /* Allocate thread and task queue */
+    /* Allocate threads and deques */
     pool->threads = (pthread_t *)malloc(sizeof (pthread_t) * thread_count);
-    pool->queue = (threadpool_task_t *)malloc
-        (sizeof (threadpool_task_t) * queue_size);
+    pool->deques = (threadpool_deque_t *)calloc
+        (thread_count, sizeof (threadpool_deque_t));
 
-    /* Initialize mutex and conditional variable first */
+    /* Initialize mutex first */
     if((pthread_mutex_init(&(pool->lock), NULL) != 0) ||
-       (pthread_cond_init(&(pool->notify), NULL) != 0) ||
        (pool->threads == NULL) ||
-       (pool->queue == NULL)) {
+       (pool->deques == NULL)) {
         goto err;
     }
 
+    initial_size = queue_size < THREADPOOL_DEQUE_INITIAL_SIZE ?
+        queue_size : THREADPOOL_DEQUE_INITIAL_SIZE;
+    for(i = 0; i < thread_count; i++) {
+        threadpool_deque_t *deque = &(pool->deques[i]);
+
+        deque->size = initial_size;
+        deque->tasks = (threadpool_task_t *)malloc
+            (sizeof (threadpool_task_t) * initial_size);
+        if((deque->tasks == NULL) ||
+           (pthread_mutex_init(&(deque->lock), NULL) != 0) ||
+           (pthread_cond_init(&(deque->notify), NULL) != 0)) {
+            free(deque->tasks);
+            goto err;
+        }
+        pool->thread_count++;
+    }
+
     /* Start worker threads */
     for(i = 0; i < thread_count; i++) {
+        if((worker = (threadpool_worker_t *)malloc
+                (sizeof (threadpool_worker_t))) == NULL) {
+            threadpool_destroy(pool, 0);
+            return NULL;
+        }
+        worker->pool = pool;
+        worker->id = i;
         if(pthread_create(&(pool->threads[i]), NULL,
-                          threadpool_thread, (void*)pool) != 0) {
+                          threadpool_thread, (void*)worker) != 0) {
+            free(worker);
             threadpool_destroy(pool, 0);
             return NULL;
         } else {
@@ -136,54 +246,304 @@ threadpool_t *threadpool_create(int thread_count, int queue_size, int flags)
     return NULL;
 }
 
+/* Append a task to a deque, growing its ring buffer if needed. Called with
+ * the deque lock held. */
+static int threadpool_deque_push(threadpool_t *pool,
+                                 threadpool_deque_t *deque,
+                                 threadpool_task_t *task)
+{
+    if(deque->count == deque->size) {
+        int size = deque->size * 2, tail;
+        threadpool_task_t *tasks;
+
+        if(size > pool->queue_size) size = pool->queue_size;
+        if(size == deque->size ||
+           (tasks = (threadpool_task_t *)malloc
+                (sizeof (threadpool_task_t) * size)) == NULL) {
+            return threadpool_queue_full;
+        }
+        /* Unwrap the ring buffer */
+        tail = deque->size - deque->head;
+        memcpy(tasks, deque->tasks + deque->head,
+               sizeof (threadpool_task_t) * tail);
+        memcpy(tasks + tail, deque->tasks,
+               sizeof (threadpool_task_t) * deque->head);
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->size = size;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->size] = *task;
+    deque->count += 1;
+    return 0;
+}
+
+/* Take the oldest task of a deque. Returns 0 if the deque is empty. */
+static int threadpool_deque_pop(threadpool_t *pool, int id, int owner,
+                                threadpool_task_t *task)
+{
+    threadpool_deque_t *deque = &(pool->deques[id]);
+    int found = 0;
+
+    pthread_mutex_lock(&(deque->lock));
+    if(deque->count) {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->size;
+        deque->count -= 1;
+        deque->executed += 1;
+        deque->wait_us += threadpool_ustime() - task->queued;
+        if(id != owner) deque->steals += 1;
+        found = 1;
+    }
+    pthread_mutex_unlock(&(deque->lock));
+    if(found) threadpool_count_add(pool, -1);
+    return found;
+}
+
+/* Take a task from our own deque, otherwise steal one from the others. */
+static int threadpool_next_task(threadpool_t *pool, int id,
+                                threadpool_task_t *task)
+{
+    int i;
+
+    for(i = 0; i < pool->thread_count; i++) {
+        if(threadpool_deque_pop(pool, (id + i) % pool->thread_count, id,
+                                task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Wake up the owner of a deque if it is sleeping. */
+static void threadpool_wakeup(threadpool_deque_t *deque)
+{
+    pthread_mutex_lock(&(deque->lock));
+    if(deque->sleeping) {
+        deque->wakeup = 1;
+        pthread_cond_signal(&(deque->notify));
+    }
+    pthread_mutex_unlock(&(deque->lock));
+}
+
 int threadpool_add(threadpool_t *pool, void (*function)(void *),
                    void *argument, int flags)
 {
-    int err = 0;
-    int next;
+    threadpool_task_t task;
+    threadpool_deque_t *deque;
+    int i, target = -1, count, err;
 
     if(pool == NULL || function == NULL) {
         return threadpool_invalid;
     }
 
-    if(pthread_mutex_lock(&(pool->lock)) != 0) {
-        return threadpool_lock_failure;
+    /* Are we shutting down ? */
+    if(pool->shutdown) {
+        return threadpool_shutdown;
     }
 
-    next = pool->tail + 1;
-    next = (next == pool->queue_size) ? 0 : next;
+    /* Are we full ? Reserve a slot first, workers release slots
+     * concurrently. Note that next, max_count and rejected are not atomic:
+     * submissions from workers (see threadpool_run_parallel()) may race on
+     * them, which only affects the balancing and the statistics. */
+    if((count = threadpool_count_add(pool, 1)) > pool->queue_size) {
+        threadpool_count_add(pool, -1);
+        pool->rejected++;
+        return threadpool_queue_full;
+    }
+    if(count > pool->max_count) pool->max_count = count;
 
-    do {
-        /* Are we full ? */
-        if(pool->count == pool->queue_size) {
-            err = threadpool_queue_full;
+    /* Prefer a sleeping worker, otherwise go round robin. */
+    for(i = 0; i < pool->thread_count; i++) {
+        if(pool->deques[i].sleeping) {
+            target = i;
             break;
         }
+    }
+    if(target == -1) {
+        target = pool->next;
+        pool->next = (target + 1) % pool->thread_count;
+    }
 
-        /* Are we shutting down ? */
-        if(pool->shutdown) {
-            err = threadpool_shutdown;
+    task.function = function;
+    task.argument = argument;
+    task.queued = threadpool_ustime();
+
+    deque = &(pool->deques[target]);
+    pthread_mutex_lock(&(deque->lock));
+    err = threadpool_deque_push(pool, deque, &task);
+    if(!err && deque->sleeping) {
+        deque->wakeup = 1;
+        if(pthread_cond_signal(&(deque->notify)) != 0) {
+            err = threadpool_lock_failure;
+        }
+    }
+    pthread_mutex_unlock(&(deque->lock));
+    if(err == threadpool_queue_full) {
+        threadpool_count_add(pool, -1);
+        pool->rejected++;
+        return err;
+    }
+
+    /* A worker may have found every deque empty and gone to sleep while
+     * we were pushing to a busy one: wake it up so that it steals the
+     * task. Pairs with the barrier in threadpool_thread(). */
+    threadpool_barrier(pool);
+    for(i = 0; i < pool->thread_count; i++) {
+        if(i != target && pool->deques[i].sleeping) {
+            threadpool_wakeup(&(pool->deques[i]));
             break;
         }
+    }
 
-        /* Add task to queue */
-        pool->queue[pool->tail].function = function;
-        pool->queue[pool->tail].argument = argument;
-        pool->tail = next;
-        pool->count += 1;
+    return err;
+}
 
-        /* pthread_cond_broadcast */
-        if(pthread_cond_signal(&(pool->notify)) != 0) {
-            err = threadpool_lock_failure;
+/**
+ *  @struct threadpool_job
+ *  @brief A function run on several parts by threadpool_run_parallel()
+ *
+ *  @var lock     Protects every other field of the job.
+ *  @var finished Signaled when the last part is done.
+ *  @var routine  Function to call for every part.
+ *  @var argument First argument of routine.
+ *  @var parts    Number of parts.
+ *  @var next     Next part to be claimed.
+ *  @var done     Number of parts done.
+ *  @var refcount The caller and the helper tasks not finished yet.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    void (*routine)(void *, int);
+    void *argument;
+    int parts;
+    int next;
+    int done;
+    int refcount;
+} threadpool_job_t;
+
+/* Claim and run parts of the job until there are none left. */
+static void threadpool_job_run(threadpool_job_t *job)
+{
+    int part;
+
+    for(;;) {
+        pthread_mutex_lock(&(job->lock));
+        if(job->next == job->parts) {
+            pthread_mutex_unlock(&(job->lock));
+            return;
+        }
+        part = job->next++;
+        pthread_mutex_unlock(&(job->lock));
+
+        job->routine(job->argument, part);
+
+        pthread_mutex_lock(&(job->lock));
+        if(++job->done == job->parts) {
+            pthread_cond_signal(&(job->finished));
+        }
+        pthread_mutex_unlock(&(job->lock));
+    }
+}
+
+static void threadpool_job_release(threadpool_job_t *job)
+{
+    int refcount;
+
+    pthread_mutex_lock(&(job->lock));
+    refcount = --job->refcount;
+    pthread_mutex_unlock(&(job->lock));
+    if(refcount == 0) {
+        pthread_mutex_destroy(&(job->lock));
+        pthread_cond_destroy(&(job->finished));
+        free(job);
+    }
+}
+
+static void threadpool_job_helper(void *argument)
+{
+    threadpool_job_t *job = (threadpool_job_t *)argument;
+
+    threadpool_job_run(job);
+    threadpool_job_release(job);
+}
+
+int threadpool_run_parallel(threadpool_t *pool, int parts,
+                            void (*routine)(void *, int), void *argument)
+{
+    threadpool_job_t *job;
+    int i, helpers;
+
+    if(pool == NULL || routine == NULL || parts <= 0) {
+        return threadpool_invalid;
+    }
+
+    if((job = (threadpool_job_t *)malloc(sizeof(threadpool_job_t))) == NULL ||
+       pthread_mutex_init(&(job->lock), NULL) != 0 ||
+       pthread_cond_init(&(job->finished), NULL) != 0) {
+        /* Nothing to share the work with, do it all here. */
+        free(job);
+        for(i = 0; i < parts; i++) {
+            routine(argument, i);
+        }
+        return 0;
+    }
+    job->routine = routine;
+    job->argument = argument;
+    job->parts = parts;
+    job->next = job->done = 0;
+    job->refcount = 1;
+
+    /* The caller runs parts too, so parts-1 helpers are enough. Helpers
+     * that can't be queued are not an error: the caller will run more
+     * parts itself. */
+    helpers = parts - 1 < pool->thread_count ? parts - 1 : pool->thread_count;
+    for(i = 0; i < helpers; i++) {
+        pthread_mutex_lock(&(job->lock));
+        job->refcount++;
+        pthread_mutex_unlock(&(job->lock));
+        if(threadpool_add(pool, threadpool_job_helper, job, 0) != 0) {
+            threadpool_job_release(job);
             break;
         }
-    } while(0);
+    }
 
-    if(pthread_mutex_unlock(&pool->lock) != 0) {
-        err = threadpool_lock_failure;
+    /* A helper still queued when every part has been claimed finds nothing
+     * to do: we never wait for it, only for the parts being run. This is
+     * what makes it safe to call this function from a worker thread. */
+    threadpool_job_run(job);
+    pthread_mutex_lock(&(job->lock));
+    while(job->done < job->parts) {
+        pthread_cond_wait(&(job->finished), &(job->lock));
     }
+    pthread_mutex_unlock(&(job->lock));
+    threadpool_job_release(job);
+    return 0;
+}
 
-    return err;
+void threadpool_get_stats(threadpool_t *pool, threadpool_stats_t *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    if(pool == NULL) {
+        return;
+    }
+    stats->thread_count = pool->thread_count;
+    stats->queue_size = pool->queue_size;
+    stats->queue_depth_max = pool->max_count;
+    stats->rejected = pool->rejected;
+    for(i = 0; i < pool->thread_count; i++) {
+        threadpool_deque_t *deque = &(pool->deques[i]);
+
+        pthread_mutex_lock(&(deque->lock));
+        stats->queue_depth += deque->count;
+        stats->executed += deque->executed;
+        stats->steals += deque->steals;
+        stats->wait_us += deque->wait_us;
+        pthread_mutex_unlock(&(deque->lock));
+    }
 }
 
 int threadpool_destroy(threadpool_t *pool, int flags)
@@ -194,38 +554,32 @@ int threadpool_destroy(threadpool_t *pool, int flags)
         return threadpool_invalid;
     }
 
-    if(pthread_mutex_lock(&(pool->lock)) != 0) {
-        return threadpool_lock_failure;
+    /* Already shutting down */
+    if(pool->shutdown) {
+        return threadpool_shutdown;
     }
 
-    do {
-        /* Already shutting down */
-        if(pool->shutdown) {
-            err = threadpool_shutdown;
-            break;
-        }
+    pool->shutdown = 1;
 
-        pool->shutdown = 1;
+    /* Wake up all worker threads */
+    for(i = 0; i < pool->thread_count; i++) {
+        threadpool_deque_t *deque = &(pool->deques[i]);
 
-        /* Wake up all worker threads */
-        if((pthread_cond_broadcast(&(pool->notify)) != 0) ||
-           (pthread_mutex_unlock(&(pool->lock)) != 0)) {
+        if((pthread_mutex_lock(&(deque->lock)) != 0) ||
+           (pthread_cond_signal(&(deque->notify)) != 0) ||
+           (pthread_mutex_unlock(&(deque->lock)) != 0)) {
             err = threadpool_lock_failure;
-            break;
         }
+    }
 
-        /* Join all worker thread */
-        for(i = 0; i < pool->thread_count; i++) {
-            if(pthread_join(pool->threads[i], NULL) != 0) {
-                err = threadpool_thread_failure;
-            }
+    /* Join all worker thread */
+    for(i = 0; i < pool->started; i++) {
+        if(pthread_join(pool->threads[i], NULL) != 0) {
+            err = threadpool_thread_failure;
         }
-    } while(0);
-
-    if(pthread_mutex_unlock(&pool->lock) != 0) {
-        err = threadpool_lock_failure;
     }
-    
+    pool->started = 0;
+
     /* Only if everything went well do we deallocate the pool */
     if(!err) {
         threadpool_free(pool);
@@ -235,62 +589,78 @@ int threadpool_destroy(threadpool_t *pool, int flags)
 
 int threadpool_free(threadpool_t *pool)
 {
+    int i;
+
     if(pool == NULL || pool->started > 0) {
         return -1;
     }
 
     /* Did we manage to allocate ? */
+    if(pool->deques) {
+        for(i = 0; i < pool->thread_count; i++) {
+            free(pool->deques[i].tasks);
+            pthread_mutex_destroy(&(pool->deques[i].lock));
+            pthread_cond_destroy(&(pool->deques[i].notify));
+        }
+        free(pool->deques);
+    }
     if(pool->threads) {
         free(pool->threads);
-        free(pool->queue);
- 
         /* Because we allocate pool->threads after initializing the
-           mutex and condition variable, we're sure they're
-           initialized. Let's lock the mutex just in case. */
-        pthread_mutex_lock(&(pool->lock));
+           mutex, we're sure it's initialized. */
         pthread_mutex_destroy(&(pool->lock));
-        pthread_cond_destroy(&(pool->notify));
     }
-    free(pool);    
+    free(pool);
     return 0;
 }
 
 
-static void *threadpool_thread(void *threadpool)
+static void *threadpool_thread(void *arg)
 {
-    threadpool_t *pool = (threadpool_t *)threadpool;
+    threadpool_worker_t *worker = (threadpool_worker_t *)arg;
+    threadpool_t *pool = worker->pool;
+    threadpool_deque_t *deque = &(pool->deques[worker->id]);
     threadpool_task_t task;
-    for(;;) {
-        /* Lock must be taken to wait on conditional variable */
-        pthread_mutex_lock(&(pool->lock));
-
-        /* Wait on condition variable, check for spurious wakeups.
-           When returning from pthread_cond_wait(), we own the lock. */
-        while((pool->count == 0) && (!pool->shutdown)) {
-            pthread_cond_wait(&(pool->notify), &(pool->lock));
-        }
+    int id = worker->id;
 
+    free(worker);
+    for(;;) {
         if(pool->shutdown) {
             break;
         }
 
-        /* Grab our task */
-        task.function = pool->queue[pool->head].function;
-        task.argument = pool->queue[pool->head].argument;
-        pool->head += 1;
-        pool->head = (pool->head == pool->queue_size) ? 0 : pool->head;
-        pool->count -= 1;
+        if(!threadpool_next_task(pool, id, &task)) {
+            /* Announce we are going to sleep, then look for work one last
+             * time: a submitter that pushed a task to a busy worker after
+             * our first look will see the flag and wake us up. */
+            pthread_mutex_lock(&(deque->lock));
+            deque->sleeping = 1;
+            pthread_mutex_unlock(&(deque->lock));
+            threadpool_barrier(pool);
+
+            if(!threadpool_next_task(pool, id, &task)) {
+                pthread_mutex_lock(&(deque->lock));
+                /* Wait on condition variable, check for spurious wakeups.
+                   When returning from pthread_cond_wait(), we own the
+                   lock. */
+                while((deque->count == 0) && (!deque->wakeup) &&
+                      (!pool->shutdown)) {
+                    pthread_cond_wait(&(deque->notify), &(deque->lock));
+                }
+                deque->sleeping = deque->wakeup = 0;
+                pthread_mutex_unlock(&(deque->lock));
+                continue;
+            }
 
-        /* Unlock */
-        pthread_mutex_unlock(&(pool->lock));
+            pthread_mutex_lock(&(deque->lock));
+            deque->sleeping = deque->wakeup = 0;
+            pthread_mutex_unlock(&(deque->lock));
+        }
 
         /* Get to work */
         (*(task.function))(task.argument);
     }
 
-    pool->started--;
-
-    pthread_mutex_unlock(&(pool->lock));
     pthread_exit(NULL);
     return(NULL);
 }
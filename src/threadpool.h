@@ -44,11 +44,35 @@ typedef enum {
     threadpool_thread_failure = -5
 } threadpool_error_t;
 
+/**
+ * @struct threadpool_stats
+ * @brief Counters returned by threadpool_get_stats()
+ *
+ * @var thread_count    Number of worker threads.
+ * @var queue_size      Maximum number of queued tasks.
+ * @var queue_depth     Number of tasks currently queued.
+ * @var queue_depth_max Highest number of tasks queued at the same time.
+ * @var executed        Tasks dequeued by the workers.
+ * @var steals          Tasks dequeued by a worker from another worker.
+ * @var rejected        Tasks refused with threadpool_queue_full.
+ * @var wait_us         Total time tasks waited in the queue, microseconds.
+ */
+typedef struct {
+    int thread_count;
+    int queue_size;
+    int queue_depth;
+    int queue_depth_max;
+    long long executed;
+    long long steals;
+    long long rejected;
+    long long wait_us;
+} threadpool_stats_t;
+
 /**
  * @function threadpool_create
  * @brief Creates a threadpool_t object.
  * @param thread_count Number of worker threads.
- * @param queue_size   Size of the queue.
+ * @param queue_size   Maximum number of tasks queued at the same time.
  * @param flags        Unused parameter.
  * @return a newly created thread pool or NULL
  */
@@ -62,11 +86,36 @@ threadpool_t *threadpool_create(int thread_count, int queue_size, int flags);
  * @param argument Argument to be passed to the function.
  * @param flags    Unused parameter.
  * @return 0 if all goes well, negative values in case of error (@see
- * threadpool_error_t for codes).
+ * threadpool_error_t for codes). threadpool_queue_full is returned when
+ * queue_size tasks are already waiting.
  */
 int threadpool_add(threadpool_t *pool, void (*routine)(void *),
                    void *arg, int flags);
 
+/**
+ * @function threadpool_run_parallel
+ * @brief Run a function on several parts of a job, using the pool threads.
+ * @param pool     Thread pool providing the helper threads.
+ * @param parts    Number of parts, routine is called once for each.
+ * @param routine  Function called with argument and the part number.
+ * @param argument First argument of routine.
+ * @return 0 once every part is done, threadpool_invalid on bad arguments.
+ *
+ * The caller runs parts as well and only waits for the parts being run by
+ * helpers, so it may be a worker of the same pool. Parts run concurrently
+ * and in no particular order.
+ */
+int threadpool_run_parallel(threadpool_t *pool, int parts,
+                            void (*routine)(void *, int), void *argument);
+
+/**
+ * @function threadpool_get_stats
+ * @brief Fill stats with the counters of the thread pool.
+ * @param pool  Thread pool to inspect.
+ * @param stats Structure to fill.
+ */
+void threadpool_get_stats(threadpool_t *pool, threadpool_stats_t *stats);
+
 /**
  * @function threadpool_destroy
  * @brief Stops and destroys a thread pool.
@@ -25,6 +25,7 @@ set ::all_tests {
     unit/other
     unit/cas
     unit/quit
+    unit/sql
     unit/aofrw
     integration/replication
     integration/replication-2
@@ -21,4 +21,103 @@ start_server {tags {"introspection"}} {
         assert_match {*eval*} [$rd read]
         assert_match {*lua*"set"*"foo"*"bar"*} [$rd read]
     }
+
+    test {CONFIG SET thread-commands} {
+        r config set thread-commands "+hmget -lrange"
+        set res [lindex [r config get thread-commands] 1]
+        r config set thread-commands ""
+        list $res [lindex [r config get thread-commands] 1]
+    } {{+hmget -lrange} {}}
+
+    test {CONFIG SET thread-commands rejects unknown or unsafe commands} {
+        set e1 [catch {r config set thread-commands "+nosuchcommand"}]
+        set e2 [catch {r config set thread-commands "+subscribe"}]
+        set e3 [catch {r config set thread-commands "lrange"}]
+        set e4 [catch {r config set thread-commands "+flushdb"}]
+        set e5 [catch {r config set thread-commands "+hmget +flushall"}]
+        list $e1 $e2 $e3 $e4 $e5 [lindex [r config get thread-commands] 1]
+    } {1 1 1 1 1 {}}
+
+    test {Threaded commands give the same reply in and out of threads} {
+        r del mylist
+        for {set i 0} {$i < 200} {incr i} { r rpush mylist $i }
+        set res {}
+        foreach mincost {0 1000000} {
+            r config set thread-min-cost $mincost
+            lappend res [r lrange mylist 0 0] [llength [r lrange mylist 0 -1]]
+        }
+        r config set thread-min-cost 128
+        set res
+    } {0 200 0 200}
+
+    test {ZRANGEBYSCORE with a huge LIMIT count is not estimated as cheap} {
+        r del myzset
+        for {set i 0} {$i < 200} {incr i} { r zadd myzset $i $i }
+        set tasks [status r threadpool_tasks]
+        set res [llength [r zrangebyscore myzset -inf +inf LIMIT 1 9223372036854775807]]
+        list $res [expr {[status r threadpool_tasks] > $tasks}]
+    } {199 1}
+}
+
+start_server {tags {"introspection"} overrides {threadpool-queue-size 1 thread-min-cost 0}} {
+    test {Clients are paused, not dropped, when the threadpool queue is full} {
+        r del mylist
+        for {set i 0} {$i < 100} {incr i} { r rpush mylist $i }
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            for {set i 0} {$i < 20} {incr i} { $rd lrange mylist 0 -1 }
+            $rd flush
+            lappend clients $rd
+        }
+        set ok 0
+        foreach rd $clients {
+            for {set i 0} {$i < 20} {incr i} {
+                if {[llength [$rd read]] == 100} { incr ok }
+            }
+            $rd close
+        }
+        set ok
+    } {200}
+
+    test {INFO threadpool} {
+        set info [r info threadpool]
+        # Pipelined LRANGEs are run by the same task in batches.
+        set threaded [expr {[status r threadpool_tasks] +
+                            [status r pipeline_batched_commands] -
+                            [status r pipeline_batches]}]
+        list [status r threadpool_queue_size] \
+             [status r threadpool_waiting_clients] \
+             [expr {$threaded >= 200}] \
+             [string match {*threadpool_steals:*} $info]
+    } {1 0 1 1}
+
+    test {INFO keylocks, readers of the same key never wait} {
+        set info [r info keylocks]
+        list [expr {[status r keylock_acquired] > 0}] \
+             [status r keylock_contended] \
+             [status r keylock_waiting_clients] \
+             [status r keylock_locked_keys] \
+             [string match {*keylock_wait_usec:*} $info]
+    } {1 0 0 0 1}
+
+    test {Keys differing in case or repeated are locked once each} {
+        r del a A dst
+        r sadd a x y
+        r sadd A y z
+        set before [status r keylock_acquired]
+        set n [r sunionstore dst a A a "bin\x00key" A a]
+        set acquired [expr {[status r keylock_acquired] - $before}]
+        list $n [lsort [r smembers dst]] $acquired \
+            [status r keylock_locked_keys]
+    } {3 {x y z} 4 0}
+
+    test {BITOP locks its target and sources once, even when they repeat} {
+        r set bits1 "\xff\x0f"
+        r set bits2 "\x0f"
+        set before [status r keylock_acquired]
+        set n [r bitop and bits1 bits2 bits1 bits2]
+        set acquired [expr {[status r keylock_acquired] - $before}]
+        list $n [r get bits1] $acquired [status r keylock_locked_keys]
+    } [list 2 "\x0f\x00" 2 0]
 }
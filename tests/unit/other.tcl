@@ -290,3 +290,179 @@ start_server {tags {"other"}} {
         r save
     } {OK}
 }
+
+start_server {tags {"other"} overrides {reply-cache-max-memory 1mb reply-cache-min-size 1024}} {
+    test {Reply cache serves hot replies and drops them when the key changes} {
+        for {set i 0} {$i < 100} {incr i} {
+            r rpush feed [string repeat $i 20]
+        }
+        set first [r lrange feed 0 -1]
+        set again [r lrange feed 0 -1]
+        set hits [status r reply_cache_hits]
+        r rpush feed last
+        set after [r lrange feed 0 -1]
+        r del feed
+        list [expr {$first eq $again}] $hits [llength $after] \
+            [lindex $after end] [r lrange feed 0 -1] \
+            [status r reply_cache_keys]
+    } {1 1 101 last {} 0}
+
+    test {Reply cache keeps the replies of other arguments and DBs apart} {
+        r select 9
+        for {set i 0} {$i < 100} {incr i} {
+            r zadd z $i [string repeat $i 20]
+        }
+        set all [r zrange z 0 -1]
+        set scores [r zrange z 0 -1 withscores]
+        set rev [r zrevrange z 0 -1]
+        r select 10
+        set other [r zrange z 0 -1]
+        r select 9
+        list [llength $all] [llength $scores] [lindex $rev 0] \
+            [expr {$all eq [r zrange z 0 -1]}] $other
+    } [list 100 200 [string repeat 99 20] 1 {}]
+
+    test {Reply cache drops the replies of expired keys and flushed DBs} {
+        r hset h a [string repeat x 2000]
+        r hgetall h
+        r pexpire h 100
+        after 200
+        set expired [r hgetall h]
+        r hset h b [string repeat y 2000]
+        r hgetall h
+        r flushdb
+        list $expired [r hgetall h] [status r reply_cache_keys]
+    } {{} {} 0}
+
+    test {Reply cache drops the replies of lists served to blocked clients} {
+        r del blist go
+        set blocked [redis_deferring_client]
+        $blocked blpop blist 0
+        wait_for_condition 50 100 {
+            [status r blocked_clients] == 1
+        } else {
+            fail "Client not blocked"
+        }
+        # The blocked client is only served after the next command, so
+        # the LRANGE below caches the list with the element it pops. The
+        # script tells it pushed and waits for the LRANGE to be done.
+        set pushed [redis_deferring_client]
+        $pushed subscribe pushed
+        $pushed read
+        set script [redis_deferring_client]
+        $script eval {
+            redis.call('rpush','blist','first',ARGV[1])
+            redis.call('publish','pushed','1')
+            while not redis.call('get','go') do end
+        } 0 [string repeat x 2000]
+        $script flush
+        $pushed read
+        set before [llength [r lrange blist 0 -1]]
+        r set go 1
+        $script read
+        set popped [$blocked read]
+        $blocked close
+        $pushed close
+        $script close
+        list $before $popped [llength [r lrange blist 0 -1]]
+    } {2 {blist first} 1}
+}
+
+start_server {tags {"other"} overrides {reply-cache-max-memory 10mb reply-cache-min-size 1024 thread-min-cost 0}} {
+    test {Reply cache doesn't keep a reply raced by writes before its first entry} {
+        set elements [lrepeat 1000 xyz]
+        for {set i 0} {$i < 50} {incr i} {
+            r rpush list {*}$elements
+        }
+        # Nothing is cached yet when the writes race with the thread
+        # building the reply
+        set reader [redis_deferring_client]
+        set writer [redis_deferring_client]
+        $reader lrange list 0 -1
+        $reader flush
+        for {set i 0} {$i < 1000} {incr i} {$writer rpush list $i}
+        $writer flush
+        $reader read
+        for {set i 0} {$i < 1000} {incr i} {$writer read}
+        $reader close
+        $writer close
+        llength [r lrange list 0 -1]
+    } {51000}
+}
+
+start_server {tags {"other"} overrides {thread-min-cost 0}} {
+    test {Pipelined commands run in batches, replies in order} {
+        r del ctr mylist
+        r rpush mylist a b c
+        set buf {}
+        set lrange "*4\r\n\$6\r\nLRANGE\r\n\$6\r\nmylist\r\n"
+        append lrange "\$1\r\n0\r\n\$2\r\n-1\r\n"
+        for {set i 0} {$i < 100} {incr i} {
+            append buf $lrange $lrange
+            append buf "*2\r\n\$4\r\nINCR\r\n\$3\r\nctr\r\n"
+        }
+        r write $buf
+        r flush
+        set ok 1
+        for {set i 0} {$i < 100} {incr i} {
+            if {[r read] ne {a b c} || [r read] ne {a b c}} {set ok 0}
+            if {[r read] != $i+1} {set ok 0}
+        }
+        list $ok [r get ctr] [expr {[status r pipeline_batches] > 0}]
+    } {1 100 1}
+
+    test {Pipelined batches check maxmemory before every command} {
+        r flushdb
+        r config set maxmemory-policy noeviction
+        r select 0
+        r del held stop
+        r hset held f v
+        r sql "create virtual table vheld using redis ('held')"
+        r select 9
+        # Keeps a thread busy, holding held, until stop is set: the
+        # batches run in the event loop
+        set rd [redis_deferring_client]
+        $rd select 0
+        $rd read
+        $rd sql "select count(*) > 0 from vheld, (with recursive c(x) as
+            (select 1 union all select x+1 from c
+             where redis('exists','stop') = '0') select x from c)"
+        $rd flush
+        # INFO sqlite waits for the running statement, ask for sections
+        wait_for_condition 50 100 {
+            [string match {*keylock_locked_keys:1*} [r info keylocks]]
+        } else {
+            fail "the SQL statement didn't lock held"
+        }
+        regexp {used_memory:(\d+)} [r info memory] _ used
+        r config set maxmemory [expr {$used+20000}]
+        # Every SETRANGE allocates 2k, much more than its arguments
+        set buf {}
+        for {set i 0} {$i < 100} {incr i} {
+            append buf "*4\r\n\$8\r\nSETRANGE\r\n"
+            append buf "\$[string length key$i]\r\nkey$i\r\n"
+            append buf "\$4\r\n2000\r\n\$1\r\nx\r\n"
+        }
+        r write $buf
+        r flush
+        set ok 0
+        for {set i 0} {$i < 100} {incr i} {
+            if {[catch {r read} e]} {
+                assert_match {*OOM*} $e
+            } else {
+                incr ok
+            }
+        }
+        r config set maxmemory 0
+        r select 0
+        r set stop 1
+        $rd read
+        $rd close
+        r sql "drop table vheld"
+        r del held stop
+        r select 9
+        r flushdb
+        # Without checking every command a batch of 64 gets past maxmemory
+        list [expr {$ok > 0}] [expr {$ok < 30}]
+    } {1 1}
+}
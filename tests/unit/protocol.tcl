@@ -107,3 +107,71 @@ start_server {tags {"regression"}} {
         $rd read
     }
 }
+
+start_server {tags {"protocol"}} {
+    test "Big replies mixing copied and referenced values" {
+        set values {}
+        for {set j 0} {$j < 2000} {incr j} {
+            set v [string repeat [format %c [expr {65+$j%26}]] \
+                [expr {($j*37)%3000}]]
+            lappend values $v
+            r rpush biglist $v
+        }
+        set deferred [redis_deferring_client]
+        $deferred lrange biglist 0 -1
+        $deferred get nosuchkey
+        $deferred lindex biglist 1999
+        set res [list [expr {[$deferred read] eq $values}] \
+            [$deferred read] [string length [$deferred read]]]
+        $deferred close
+        set res
+    } {1 {} 1963}
+
+    test "Arguments kept by commands are not reused for the next ones" {
+        r del myset mylist
+        set members {}
+        for {set j 0} {$j < 100} {incr j} {
+            r sadd myset member:$j
+            r rpush mylist [string repeat $j 10]
+            r get nosuchkey:$j
+            lappend members member:$j
+        }
+        r multi
+        r set queued:key queued:value
+        r echo another:value
+        r exec
+        list [expr {[lsort [r smembers myset]] eq [lsort $members]}] \
+            [r lindex mylist 42] [r get queued:key]
+    } [list 1 [string repeat 42 10] queued:value]
+}
+
+start_server {tags {"protocol"} overrides {io-threads 2}} {
+    test "I/O threads read and write the clients, pipelined or not" {
+        set clients {}
+        for {set j 0} {$j < 6} {incr j} {
+            set rd [redis_deferring_client]
+            for {set i 0} {$i < 50} {incr i} {
+                $rd incr iothreads:$j
+            }
+            lappend clients $rd
+        }
+        set res {}
+        foreach rd $clients {
+            for {set i 0} {$i < 50} {incr i} {set last [$rd read]}
+            lappend res $last
+            $rd close
+        }
+        list $res [expr {[status r io_threaded_reads] > 0}] \
+            [expr {[status r io_threaded_writes] > 0}]
+    } {{50 50 50 50 50 50} 1 1}
+
+    test "I/O threads reply to protocol errors and close the client" {
+        set s [socket [srv 0 host] [srv 0 port]]
+        fconfigure $s -translation binary
+        puts -nonewline $s "*1\r\n\$xx\r\n"
+        flush $s
+        set line [string trim [gets $s]]
+        close $s
+        list $line [r ping]
+    } {{-ERR Protocol error: invalid bulk length} PONG}
+}
@@ -258,6 +258,26 @@ start_server {tags {"scripting"}} {
         set res
     } {4 3 2 2 2}
 
+    test {Scripts are compiled once for the interpreters of all threads} {
+        r script flush
+        assert_equal 0 [status r lua_bytecode_scripts]
+        set misses [status r lua_bytecode_misses]
+        set sha [r script load {return redis.call('incr',KEYS[1])}]
+        set clients {}
+        for {set j 0} {$j < 8} {incr j} {
+            set rd [redis_deferring_client]
+            $rd evalsha $sha 1 lua_counter
+            lappend clients $rd
+        }
+        foreach rd $clients {
+            $rd read
+            $rd close
+        }
+        list [r get lua_counter] [status r lua_bytecode_scripts] \
+            [expr {[status r lua_bytecode_misses]-$misses}] \
+            [expr {[status r lua_vms] > 0}]
+    } {8 1 1 1}
+
     test {Scripting engine resets PRNG at every script execution} {
         set rand1 [r eval {return tostring(math.random())} 0]
         set rand2 [r eval {return tostring(math.random())} 0]
@@ -0,0 +1,487 @@
+start_server {tags {"sql"}} {
+    test {SQL returns the columns and then the rows} {
+        r sql "create table t1 (id integer, name text)"
+        for {set i 0} {$i < 10} {incr i} {
+            r sql "insert into t1 values (?, ?)" $i "name$i"
+        }
+        set res [r sql "select id, name from t1 where id < 2 order by id"]
+        list [llength $res] [lindex $res 0] [lrange $res 1 end]
+    } {3 {{id INTEGER} {name TEXT}} {{0 name0} {1 name1}}}
+
+    test {SQLCURSOR FETCH returns the rows a few at a time} {
+        set cols [r sqlcursor open c1 "select id from t1 where id >= ? order by id" 3]
+        set rows {}
+        while 1 {
+            set chunk [r sqlcursor fetch c1 3]
+            assert {[llength $chunk] <= 3}
+            if {[llength $chunk] == 0} break
+            foreach row $chunk {lappend rows [lindex $row 0]}
+        }
+        assert_equal OK [r sqlcursor close c1]
+        list $cols $rows
+    } {{{id INTEGER}} {3 4 5 6 7 8 9}}
+
+    test {SQLCURSOR parameters outlive the command that opened the cursor} {
+        r sqlcursor open c1 "select id from t1 where name = ? or name = ?" \
+            name4 :name7
+        # Commands in between free or reuse the arguments of the OPEN
+        for {set i 0} {$i < 4} {incr i} {
+            r echo "something else $i"
+        }
+        set rows [r sqlcursor fetch c1 10]
+        r sqlcursor close c1
+        set rows
+    } {4 7}
+
+    test {SQLCURSOR errors} {
+        assert_error "*no such cursor*" {r sqlcursor fetch nosuch 1}
+        assert_error "*no such cursor*" {r sqlcursor close nosuch}
+        assert_error "*SQL error*" {r sqlcursor open c2 "select * from nosuch"}
+        assert_error "*exactly one*" {r sqlcursor open c2 "select 1; select 2"}
+        r sqlcursor open c2 "select 1"
+        assert_error "*already open*" {r sqlcursor open c2 "select 1"}
+        assert_error "*greater than 0*" {r sqlcursor fetch c2 0}
+        r sqlcursor close c2
+    } {OK}
+
+    test {SQLCURSOR idle past sql-cursor-timeout stops holding its tables} {
+        r config set sql-cursor-timeout 1
+        set rd [redis_deferring_client]
+        $rd sqlcursor open c4 "select id from t1 order by id"
+        $rd read
+        $rd sqlcursor fetch c4 1
+        set first [$rd read]
+        # The cursor is mid-step, the insert waits for it to be closed.
+        set wr [redis_deferring_client]
+        $wr sql "insert into t1 values (100, 'name100')"
+        set start [clock milliseconds]
+        set ins [$wr read]
+        set waited [expr {[clock milliseconds] - $start}]
+        $rd sqlcursor fetch c4 1
+        catch {$rd read} err
+        $rd sqlcursor close c4
+        $rd read
+        $rd close
+        $wr close
+        r sql "delete from t1 where id = 100"
+        r config set sql-cursor-timeout 60
+        assert {$waited > 500 && $waited < 4000}
+        assert_match "*timed out*" $err
+        list $first $ins
+    } {0 1}
+
+    test {SQLFORMAT BINARY sends every row as typed binary values} {
+        set rd [redis_deferring_client]
+        $rd sqlformat binary
+        $rd read
+        $rd sqlformat
+        set format [$rd read]
+        $rd sql "select 1 as i, -2.5 as f, 'ab' as s, null as n, x'00ff' as b"
+        set res [$rd read]
+        $rd sqlformat text
+        $rd read
+        $rd sql "select 1, null"
+        set text [$rd read]
+        $rd close
+        set row [lindex $res 1]
+        binary scan $row cua1wa1qa1iua2a1iua2 \
+            nulls ti i tf f ts slen s tb blen b
+        list $format [llength $res] [string length $row] $nulls \
+            $ti $i $tf $f $ts $slen $s $tb $blen [binary encode hex $b] \
+            [lindex $text 1]
+    } {binary 2 33 8 i 1 f -2.5 s 2 ab b 2 00ff {1 {}}}
+
+    test {SQLCURSOR refuses statements over Redis keys} {
+        # The virtual tables read the keys of DB 0
+        r select 0
+        r rpush mylist a b c
+        r sql "create virtual table vmylist using redis (mylist)"
+        assert_equal {{{key text} {val text}} {1 a} {2 b} {3 c}} \
+            [r sql "select * from vmylist"]
+        assert_error "*Redis keys*" {r sqlcursor open c3 "select * from vmylist"}
+        r select 9
+    }
+
+    test {SQL locks the keys of the virtual tables it uses} {
+        set before [status r keylock_acquired]
+        r sql "select count(*) from t1"
+        assert_equal $before [status r keylock_acquired]
+        r sql "select count(*) from vmylist"
+        r sql "insert into t1 select 100 + key, val from vmylist"
+        expr {[status r keylock_acquired] - $before}
+    } {2}
+
+    test {A key expired while SQL reads it is gone for the other readers} {
+        r select 0
+        r del explist
+        r rpush explist a
+        r sql "create virtual table vexplist using redis (explist)"
+        r pexpire explist 200
+        set rd [redis_deferring_client]
+        $rd select 0
+        $rd read
+        $rd sql "select count(*) from vexplist, (with recursive c(x) as
+            (select 1 union all select x+1 from c where x < 1000000)
+            select x from c)"
+        after 400
+        set held [status r keylock_locked_keys]
+        set res [list [r exists explist] [r type explist] [r llen explist]]
+        $rd read
+        $rd close
+        r select 9
+        lappend res $held
+    } {0 none 0 1}
+
+    foreach {type size} {small 10 big 300} {
+        test "SQL on Redis keys seeks to the constraints on key - $type" {
+            r select 0
+            r del myzset mylist2 myhash
+            for {set i 1} {$i <= $size} {incr i} {
+                r zadd myzset $i m$i
+                r rpush mylist2 v$i
+                r hset myhash f$i $i
+            }
+            r sql "create virtual table if not exists vmyzset using redis (myzset)"
+            r sql "create virtual table if not exists vmylist2 using redis (mylist2)"
+            r sql "create virtual table if not exists vmyhash using redis (myhash)"
+            assert_equal {m3 m4 m5} [lrange [r sql "select val from vmyzset where key > 2 and key <= 5"] 1 end]
+            assert_equal {m7} [lrange [r sql "select val from vmyzset where key = 7"] 1 end]
+            assert_equal "m[expr {$size-1}] m$size" \
+                [lrange [r sql "select val from vmyzset where key >= [expr {$size-1}]"] 1 end]
+            assert_equal {v2 v3} [lrange [r sql "select val from vmylist2 where key > 1.5 and key < 4"] 1 end]
+            assert_equal "v$size" [lrange [r sql "select val from vmylist2 where key = $size"] 1 end]
+            assert_equal {} [lrange [r sql "select val from vmylist2 where key > $size"] 1 end]
+            assert_equal {{f3 3}} [lrange [r sql "select * from vmyhash where key = 'f3'"] 1 end]
+            assert_equal {} [lrange [r sql "select * from vmyhash where key = 'nosuch'"] 1 end]
+            assert_equal $size [lindex [r sql "select count(*) from vmyzset z join vmyhash h on h.key = 'f' || cast(z.key as integer)"] 1]
+            r select 9
+        }
+    }
+
+    test {SQL on Redis keys with typed columns} {
+        r select 0
+        r del tzset tlist
+        r zadd tzset 1.5 a 2 b 10 c
+        r rpush tlist 10 x 3.5
+        r sql "create virtual table if not exists vtzset using redis (tzset, member, score, rank)"
+        r sql "create virtual table if not exists vtlist using redis (tlist, pos, value INTEGER)"
+        assert_equal {{a 1.5 0} {b 2.0 1} {c 10.0 2}} [lrange [r sql "select member, score, rank from vtzset"] 1 end]
+        assert_equal {{real integer}} [lrange [r sql "select typeof(score), typeof(rank) from vtzset where member = 'c'"] 1 end]
+        assert_equal {c} [lrange [r sql "select member from vtzset where rank = 2"] 1 end]
+        assert_equal {{b 1}} [lrange [r sql "select member, rank from vtzset where score >= 2 and score < 5"] 1 end]
+        assert_equal {{1 x} {2 3.5}} [lrange [r sql "select * from vtlist where pos > 0"] 1 end]
+        assert_equal {integer text real} [lrange [r sql "select typeof(value) from vtlist"] 1 end]
+        assert_error "*unknown column*" {r sql "create virtual table vbad using redis (tzset, nosuch)"}
+        r select 9
+    }
+
+    test {SQL on a pattern of Redis hashes} {
+        r select 0
+        r del user:1 user:2 user:3 user:big
+        r hmset user:1 name alice age 30
+        r hmset user:2 name bob age 25
+        r hmset user:3 name carol
+        r set user:notahash 1
+        r sql "create virtual table if not exists vusers using redis ('user:*', name TEXT, age INTEGER)"
+        assert_equal {{alice 30} {bob 25} {carol {}}} [lrange [r sql "select name, age from vusers order by name"] 1 end]
+        assert_equal {{55 integer}} [lrange [r sql "select sum(age), typeof(max(age)) from vusers"] 1 end]
+        assert_equal {alice} [lrange [r sql "select name from vusers where age > 26"] 1 end]
+        assert_equal {{user:2 bob}} [lrange [r sql "select _key, name from vusers where _key = 'user:2'"] 1 end]
+        r hmset other:1 name mallory
+        assert_equal {} [lrange [r sql "select _key, name from vusers where _key = 'other:1'"] 1 end]
+        r del other:1
+        for {set i 0} {$i < 300} {incr i} {r hset user:big f$i $i}
+        r hset user:big age 40
+        assert_equal {95} [lindex [r sql "select sum(age) from vusers"] 1]
+        r del user:big user:notahash
+        r select 9
+    }
+
+    test {INSERT, UPDATE and DELETE on Redis keys} {
+        r select 0
+        r del wzset wlist whash
+        r sql "create virtual table if not exists vwzset using redis (wzset, member, score)"
+        r sql "create virtual table if not exists vwlist using redis (wlist, pos, value)"
+        r sql "create virtual table if not exists vwhash using redis (whash)"
+        assert_equal 9 [r sql "insert into vwzset select name, id from t1 where id between 1 and 9"]
+        assert_equal 9 [r zcard wzset]
+        assert_equal 7 [r zscore wzset name7]
+        assert_equal 1 [r sql "update vwzset set score = 100 where member = 'name7'"]
+        assert_equal 3 [r sql "delete from vwzset where score < 4"]
+        assert_equal {name4 name5 name6 name8 name9 name7} [r zrange wzset 0 -1]
+        r sql "update vwzset set member = 'seven' where score = 100"
+        assert_equal {100} [r zscore wzset seven]
+
+        r sql "insert into vwlist (value) values ('a'), ('b'), ('c'), ('d')"
+        assert_equal 2 [r sql "delete from vwlist where value in ('b', 'c')"]
+        r sql "update vwlist set value = 'z' where pos = 1"
+        assert_equal {a z} [r lrange wlist 0 -1]
+
+        r hset whash f1 1
+        r sql "insert into vwhash values ('f2', 2)"
+        r sql "update vwhash set val = val + 10"
+        assert_equal {11 12} [r hmget whash f1 f2]
+        r sql "delete from vwhash"
+        assert_equal 0 [r exists whash]
+        assert_error "*no such key*" {r sql "insert into vwhash values ('f', 1)"}
+        assert_error "*score must be a number*" {r sql "insert into vwzset values ('x', 'y')"}
+        r select 9
+    }
+
+    test {INSERT, UPDATE and DELETE on a pattern of Redis hashes} {
+        r select 0
+        r del wuser:1 wuser:2
+        r sql "create virtual table if not exists vwusers using redis ('wuser:*', name TEXT, age INTEGER)"
+        r sql "insert into vwusers (_key, name, age) values ('wuser:1', 'alice', 30), ('wuser:2', 'bob', NULL)"
+        assert_equal {alice 30} [r hmget wuser:1 name age]
+        assert_equal {name bob} [r hgetall wuser:2]
+        r sql "update vwusers set age = 26 where name = 'bob'"
+        assert_equal 26 [r hget wuser:2 age]
+        r sql "delete from vwusers where age > 29"
+        assert_equal 0 [r exists wuser:1]
+        assert_error "*doesn't match*" {r sql "insert into vwusers (_key, name) values ('other', 'x')"}
+        r del wuser:2
+        r select 9
+    }
+
+    test {SQLSAVE replies once saved, before the next commands} {
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        $rd1 sqlsave
+        $rd1 ping
+        $rd2 sqlsave
+        $rd1 flush
+        $rd2 flush
+        set res [list [$rd1 read] [$rd1 read] [$rd2 read]]
+        $rd1 close
+        $rd2 close
+        lappend res [status r sqlite_save_in_progress]
+        assert_error "*BGSAVE*" {r multi; r sqlsave; r exec}
+        set res
+    } {OK PONG OK 0}
+
+    test {SQLSAVE saves the SQL DB in a child and reports it in INFO} {
+        assert_equal OK [r sqlsave]
+        assert {[status r sqlite_save_pages] > 0}
+        assert_equal [status r sqlite_save_pages] [status r sqlite_save_pages_done]
+        list [status r sqlite_save_in_progress] [status r sqlite_last_save_status]
+    } {0 ok}
+
+    test {SQL reuses the statements it prepared} {
+        r config resetstat
+        r sql "select count(*) from t1 where id < ?" 5
+        r sql "select count(*) from t1 where id < ?" 5
+        set res [r sql "select count(*) from t1 where id < ?" 3]
+        list [lindex $res 1] [status r sqlite_stmt_cache_hits] [status r sqlite_stmt_cache_misses]
+    } {3 2 1}
+
+    test {SQLPREPARE and SQLEXEC} {
+        set h [r sqlprepare "select name from t1 where id = ?"]
+        assert_equal $h [r sqlprepare "select name from t1 where id = ?"]
+        assert_equal {name3} [lindex [r sqlexec $h 3] 1]
+        assert_equal {name7} [lindex [r sqlexec $h 7] 1]
+        set ins [r sqlprepare "insert into t1 values (?, ?)"]
+        assert_equal 1 [r sqlexec $ins 10 name10]
+        assert_equal {name10} [lindex [r sqlexec $h 10] 1]
+        assert_error "*exactly one*" {r sqlprepare "select 1; select 2"}
+        assert_error "*no such prepared statement*" {r sqlexec 12345}
+    }
+
+    test {SQLEXEC writes are in the AOF as SQL statements} {
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r sql "create table aoft (id integer, name text)"
+        set ins [r sqlprepare "insert into aoft values (?, ?)"]
+        r sqlexec $ins 1 one
+        r sqlexec $ins 2 two
+        r config set appendonly no
+        # Not in the AOF: the rows are back only if the AOF has the inserts
+        r sql "drop table aoft"
+        r debug loadaof
+        set res [r sql "select id, name from aoft order by id"]
+        r sql "drop table aoft"
+        lrange $res 1 end
+    } {{1 one} {2 two}}
+
+    test {SQL connections are opened on first use and pooled} {
+        set used [expr {[status r sqlite_conns_created]+[status r sqlite_conns_reused]}]
+        set reused [status r sqlite_conns_reused]
+        set rd [redis_deferring_client]
+        $rd ping
+        $rd read
+        assert_equal $used [expr {[status r sqlite_conns_created]+[status r sqlite_conns_reused]}]
+        foreach i {1 2} {
+            $rd sql "select 1"
+            $rd read
+            $rd close
+            wait_for_condition 50 100 {
+                [status r sqlite_conns_pooled] > 0
+            } else {
+                fail "SQL connection not pooled"
+            }
+            set rd [redis_deferring_client]
+        }
+        $rd close
+        expr {[status r sqlite_conns_reused] > $reused}
+    } {1}
+
+    test {Pooled SQL connections don't keep the temp tables of a client} {
+        set rd [redis_deferring_client]
+        $rd sql "create temp table tt (x)"
+        $rd read
+        $rd sql "begin"
+        $rd read
+        $rd close
+        after 100
+        set rd [redis_deferring_client]
+        $rd sql "select * from tt"
+        catch {$rd read} err
+        $rd sql "begin"
+        $rd read
+        $rd sql "rollback"
+        $rd read
+        $rd close
+        assert_match {*no such table*} $err
+    }
+
+    test {SQL connections with attached databases are not pooled} {
+        # Leave a clean connection in the pool for the second client
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        foreach c [list $rd1 $rd2] { $c sql "select 1"; $c read }
+        $rd1 close
+        $rd2 close
+        wait_for_condition 50 100 {
+            [status r sqlite_conns_pooled] >= 2
+        } else {
+            fail "clean SQL connections not pooled"
+        }
+        set rd [redis_deferring_client]
+        $rd sql "attach database ':memory:' as aux"
+        $rd read
+        set pooled [status r sqlite_conns_pooled]
+        $rd close
+        set rd [redis_deferring_client]
+        $rd sql "select 1"
+        $rd read
+        after 100
+        set res [list [status r sqlite_conns_pooled]]
+        $rd close
+        wait_for_condition 50 100 {
+            [status r sqlite_conns_pooled] > [lindex $res 0]
+        } else {
+            fail "clean SQL connection not pooled"
+        }
+        expr {[lindex $res 0] < $pooled}
+    } {1}
+
+    test {Prepared statements are evicted when the cache is full} {
+        r config set sql-stmt-cache-size 2
+        set h [r sqlprepare "select 1"]
+        r sql "select 2"
+        r sql "select 3"
+        assert_error "*no such prepared statement*" {r sqlexec $h}
+        assert {[status r sqlite_stmt_cache_evictions] > 0}
+        r config set sql-stmt-cache-size 64
+    } {OK}
+}
+
+start_server {tags {"sql"} overrides {sql-wal yes sql-wal-checkpoint 16 sql-cache-size 1mb}} {
+    test {SQL DB in WAL mode} {
+        r sql "create table w (id integer primary key, v text)"
+        for {set i 0} {$i < 100} {incr i} {
+            r sql "insert into w values (?, ?)" $i [string repeat x 100]
+        }
+        assert_equal 1 [status r sqlite_wal]
+        assert_equal [lindex [r sql "pragma journal_mode"] 1] wal
+        list [lindex [r sql "select count(*) from w"] 1] \
+             [file exists [file join [lindex [r config get dir] 1] dump.sqlite]]
+    } {100 1}
+
+    test {SQL WAL is checkpointed in the background} {
+        wait_for_condition 50 100 {
+            [status r sqlite_wal_checkpoints] > 0 &&
+            [status r sqlite_wal_checkpoint_in_progress] == 0
+        } else {
+            fail "no WAL checkpoint"
+        }
+        status r sqlite_last_checkpoint_status
+    } {ok}
+
+    test {SQL WAL mode connections see the virtual tables of each other} {
+        r select 0
+        r rpush wl a b c
+        r sql "create virtual table vwl using redis(wl, pos, value)"
+        set rd [redis_deferring_client]
+        $rd select 0
+        $rd read
+        $rd sql "select value from vwl where pos = 1"
+        set res [$rd read]
+        $rd close
+        r select 9
+        lindex $res 1
+    } {b}
+
+    # Readers don't block writers in WAL mode, so a write statement can run
+    # while another statement reads the keys it writes.
+    test {A key the statement reads isn't written while others share it} {
+        r select 0
+        r del wuser:3 wstop
+        r hmset wuser:3 name carol age 40
+        r sql "create virtual table vwusers using redis ('wuser:*', name TEXT, age INTEGER)"
+        r sql "create virtual table vwuser3 using redis ('wuser:3')"
+        set rd [redis_deferring_client]
+        $rd select 0
+        $rd read
+        # Holds wuser:3 shared until wstop is set
+        $rd sql "select count(*) > 0 from vwuser3, (with recursive c(x) as
+            (select 1 union all select x+1 from c
+             where redis('exists','wstop') = '0') select x from c)"
+        wait_for_condition 50 100 {
+            [status r keylock_locked_keys] == 1
+        } else {
+            fail "the reader didn't lock wuser:3"
+        }
+        # The subquery holds wuser:3 shared, the row needs it exclusive
+        catch {r sql "update vwusers set age = 41
+            where _key = (select 'wuser:3' from vwuser3 limit 1)"} err
+        r set wstop 1
+        set res [$rd read]
+        $rd close
+        set age [r hget wuser:3 age]
+        r del wuser:3 wstop
+        r select 9
+        list [string match "*busy*" $err] $age [lindex $res 1]
+    } {1 40 1}
+
+    test {SQLSAVE checkpoints the WAL} {
+        r sqlsave
+        list [status r sqlite_wal_pages] [lindex [r sql "select count(*) from w"] 1]
+    } {0 100}
+}
+
+start_server {tags {"sql repl"}} {
+    start_server {} {
+        test {SQLEXEC writes reach the slaves} {
+            # SQL is a write command: SELECT on the slave needs it writable
+            r -1 config set slave-read-only no
+            r -1 slaveof [srv 0 host] [srv 0 port]
+            wait_for_condition 50 100 {
+                [string match {*master_link_status:up*} [r -1 info replication]]
+            } else {
+                fail "Can't turn the instance into a slave"
+            }
+            r sql "create table replt (id integer, name text)"
+            set ins [r sqlprepare "insert into replt values (?, ?)"]
+            r sqlexec $ins 1 one
+            r sqlexec $ins 2 two
+            wait_for_condition 50 100 {
+                [catch {r -1 sql "select id from replt"} res] == 0 &&
+                [llength $res] == 3
+            } else {
+                fail "SQLEXEC writes didn't reach the slave: $res"
+            }
+            lrange [r -1 sql "select id, name from replt order by id"] 1 end
+        } {{1 one} {2 two}}
+    }
+}
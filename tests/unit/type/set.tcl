@@ -246,6 +246,49 @@ start_server {
         assert_equal 0 [r exists setres]
     }
 
+    test "SINTERSTORE of intsets bigger than set-max-intset-entries" {
+        r del set1 set2
+        r config set set-max-intset-entries 2000
+        r sadd set1 -1
+        r sadd set2 -1
+        for {set i 0} {$i < 1200} {incr i} {
+            r sadd set1 $i
+            r sadd set2 [expr {$i*2}]
+        }
+        assert_encoding intset set1
+        r config set set-max-intset-entries 500
+        assert_equal 601 [r sinterstore setres set1 set2]
+        assert_encoding hashtable setres
+        r config set set-max-intset-entries 512
+        assert_equal {-1 0 2} [lrange [r sinter set1 set2] 0 2]
+    }
+
+    test "SINTER and SDIFF give the same result when probed in parallel" {
+        r del set1 set2 set3
+        for {set i 0} {$i < 1000} {incr i} {
+            r sadd set1 $i m$i
+            r sadd set2 [expr {$i*2}] m[expr {$i*3}]
+            r sadd set3 [expr {$i*3}] m[expr {$i*2}]
+        }
+        r sadd setint 0 2 4 6 8 12 18 24
+        set res {}
+        foreach mincost {0 1} {
+            r config set parallel-min-cost $mincost
+            r config set parallel-max-parts 4
+            lappend res [lsort [r sinter set1 set2 set3]] \
+                        [lsort [r sinter setint set2 set3]] \
+                        [lsort [r sdiff set1 set2 set3]] \
+                        [lsort [r sdiff setint set3]]
+            r sdiffstore setres set1 set2
+            lappend res [lsort [r smembers setres]]
+        }
+        r config set parallel-min-cost 65536
+        r config set parallel-max-parts 0
+        assert {[llength [lindex $res 0]] > 0}
+        assert {[llength [lindex $res 3]] > 0}
+        assert_equal [lrange $res 0 4] [lrange $res 5 9]
+    }
+
     test "SUNIONSTORE against non existing keys should delete dstkey" {
         r set setres xxx
         assert_equal 0 [r sunionstore setres foo111 bar222]
@@ -532,6 +532,35 @@ start_server {tags {"zset"}} {
         r zrange to_here 0 -1
     } {100}
 
+    test {ZUNIONSTORE/ZINTERSTORE give the same result when run in parallel} {
+        r del pint pset pzl psl
+        for {set i 0} {$i < 300} {incr i} {
+            r sadd pint [expr {$i*2}]
+            r sadd pset [expr {$i*3}] m$i
+            r zadd psl [expr {$i*0.5}] [expr {$i*5}] [expr {-$i}] m[expr {$i*2}]
+        }
+        for {set i 0} {$i < 50} {incr i} {
+            r zadd pzl $i [expr {$i*6}]
+        }
+        set err {}
+        r config set parallel-max-parts 4
+        foreach cmd {zunionstore zinterstore} {
+            foreach opts {{} {weights 1 2 0.5 -1} {aggregate min} {aggregate max}} {
+                r config set parallel-min-cost 0
+                r $cmd pseq 4 pint pset pzl psl {*}$opts
+                r config set parallel-min-cost 1
+                r $cmd ppar 4 pint pset pzl psl {*}$opts
+                if {[r zrange pseq 0 -1 withscores] ne
+                    [r zrange ppar 0 -1 withscores]} {
+                    lappend err "$cmd $opts"
+                }
+            }
+        }
+        r config set parallel-min-cost 65536
+        r config set parallel-max-parts 0
+        set err
+    } {}
+
     proc stressers {encoding} {
         if {$encoding == "ziplist"} {
             # Little extra to allow proper fuzzing in the sorting stresser